@@ -46,55 +46,16 @@ uart_pty_t uart_pty;
 avr_t * avr = NULL;
 avr_vcd_t vcd_file;
 
-struct avr_flash {
-	char avr_flash_path[1024];
-	int avr_flash_fd;
-};
-
-// avr special flash initalization
-// here: open and map a file to enable a persistent storage for the flash memory
-void avr_special_init( avr_t * avr, void * data)
-{
-	struct avr_flash *flash_data = (struct avr_flash *)data;
-
-	printf("%s\n", __func__);
-	// open the file
-	flash_data->avr_flash_fd = open(flash_data->avr_flash_path,
-									O_RDWR|O_CREAT, 0644);
-	if (flash_data->avr_flash_fd < 0) {
-		perror(flash_data->avr_flash_path);
-		exit(1);
-	}
-	// resize and map the file the file
-	(void)ftruncate(flash_data->avr_flash_fd, avr->flashend + 1);
-	ssize_t r = read(flash_data->avr_flash_fd, avr->flash, avr->flashend + 1);
-	if (r != avr->flashend + 1) {
-		fprintf(stderr, "unable to load flash memory\n");
-		perror(flash_data->avr_flash_path);
-		exit(1);
-	}
-}
-
-// avr special flash deinitalization
-// here: cleanup the persistent storage
+// avr special deinitalization
+// here: stop the uart pty thread
 void avr_special_deinit( avr_t* avr, void * data)
 {
-	struct avr_flash *flash_data = (struct avr_flash *)data;
-
-	printf("%s\n", __func__);
-	lseek(flash_data->avr_flash_fd, SEEK_SET, 0);
-	ssize_t r = write(flash_data->avr_flash_fd, avr->flash, avr->flashend + 1);
-	if (r != avr->flashend + 1) {
-		fprintf(stderr, "unable to load flash memory\n");
-		perror(flash_data->avr_flash_path);
-	}
-	close(flash_data->avr_flash_fd);
 	uart_pty_stop(&uart_pty);
 }
 
 int main(int argc, char *argv[])
 {
-	struct avr_flash flash_data;
+	char flash_path[1024];
 	char boot_path[1024] = "ATmegaBOOT_168_atmega328.ihex";
 	uint32_t boot_base, boot_size;
 	char * mmcu = "atmega328p";
@@ -132,14 +93,15 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	snprintf(flash_data.avr_flash_path, sizeof(flash_data.avr_flash_path),
-			"simduino_%s_flash.bin", mmcu);
-	flash_data.avr_flash_fd = 0;
+	// the flash is mapped from this file, to persist the uploaded sketches
+	snprintf(flash_path, sizeof(flash_path), "simduino_%s_flash.bin", mmcu);
+	avr->backing.flash = flash_path;
 	// register our own functions
-	avr->custom.init = avr_special_init;
 	avr->custom.deinit = avr_special_deinit;
-	avr->custom.data = &flash_data;
-	avr_init(avr);
+	if (avr_init(avr)) {
+		fprintf(stderr, "%s: Unable to map %s\n", argv[0], flash_path);
+		exit(1);
+	}
 	avr->frequency = freq;
 
 	memcpy(avr->flash + boot_base, boot, boot_size);
@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include "avr_acomp.h"
 #include "avr_timer.h"
+#include "sim_state.h"
 
 static uint8_t
 avr_acomp_get_state(
@@ -197,6 +198,13 @@ avr_acomp_reset(avr_io_t * port)
 	}
 }
 
+static int avr_acomp_state(struct avr_io_t *io, avr_state_io_t *s)
+{
+	avr_acomp_t * p = (avr_acomp_t *)io;
+	return AVR_STATE_IO(s, p->adc_values) ||
+			AVR_STATE_IO(s, p->ain_values);
+}
+
 static const char * irq_names[ACOMP_IRQ_COUNT] = {
 	[ACOMP_IRQ_AIN0] = "16<ain0",
 	[ACOMP_IRQ_AIN1] = "16<ain1",
@@ -223,6 +231,7 @@ static avr_io_t _io = {
 	.kind = "ac",
 	.reset = avr_acomp_reset,
 	.irq_names = irq_names,
+	.state = avr_acomp_state,
 };
 
 void
@@ -24,6 +24,7 @@
 #include <string.h>
 #include "sim_time.h"
 #include "avr_adc.h"
+#include "sim_state.h"
 
 static avr_cycle_count_t
 avr_adc_int_raise(
@@ -381,6 +382,20 @@ static void avr_adc_reset(avr_io_t * port)
 		avr_irq_register_notify(p->io.irq + i, avr_adc_irq_notify, p);
 }
 
+static int avr_adc_state(struct avr_io_t *io, avr_state_io_t *s)
+{
+	avr_adc_t * p = (avr_adc_t *)io;
+	return AVR_STATE_IO(s, p->adc_values) ||
+			AVR_STATE_IO(s, p->temp) ||
+			AVR_STATE_IO(s, p->first) ||
+			AVR_STATE_IO(s, p->read_status) ||
+			AVR_STATE_IO(s, p->current_muxi) ||
+			AVR_STATE_IO(s, p->current_refi) ||
+			AVR_STATE_IO(s, p->current_prescale) ||
+			AVR_STATE_IO(s, p->current_extras) ||
+			AVR_STATE_IO(s, p->result);
+}
+
 static const char * irq_names[ADC_IRQ_COUNT] = {
 	[ADC_IRQ_ADC0] = "16<adc0",
 	[ADC_IRQ_ADC1] = "16<adc1",
@@ -407,6 +422,7 @@ static	avr_io_t	_io = {
 	.kind = "adc",
 	.reset = avr_adc_reset,
 	.irq_names = irq_names,
+	.state = avr_adc_state,
 };
 
 void avr_adc_init(avr_t * avr, avr_adc_t * p)
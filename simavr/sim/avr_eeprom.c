@@ -24,7 +24,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include "avr_eeprom.h"
+#include "sim_utils.h"
+#include "sim_state.h"
 
 static avr_cycle_count_t avr_eempe_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -112,6 +115,26 @@ static int avr_eeprom_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_para
 			else	// allow to get access to the read data, for gdb support
 				desc->ee = p->eeprom + desc->offset;
 		}	break;
+		case AVR_IOCTL_EEPROM_MAP: {
+			avr_eeprom_map_t * m = (avr_eeprom_map_t*)io_param;
+			if (!m || !m->path)
+				return -2;
+			uint8_t * ee = sim_mmap_file(m->path, p->size, 0, 0xff, m->shared);
+			if (!ee) {
+				AVR_LOG(port->avr, LOG_ERROR, "EEPROM: %s: can't map %s: %s\n",
+						__FUNCTION__, m->path, strerror(errno));
+				return -2;
+			}
+			if (p->mapped)
+				sim_munmap_file(p->eeprom, p->size, 0);
+			else
+				free(p->eeprom);
+			p->eeprom = ee;
+			p->mapped = 1;
+			AVR_LOG(port->avr, LOG_TRACE, "EEPROM: %s: mapped %s (%s)\n",
+					__FUNCTION__, m->path, m->shared ? "shared" : "scratch");
+			res = 0;
+		}	break;
 	}
 	
 	return res;
@@ -120,15 +143,25 @@ static int avr_eeprom_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_para
 static void avr_eeprom_dealloc(struct avr_io_t * port)
 {
 	avr_eeprom_t * p = (avr_eeprom_t *)port;
-	if (p->eeprom)
+	if (p->mapped)
+		sim_munmap_file(p->eeprom, p->size, 0);
+	else if (p->eeprom)
 		free(p->eeprom);
 	p->eeprom = NULL;
+	p->mapped = 0;
+}
+
+// the eeprom content is saved with the core
+static int avr_eeprom_state(struct avr_io_t *io, avr_state_io_t *s)
+{
+	return 0;
 }
 
 static	avr_io_t	_io = {
 	.kind = "eeprom",
 	.ioctl = avr_eeprom_ioctl,
 	.dealloc = avr_eeprom_dealloc,
+	.state = avr_eeprom_state,
 };
 
 void avr_eeprom_init(avr_t * avr, avr_eeprom_t * p)
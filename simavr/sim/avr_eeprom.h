@@ -33,6 +33,7 @@ typedef struct avr_eeprom_t {
 
 	uint8_t *	eeprom;	// actual bytes
 	uint16_t	size;	// size for this MCU
+	uint8_t		mapped;	// 'eeprom' is a file mapped by AVR_IOCTL_EEPROM_MAP
 	
 	uint8_t r_eearh;
 	uint8_t r_eearl;
@@ -59,6 +60,18 @@ typedef struct avr_eeprom_desc_t {
 #define AVR_IOCTL_EEPROM_GET	AVR_IOCTL_DEF('e','e','g','p')
 #define AVR_IOCTL_EEPROM_SET	AVR_IOCTL_DEF('e','e','s','p')
 
+/*
+ * Back the eeprom with a memory mapped file. With 'shared' set, the file is
+ * created if needed and the eeprom writes land in it, otherwise it is only
+ * used as the initial content. Missing bytes read as 0xff.
+ */
+typedef struct avr_eeprom_map_t {
+	const char *	path;
+	int				shared;
+} avr_eeprom_map_t;
+
+#define AVR_IOCTL_EEPROM_MAP	AVR_IOCTL_DEF('e','e','m','p')
+
 
 /*
  * the eeprom block seems to be very similar across AVRs, 
@@ -25,6 +25,7 @@
 #include <string.h>
 #include "avr_extint.h"
 #include "avr_ioport.h"
+#include "sim_state.h"
 
 typedef struct avr_extint_poll_context_t {
 	uint32_t	eint_no; // index of particular interrupt source we are monitoring
@@ -194,6 +195,12 @@ static void avr_extint_reset(avr_io_t * port)
 	}
 }
 
+// it's all in the IO registers and the IRQs
+static int avr_extint_state(struct avr_io_t *io, avr_state_io_t *s)
+{
+	return 0;
+}
+
 static const char * irq_names[EXTINT_COUNT] = {
 	[EXTINT_IRQ_OUT_INT0] = "<int0",
 	[EXTINT_IRQ_OUT_INT1] = "<int1",
@@ -209,6 +216,7 @@ static	avr_io_t	_io = {
 	.kind = "extint",
 	.reset = avr_extint_reset,
 	.irq_names = irq_names,
+	.state = avr_extint_state,
 };
 
 void avr_extint_init(avr_t * avr, avr_extint_t * p)
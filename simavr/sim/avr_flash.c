@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_flash.h"
+#include "sim_state.h"
 
 static avr_cycle_count_t avr_progen_clear(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -71,11 +72,13 @@ static int avr_flash_ioctl(struct avr_io_t * port, uint32_t ctl, void * io_param
 		avr_cycle_timer_cancel(avr, avr_progen_clear, p);
 
 		if (avr_regbit_get(avr, p->pgers)) {
+			avr_flash_unshare(avr);	// copy on write
 			z &= ~1;
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Erasing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
 			for (int i = 0; i < p->spm_pagesize; i++)
 				avr->flash[z++] = 0xff;
 		} else if (avr_regbit_get(avr, p->pgwrt)) {
+			avr_flash_unshare(avr);
 			z &= ~(p->spm_pagesize - 1);
 			AVR_LOG(avr, LOG_TRACE, "FLASH: Writing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
 			for (int i = 0; i < p->spm_pagesize / 2; i++) {
@@ -120,11 +123,21 @@ avr_flash_dealloc(struct avr_io_t * port)
 		free(p->tmppage_used);
 }
 
+// the page buffer being filled by SPM
+static int avr_flash_state(struct avr_io_t *io, avr_state_io_t *s)
+{
+	avr_flash_t * p = (avr_flash_t *)io;
+	return AVR_STATE_IO(s, p->flags) ||
+			avr_state_io(s, p->tmppage, p->spm_pagesize) ||
+			avr_state_io(s, p->tmppage_used, p->spm_pagesize / 2);
+}
+
 static	avr_io_t	_io = {
 	.kind = "flash",
 	.ioctl = avr_flash_ioctl,
 	.reset = avr_flash_reset,
 	.dealloc = avr_flash_dealloc,
+	.state = avr_flash_state,
 };
 
 void avr_flash_init(avr_t * avr, avr_flash_t * p)
@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include "avr_ioport.h"
+#include "sim_state.h"
 
 #define D(_w)
 
@@ -285,6 +286,12 @@ avr_ioport_ioctl(
 	return res;
 }
 
+static int avr_ioport_state(struct avr_io_t *io, avr_state_io_t *s)
+{
+	avr_ioport_t * p = (avr_ioport_t *)io;
+	return AVR_STATE_IO(s, p->external);
+}
+
 static const char * irq_names[IOPORT_IRQ_COUNT] = {
 	[IOPORT_IRQ_PIN0] = "=pin0",
 	[IOPORT_IRQ_PIN1] = "=pin1",
@@ -305,6 +312,7 @@ static	avr_io_t	_io = {
 	.reset = avr_ioport_reset,
 	.ioctl = avr_ioport_ioctl,
 	.irq_names = irq_names,
+	.state = avr_ioport_state,
 };
 
 void avr_ioport_init(avr_t * avr, avr_ioport_t * p)
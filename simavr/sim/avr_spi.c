@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include "avr_spi.h"
+#include "sim_state.h"
 
 static avr_cycle_count_t avr_spi_raise(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -94,6 +95,12 @@ void avr_spi_reset(struct avr_io_t *io)
 	avr_irq_register_notify(p->io.irq + SPI_IRQ_INPUT, avr_spi_irq_input, p);
 }
 
+static int avr_spi_state(struct avr_io_t *io, avr_state_io_t *s)
+{
+	avr_spi_t * p = (avr_spi_t *)io;
+	return AVR_STATE_IO(s, p->input_data_register);
+}
+
 static const char * irq_names[SPI_IRQ_COUNT] = {
 	[SPI_IRQ_INPUT] = "8<in",
 	[SPI_IRQ_OUTPUT] = "8<out",
@@ -103,6 +110,7 @@ static	avr_io_t	_io = {
 	.kind = "spi",
 	.reset = avr_spi_reset,
 	.irq_names = irq_names,
+	.state = avr_spi_state,
 };
 
 void avr_spi_init(avr_t * avr, avr_spi_t * p)
@@ -30,6 +30,7 @@
 #include "avr_timer.h"
 #include "avr_ioport.h"
 #include "sim_time.h"
+#include "sim_state.h"
 
 /*
  * The timers are /always/ 16 bits here, if the higher byte register
@@ -884,6 +885,25 @@ avr_timer_reset(
 
 }
 
+static int avr_timer_state(struct avr_io_t *io, avr_state_io_t *s)
+{
+	avr_timer_t * p = (avr_timer_t *)io;
+	int res = AVR_STATE_IO(s, p->mode) ||
+			AVR_STATE_IO(s, p->wgm_op_mode_kind) ||
+			AVR_STATE_IO(s, p->wgm_op_mode_size) ||
+			AVR_STATE_IO(s, p->cs_div_value) ||
+			AVR_STATE_IO(s, p->ext_clock_flags) ||
+			AVR_STATE_IO(s, p->ext_clock) ||
+			AVR_STATE_IO(s, p->tov_cycles) ||
+			AVR_STATE_IO(s, p->tov_cycles_fract) ||
+			AVR_STATE_IO(s, p->phase_accumulator) ||
+			AVR_STATE_IO(s, p->tov_base) ||
+			AVR_STATE_IO(s, p->tov_top);
+	for (int i = 0; i < AVR_TIMER_COMP_COUNT && !res; i++)
+		res = AVR_STATE_IO(s, p->comp[i].comp_cycles);
+	return res;
+}
+
 static const char * irq_names[TIMER_IRQ_COUNT] = {
 	[TIMER_IRQ_OUT_PWM0] = "8>pwm0",
 	[TIMER_IRQ_OUT_PWM1] = "8>pwm1",
@@ -899,6 +919,7 @@ static	avr_io_t	_io = {
 	.irq_names = irq_names,
 	.reset = avr_timer_reset,
 	.ioctl = avr_timer_ioctl,
+	.state = avr_timer_state,
 };
 
 void
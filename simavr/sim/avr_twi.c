@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include "avr_twi.h"
+#include "sim_state.h"
 
 /*
  * This block respectfully nicked straight out from the Atmel sample
@@ -477,6 +478,14 @@ void avr_twi_reset(struct avr_io_t *io)
 	avr_regbit_setto_raw(p->io.avr, p->twsr, TWI_NO_STATE);
 }
 
+static int avr_twi_state(struct avr_io_t *io, avr_state_io_t *s)
+{
+	avr_twi_t * p = (avr_twi_t *)io;
+	return AVR_STATE_IO(s, p->state) ||
+			AVR_STATE_IO(s, p->peer_addr) ||
+			AVR_STATE_IO(s, p->next_twstate);
+}
+
 static const char * irq_names[TWI_IRQ_COUNT] = {
 	[TWI_IRQ_INPUT] = "8<input",
 	[TWI_IRQ_OUTPUT] = "32>output",
@@ -487,6 +496,7 @@ static	avr_io_t	_io = {
 	.kind = "twi",
 	.reset = avr_twi_reset,
 	.irq_names = irq_names,
+	.state = avr_twi_state,
 };
 
 void avr_twi_init(avr_t * avr, avr_twi_t * p)
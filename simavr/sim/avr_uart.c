@@ -39,6 +39,10 @@
 #include "sim_hex.h"
 #include "sim_time.h"
 #include "sim_gdb.h"
+#include "sim_state.h"
+
+// longest line printed by AVR_UART_FLAG_STDIO
+#define AVR_UART_STDIO_SIZE	256
 
 //#define TRACE(_w) _w
 #ifndef TRACE
@@ -269,7 +273,7 @@ avr_uart_udr_write(
 	}
 
 	if (p->flags & AVR_UART_FLAG_STDIO) {
-		const int maxsize = 256;
+		const int maxsize = AVR_UART_STDIO_SIZE;
 		if (!p->stdio_out)
 			p->stdio_out = malloc(maxsize);
 		p->stdio_out[p->stdio_len++] = v < ' ' ? '.' : v;
@@ -491,6 +495,29 @@ avr_uart_ioctl(
 	return res;
 }
 
+static int avr_uart_state(struct avr_io_t *io, avr_state_io_t *s)
+{
+	avr_uart_t * p = (avr_uart_t *)io;
+	int len = p->stdio_len;
+	if (AVR_STATE_IO(s, p->input) ||
+			AVR_STATE_IO(s, p->tx_cnt) ||
+			AVR_STATE_IO(s, p->rx_cnt) ||
+			AVR_STATE_IO(s, p->flags) ||
+			AVR_STATE_IO(s, p->cycles_per_byte) ||
+			AVR_STATE_IO(s, p->rxc_raise_time) ||
+			AVR_STATE_IO(s, len))
+		return -1;
+	// the stdio line that isn't printed yet
+	if (len < 0 || len >= AVR_UART_STDIO_SIZE)
+		return -1;
+	if (len && !p->stdio_out && !(p->stdio_out = malloc(AVR_UART_STDIO_SIZE)))
+		return -1;
+	if (len && avr_state_io(s, p->stdio_out, len))
+		return -1;
+	p->stdio_len = len;
+	return 0;
+}
+
 static const char * irq_names[UART_IRQ_COUNT] = {
 	[UART_IRQ_INPUT] = "8<in",
 	[UART_IRQ_OUTPUT] = "8>out",
@@ -503,6 +530,7 @@ static	avr_io_t	_io = {
 	.reset = avr_uart_reset,
 	.ioctl = avr_uart_ioctl,
 	.irq_names = irq_names,
+	.state = avr_uart_state,
 };
 
 void
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "avr_watchdog.h"
+#include "sim_state.h"
 
 static void avr_watchdog_run_callback_software_reset(avr_t * avr)
 {
@@ -211,10 +212,18 @@ static void avr_watchdog_reset(avr_io_t * port)
 	avr_irq_register_notify(p->watchdog.irq, avr_watchdog_irq_notify, p);
 }
 
+static int avr_watchdog_state(struct avr_io_t *io, avr_state_io_t *s)
+{
+	avr_watchdog_t * p = (avr_watchdog_t *)io;
+	return AVR_STATE_IO(s, p->cycle_count) ||
+			AVR_STATE_IO(s, p->reset_context.wdrf);
+}
+
 static	avr_io_t	_io = {
 	.kind = "watchdog",
 	.reset = avr_watchdog_reset,
 	.ioctl = avr_watchdog_ioctl,
+	.state = avr_watchdog_state,
 };
 
 void avr_watchdog_init(avr_t * avr, avr_watchdog_t * p)
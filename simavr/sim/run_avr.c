@@ -24,12 +24,20 @@
 #include <libgen.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
 #include "sim_avr.h"
 #include "sim_elf.h"
 #include "sim_core.h"
 #include "sim_gdb.h"
+#include "sim_state.h"
 #include "sim_hex.h"
 #include "sim_vcd_file.h"
+#include "sim_batch.h"
+#include "sim_itrace.h"
+#include "sim_profile.h"
+#include "sim_stack.h"
+#include "sim_coverage.h"
+#include "sim_perf.h"
 
 #include "sim_core_decl.h"
 
@@ -43,10 +51,13 @@ display_usage(
 	 "       [--list-cores]      List all supported AVR cores and exit\n"
 	 "       [-v]                Raise verbosity level\n"
 	 "                           (can be passed more than once)\n"
-	 "       [--freq|-f <freq>]  Sets the frequency for an .hex firmware\n"
-	 "       [--mcu|-m <device>] Sets the MCU type for an .hex firmware\n"
+	 "       [--freq|-f <freq>]  Sets the frequency for a .hex, .srec or .bin\n"
+	 "       [--mcu|-m <device>] Sets the MCU type for a .hex, .srec or .bin\n"
 	 "       [--gdb|-g [<port>]] Listen for gdb connection on <port> "
 	 "(default 1234)\n"
+	 "       [--monitor <port>]  Accept JSON monitor clients on <port>, they\n"
+	 "                           can read the counters and memory while the\n"
+	 "                           core runs. Starts the gdb server too\n"
 #ifdef CONFIG_SIMAVR_TRACE
 	 "       [--trace, -t]       Run full scale decoder trace\n"
 #else
@@ -54,17 +65,101 @@ display_usage(
 #endif //CONFIG_SIMAVR_TRACE
 	 "       [-ti <vector>]      Add traces for IRQ vector <vector>\n"
 	 "       [--input|-i <file>] A VCD file to use as input signals\n"
+	 "       [--input-loop]      Replay the input VCD file forever\n"
+	 "       [--input-scale <x>] Multiply the input VCD time by <x>\n"
+	 "       [--input-seek <ns>] Start replaying the input VCD at <ns>\n"
 	 "       [--output|-o <file>] A VCD file to save the traced signals\n"
+	 "                           (<file>.vcd.gz for a compressed one)\n"
 	 "       [--add-trace|-at <name=kind@addr/mask>]\n"
 	 "                           Add signal to be included in VCD output\n"
-	 "       [-ff <.hex file>]   Load next .hex file as flash\n"
-	 "       [-ee <.hex file>]   Load next .hex file as eeprom\n"
-	 "       <firmware>          A .hex or an ELF file. ELF files are\n"
+	 "       [-ff <.hex file>]   Load next .hex/.srec/.bin file as flash\n"
+	 "       [-ee <.hex file>]   Load next .hex/.srec/.bin file as eeprom\n"
+	 "       [--flash-file <file>] Back the flash with <file>, flash writes\n"
+	 "                           are kept in it across runs\n"
+	 "       [--eeprom-file <file>] Back the eeprom with <file>\n"
+	 "       [--scratch]         Only read the --flash-file/--eeprom-file,\n"
+	 "                           don't write changes back to them\n"
+	 "       [--warm-start <dir>] Start from the state cached in <dir> if\n"
+	 "                           any, otherwise run to --warm-until and\n"
+	 "                           cache the state there\n"
+	 "       [--warm-until <cycle|symbol>] Warm start point\n"
+	 "       [--itrace <file>]   Record an instruction trace in <file>\n"
+	 "       [--itrace-size <n>] Number of instructions kept in the trace\n"
+	 "       [--itrace-dump <file>] Print instruction trace <file> and exit,\n"
+	 "                           using the <firmware> symbols, if any\n"
+	 "       [--profile <file>]  Write a cycle profile to <file> on exit\n"
+	 "       [--profile-format <flat|gmon|folded|callgrind>]\n"
+	 "                           Profile format (flat)\n"
+	 "       [--profile-period <n>] Sample the PC every <n> cycles instead\n"
+	 "                           of profiling every instruction\n"
+	 "       [--stack-report <file>] Write the worst case stack usage, and\n"
+	 "                           how it was reached, to <file> on exit\n"
+	 "       [--coverage <file>] Write the code coverage as an lcov file\n"
+	 "                           on exit (needs an ELF built with -g)\n"
+	 "       [--perf <file>]     Append the performance counters to <file>\n"
+	 "                           as JSON lines, periodically and on exit\n"
+	 "       [--perf-period <ms>] Host time between two --perf lines\n"
+	 "                           (default 1000, 0 for on exit only)\n"
+	 "       [--batch <manifest>] Run all the firmwares listed in <manifest>\n"
+	 "                           and exit (see sim_batch.h for the format)\n"
+	 "       [--jobs|-j <n>]     Number of threads for --batch (default:\n"
+	 "                           one per CPU)\n"
+	 "       [--junit <file>]    Write --batch results as JUnit XML\n"
+	 "       [--json <file>]     Write --batch results as JSON\n"
+	 "       <firmware>          A .hex, .srec, .bin or an ELF file. ELF files are\n"
 	 "                           preferred, and can include "
 	 "debugging syms\n");
 	exit(1);
 }
 
+/*
+ * Restore the state cached for this firmware, or run to the 'until' point
+ * (a cycle number or a code symbol) and cache it.
+ */
+static void
+warm_start(
+		avr_t * avr,
+		elf_firmware_t * f,
+		const char * dir,
+		const char * until,
+		const char * vcd_input)
+{
+	avr_cycle_count_t cycle = 0;
+	avr_flashaddr_t pc = AVR_STATE_ANY_PC;
+	char * end;
+
+	cycle = strtoull(until, &end, 0);
+	if (*end) {
+		cycle = 0;
+#if ELF_SYMBOLS
+		int count = elf_firmware_load_symbols(f);
+		for (int i = 0; i < count && pc == AVR_STATE_ANY_PC; i++)
+			if (!strcmp(f->symbol[i]->symbol, until))
+				pc = f->symbol[i]->addr;
+#endif
+		if (pc == AVR_STATE_ANY_PC) {
+			fprintf(stderr, "Warm start: symbol %s not found\n", until);
+			exit(1);
+		}
+	}
+	uint64_t key = avr_state_key(avr, until, strlen(until));
+	if (vcd_input)
+		key = avr_state_hash_file(key, vcd_input);
+	switch (avr_state_warm_start(avr, dir, key, cycle, pc)) {
+		case 1:
+			printf("Warm start: restored at cycle %llu\n",
+					(unsigned long long)avr->cycle);
+			break;
+		case 0:
+			printf("Warm start: ran to cycle %llu\n",
+					(unsigned long long)avr->cycle);
+			break;
+		default:
+			fprintf(stderr, "Warm start: firmware stopped before %s\n", until);
+			exit(1);
+	}
+}
+
 static void
 list_cores()
 {
@@ -80,11 +175,47 @@ list_cores()
 
 static avr_t * avr = NULL;
 
+static int
+run_batch(
+		const char * manifest,
+		int jobs,
+		int log,
+		const char * junit,
+		const char * json)
+{
+	avr_batch_t * b = avr_batch_load(manifest);
+	if (!b) {
+		fprintf(stderr, "Unable to load batch manifest %s\n", manifest);
+		return 1;
+	}
+	b->log = log > LOG_TRACE ? LOG_TRACE : log;
+	int failed = avr_batch_run(b, jobs);
+	for (int i = 0; i < b->count; i++) {
+		avr_batch_entry_t * e = &b->entry[i];
+		printf("%-6s %-40s %12" PRI_avr_cycle_count " cycles %8.3fs %s\n",
+			e->status == AVR_BATCH_PASS ? "PASS" :
+				e->status == AVR_BATCH_FAIL ? "FAIL" : "ERROR",
+			e->name, e->run_cycles, e->host_usec / 1000000.0, e->message);
+	}
+	printf("%d/%d passed in %.3fs\n", b->count - failed, b->count,
+			b->host_usec / 1000000.0);
+	if (junit)
+		avr_batch_write_junit(b, junit);
+	if (json)
+		avr_batch_write_json(b, json);
+	avr_batch_free(b);
+	return failed ? 1 : 0;
+}
+
+static FILE * perf_out;
+
 static void
 sig_int(
 		int sign)
 {
 	printf("signal caught, simavr terminating\n");
+	if (avr && perf_out)
+		avr_perf_write_json(avr, perf_out);
 	if (avr)
 		avr_terminate(avr);
 	exit(0);
@@ -103,11 +234,29 @@ main(
 	int gdb = 0;
 	int log = 1;
 	int port = 1234;
+	int monitor_port = 0;
 	char name[24] = "";
 	uint32_t loadBase = AVR_SEGMENT_OFFSET_FLASH;
 	int trace_vectors[8] = {0};
 	int trace_vectors_count = 0;
 	const char *vcd_input = NULL;
+	int vcd_input_loop = 0;
+	double vcd_input_scale = 1;
+	uint64_t vcd_input_seek = 0;
+	const char *batch = NULL, *batch_junit = NULL, *batch_json = NULL;
+	int batch_jobs = 0;
+	const char *flash_file = NULL, *eeprom_file = NULL;
+	int scratch = 0;
+	const char *warm_dir = NULL, *warm_until = NULL;
+	const char *itrace = NULL, *itrace_dump = NULL;
+	uint32_t itrace_size = AVR_ITRACE_DEFAULT_SIZE;
+	const char *profile = NULL;
+	int profile_format = AVR_PROFILE_FLAT;
+	uint32_t profile_period = 0;
+	const char *stack_report = NULL;
+	const char *coverage = NULL;
+	const char *perf = NULL;
+	uint32_t perf_period = 1000;
 
 	if (argc == 1)
 		display_usage(basename(argv[0]));
@@ -132,6 +281,18 @@ main(
 				vcd_input = argv[++pi];
 			else
 				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--input-loop")) {
+			vcd_input_loop = 1;
+		} else if (!strcmp(argv[pi], "--input-scale")) {
+			if (pi < argc-1)
+				vcd_input_scale = atof(argv[++pi]);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--input-seek")) {
+			if (pi < argc-1)
+				vcd_input_seek = strtoull(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
 		} else if (!strcmp(argv[pi], "-o") ||
 				   !strcmp(argv[pi], "--output")) {
 			if (pi + 1 >= argc) {
@@ -176,12 +337,13 @@ main(
 				exit(1);
 			}
 
+			elf_firmware_trace_t * t = elf_firmware_add_trace(&f);
 			/****/ if (!strcmp(trace.kind, "portpin")) {
-				f.trace[f.tracecount].kind = AVR_MMCU_TAG_VCD_PORTPIN;
+				t->kind = AVR_MMCU_TAG_VCD_PORTPIN;
 			} else if (!strcmp(trace.kind, "irq")) {
-				f.trace[f.tracecount].kind = AVR_MMCU_TAG_VCD_IRQ;
+				t->kind = AVR_MMCU_TAG_VCD_IRQ;
 			} else if (!strcmp(trace.kind, "trace")) {
-				f.trace[f.tracecount].kind = AVR_MMCU_TAG_VCD_TRACE;
+				t->kind = AVR_MMCU_TAG_VCD_TRACE;
 			} else {
 				fprintf(
 					stderr,
@@ -191,22 +353,20 @@ main(
 				);
 				exit(1);
 			}
-			f.trace[f.tracecount].mask = trace.mask;
-			f.trace[f.tracecount].addr = trace.addr;
-			strncpy(f.trace[f.tracecount].name, trace.name, sizeof(f.trace[f.tracecount].name));
+			t->mask = trace.mask;
+			t->addr = trace.addr;
+			snprintf(t->name, sizeof(t->name), "%s", trace.name);
 
 			printf(
 				"Adding %s trace on address 0x%04x, mask 0x%02x ('%s')\n",
-				  f.trace[f.tracecount].kind == AVR_MMCU_TAG_VCD_PORTPIN ? "portpin"
-				: f.trace[f.tracecount].kind == AVR_MMCU_TAG_VCD_IRQ     ? "irq"
-				: f.trace[f.tracecount].kind == AVR_MMCU_TAG_VCD_TRACE   ? "trace"
+				  t->kind == AVR_MMCU_TAG_VCD_PORTPIN ? "portpin"
+				: t->kind == AVR_MMCU_TAG_VCD_IRQ     ? "irq"
+				: t->kind == AVR_MMCU_TAG_VCD_TRACE   ? "trace"
 				: "unknown",
-				f.trace[f.tracecount].addr,
-				f.trace[f.tracecount].mask,
-				f.trace[f.tracecount].name
+				t->addr,
+				t->mask,
+				t->name
 			);
-
-			++f.tracecount;
 		} else if (!strcmp(argv[pi], "-ti")) {
 			if (pi < argc-1)
 				trace_vectors[trace_vectors_count++] = atoi(argv[++pi]);
@@ -215,6 +375,109 @@ main(
 			gdb++;
 			if (pi < (argc-2) && argv[pi+1][0] != '-' )
 				port = atoi(argv[++pi]);
+		} else if (!strcmp(argv[pi], "--monitor")) {
+			if (pi < argc-1)
+				monitor_port = atoi(argv[++pi]);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--batch")) {
+			if (pi < argc-1)
+				batch = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "-j") || !strcmp(argv[pi], "--jobs")) {
+			if (pi < argc-1)
+				batch_jobs = atoi(argv[++pi]);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--junit")) {
+			if (pi < argc-1)
+				batch_junit = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--json")) {
+			if (pi < argc-1)
+				batch_json = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--flash-file")) {
+			if (pi < argc-1)
+				flash_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--eeprom-file")) {
+			if (pi < argc-1)
+				eeprom_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--scratch")) {
+			scratch++;
+		} else if (!strcmp(argv[pi], "--warm-start")) {
+			if (pi < argc-1)
+				warm_dir = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--warm-until")) {
+			if (pi < argc-1)
+				warm_until = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--itrace")) {
+			if (pi < argc-1)
+				itrace = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--itrace-size")) {
+			if (pi < argc-1) {
+				unsigned long n = strtoul(argv[++pi], NULL, 0);
+				if (n > AVR_ITRACE_MAX_SIZE) {
+					fprintf(stderr, "%s: --itrace-size %s is more than %u\n",
+							argv[0], argv[pi], AVR_ITRACE_MAX_SIZE);
+					exit(1);
+				}
+				itrace_size = n;
+			} else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--itrace-dump")) {
+			if (pi < argc-1)
+				itrace_dump = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--profile")) {
+			if (pi < argc-1)
+				profile = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--profile-format")) {
+			if (pi < argc-1)
+				profile_format = avr_profile_parse_format(argv[++pi]);
+			if (pi == argc-1 || profile_format < 0)
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--profile-period")) {
+			if (pi < argc-1)
+				profile_period = strtoul(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--stack-report")) {
+			if (pi < argc-1)
+				stack_report = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--coverage")) {
+			if (pi < argc-1)
+				coverage = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--perf")) {
+			if (pi < argc-1)
+				perf = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		} else if (!strcmp(argv[pi], "--perf-period")) {
+			if (pi < argc-1)
+				perf_period = strtoul(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
 		} else if (!strcmp(argv[pi], "-v")) {
 			log++;
 		} else if (!strcmp(argv[pi], "-ee")) {
@@ -223,34 +486,20 @@ main(
 			loadBase = AVR_SEGMENT_OFFSET_FLASH;
 		} else if (argv[pi][0] != '-') {
 			char * filename = argv[pi];
-			char * suffix = strrchr(filename, '.');
-			if (suffix && !strcasecmp(suffix, ".hex")) {
+			if (image_kind(filename) != IMAGE_ELF) {
 				if (!name[0] || !f_cpu) {
-					fprintf(stderr, "%s: --mcu and --freq are mandatory to load .hex files\n", argv[0]);
+					fprintf(stderr, "%s: --mcu and --freq are mandatory to load .hex, .srec and .bin files\n", argv[0]);
 					exit(1);
 				}
-				ihex_chunk_p chunk = NULL;
-				int cnt = read_ihex_chunks(filename, &chunk);
-				if (cnt <= 0) {
-					fprintf(stderr, "%s: Unable to load IHEX file %s\n",
+				if (read_image_firmware(filename, &f, loadBase)) {
+					fprintf(stderr, "%s: Unable to load image file %s\n",
 						argv[0], argv[pi]);
 					exit(1);
 				}
-				printf("Loaded %d section of ihex\n", cnt);
-				for (int ci = 0; ci < cnt; ci++) {
-					if (chunk[ci].baseaddr < (1*1024*1024)) {
-						f.flash = chunk[ci].data;
-						f.flashsize = chunk[ci].size;
-						f.flashbase = chunk[ci].baseaddr;
-						printf("Load HEX flash %08x, %d\n", f.flashbase, f.flashsize);
-					} else if (chunk[ci].baseaddr >= AVR_SEGMENT_OFFSET_EEPROM ||
-							chunk[ci].baseaddr + loadBase >= AVR_SEGMENT_OFFSET_EEPROM) {
-						// eeprom!
-						f.eeprom = chunk[ci].data;
-						f.eesize = chunk[ci].size;
-						printf("Load HEX eeprom %08x, %d\n", chunk[ci].baseaddr, f.eesize);
-					}
-				}
+				if (f.flash)
+					printf("Load flash %08x, %d\n", f.flashbase, f.flashsize);
+				if (f.eeprom)
+					printf("Load eeprom, %d\n", f.eesize);
 			} else {
 				if (elf_read_firmware(filename, &f) == -1) {
 					fprintf(stderr, "%s: Unable to load firmware from file %s\n",
@@ -261,6 +510,11 @@ main(
 		}
 	}
 
+	if (itrace_dump)
+		return avr_itrace_decode(itrace_dump, &f, stdout, 0) ? 1 : 0;
+	if (batch)
+		return run_batch(batch, batch_jobs, log, batch_junit, batch_json);
+
 	if (strlen(name))
 		strcpy(f.mmcu, name);
 	if (f_cpu)
@@ -271,43 +525,89 @@ main(
 		fprintf(stderr, "%s: AVR '%s' not known\n", argv[0], f.mmcu);
 		exit(1);
 	}
-	avr_init(avr);
+	avr->backing.flash = flash_file;
+	avr->backing.eeprom = eeprom_file;
+	avr->backing.scratch = scratch;
+	if (avr_init(avr)) {
+		fprintf(stderr, "%s: Unable to initialize the AVR\n", argv[0]);
+		exit(1);
+	}
 	avr->log = (log > LOG_TRACE ? LOG_TRACE : log);
 #ifdef CONFIG_SIMAVR_TRACE
 	avr->trace = trace;
 #endif //CONFIG_SIMAVR_TRACE
 
 	avr_load_firmware(avr, &f);
-	if (f.flashbase) {
-		printf("Attempted to load a bootloader at %04x\n", f.flashbase);
-		avr->pc = f.flashbase;
+	if (f.entry || f.flashbase) {
+		avr->pc = f.entry ? f.entry : f.flashbase;
+		printf("Attempted to load a bootloader at %04x\n", avr->pc);
 	}
 	for (int ti = 0; ti < trace_vectors_count; ti++) {
 		for (int vi = 0; vi < avr->interrupts.vector_count; vi++)
 			if (avr->interrupts.vector[vi]->vector == trace_vectors[ti])
 				avr->interrupts.vector[vi]->trace = 1;
 	}
+	if (warm_dir && warm_until)
+		warm_start(avr, &f, warm_dir, warm_until, vcd_input);
+	else if (warm_dir)
+		fprintf(stderr, "%s: --warm-start needs --warm-until\n", argv[0]);
 	if (vcd_input) {
 		static avr_vcd_t input;
 		if (avr_vcd_init_input(avr, vcd_input, &input)) {
 			fprintf(stderr, "%s: Warning: VCD input file %s failed\n", argv[0], vcd_input);
+		} else {
+			avr_vcd_input_loop(&input, vcd_input_loop);
+			avr_vcd_input_scale(&input, vcd_input_scale);
+			if (vcd_input_seek)
+				avr_vcd_input_seek(&input, vcd_input_seek);
 		}
 	}
+	if (itrace && avr_itrace_init(avr, itrace, itrace_size))
+		fprintf(stderr, "%s: Warning: can't record the instruction trace in %s\n",
+				argv[0], itrace);
+	if (profile && avr_profile_init(avr, &f, profile_period, profile, profile_format))
+		fprintf(stderr, "%s: Warning: can't start the profiler\n", argv[0]);
+	if (stack_report && avr_stack_init(avr, &f, stack_report))
+		fprintf(stderr, "%s: Warning: can't start the stack analysis\n", argv[0]);
+	if (coverage && avr_coverage_init(avr, &f, coverage, NULL))
+		fprintf(stderr, "%s: Warning: can't record the code coverage\n", argv[0]);
+	if (perf) {
+		perf_out = strcmp(perf, "-") ? fopen(perf, "a") : stdout;
+		if (!perf_out)
+			fprintf(stderr, "%s: Warning: can't open %s: %s\n", argv[0],
+					perf, strerror(errno));
+	}
 
 	// even if not setup at startup, activate gdb if crashing
 	avr->gdb_port = port;
+	avr->monitor_port = monitor_port;
 	if (gdb) {
 		avr->state = cpu_Stopped;
 		avr_gdb_init(avr);
-	}
+	} else if (monitor_port)
+		avr_gdb_init_monitor(avr);
 
 	signal(SIGINT, sig_int);
 	signal(SIGTERM, sig_int);
 
-	for (;;) {
+	// start the host clock, 'host_ns' counts from there
+	uint64_t perf_next = avr_get_time_stamp(avr) + perf_period * 1000000ULL;
+	for (uint32_t n = 1; ; n++) {
 		int state = avr_run(avr);
 		if (state == cpu_Done || state == cpu_Crashed)
 			break;
+		// reading the host clock is not free, only do it now and then
+		if (perf_out && perf_period && !(n & 0xffff) &&
+				avr_get_time_stamp(avr) >= perf_next) {
+			avr_perf_write_json(avr, perf_out);
+			perf_next = avr_get_time_stamp(avr) + perf_period * 1000000ULL;
+		}
+	}
+	if (perf_out) {
+		avr_perf_write_json(avr, perf_out);
+		if (perf_out != stdout)
+			fclose(perf_out);
+		perf_out = NULL;
 	}
 
 	avr_terminate(avr);
@@ -26,11 +26,22 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <errno.h>
+#include <pthread.h>
 #include "sim_avr.h"
+#include "sim_utils.h"
 #include "sim_core.h"
 #include "sim_time.h"
 #include "sim_gdb.h"
+#include "sim_undo.h"
+#include "sim_itrace.h"
+#include "sim_profile.h"
+#include "sim_stack.h"
+#include "sim_callstack.h"
+#include "sim_coverage.h"
+#include "sim_perf.h"
 #include "avr_uart.h"
+#include "avr_eeprom.h"
 #include "sim_vcd_file.h"
 #include "avr/avr_mcu_section.h"
 
@@ -93,16 +104,67 @@ avr_get_time_stamp(
 	return stamp - avr->time_base;
 }
 
+/*
+ * What avr_reset_full() restores. Only the callbacks are taken back from
+ * 'io', the IRQs made on demand by avr_iomem_getirq() are kept.
+ */
+typedef struct avr_init_state_t {
+	struct avr_io_slot_t	io[MAX_IOs];
+	int						io_shared_io_count;
+	struct avr_io_shared_t	io_shared_io[4];
+	avr_cmd_table_t			commands;
+	uint8_t					fuse[6];
+	uint8_t					lockbits;
+	uint32_t				frequency;
+	uint32_t				vcc, avcc, aref;
+} avr_init_state_t;
+
+static void
+_avr_init_state_save(
+		avr_t * avr)
+{
+	avr_init_state_t * st = avr->init_state;
+	if (!st && !(st = avr->init_state = malloc(sizeof(*st))))
+		return;
+	memcpy(st->io, avr->io, sizeof(st->io));
+	st->io_shared_io_count = avr->io_shared_io_count;
+	memcpy(st->io_shared_io, avr->io_shared_io, sizeof(st->io_shared_io));
+	st->commands = avr->commands;
+	memcpy(st->fuse, avr->fuse, sizeof(st->fuse));
+	st->lockbits = avr->lockbits;
+	st->frequency = avr->frequency;
+	st->vcc = avr->vcc;
+	st->avcc = avr->avcc;
+	st->aref = avr->aref;
+	// the hooks the modules made between themselves are there to stay
+	avr_irq_pool_seal(&avr->irq_pool);
+}
+
 int
 avr_init(
 		avr_t * avr)
 {
-	avr->flash = malloc(avr->flashend + 4);
-	memset(avr->flash, 0xff, avr->flashend + 1);
-	*((uint16_t*)&avr->flash[avr->flashend + 1]) = AVR_OVERFLOW_OPCODE;
+	int res = 0;
+	if (avr_perf_init(avr))
+		return -1;
+	if (avr->flash_share_blank) {
+		// the flash is only made private when code is loaded in it
+		avr->flash_image = avr_flash_image_blank(avr->flashend);
+		if (!avr->flash_image)
+			return -1;
+		avr->flash = avr->flash_image->data;
+	} else {
+		avr->flash = malloc(avr->flashend + 4);
+		if (!avr->flash)
+			return -1;
+		memset(avr->flash, 0xff, avr->flashend + 1);
+		*((uint16_t*)&avr->flash[avr->flashend + 1]) = AVR_OVERFLOW_OPCODE;
+	}
+	if (avr->backing.flash &&
+			avr_flash_map_file(avr, avr->backing.flash, !avr->backing.scratch))
+		res = -1;
 	avr->codeend = avr->flashend;
-	avr->data = malloc(avr->ramend + 1);
-	memset(avr->data, 0, avr->ramend + 1);
+	avr->data = calloc(1, avr->ramend + 1);
 #ifdef CONFIG_SIMAVR_TRACE
 	avr->trace_data = calloc(1, sizeof(struct avr_trace_data_t));
 #endif
@@ -118,6 +180,17 @@ avr_init(
 		avr->custom.init(avr, avr->custom.data);
 	if (avr->init)
 		avr->init(avr);
+	if (avr->backing.eeprom) {
+		avr_eeprom_map_t m = {
+			.path = avr->backing.eeprom,
+			.shared = !avr->backing.scratch,
+		};
+		if (avr_ioctl(avr, AVR_IOCTL_EEPROM_MAP, &m) < 0) {
+			AVR_LOG(avr, LOG_ERROR, "%s: can't map eeprom file %s\n",
+					__func__, avr->backing.eeprom);
+			res = -1;
+		}
+	}
 	// set default (non gdb) fast callbacks
 	avr->run = avr_callback_run_raw;
 	avr->sleep = avr_callback_sleep_raw;
@@ -126,7 +199,8 @@ avr_init(
 	avr->log = 1;
 	avr_reset(avr);
 	avr_regbit_set(avr, avr->reset_flags.porf);		// by  default set to power-on reset
-	return 0;
+	_avr_init_state_save(avr);
+	return res;
 }
 
 void
@@ -143,9 +217,20 @@ avr_terminate(
 		avr_vcd_close(avr->vcd);
 		avr->vcd = NULL;
 	}
+	avr_itrace_deinit(avr);
+	avr_profile_deinit(avr);
+	avr_stack_deinit(avr);
+	avr_coverage_deinit(avr);
 	avr_deallocate_ios(avr);
 
-	if (avr->flash) free(avr->flash);
+	if (avr->flash_image) {
+		avr_flash_image_unref(avr->flash_image);
+		avr->flash_image = NULL;
+	} else if (avr->flash_mapped) {
+		sim_munmap_file(avr->flash, avr->flashend + 1, 3);
+		avr->flash_mapped = 0;
+	} else if (avr->flash)
+		free(avr->flash);
 	if (avr->data) free(avr->data);
 	if (avr->io_console_buffer.buf) {
 		avr->io_console_buffer.len = 0;
@@ -154,6 +239,11 @@ avr_terminate(
 		avr->io_console_buffer.buf = NULL;
 	}
 	avr->flash = avr->data = NULL;
+	if (avr->init_state) {
+		free(avr->init_state);
+		avr->init_state = NULL;
+	}
+	avr_perf_deinit(avr);
 }
 
 void
@@ -179,7 +269,78 @@ avr_reset(
 			port->reset(port);
 		port = port->next;
 	}
+	avr->perf->cycle_base += avr->cycle;
 	avr->cycle = 0; // Prevent crash
+	// there is no going back past a reset
+	avr_undo_clear(avr);
+	avr_profile_reset(avr);
+	avr_callstack_reset(avr);
+}
+
+void
+avr_reset_full(
+		avr_t * avr)
+{
+	avr_init_state_t * st = avr->init_state;
+
+	AVR_LOG(avr, LOG_TRACE, "%s full reset\n", avr->mmcu);
+	/*
+	 * Drop the external hooks first, the VCD signals are chained from the
+	 * avr irqs and are about to be freed
+	 */
+	avr_irq_pool_unhook(&avr->irq_pool);
+	if (avr->vcd) {
+		avr_vcd_close(avr->vcd);
+		free(avr->vcd);
+		avr->vcd = NULL;
+	}
+	if (st) {
+		for (int i = 0; i < MAX_IOs; i++) {
+			avr->io[i].r = st->io[i].r;
+			avr->io[i].w = st->io[i].w;
+		}
+		avr->io_shared_io_count = st->io_shared_io_count;
+		memcpy(avr->io_shared_io, st->io_shared_io, sizeof(st->io_shared_io));
+		avr->commands = st->commands;
+		memcpy(avr->fuse, st->fuse, sizeof(st->fuse));
+		avr->lockbits = st->lockbits;
+		avr->frequency = st->frequency;
+		avr->vcc = st->vcc;
+		avr->avcc = st->avcc;
+		avr->aref = st->aref;
+	}
+	avr->io_console_buffer.len = 0;
+	avr->firmware = NULL;
+
+	/*
+	 * a private flash is blanked in place, a shared one goes back to the
+	 * blank image, or is made private first if the instance doesn't share it
+	 */
+	if (avr->flash_image && !avr->flash_share_blank)
+		avr_flash_unshare(avr);
+	if (avr->flash_image) {
+		avr_flash_image_t * blank = avr_flash_image_blank(avr->flashend);
+		if (blank) {
+			avr_flash_image_attach(avr, blank);
+			avr_flash_image_unref(blank);
+		}
+	} else if (!avr->flash_mapped)
+		memset(avr->flash, 0xff, avr->flashend + 1);
+	avr->codeend = avr->flashend;
+	if (!avr->backing.eeprom && avr->e2end) {
+		avr_eeprom_desc_t d = { .offset = 0, .size = avr->e2end + 1 };
+		if (avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &d) == 0 && d.ee)
+			memset(d.ee, 0xff, d.size);
+	}
+	memset(avr->data, 0, avr->ramend + 1);
+	// the counters were for the code that was in the flash
+	avr_profile_rebind(avr, NULL);
+	avr_coverage_rebind(avr, NULL);
+	avr_stack_rebind(avr, NULL);
+
+	avr_reset(avr);
+	avr_regbit_set(avr, avr->reset_flags.porf);
+	avr_ioctl(avr, AVR_IOCTL_PERF_RESET, NULL);
 }
 
 void
@@ -251,9 +412,145 @@ avr_loadcode(
 			size, avr->flashend + 1);
 		abort();
 	}
+	avr_flash_unshare(avr);
 	memcpy(avr->flash + address, code, size);
 }
 
+avr_flash_image_t *
+avr_flash_image_alloc(
+		uint32_t flashend)
+{
+	avr_flash_image_t * image = malloc(sizeof(*image) + flashend + 4);
+	if (!image)
+		return NULL;
+	image->refcount = 1;
+	image->flashend = flashend;
+	memset(image->data, 0xff, flashend + 1);
+	*((uint16_t*)&image->data[flashend + 1]) = AVR_OVERFLOW_OPCODE;
+	return image;
+}
+
+#define AVR_FLASH_BLANK_SIZES	16
+static avr_flash_image_t * avr_flash_blank[AVR_FLASH_BLANK_SIZES];
+static pthread_mutex_t avr_flash_blank_lock = PTHREAD_MUTEX_INITIALIZER;
+
+avr_flash_image_t *
+avr_flash_image_blank(
+		uint32_t flashend)
+{
+	avr_flash_image_t * image = NULL;
+	pthread_mutex_lock(&avr_flash_blank_lock);
+	int i = 0;
+	for (; i < AVR_FLASH_BLANK_SIZES && avr_flash_blank[i]; i++)
+		if (avr_flash_blank[i]->flashend == flashend) {
+			image = avr_flash_image_ref(avr_flash_blank[i]);
+			break;
+		}
+	/*
+	 * the cache keeps its own reference, blank images are never freed;
+	 * when it is full, the caller gets the only reference to a new one
+	 */
+	if (!image && (image = avr_flash_image_alloc(flashend)) &&
+			i < AVR_FLASH_BLANK_SIZES)
+		avr_flash_blank[i] = avr_flash_image_ref(image);
+	pthread_mutex_unlock(&avr_flash_blank_lock);
+	return image;
+}
+
+void
+avr_flash_image_load(
+		avr_flash_image_t * image,
+		const uint8_t * code,
+		uint32_t size,
+		avr_flashaddr_t address)
+{
+	if ((address + size) > image->flashend + 1) {
+		AVR_LOG(NULL, LOG_ERROR, "%s: Attempted to load code of size %d but flash size is only %d.\n",
+			__func__, size, image->flashend + 1);
+		abort();
+	}
+	memcpy(image->data + address, code, size);
+}
+
+avr_flash_image_t *
+avr_flash_image_ref(
+		avr_flash_image_t * image)
+{
+	__sync_add_and_fetch(&image->refcount, 1);
+	return image;
+}
+
+void
+avr_flash_image_unref(
+		avr_flash_image_t * image)
+{
+	if (image && __sync_sub_and_fetch(&image->refcount, 1) == 0)
+		free(image);
+}
+
+int
+avr_flash_image_attach(
+		avr_t * avr,
+		avr_flash_image_t * image)
+{
+	// a file backed flash keeps its own copy
+	if (image->flashend != avr->flashend || avr->flash_mapped)
+		return -1;
+	avr_flash_image_ref(image);
+	if (avr->flash_image)
+		avr_flash_image_unref(avr->flash_image);
+	else
+		free(avr->flash);
+	avr->flash_image = image;
+	avr->flash = image->data;
+	return 0;
+}
+
+void
+avr_flash_unshare(
+		avr_t * avr)
+{
+	if (likely(!avr->flash_image))
+		return;
+	uint8_t * flash = malloc(avr->flashend + 4);
+	if (!flash) {
+		AVR_LOG(avr, LOG_ERROR, "%s: can't allocate a %d bytes flash\n",
+				__func__, avr->flashend + 4);
+		abort();
+	}
+	memcpy(flash, avr->flash, avr->flashend + 4);
+	avr_flash_image_unref(avr->flash_image);
+	avr->flash_image = NULL;
+	avr->flash = flash;
+}
+
+int
+avr_flash_map_file(
+		avr_t * avr,
+		const char * path,
+		int shared)
+{
+	uint8_t * flash = sim_mmap_file(path, avr->flashend + 1, 3, 0xff, shared);
+	if (!flash) {
+		AVR_LOG(avr, LOG_ERROR, "%s: can't map %s: %s\n",
+				__func__, path, strerror(errno));
+		return -1;
+	}
+	*((uint16_t*)&flash[avr->flashend + 1]) = AVR_OVERFLOW_OPCODE;
+	if (avr->flash_image) {
+		avr_flash_image_unref(avr->flash_image);
+		avr->flash_image = NULL;
+	} else if (avr->flash_mapped)
+		sim_munmap_file(avr->flash, avr->flashend + 1, 3);
+	else
+		free(avr->flash);
+	avr->flash = flash;
+	avr->flash_mapped = 1;
+	AVR_LOG(avr, LOG_TRACE, "%s: flash mapped from %s (%s)\n",
+			__func__, path, shared ? "shared" : "scratch");
+	return 0;
+}
+
 /**
  * Accumulates sleep requests (and returns a sleep time of 0) until
  * a minimum count of requested sleep microseconds are reached
@@ -287,7 +584,14 @@ void
 avr_callback_run_gdb(
 		avr_t * avr)
 {
-	avr_gdb_processor(avr, avr->state == cpu_Stopped ? 50000 : 0);
+	avr_gdb_t * g = avr->gdb;
+	/*
+	 * While running, the gdb server only needs to be called when the
+	 * network thread has something for us, and when a breakpoint is hit.
+	 */
+	if (avr->state != cpu_Running || avr_gdb_pending(g) ||
+			avr_gdb_break_at(g, avr->pc))
+		avr_gdb_processor(avr, avr->state == cpu_Stopped ? 50000 : 0);
 
 	if (avr->state == cpu_Stopped)
 		return ;
@@ -324,6 +628,7 @@ avr_callback_run_gdb(
 		 */
 		avr->sleep(avr, sleep);
 		avr->cycle += 1 + sleep;
+		avr->perf->sleep_cycles += 1 + sleep;
 	}
 	// Interrupt servicing might change the PC too, during 'sleep'
 	if (avr->state == cpu_Running || avr->state == cpu_Sleeping)
@@ -386,6 +691,7 @@ avr_callback_run_raw(
 		 */
 		avr->sleep(avr, sleep);
 		avr->cycle += 1 + sleep;
+		avr->perf->sleep_cycles += 1 + sleep;
 	}
 	// Interrupt servicing might change the PC too, during 'sleep'
 	if (avr->state == cpu_Running || avr->state == cpu_Sleeping) {
@@ -413,21 +719,60 @@ avr_core_allocate(
 {
 	uint8_t * b = malloc(coreLen);
 	memcpy(b, core, coreLen);
+	((avr_t *)b)->core_size = coreLen;
 	return (avr_t *)b;
 }
 
+/*
+ * Open addressing hash table of all the avr_kind[] names, built the first
+ * time a core is looked up.
+ */
+#define AVR_KIND_HASH_SIZE	512
+static struct {
+	const char *	name;
+	avr_kind_t *	kind;
+} avr_kind_hash[AVR_KIND_HASH_SIZE];
+static pthread_once_t avr_kind_hash_once = PTHREAD_ONCE_INIT;
+
+static uint32_t
+avr_kind_hash_name(
+		const char * name)
+{
+	uint32_t h = 2166136261u;	// FNV-1a
+	while (*name)
+		h = (h ^ (uint8_t)*name++) * 16777619u;
+	return h & (AVR_KIND_HASH_SIZE - 1);
+}
+
+static void
+avr_kind_hash_init(void)
+{
+	for (int i = 0; avr_kind[i]; i++)
+		for (int j = 0; j < 4 && avr_kind[i]->names[j]; j++) {
+			const char * name = avr_kind[i]->names[j];
+			uint32_t h = avr_kind_hash_name(name);
+			while (avr_kind_hash[h].name && strcmp(avr_kind_hash[h].name, name))
+				h = (h + 1) & (AVR_KIND_HASH_SIZE - 1);
+			// the first core with a name wins, as with the linear search
+			if (!avr_kind_hash[h].name) {
+				avr_kind_hash[h].name = name;
+				avr_kind_hash[h].kind = avr_kind[i];
+			}
+		}
+}
+
 avr_t *
 avr_make_mcu_by_name(
 		const char *name)
 {
 	avr_kind_t * maker = NULL;
-	for (int i = 0; avr_kind[i] && !maker; i++) {
-		for (int j = 0; avr_kind[i]->names[j]; j++)
-			if (!strcmp(avr_kind[i]->names[j], name)) {
-				maker = avr_kind[i];
-				break;
-			}
-	}
+	pthread_once(&avr_kind_hash_once, avr_kind_hash_init);
+	for (uint32_t h = avr_kind_hash_name(name); avr_kind_hash[h].name;
+			h = (h + 1) & (AVR_KIND_HASH_SIZE - 1))
+		if (!strcmp(avr_kind_hash[h].name, name)) {
+			maker = avr_kind_hash[h].kind;
+			break;
+		}
 	if (!maker) {
 		AVR_LOG(((avr_t*)0), LOG_ERROR, "%s: AVR '%s' not known\n", __FUNCTION__, name);
 		return NULL;
@@ -114,8 +114,6 @@ enum {
 
 // this is only ever used if CONFIG_SIMAVR_TRACE is defined
 struct avr_trace_data_t {
-	struct avr_symbol_t ** codeline;
-
 	/* DEBUG ONLY
 	 * this keeps track of "jumps" ie, call,jmp,ret,reti and so on
 	 * allows dumping of a meaningful data even if the stack is
@@ -160,6 +158,7 @@ typedef void (*avr_run_t)(
  */
 typedef struct avr_t {
 	const char * 		mmcu;	// name of the AVR
+	uint32_t			core_size;	// size of the whole core structure, with the IO modules
 	// these are filled by sim_core_declare from constants in /usr/lib/avr/include/avr/io*.h
 	uint16_t			ioend;
 	uint16_t 			ramend;
@@ -211,14 +210,25 @@ typedef struct avr_t {
 	void (*reset)(struct avr_t * avr);
 
 	struct {
-		// called at init time (for special purposes like using a
-		// memory mapped file as flash see: simduino)
+		// called at init time (for special purposes, for a memory
+		// mapped flash, see 'backing' below)
 		void (*init)(struct avr_t * avr, void * data);
 		// called at termination time ( to clean special initializations)
 		void (*deinit)(struct avr_t * avr, void * data);
 		// value passed to init() and deinit()
 		void *data;
 	} custom;
+	/*
+	 * Optional files to back the flash and eeprom with, mapped at init time.
+	 * Unless 'scratch' is set, SPM and eeprom writes land in the files, so
+	 * the content survives a restart; with 'scratch', the files are only
+	 * used as the initial content.
+	 */
+	struct {
+		const char * flash;
+		const char * eeprom;
+		uint8_t scratch;
+	} backing;
 
 	/*!
 	 * Default AVR core run function.
@@ -275,7 +285,7 @@ typedef struct avr_t {
 	 * If you wanted to emulate the BIG AVRs, and XMegas, this would need
 	 * work.
 	 */
-	struct {
+	struct avr_io_slot_t {
 		struct avr_irq_t * irq;	// optional, used only if asked for with avr_iomem_getirq()
 		struct {
 			void * param;
@@ -297,7 +307,7 @@ typedef struct avr_t {
 	 * other, normal cases...
 	 */
 	int				io_shared_io_count;
-	struct {
+	struct avr_io_shared_t {
 		int used;
 		struct {
 			void * param;
@@ -307,6 +317,18 @@ typedef struct avr_t {
 
 	// flash memory (initialized to 0xff, and code loaded into it)
 	uint8_t *		flash;
+	// if non-NULL, 'flash' points into this shared, read only image
+	// and must be made private with avr_flash_unshare() before writing to it
+	struct avr_flash_image_t * flash_image;
+	/*
+	 * Set before avr_init() to start from the blank flash image shared by
+	 * the whole process, instead of filling a private flash. Only for code
+	 * that never writes to avr->flash directly, but through avr_loadcode(),
+	 * avr_load_firmware() or after avr_flash_unshare().
+	 */
+	uint8_t			flash_share_blank;
+	// set when 'flash' is a file mapped by avr_flash_map_file()
+	uint8_t			flash_mapped;
 	// this is the general purpose registers, IO registers, and SRAM
 	uint8_t *		data;
 
@@ -315,6 +337,8 @@ typedef struct avr_t {
 
 	// Builtin and user-defined commands
 	avr_cmd_table_t commands;
+	// what avr_init() set up, for avr_reset_full() to go back to
+	struct avr_init_state_t * init_state;
 	// cycle timers tracking & delivery
 	avr_cycle_timer_pool_t	cycle_timers;
 	// interrupt vectors and delivery fifo
@@ -326,6 +350,9 @@ typedef struct avr_t {
 
 	// Only used if CONFIG_SIMAVR_TRACE is defined
 	struct avr_trace_data_t *trace_data;
+	// firmware loaded by avr_load_firmware(), for avr_symbol_at(); it has
+	// to stay valid as long as this avr is
+	struct elf_firmware_t * firmware;
 
 	// VALUE CHANGE DUMP file (waveforms)
 	// this is the VCD file that gets allocated if the
@@ -336,11 +363,29 @@ typedef struct avr_t {
 
 	// gdb hooking structure. Only present when gdb server is active
 	struct avr_gdb_t * gdb;
+	// undo log for reverse execution, only present when gdb server is active
+	struct avr_undo_t * undo;
+	// binary instruction trace, NULL while it's stopped (see sim_itrace.h)
+	struct avr_itrace_t * itrace;
+	struct avr_itrace_t * itrace_ring;
+	// cycle profiler, only present when enabled (see sim_profile.h)
+	struct avr_profile_t * profile;
+	// stack usage analysis, only present when enabled (see sim_stack.h)
+	struct avr_stack_t * stack;
+	// shadow call stack, present while the two above use it (see sim_callstack.h)
+	struct avr_callstack_t * callstack;
+	// code coverage bitmaps, only present when enabled (see sim_coverage.h)
+	struct avr_coverage_t * coverage;
+	// performance counters, always present (see sim_perf.h)
+	struct avr_perf_t * perf;
 
 	// if non-zero, the gdb server will be started when the core
 	// crashed even if not activated at startup
 	// if zero, the simulator will just exit() in case of a crash
 	int		gdb_port;
+	// if non-zero, the gdb server also accepts JSON monitor clients
+	// on that port, see sim_gdb.c
+	int		monitor_port;
 
 	// buffer for console debugging output from register
 	struct {
@@ -357,6 +402,17 @@ typedef struct avr_kind_t {
 	avr_t * (*make)(void);
 } avr_kind_t;
 
+/*
+ * A flash image shared between several avr_t instances running the same
+ * firmware. It is reference counted, and never changes once loaded; an
+ * instance that needs to write to its flash (SPM, gdb) gets a private copy.
+ */
+typedef struct avr_flash_image_t {
+	volatile uint32_t	refcount;
+	uint32_t			flashend;
+	uint8_t				data[0];	// flashend + 4 bytes, like avr_t.flash
+} avr_flash_image_t;
+
 // a symbol loaded from the .elf file
 typedef struct avr_symbol_t {
 	uint32_t	addr;
@@ -382,6 +438,20 @@ avr_core_allocate(
 void
 avr_reset(
 		avr_t * avr);
+/*
+ * Puts the AVR back in the state avr_init() left it in, reusing all its
+ * buffers and IRQs: SRAM is cleared, the flash is blank and the eeprom
+ * erased (unless they are backed by a file), and the fuses, lock bits,
+ * frequency and voltages are the core's defaults again. Everything that
+ * was hooked on the irqs of avr->irq_pool, IO registers or commands after
+ * avr_init() is disconnected in one go, as is the firmware VCD file. The
+ * gdb server and the run/sleep callbacks stay, as does the instrumentation
+ * (profile, coverage, stack), but its counters are cleared and it forgets
+ * the firmware; avr_reload() gives it the new one.
+ */
+void
+avr_reset_full(
+		avr_t * avr);
 // run one cycle of the AVR, sleep if necessary
 int
 avr_run(
@@ -413,6 +483,54 @@ avr_loadcode(
 		uint32_t size,
 		avr_flashaddr_t address);
 
+/*
+ * Returns a new reference to the blank (0xff filled) flash image of
+ * 'flashend', shared by the instances of that flash size that have
+ * 'flash_share_blank' set until they load code, so avr_init() doesn't have
+ * to fill a flash of their own.
+ */
+avr_flash_image_t *
+avr_flash_image_blank(
+		uint32_t flashend);
+
+// allocate a blank (0xff filled) flash image, with a reference count of one
+avr_flash_image_t *
+avr_flash_image_alloc(
+		uint32_t flashend);
+// load code in a flash image, before it is shared
+void
+avr_flash_image_load(
+		avr_flash_image_t * image,
+		const uint8_t * code,
+		uint32_t size,
+		avr_flashaddr_t address);
+avr_flash_image_t *
+avr_flash_image_ref(
+		avr_flash_image_t * image);
+// drop a reference, frees the image when it was the last one
+void
+avr_flash_image_unref(
+		avr_flash_image_t * image);
+// make 'avr' use 'image' as its flash, returns -1 if the sizes do not match
+int
+avr_flash_image_attach(
+		avr_t * avr,
+		avr_flash_image_t * image);
+// make sure avr->flash is private to this instance, before writing to it
+void
+avr_flash_unshare(
+		avr_t * avr);
+/*
+ * Replace the flash with file 'path' mapped in memory. If 'shared' is set, it
+ * is created if needed, and flash writes are written back to it. Otherwise
+ * the file is only the initial content. Returns -1 on error.
+ */
+int
+avr_flash_map_file(
+		avr_t * avr,
+		const char * path,
+		int shared);
+
 /*
  * These are accessors for avr->data but allows watchpoints to be set for gdb
  * IO modules use that to set values to registers, and the AVR core decoder uses
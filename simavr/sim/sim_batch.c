@@ -0,0 +1,669 @@
+/*
+	sim_batch.c
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_hex.h"
+#include "avr_uart.h"
+#include "sim_batch.h"
+
+#define AVR_BATCH_DEFAULT_CYCLES	10000000
+
+static uint64_t
+_avr_batch_usec(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+/*
+ * Split the next key=value token from 'line', decodes quoted values in place.
+ * Returns a pointer past the token, or NULL when there are no more.
+ */
+static char *
+_avr_batch_token(
+		char * line,
+		char ** key,
+		char ** value,
+		uint32_t * value_len)
+{
+	while (*line && isspace(*line))
+		line++;
+	if (!*line || *line == '#')
+		return NULL;
+	*key = line;
+	while (*line && *line != '=' && !isspace(*line))
+		line++;
+	if (*line != '=') {
+		*line = 0;
+		*value = line;
+		*value_len = 0;
+		return line;
+	}
+	*line++ = 0;
+	char * dst = *value = line;
+	if (*line != '"') {
+		while (*line && !isspace(*line))
+			line++;
+		*value_len = line - *value;
+		if (*line)
+			*line++ = 0;
+		return line;
+	}
+	line++;
+	while (*line && *line != '"') {
+		if (*line == '\\' && line[1]) {
+			line++;
+			switch (*line) {
+				case 'n': *dst++ = '\n'; line++; break;
+				case 'r': *dst++ = '\r'; line++; break;
+				case 't': *dst++ = '\t'; line++; break;
+				case '0': *dst++ = 0; line++; break;
+				case 'x': {
+					unsigned int v = 0;
+					int n = 0;
+					line++;
+					while (n < 2 && isxdigit(*line)) {
+						v = (v << 4) | (isdigit(*line) ? *line - '0' :
+									(tolower(*line) - 'a' + 10));
+						line++; n++;
+					}
+					*dst++ = v;
+				}	break;
+				default: *dst++ = *line++; break;
+			}
+		} else
+			*dst++ = *line++;
+	}
+	if (*line)
+		line++;
+	*value_len = dst - *value;
+	*dst = 0;
+	return line;
+}
+
+avr_batch_t *
+avr_batch_load(
+		const char * manifest)
+{
+	FILE * f = fopen(manifest, "r");
+	if (!f) {
+		perror(manifest);
+		return NULL;
+	}
+	avr_batch_t * batch = malloc(sizeof(*batch));
+	memset(batch, 0, sizeof(*batch));
+	batch->name = strdup(manifest);
+	batch->log = LOG_ERROR;
+
+	// firmware files are relative to the manifest
+	char dir[1024] = "";
+	const char * slash = strrchr(manifest, '/');
+	if (slash && slash - manifest < sizeof(dir) - 1)
+		snprintf(dir, slash - manifest + 2, "%s", manifest);
+
+	char line[4096];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		avr_batch_entry_t e = {
+			.cycles = AVR_BATCH_DEFAULT_CYCLES,
+		};
+		char * key, * value;
+		uint32_t vlen;
+		char * cur = line;
+		int error = 0;
+
+		while (!error && (cur = _avr_batch_token(cur, &key, &value, &vlen))) {
+			if (!strcmp(key, "name"))
+				e.name = strdup(value);
+			else if (!strcmp(key, "firmware")) {
+				if (value[0] != '/' && dir[0]) {
+					e.firmware = malloc(strlen(dir) + vlen + 1);
+					sprintf(e.firmware, "%s%s", dir, value);
+				} else
+					e.firmware = strdup(value);
+			} else if (!strcmp(key, "mmcu"))
+				snprintf(e.mmcu, sizeof(e.mmcu), "%s", value);
+			else if (!strcmp(key, "freq"))
+				e.frequency = strtoul(value, NULL, 0);
+			else if (!strcmp(key, "cycles"))
+				e.cycles = strtoull(value, NULL, 0);
+			else if (!strcmp(key, "uart"))
+				e.uart = value[0];
+			else if (!strcmp(key, "reg"))
+				e.reg = strtoul(value, NULL, 16);
+			else if (!strcmp(key, "expect")) {
+				e.expected = malloc(vlen + 1);
+				memcpy(e.expected, value, vlen + 1);
+				e.expected_len = vlen;
+			} else if (!strcmp(key, "finish"))
+				e.finish = atoi(value);
+			else {
+				AVR_LOG(NULL, LOG_ERROR, "BATCH: %s:%d unknown key '%s'\n",
+						manifest, lineno, key);
+				error++;
+			}
+		}
+		if (!error && !e.firmware && (e.name || e.expected)) {
+			AVR_LOG(NULL, LOG_ERROR, "BATCH: %s:%d missing firmware\n",
+					manifest, lineno);
+			error++;
+		}
+		if (error) {
+			free(e.name);
+			free(e.firmware);
+			free(e.expected);
+			avr_batch_free(batch);
+			fclose(f);
+			return NULL;
+		}
+		if (!e.firmware)
+			continue;	// empty line
+		if (!e.name) {
+			const char * base = strrchr(e.firmware, '/');
+			e.name = strdup(base ? base + 1 : e.firmware);
+		}
+		if (!(batch->count % 16))
+			batch->entry = realloc(batch->entry,
+					(batch->count + 16) * sizeof(batch->entry[0]));
+		batch->entry[batch->count++] = e;
+	}
+	fclose(f);
+	return batch;
+}
+
+/*
+ * Output capture, either from an UART IRQ or an IO register write
+ */
+static void
+_avr_batch_output(
+		avr_batch_entry_t * e,
+		uint8_t v)
+{
+	if (!(e->output_len % 256))
+		e->output = realloc(e->output, e->output_len + 256 + 1);
+	e->output[e->output_len++] = v;
+	e->output[e->output_len] = 0;
+}
+
+static void
+_avr_batch_uart_cb(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	_avr_batch_output(param, value);
+}
+
+static void
+_avr_batch_reg_cb(
+		struct avr_t * avr,
+		avr_io_addr_t addr,
+		uint8_t v,
+		void * param)
+{
+	_avr_batch_output(param, v);
+	avr_core_watch_write(avr, addr, v);
+}
+
+// we run as fast as possible, without syncing to wall clock time
+static void
+_avr_batch_sleep(
+		avr_t * avr,
+		avr_cycle_count_t howLong)
+{
+}
+
+/*
+ * Entries running the same firmware on the same core share the loaded
+ * firmware, and its flash image; it is loaded by the first worker that
+ * needs it, and freed once the last entry using it is done.
+ */
+typedef struct avr_batch_firmware_t {
+	pthread_mutex_t		lock;
+	int					users;	// entries left to run
+	int					loaded;	// 1 when loaded, -1 on error
+	char				message[256];
+	elf_firmware_t		f;
+} avr_batch_firmware_t;
+
+typedef struct avr_batch_worker_t {
+	avr_batch_t *		batch;
+	avr_batch_firmware_t * firmware;	// array of shared firmwares
+	int *				index;	// firmware index of each entry
+	volatile int		next;
+} avr_batch_worker_t;
+
+// the instance a worker thread reuses for the entries of the same core
+typedef struct avr_batch_core_t {
+	avr_t *				avr;
+	char				mmcu[64];
+} avr_batch_core_t;
+
+static int
+_avr_batch_load_firmware(
+		avr_batch_entry_t * e,
+		elf_firmware_t * f,
+		char * message,
+		size_t size)
+{
+	if (image_kind(e->firmware) != IMAGE_ELF) {
+		if (!e->mmcu[0] || !e->frequency) {
+			snprintf(message, size,
+					"mmcu and freq are mandatory to load .hex, .srec and .bin files");
+			return -1;
+		}
+		if (read_image_firmware(e->firmware, f, AVR_SEGMENT_OFFSET_FLASH)) {
+			snprintf(message, size,
+					"Unable to load image file %s", e->firmware);
+			return -1;
+		}
+	} else if (elf_read_firmware(e->firmware, f) == -1) {
+		snprintf(message, size,
+				"Unable to load firmware from file %s", e->firmware);
+		return -1;
+	}
+	if (e->mmcu[0])
+		strcpy(f->mmcu, e->mmcu);
+	if (e->frequency)
+		f->frequency = e->frequency;
+	return 0;
+}
+
+/*
+ * Returns the shared firmware for entry 'e', loading it if needed,
+ * or NULL (and the reason in e->message) if it could not be loaded
+ */
+static elf_firmware_t *
+_avr_batch_get_firmware(
+		avr_batch_entry_t * e,
+		avr_batch_firmware_t * fw)
+{
+	pthread_mutex_lock(&fw->lock);
+	if (!fw->loaded)
+		fw->loaded = _avr_batch_load_firmware(e, &fw->f,
+				fw->message, sizeof(fw->message)) ? -1 : 1;
+	pthread_mutex_unlock(&fw->lock);
+	if (fw->loaded < 0) {
+		snprintf(e->message, sizeof(e->message), "%s", fw->message);
+		return NULL;
+	}
+	return &fw->f;
+}
+
+static void
+_avr_batch_put_firmware(
+		avr_batch_firmware_t * fw)
+{
+	if (__sync_sub_and_fetch(&fw->users, 1) == 0)
+		elf_free_firmware(&fw->f);
+}
+
+static void
+_avr_batch_core_free(
+		avr_batch_core_t * core)
+{
+	if (!core->avr)
+		return;
+	avr_terminate(core->avr);
+	free(core->avr);
+	core->avr = NULL;
+}
+
+static void
+_avr_batch_run_one(
+		avr_batch_t * batch,
+		avr_batch_core_t * core,
+		avr_batch_entry_t * e,
+		avr_batch_firmware_t * fw)
+{
+	uint64_t start = _avr_batch_usec();
+
+	e->status = AVR_BATCH_ERROR;
+	elf_firmware_t * f = _avr_batch_get_firmware(e, fw);
+	if (!f)
+		goto done;
+
+	if (core->avr && strcmp(core->mmcu, f->mmcu))
+		_avr_batch_core_free(core);
+	avr_t * avr = core->avr;
+	if (!avr) {
+		avr = avr_make_mcu_by_name(f->mmcu);
+		if (!avr) {
+			snprintf(e->message, sizeof(e->message),
+					"AVR '%s' not known", f->mmcu);
+			goto done;
+		}
+		// its flash is only ever replaced by the firmware images
+		avr->flash_share_blank = 1;
+		avr_init(avr);
+		avr->log = batch->log;
+		avr->gdb_port = 0;	// crashes are reported, not debugged
+		avr->sleep = _avr_batch_sleep;
+		core->avr = avr;
+		snprintf(core->mmcu, sizeof(core->mmcu), "%s", f->mmcu);
+	}
+
+	// the first instance makes the flash image the others will share
+	pthread_mutex_lock(&fw->lock);
+	if (!f->flash_image) {
+		f->flash_image = avr_flash_image_alloc(avr->flashend);
+		if (f->flash_image)
+			avr_flash_image_load(f->flash_image, f->flash,
+					f->flashsize, f->flashbase);
+	}
+	pthread_mutex_unlock(&fw->lock);
+	// the previous entry's hooks go away with the rest of its state
+	avr_reload(avr, f);
+
+	if (e->uart) {
+		avr_irq_t * irq = avr_io_getirq(avr,
+				AVR_IOCTL_UART_GETIRQ(e->uart), UART_IRQ_OUTPUT);
+		if (!irq) {
+			snprintf(e->message, sizeof(e->message),
+					"%s has no UART '%c'", f->mmcu, e->uart);
+			goto done;
+		}
+		avr_irq_register_notify(irq, _avr_batch_uart_cb, e);
+	}
+	if (e->reg)
+		avr_register_io_write(avr, e->reg, _avr_batch_reg_cb, e);
+
+	int state = cpu_Running;
+	while (avr->cycle < e->cycles) {
+		state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed)
+			break;
+	}
+	e->state = state;
+	e->run_cycles = avr->cycle;
+
+	if (state == cpu_Crashed) {
+		e->status = AVR_BATCH_FAIL;
+		snprintf(e->message, sizeof(e->message),
+				"Crashed at PC %04x, cycle %" PRI_avr_cycle_count,
+				avr->pc, avr->cycle);
+	} else if (e->expected &&
+			(e->output_len != e->expected_len ||
+			memcmp(e->output, e->expected, e->expected_len))) {
+		e->status = AVR_BATCH_FAIL;
+		snprintf(e->message, sizeof(e->message),
+				"Outputs differ (%d bytes expected, got %d)",
+				e->expected_len, e->output_len);
+	} else if (e->finish && state != cpu_Done) {
+		e->status = AVR_BATCH_FAIL;
+		snprintf(e->message, sizeof(e->message),
+				"Did not finish within %" PRI_avr_cycle_count " cycles",
+				e->cycles);
+	} else
+		e->status = AVR_BATCH_PASS;
+done:
+	_avr_batch_put_firmware(fw);
+	e->host_usec = _avr_batch_usec() - start;
+}
+
+static void *
+_avr_batch_worker(
+		void * param)
+{
+	avr_batch_worker_t * w = param;
+	avr_batch_core_t core = { 0 };
+	int i;
+
+	while ((i = __sync_fetch_and_add(&w->next, 1)) < w->batch->count)
+		_avr_batch_run_one(w->batch, &core, &w->batch->entry[i],
+				&w->firmware[w->index[i]]);
+	_avr_batch_core_free(&core);
+	return NULL;
+}
+
+int
+avr_batch_run(
+		avr_batch_t * batch,
+		int threads)
+{
+	avr_batch_worker_t w = { .batch = batch };
+	uint64_t start = _avr_batch_usec();
+
+	// group the entries that use the same firmware on the same core
+	int count = 0;
+	w.index = malloc(batch->count * sizeof(w.index[0]));
+	w.firmware = calloc(batch->count, sizeof(w.firmware[0]));
+	for (int i = 0; i < batch->count; i++) {
+		avr_batch_entry_t * e = &batch->entry[i];
+		int fi;
+		for (fi = 0; fi < i; fi++) {
+			avr_batch_entry_t * o = &batch->entry[fi];
+			if (!strcmp(o->firmware, e->firmware) &&
+					!strcmp(o->mmcu, e->mmcu) &&
+					o->frequency == e->frequency)
+				break;
+		}
+		if (fi == i) {
+			fi = count++;
+			pthread_mutex_init(&w.firmware[fi].lock, NULL);
+		} else
+			fi = w.index[fi];
+		w.index[i] = fi;
+		w.firmware[fi].users++;
+	}
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > batch->count)
+		threads = batch->count;
+	if (threads <= 1)
+		_avr_batch_worker(&w);
+	else {
+		pthread_t thread[threads];
+		int started = 0;
+		for (; started < threads; started++)
+			if (pthread_create(&thread[started], NULL, _avr_batch_worker, &w))
+				break;
+		// if we could not start any, do it ourselves
+		if (!started)
+			_avr_batch_worker(&w);
+		for (int i = 0; i < started; i++)
+			pthread_join(thread[i], NULL);
+	}
+	batch->host_usec = _avr_batch_usec() - start;
+
+	for (int i = 0; i < count; i++)
+		pthread_mutex_destroy(&w.firmware[i].lock);
+	free(w.firmware);
+	free(w.index);
+
+	int failed = 0;
+	for (int i = 0; i < batch->count; i++)
+		if (batch->entry[i].status != AVR_BATCH_PASS)
+			failed++;
+	return failed;
+}
+
+static void
+_avr_batch_xml_puts(
+		FILE * o,
+		const char * s,
+		uint32_t len)
+{
+	for (uint32_t i = 0; i < len; i++) {
+		uint8_t c = s[i];
+		switch (c) {
+			case '<': fputs("&lt;", o); break;
+			case '>': fputs("&gt;", o); break;
+			case '&': fputs("&amp;", o); break;
+			case '"': fputs("&quot;", o); break;
+			default:
+				if (c < 0x20 && c != '\n' && c != '\r' && c != '\t')
+					fprintf(o, "&#x%x;", 0x2400 + c);	// control pictures
+				else
+					fputc(c, o);
+		}
+	}
+}
+
+static void
+_avr_batch_json_puts(
+		FILE * o,
+		const char * s,
+		uint32_t len)
+{
+	fputc('"', o);
+	for (uint32_t i = 0; i < len; i++) {
+		uint8_t c = s[i];
+		switch (c) {
+			case '"': fputs("\\\"", o); break;
+			case '\\': fputs("\\\\", o); break;
+			case '\n': fputs("\\n", o); break;
+			case '\r': fputs("\\r", o); break;
+			case '\t': fputs("\\t", o); break;
+			default:
+				if (c < 0x20 || c >= 0x7f)
+					fprintf(o, "\\u%04x", c);
+				else
+					fputc(c, o);
+		}
+	}
+	fputc('"', o);
+}
+
+static const char * _avr_batch_status[] = {
+	[AVR_BATCH_PENDING] = "pending",
+	[AVR_BATCH_PASS] = "pass",
+	[AVR_BATCH_FAIL] = "fail",
+	[AVR_BATCH_ERROR] = "error",
+};
+
+int
+avr_batch_write_junit(
+		avr_batch_t * batch,
+		const char * filename)
+{
+	FILE * o = fopen(filename, "w");
+	if (!o) {
+		perror(filename);
+		return -1;
+	}
+	int failures = 0, errors = 0;
+	for (int i = 0; i < batch->count; i++)
+		if (batch->entry[i].status == AVR_BATCH_FAIL)
+			failures++;
+		else if (batch->entry[i].status != AVR_BATCH_PASS)
+			errors++;
+
+	fprintf(o, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	fprintf(o, "<testsuite name=\"");
+	_avr_batch_xml_puts(o, batch->name, strlen(batch->name));
+	fprintf(o, "\" tests=\"%d\" failures=\"%d\" errors=\"%d\" time=\"%.6f\">\n",
+			batch->count, failures, errors, batch->host_usec / 1000000.0);
+	for (int i = 0; i < batch->count; i++) {
+		avr_batch_entry_t * e = &batch->entry[i];
+		const char * mmcu = e->mmcu[0] ? e->mmcu : "elf";
+		fprintf(o, "  <testcase classname=\"simavr.");
+		_avr_batch_xml_puts(o, mmcu, strlen(mmcu));
+		fprintf(o, "\" name=\"");
+		_avr_batch_xml_puts(o, e->name, strlen(e->name));
+		fprintf(o, "\" time=\"%.6f\">\n", e->host_usec / 1000000.0);
+		fprintf(o, "    <properties>\n"
+				"      <property name=\"cycles\" value=\"%" PRI_avr_cycle_count "\"/>\n"
+				"    </properties>\n", e->run_cycles);
+		if (e->status != AVR_BATCH_PASS) {
+			fprintf(o, "    <%s message=\"",
+					e->status == AVR_BATCH_FAIL ? "failure" : "error");
+			_avr_batch_xml_puts(o, e->message, strlen(e->message));
+			fprintf(o, "\"/>\n");
+		}
+		if (e->output_len) {
+			fprintf(o, "    <system-out>");
+			_avr_batch_xml_puts(o, e->output, e->output_len);
+			fprintf(o, "</system-out>\n");
+		}
+		fprintf(o, "  </testcase>\n");
+	}
+	fprintf(o, "</testsuite>\n");
+	fclose(o);
+	return 0;
+}
+
+int
+avr_batch_write_json(
+		avr_batch_t * batch,
+		const char * filename)
+{
+	FILE * o = fopen(filename, "w");
+	if (!o) {
+		perror(filename);
+		return -1;
+	}
+	fprintf(o, "{\n  \"suite\": ");
+	_avr_batch_json_puts(o, batch->name, strlen(batch->name));
+	fprintf(o, ",\n  \"host_usec\": %llu,\n  \"tests\": [",
+			(unsigned long long)batch->host_usec);
+	for (int i = 0; i < batch->count; i++) {
+		avr_batch_entry_t * e = &batch->entry[i];
+		fprintf(o, "%s\n    { \"name\": ", i ? "," : "");
+		_avr_batch_json_puts(o, e->name, strlen(e->name));
+		fprintf(o, ", \"firmware\": ");
+		_avr_batch_json_puts(o, e->firmware, strlen(e->firmware));
+		fprintf(o, ", \"status\": \"%s\", \"cycles\": %" PRI_avr_cycle_count
+				", \"host_usec\": %llu",
+				_avr_batch_status[e->status], e->run_cycles,
+				(unsigned long long)e->host_usec);
+		if (e->message[0]) {
+			fprintf(o, ", \"message\": ");
+			_avr_batch_json_puts(o, e->message, strlen(e->message));
+		}
+		if (e->output_len) {
+			fprintf(o, ", \"output\": ");
+			_avr_batch_json_puts(o, e->output, e->output_len);
+		}
+		fprintf(o, " }");
+	}
+	fprintf(o, "\n  ]\n}\n");
+	fclose(o);
+	return 0;
+}
+
+void
+avr_batch_free(
+		avr_batch_t * batch)
+{
+	if (!batch)
+		return;
+	for (int i = 0; i < batch->count; i++) {
+		free(batch->entry[i].name);
+		free(batch->entry[i].firmware);
+		free(batch->entry[i].expected);
+		free(batch->entry[i].output);
+	}
+	free(batch->entry);
+	free(batch->name);
+	free(batch);
+}
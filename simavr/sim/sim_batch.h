@@ -0,0 +1,122 @@
+/*
+	sim_batch.h
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Batch runner: loads a "manifest" of firmwares to run, runs each of
+ * them in their own avr_t instance on a pool of threads, and checks their
+ * output against an expected string.
+ *
+ * The manifest has one entry per line, as a list of key=value pairs; values
+ * can be double quoted, and use C escapes (\n, \r, \t, \\, \", \xHH).
+ * Empty lines, and lines starting with '#' are ignored.
+ *
+ *	name=<test name>	defaults to the firmware file name
+ *	firmware=<file>		mandatory, ELF, .hex, .srec or .bin, relative to
+ *						the manifest
+ *	mmcu=<core>			mandatory for .hex, .srec and .bin files
+ *	freq=<hz>			mandatory for .hex, .srec and .bin files
+ *	cycles=<n>			maximum number of cycles to run, default 10M
+ *	uart=<0..9>			capture the output of this UART
+ *	reg=<hex addr>		capture the values written to this IO register
+ *	expect="<string>"	expected captured output
+ *	finish=1			fail if the firmware did not finish (sleep with
+ *						interrupts off) within 'cycles'
+ *
+ * for example:
+ * firmware=atmega88_uart_echo.axf uart=0 cycles=8000000 expect="Hello\r\n"
+ */
+#ifndef __SIM_BATCH_H__
+#define __SIM_BATCH_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+	AVR_BATCH_PENDING = 0,
+	AVR_BATCH_PASS,
+	AVR_BATCH_FAIL,
+	AVR_BATCH_ERROR,	// could not be run at all
+};
+
+typedef struct avr_batch_entry_t {
+	char *				name;
+	char *				firmware;
+	char				mmcu[64];
+	uint32_t			frequency;
+	avr_cycle_count_t	cycles;
+	char				uart;	// UART name to capture, or zero
+	avr_io_addr_t		reg;	// IO register to capture, or zero
+	char *				expected;
+	uint32_t			expected_len;
+	int					finish;
+
+	// results
+	int					status;
+	int					state;		// cpu state at the end of the run
+	avr_cycle_count_t	run_cycles;	// simulated cycles
+	uint64_t			host_usec;	// wall clock time of the run
+	char *				output;		// captured output
+	uint32_t			output_len;
+	char				message[256];
+} avr_batch_entry_t;
+
+typedef struct avr_batch_t {
+	char *				name;	// suite name, the manifest file
+	int					count;
+	avr_batch_entry_t *	entry;
+	int					log;	// log level for the instances
+	uint64_t			host_usec;	// wall clock time for the whole batch
+} avr_batch_t;
+
+// parse 'manifest', returns NULL on error
+avr_batch_t *
+avr_batch_load(
+		const char * manifest);
+/*
+ * Run all the entries using 'threads' worker threads (0 is one per
+ * online CPU). Returns the number of entries that did not pass.
+ */
+int
+avr_batch_run(
+		avr_batch_t * batch,
+		int threads);
+// write the results as a JUnit XML test suite
+int
+avr_batch_write_junit(
+		avr_batch_t * batch,
+		const char * filename);
+// write the results as JSON
+int
+avr_batch_write_json(
+		avr_batch_t * batch,
+		const char * filename);
+void
+avr_batch_free(
+		avr_batch_t * batch);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_BATCH_H__ */
@@ -0,0 +1,96 @@
+/*
+	sim_callstack.c
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include "sim_avr.h"
+#include "sim_callstack.h"
+#include "sim_profile.h"
+
+int
+avr_callstack_get(
+		avr_t * avr)
+{
+	if (!avr->callstack) {
+		avr_callstack_t * c = malloc(sizeof(avr_callstack_t));
+		if (!c)
+			return -1;
+		c->users = 0;
+		c->depth = 0;
+		avr->callstack = c;
+	}
+	avr->callstack->users++;
+	return 0;
+}
+
+void
+avr_callstack_put(
+		avr_t * avr)
+{
+	avr_callstack_t * c = avr->callstack;
+	if (!c || --c->users)
+		return;
+	avr->callstack = NULL;
+	free(c);
+}
+
+void
+avr_callstack_reset(
+		avr_t * avr)
+{
+	if (avr->callstack)
+		avr->callstack->depth = 0;
+}
+
+void
+avr_callstack_call(
+		avr_t * avr,
+		avr_flashaddr_t target,
+		uint16_t sp,
+		avr_cycle_count_t start,
+		int irq)
+{
+	avr_callstack_t * c = avr->callstack;
+	if (c->depth == AVR_CALLSTACK_MAX_DEPTH)
+		return;
+	avr_call_frame_t * f = &c->frame[c->depth++];
+	f->site = avr->pc;
+	f->target = target;
+	f->start = start;
+	f->sp = sp;
+	f->irq = irq;
+}
+
+void
+avr_callstack_ret(
+		avr_t * avr,
+		uint16_t sp,
+		avr_cycle_count_t end)
+{
+	avr_callstack_t * c = avr->callstack;
+	// drop the frames that are deeper than this one, they were unwound
+	while (c->depth && c->frame[c->depth - 1].sp < sp)
+		c->depth--;
+	if (!c->depth || c->frame[c->depth - 1].sp != sp)
+		return;
+	avr_call_frame_t * f = &c->frame[--c->depth];
+	if (avr->profile)
+		avr_profile_ret(avr, f, end);
+}
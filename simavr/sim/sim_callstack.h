@@ -0,0 +1,97 @@
+/*
+	sim_callstack.h
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Shadow call stack, updated by the core for the calls, returns and
+ * interrupts. It is shared by the cycle profiler (for the call graph) and
+ * the stack analysis (for the call chain of the worst case), and only
+ * present while one of them uses it.
+ *
+ * Returns are matched to their call using the stack pointer, so frames
+ * unwound without a RET (longjmp) are dropped, and a RET that doesn't match
+ * a call (a computed jump) is ignored.
+ */
+#ifndef __SIM_CALLSTACK_H__
+#define __SIM_CALLSTACK_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// maximum depth of the shadow call stack, deeper calls are not tracked
+#define AVR_CALLSTACK_MAX_DEPTH	1024
+
+typedef struct avr_call_frame_t {
+	avr_flashaddr_t		site;	// call instruction, or interrupted PC
+	avr_flashaddr_t		target;	// called function, or vector
+	avr_cycle_count_t	start;	// cycle the callee starts at
+	uint16_t			sp;		// SP before the return address was pushed
+	uint8_t				irq;	// frame is an interrupt entry
+} avr_call_frame_t;
+
+typedef struct avr_callstack_t {
+	int					users;
+	uint32_t			depth;
+	avr_call_frame_t	frame[AVR_CALLSTACK_MAX_DEPTH];
+} avr_callstack_t;
+
+// take a reference on the shadow call stack of 'avr', allocate it if needed
+int
+avr_callstack_get(
+		avr_t * avr);
+// drop a reference, the last user frees it
+void
+avr_callstack_put(
+		avr_t * avr);
+// called by avr_reset(), the frames are forgotten
+void
+avr_callstack_reset(
+		avr_t * avr);
+
+/*
+ * Called by the core when the instruction at the PC calls 'target', or when
+ * an interrupt jumps to it ('irq' set); 'sp' is the SP before the return
+ * address is pushed, and 'start' the cycle the callee starts at.
+ */
+void
+avr_callstack_call(
+		avr_t * avr,
+		avr_flashaddr_t target,
+		uint16_t sp,
+		avr_cycle_count_t start,
+		int irq);
+/*
+ * Called by the core after a RET/RETI popped its address, 'end' is when
+ * it's done; the profiler is told about the frame that returned.
+ */
+void
+avr_callstack_ret(
+		avr_t * avr,
+		uint16_t sp,
+		avr_cycle_count_t end);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_CALLSTACK_H__ */
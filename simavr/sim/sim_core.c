@@ -26,6 +26,14 @@
 #include "sim_avr.h"
 #include "sim_core.h"
 #include "sim_gdb.h"
+#include "sim_undo.h"
+#include "sim_itrace.h"
+#include "sim_profile.h"
+#include "sim_elf.h"
+#include "sim_stack.h"
+#include "sim_callstack.h"
+#include "sim_coverage.h"
+#include "sim_perf.h"
 #include "avr_flash.h"
 #include "avr_watchdog.h"
 
@@ -62,10 +70,21 @@ int dont_trace(const char * name)
 
 int donttrace = 0;
 
+// name of the function 'pc' is in, for the traces
+static const char *
+_avr_symbol_name(
+		avr_t * avr,
+		avr_flashaddr_t pc)
+{
+	avr_symbol_t * s = avr_symbol_at(avr, pc);
+	return s ? s->symbol : "unknown";
+}
+
 #define STATE(_f, args...) { \
 	if (avr->trace) {\
-		if (avr->trace_data->codeline && avr->trace_data->codeline[avr->pc>>1]) {\
-			const char * symn = avr->trace_data->codeline[avr->pc>>1]->symbol; \
+		avr_symbol_t * _sym = avr_symbol_at(avr, avr->pc);\
+		if (_sym) {\
+			const char * symn = _sym->symbol; \
 			int dont = 0 && dont_trace(symn);\
 			if (dont!=donttrace) { \
 				donttrace = dont;\
@@ -92,7 +111,7 @@ void crash(avr_t* avr)
 	for (int i = OLD_PC_SIZE-1; i > 0; i--) {
 		int pci = (avr->trace_data->old_pci + i) & 0xf;
 		printf(FONT_RED "*** %04x: %-25s RESET -%d; sp %04x\n" FONT_DEFAULT,
-				avr->trace_data->old[pci].pc, avr->trace_data->codeline ? avr->trace_data->codeline[avr->trace_data->old[pci].pc>>1]->symbol : "unknown", OLD_PC_SIZE-i, avr->trace_data->old[pci].sp);
+				avr->trace_data->old[pci].pc, _avr_symbol_name(avr, avr->trace_data->old[pci].pc), OLD_PC_SIZE-i, avr->trace_data->old[pci].sp);
 	}
 
 	printf("Stack Ptr %04x/%04x = %d \n", _avr_sp_get(avr), avr->ramend, avr->ramend - _avr_sp_get(avr));
@@ -164,9 +183,14 @@ void avr_core_watch_write(avr_t *avr, uint16_t addr, uint8_t v)
 	}
 #endif
 
-	if (avr->gdb) {
+	if (unlikely(avr->gdb) &&
+			avr_gdb_watched(avr->gdb, addr, AVR_GDB_WATCH_WRITE)) {
 		avr_gdb_handle_watchpoints(avr, addr, AVR_GDB_WATCH_WRITE);
 	}
+	if (unlikely(avr->undo))
+		avr_undo_write(avr, addr);
+	if (unlikely(avr->itrace))
+		avr_itrace_write(avr, addr, v);
 
 	avr->data[addr] = v;
 	_call_register_irqs(avr, addr);
@@ -184,7 +208,8 @@ uint8_t avr_core_watch_read(avr_t *avr, uint16_t addr)
 		addr = addr % (avr->ramend + 1);
 	}
 
-	if (avr->gdb) {
+	if (unlikely(avr->gdb) &&
+			avr_gdb_watched(avr->gdb, addr, AVR_GDB_WATCH_READ)) {
 		avr_gdb_handle_watchpoints(avr, addr, AVR_GDB_WATCH_READ);
 	}
 
@@ -201,6 +226,10 @@ static inline void _avr_set_r(avr_t * avr, uint16_t r, uint8_t v)
 {
 	REG_TOUCH(avr, r);
 
+	if (unlikely(avr->undo))
+		avr_undo_write(avr, r);
+	if (unlikely(avr->itrace))
+		avr_itrace_write(avr, r, v);
 	if (r == R_SREG) {
 		avr->data[R_SREG] = v;
 		// unsplit the SREG
@@ -209,6 +238,7 @@ static inline void _avr_set_r(avr_t * avr, uint16_t r, uint8_t v)
 	}
 	if (r > 31) {
 		avr_io_addr_t io = AVR_DATA_TO_IO(r);
+		avr->perf->io_write[io]++;
 		if (avr->io[io].w.c) {
 			avr->io[io].w.c(avr, r, v, avr->io[io].w.param);
 		} else {
@@ -282,6 +312,7 @@ static inline uint8_t _avr_get_ram(avr_t * avr, uint16_t addr)
 	} else if (addr > 31 && addr < 31 + MAX_IOs) {
 		avr_io_addr_t io = AVR_DATA_TO_IO(addr);
 
+		avr->perf->io_read[io]++;
 		if (avr->io[io].r.c)
 			avr->data[addr] = avr->io[io].r.c(avr, addr, avr->io[io].r.param);
 #if 0
@@ -369,7 +400,7 @@ static void _avr_invalid_opcode(avr_t * avr)
 {
 #if CONFIG_SIMAVR_TRACE
 	printf( FONT_RED "*** %04x: %-25s Invalid Opcode SP=%04x O=%04x \n" FONT_DEFAULT,
-			avr->pc, avr->trace_data->codeline[avr->pc>>1]->symbol, _avr_sp_get(avr), _avr_flash_read16le(avr, avr->pc));
+			avr->pc, _avr_symbol_name(avr, avr->pc), _avr_sp_get(avr), _avr_flash_read16le(avr, avr->pc));
 #else
 	AVR_LOG(avr, LOG_ERROR, FONT_RED "CORE: *** %04x: Invalid Opcode SP=%04x O=%04x \n" FONT_DEFAULT,
 			avr->pc, _avr_sp_get(avr), _avr_flash_read16le(avr, avr->pc));
@@ -504,6 +535,23 @@ void avr_dump_state(avr_t * avr)
 
 #endif
 
+/*
+ * Keep the shadow call stack of the profiler and the stack analysis;
+ * 'new_pc' and 'cycle' are already updated, and the return address pushed
+ * or popped.
+ */
+#define CALL_HOOK() \
+	if (unlikely(avr->callstack)) \
+		avr_callstack_call(avr, new_pc, \
+				_avr_sp_get(avr) + avr->address_size, avr->cycle + cycle, 0);
+// record the outcome of a conditional instruction for the code coverage
+#define BRANCH_HOOK(_taken) \
+	if (unlikely(avr->coverage)) \
+		avr_coverage_branch(avr, _taken);
+#define RET_HOOK() \
+	if (unlikely(avr->callstack)) \
+		avr_callstack_ret(avr, _avr_sp_get(avr), avr->cycle + cycle);
+
 /****************************************************************************\
  *
  * Helper functions for calculating the status register bit values.
@@ -609,13 +657,7 @@ _avr_flags_znv0s (struct avr_t * avr, uint8_t res)
 
 static inline int _avr_is_instruction_32_bits(avr_t * avr, avr_flashaddr_t pc)
 {
-	uint16_t o = _avr_flash_read16le(avr, pc) & 0xfe0f;
-	return	o == 0x9200 || // STS ! Store Direct to Data Space
-			o == 0x9000 || // LDS Load Direct from Data Space
-			o == 0x940c || // JMP Long Jump
-			o == 0x940d || // JMP Long Jump
-			o == 0x940e ||  // CALL Long Call to sub
-			o == 0x940f; // CALL Long Call to sub
+	return avr_opcode_is_32_bits(_avr_flash_read16le(avr, pc));
 }
 
 /*
@@ -658,6 +700,16 @@ run_one_again:
 		crash(avr);
 		return 0;
 	}
+	if (unlikely(avr->undo))
+		avr_undo_mark(avr);
+	if (unlikely(avr->itrace))
+		avr_itrace_mark(avr);
+	if (unlikely(avr->profile))
+		avr_profile_mark(avr);
+	if (unlikely(avr->stack))
+		avr_stack_mark(avr);
+	if (unlikely(avr->coverage))
+		avr_coverage_mark(avr);
 
 	uint32_t		opcode = _avr_flash_read16le(avr, avr->pc);
 	avr_flashaddr_t	new_pc = avr->pc + 2;	// future "default" pc
@@ -777,6 +829,7 @@ run_one_again:
 					get_vd5_vr5(opcode);
 					uint16_t res = vd == vr;
 					STATE("cpse %s[%02x], %s[%02x]\t; Will%s skip\n", avr_regname(d), avr->data[d], avr_regname(r), avr->data[r], res ? "":" not");
+					BRANCH_HOOK(res);
 					if (res) {
 						if (_avr_is_instruction_32_bits(avr, new_pc)) {
 							new_pc += 4; cycle += 2;
@@ -987,6 +1040,9 @@ run_one_again:
 					new_pc = z << 1;
 					cycle++;
 					TRACE_JUMP();
+					if (p) {
+						CALL_HOOK();
+					}
 				}	break;
 				case 0x9518: 	// RETI -- Return from Interrupt -- 1001 0101 0001 1000
 					avr_sreg_set(avr, S_I, 1);
@@ -998,6 +1054,7 @@ run_one_again:
 					STATE("ret%s\n", opcode & 0x10 ? "i" : "");
 					TRACE_JUMP();
 					STACK_FRAME_POP();
+					RET_HOOK();
 				}	break;
 				case 0x95c8: {	// LPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1100 1000
 					uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
@@ -1249,6 +1306,7 @@ run_one_again:
 							new_pc = a << 1;
 							TRACE_JUMP();
 							STACK_FRAME_PUSH();
+							CALL_HOOK();
 						}	break;
 
 						default: {
@@ -1286,6 +1344,7 @@ run_one_again:
 									get_io5_b3mask(opcode);
 									uint8_t res = _avr_get_ram(avr, io) & mask;
 									STATE("sbic %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, !res?"":" not");
+									BRANCH_HOOK(!res);
 									if (!res) {
 										if (_avr_is_instruction_32_bits(avr, new_pc)) {
 											new_pc += 4; cycle += 2;
@@ -1305,6 +1364,7 @@ run_one_again:
 									get_io5_b3mask(opcode);
 									uint8_t res = _avr_get_ram(avr, io) & mask;
 									STATE("sbis %s[%04x], 0x%02x\t; Will%s branch\n", avr_regname(io), avr->data[io], mask, res?"":" not");
+									BRANCH_HOOK(res != 0);
 									if (res) {
 										if (_avr_is_instruction_32_bits(avr, new_pc)) {
 											new_pc += 4; cycle += 2;
@@ -1367,6 +1427,7 @@ run_one_again:
 			if (o != 0) {
 				TRACE_JUMP();
 				STACK_FRAME_PUSH();
+				CALL_HOOK();
 			}
 		}	break;
 
@@ -1402,6 +1463,7 @@ run_one_again:
 					} else {
 						STATE("%s%c .%d [%04x]\t; Will%s branch\n", set ? "brbs" : "brbc", _sreg_bit_name[s], o, new_pc + (o << 1), branch ? "":" not");
 					}
+					BRANCH_HOOK(branch);
 					if (branch) {
 						cycle++; // 2 cycles if taken, 1 otherwise
 						new_pc = new_pc + (o << 1);
@@ -1427,6 +1489,7 @@ run_one_again:
 					int set = (opcode & 0x0200) != 0;
 					int branch = ((vd & mask) && set) || (!(vd & mask) && !set);
 					STATE("%s %s[%02x], 0x%02x\t; Will%s branch\n", set ? "sbrs" : "sbrc", avr_regname(d), vd, mask, branch ? "":" not");
+					BRANCH_HOOK(branch);
 					if (branch) {
 						if (_avr_is_instruction_32_bits(avr, new_pc)) {
 							new_pc += 4; cycle += 2;
@@ -1443,6 +1506,7 @@ run_one_again:
 
 	}
 	avr->cycle += cycle;
+	avr->perf->instructions++;
 
 	if ((avr->state == cpu_Running) &&
 		(avr->run_cycle_count > cycle) &&
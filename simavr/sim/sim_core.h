@@ -76,7 +76,7 @@ void avr_dump_state(avr_t * avr);
 			int pci = i-1;\
 			printf(FONT_RED "*** %04x: %-25s sp %04x\n" FONT_DEFAULT,\
 					avr->trace_data->stack_frame[pci].pc, \
-					avr->trace_data->codeline ? avr->trace_data->codeline[avr->trace_data->stack_frame[pci].pc>>1]->symbol : "unknown", \
+					_avr_symbol_name(avr, avr->trace_data->stack_frame[pci].pc), \
 							avr->trace_data->stack_frame[pci].sp);\
 		}
 #else
@@ -135,6 +135,18 @@ static inline void avr_sreg_set(avr_t * avr, uint8_t flag, uint8_t ival)
  */
 #define AVR_OVERFLOW_OPCODE 0xf1f1
 
+// LDS, STS, JMP and CALL have a second opcode word
+static inline int avr_opcode_is_32_bits(uint16_t opcode)
+{
+	uint16_t o = opcode & 0xfe0f;
+	return	o == 0x9200 || // STS ! Store Direct to Data Space
+			o == 0x9000 || // LDS Load Direct from Data Space
+			o == 0x940c || // JMP Long Jump
+			o == 0x940d || // JMP Long Jump
+			o == 0x940e ||  // CALL Long Call to sub
+			o == 0x940f; // CALL Long Call to sub
+}
+
 #ifdef __cplusplus
 };
 #endif
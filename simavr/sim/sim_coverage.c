@@ -0,0 +1,289 @@
+/*
+	sim_coverage.c
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_dwarf.h"
+#include "sim_coverage.h"
+
+int
+avr_coverage_init(
+		avr_t * avr,
+		elf_firmware_t * firmware,
+		const char * output,
+		const char * test_name)
+{
+	if (avr->coverage)
+		return 0;
+	avr_coverage_t * c = malloc(sizeof(avr_coverage_t));
+	if (!c)
+		return -1;
+	memset(c, 0, sizeof(*c));
+	c->size = (avr->flashend + 1) >> 1;
+	uint32_t bytes = (c->size + 7) / 8;
+	c->executed = calloc(3, bytes);
+	if (!c->executed) {
+		free(c);
+		return -1;
+	}
+	c->taken = c->executed + bytes;
+	c->not_taken = c->taken + bytes;
+	c->firmware = firmware;
+	c->output = output ? strdup(output) : NULL;
+	c->test_name = test_name ? strdup(test_name) : NULL;
+	avr->coverage = c;
+	return 0;
+}
+
+void
+avr_coverage_rebind(
+		avr_t * avr,
+		elf_firmware_t * firmware)
+{
+	avr_coverage_t * c = avr->coverage;
+	if (!c)
+		return;
+	c->firmware = firmware;
+	memset(c->executed, 0, 3 * ((c->size + 7) / 8));
+}
+
+void
+avr_coverage_deinit(
+		avr_t * avr)
+{
+	avr_coverage_t * c = avr->coverage;
+	if (!c)
+		return;
+	if (c->output)
+		avr_coverage_write_lcov(avr, c->output, c->test_name);
+	avr->coverage = NULL;
+	free(c->executed);
+	free(c->output);
+	free(c->test_name);
+	free(c);
+}
+
+#define BIT(_map, _w) (((_map)[(_w) >> 3] >> ((_w) & 7)) & 1)
+
+// BRxx, CPSE, SBRS/SBRC and SBIS/SBIC
+static int
+_avr_coverage_is_conditional(
+		uint16_t o)
+{
+	return (o & 0xf800) == 0xf000 || (o & 0xfc00) == 0x1000 ||
+			(o & 0xfc08) == 0xfc00 || (o & 0xfd00) == 0x9900;
+}
+
+typedef struct avr_coverage_branch_t {
+	uint32_t	line;
+	uint32_t	addr;
+	uint8_t		executed, taken, not_taken;
+} avr_coverage_branch_t;
+
+typedef struct avr_coverage_file_t {
+	uint32_t	max_line;
+	int8_t *	hit;	// per line, -1 if there is no code for it
+	uint32_t	branch_count;
+	avr_coverage_branch_t * branch;
+} avr_coverage_file_t;
+
+static int
+_avr_coverage_branch_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_coverage_branch_t * ba = a, * bb = b;
+	if (ba->line != bb->line)
+		return ba->line < bb->line ? -1 : 1;
+	return ba->addr < bb->addr ? -1 : ba->addr > bb->addr;
+}
+
+#if ELF_SYMBOLS
+/*
+ * Write the functions of file 'fi', the ones that start on one of its
+ * lines; 'start' is the range each symbol starts in, or NULL.
+ */
+static void
+_avr_coverage_functions(
+		avr_coverage_t * c,
+		avr_dwarf_range_t ** start,
+		int fi,
+		FILE * o)
+{
+	elf_firmware_t * f = c->firmware;
+	int found = 0, hit = 0;
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < f->symbolcount; i++) {
+			avr_symbol_t * s = f->symbol[i];
+			if (!start[i] || start[i]->file != fi)
+				continue;
+			int exec = BIT(c->executed, s->addr >> 1);
+			if (pass == 0) {
+				fprintf(o, "FN:%u,%s\n", start[i]->line, s->symbol);
+				found++;
+				hit += exec;
+			} else
+				fprintf(o, "FNDA:%d,%s\n", exec, s->symbol);
+		}
+	}
+	fprintf(o, "FNF:%d\nFNH:%d\n", found, hit);
+}
+#endif
+
+int
+avr_coverage_write_lcov(
+		avr_t * avr,
+		const char * path,
+		const char * test_name)
+{
+	avr_coverage_t * c = avr->coverage;
+	if (!c)
+		return -1;
+	avr_dwarf_lines_t lines = {0};
+#if ELF_SYMBOLS
+	if (c->firmware && c->firmware->debug_line)
+		avr_dwarf_read_lines(c->firmware->debug_line,
+				c->firmware->debug_line_size,
+				c->firmware->debug_line_str,
+				c->firmware->debug_line_str_size, &lines);
+#endif
+	if (!lines.range_count) {
+		AVR_LOG(avr, LOG_ERROR,
+				"COVERAGE: No line number information, build the firmware with -g\n");
+		avr_dwarf_free_lines(&lines);
+		return -1;
+	}
+	avr_coverage_file_t * file = calloc(lines.file_count, sizeof(*file));
+	for (int i = 0; i < lines.range_count; i++) {
+		avr_dwarf_range_t * r = &lines.range[i];
+		if (r->line > file[r->file].max_line)
+			file[r->file].max_line = r->line;
+	}
+	for (int i = 0; i < lines.file_count; i++) {
+		if (!file[i].max_line)
+			continue;
+		file[i].hit = malloc(file[i].max_line + 1);
+		memset(file[i].hit, -1, file[i].max_line + 1);
+	}
+	// walk the instructions of each range, line 0 is code without a line
+	for (int i = 0; i < lines.range_count; i++) {
+		avr_dwarf_range_t * r = &lines.range[i];
+		avr_coverage_file_t * f = &file[r->file];
+		if (!r->line)
+			continue;
+		for (uint32_t a = r->start; a < r->end && (a >> 1) < c->size; ) {
+			uint32_t w = a >> 1;
+			uint16_t op = avr->flash[a] | (avr->flash[a + 1] << 8);
+			int exec = BIT(c->executed, w);
+			if (f->hit[r->line] < exec)
+				f->hit[r->line] = exec;
+			if (_avr_coverage_is_conditional(op)) {
+				if (!(f->branch_count % 64))
+					f->branch = realloc(f->branch,
+							(f->branch_count + 64) * sizeof(f->branch[0]));
+				avr_coverage_branch_t * b = &f->branch[f->branch_count++];
+				b->line = r->line;
+				b->addr = a;
+				b->executed = exec;
+				b->taken = BIT(c->taken, w);
+				b->not_taken = BIT(c->not_taken, w);
+			}
+			a += avr_opcode_is_32_bits(op) ? 4 : 2;
+		}
+	}
+
+	int res = 0;
+	FILE * o = fopen(path, "w");
+	if (!o) {
+		AVR_LOG(avr, LOG_ERROR, "COVERAGE: Can't create %s: %s\n",
+				path, strerror(errno));
+		res = -1;
+		goto done;
+	}
+#if ELF_SYMBOLS
+	elf_firmware_t * fw = c->firmware;
+	elf_firmware_load_symbols(fw);
+	avr_dwarf_range_t ** start = calloc(fw->symbolcount + 1, sizeof(*start));
+	for (int i = 0; i < fw->symbolcount; i++) {
+		avr_symbol_t * s = fw->symbol[i];
+		if (!s->size || (s->addr >> 1) >= c->size)
+			continue;
+		for (int ri = 0; ri < lines.range_count && !start[i]; ri++)
+			if (s->addr >= lines.range[ri].start && s->addr < lines.range[ri].end)
+				start[i] = &lines.range[ri];
+	}
+#endif
+	fprintf(o, "TN:%s\n", test_name ? test_name : "");
+	for (int fi = 0; fi < lines.file_count; fi++) {
+		avr_coverage_file_t * f = &file[fi];
+		if (!f->max_line)
+			continue;
+		fprintf(o, "SF:%s\n", lines.file[fi]);
+#if ELF_SYMBOLS
+		_avr_coverage_functions(c, start, fi, o);
+#endif
+		qsort(f->branch, f->branch_count, sizeof(f->branch[0]),
+				_avr_coverage_branch_cmp);
+		int found = 0, hit = 0;
+		for (int bi = 0, n = 0; bi < f->branch_count; bi++, n++) {
+			avr_coverage_branch_t * b = &f->branch[bi];
+			if (bi && b->line != f->branch[bi - 1].line)
+				n = 0;
+			if (b->executed)
+				fprintf(o, "BRDA:%u,0,%d,%d\nBRDA:%u,0,%d,%d\n",
+						b->line, n * 2, b->taken, b->line, n * 2 + 1, b->not_taken);
+			else
+				fprintf(o, "BRDA:%u,0,%d,-\nBRDA:%u,0,%d,-\n",
+						b->line, n * 2, b->line, n * 2 + 1);
+			found += 2;
+			hit += b->taken + b->not_taken;
+		}
+		fprintf(o, "BRF:%d\nBRH:%d\n", found, hit);
+		found = hit = 0;
+		for (uint32_t l = 0; l <= f->max_line; l++) {
+			if (f->hit[l] < 0)
+				continue;
+			fprintf(o, "DA:%u,%d\n", l, f->hit[l]);
+			found++;
+			hit += f->hit[l];
+		}
+		fprintf(o, "LF:%d\nLH:%d\nend_of_record\n", found, hit);
+	}
+#if ELF_SYMBOLS
+	free(start);
+#endif
+	if (fclose(o)) {
+		AVR_LOG(avr, LOG_ERROR, "COVERAGE: Error writing %s\n", path);
+		res = -1;
+	}
+done:
+	for (int i = 0; i < lines.file_count; i++) {
+		free(file[i].hit);
+		free(file[i].branch);
+	}
+	free(file);
+	avr_dwarf_free_lines(&lines);
+	return res;
+}
@@ -0,0 +1,116 @@
+/*
+	sim_coverage.h
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Code coverage. The core sets a bit per flash word when an instruction
+ * is run, and for the conditional instructions (BRxx, CPSE, SBRS/SBRC and
+ * SBIS/SBIC), a bit for "taken" (branched or skipped) and one for "not
+ * taken".
+ *
+ * The bitmaps are exported as an lcov tracefile, using the DWARF line
+ * number information of the firmware (see sim_dwarf.h) to map them to the
+ * source lines; the firmware needs to be built with -g. Each conditional
+ * instruction becomes two lcov branches, taken and not taken. As only bits
+ * are kept, the line and branch counts are 0 or 1.
+ */
+#ifndef __SIM_COVERAGE_H__
+#define __SIM_COVERAGE_H__
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct avr_coverage_t {
+	uint32_t	size;		// flash words
+	uint8_t *	executed;	// bitmaps, one bit per flash word
+	uint8_t *	taken;
+	uint8_t *	not_taken;
+	elf_firmware_t *	firmware;	// for the line numbers, can be NULL
+	char *		output;		// lcov file written at avr_terminate() time
+	char *		test_name;
+} avr_coverage_t;
+
+/*
+ * Start recording the coverage of 'avr'. 'firmware' provides the line
+ * numbers and symbols, and has to stay valid until the coverage is
+ * stopped. If 'output' is not NULL, an lcov tracefile for test 'test_name'
+ * (optional) is written there by avr_terminate().
+ * Returns -1 on error.
+ */
+int
+avr_coverage_init(
+		avr_t * avr,
+		elf_firmware_t * firmware,
+		const char * output,
+		const char * test_name);
+// stop recording, write the lcov file if any, and free the bitmaps
+void
+avr_coverage_deinit(
+		avr_t * avr);
+/*
+ * Clear the bitmaps and take the line numbers from 'firmware' (can be NULL)
+ * from now on; called by avr_reset_full() and avr_reload()
+ */
+void
+avr_coverage_rebind(
+		avr_t * avr,
+		elf_firmware_t * firmware);
+/*
+ * Write the coverage as an lcov tracefile; the bitmaps are kept, so this
+ * can be called more than once. Returns -1 on error, or if the firmware
+ * has no line number information.
+ */
+int
+avr_coverage_write_lcov(
+		avr_t * avr,
+		const char * path,
+		const char * test_name);
+
+// Called by the core before each instruction
+static inline void
+avr_coverage_mark(
+		avr_t * avr)
+{
+	uint32_t w = avr->pc >> 1;
+	avr->coverage->executed[w >> 3] |= 1 << (w & 7);
+}
+
+// Called by the core for conditional instructions, once it's decided
+static inline void
+avr_coverage_branch(
+		avr_t * avr,
+		int taken)
+{
+	uint32_t w = avr->pc >> 1;
+	if (taken)
+		avr->coverage->taken[w >> 3] |= 1 << (w & 7);
+	else
+		avr->coverage->not_taken[w >> 3] |= 1 << (w & 7);
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_COVERAGE_H__ */
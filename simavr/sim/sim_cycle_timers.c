@@ -25,6 +25,7 @@
 #include "sim_avr.h"
 #include "sim_time.h"
 #include "sim_cycle_timers.h"
+#include "sim_perf.h"
 
 #define QUEUE(__q, __e) { \
 		(__e)->next = (__q); \
@@ -102,7 +103,8 @@ avr_cycle_timer_insert(
 		avr_t * avr,
 		avr_cycle_count_t when,
 		avr_cycle_timer_t timer,
-		void * param)
+		void * param,
+		uint8_t perf)
 {
 	avr_cycle_timer_pool_t * pool = &avr->cycle_timers;
 
@@ -120,6 +122,7 @@ avr_cycle_timer_insert(
 	t->timer = timer;
 	t->param = param;
 	t->when = when;
+	t->perf = perf;
 
 	// find its place in the list
 	avr_cycle_timer_slot_p loop = pool->timer, last = NULL;
@@ -148,7 +151,8 @@ avr_cycle_timer_register(
 		AVR_LOG(avr, LOG_ERROR, "CYCLE: %s: pool is full (%d)!\n", __func__, MAX_CYCLE_TIMERS);
 		return;
 	}
-	avr_cycle_timer_insert(avr, when, timer, param);
+	avr_cycle_timer_insert(avr, when, timer, param,
+			avr_perf_timer_owner(avr, timer, param));
 	avr_cycle_timer_reset_sleep_run_cycles_limited(avr);
 }
 
@@ -229,6 +233,7 @@ avr_cycle_timer_process(
 		pool->timer = t->next;
 		t->next = NULL;
 		do {
+			avr->perf->timer[t->perf].calls++;
 			avr_cycle_count_t w = t->timer(avr, when, t->param);
 			// make sure the return value is either zero, or greater
 			// than the last one to prevent infinite loop here
@@ -236,7 +241,8 @@ avr_cycle_timer_process(
 		} while (when && when <= avr->cycle);
 		
 		if (when) // reschedule then
-			avr_cycle_timer_insert(avr, when - avr->cycle, t->timer, t->param);
+			avr_cycle_timer_insert(avr, when - avr->cycle, t->timer, t->param,
+					t->perf);
 		
 		// requeue this one into the free ones
 		QUEUE(pool->timer_free, t);
@@ -59,6 +59,7 @@ typedef struct avr_cycle_timer_slot_t {
 	avr_cycle_count_t	when;
 	avr_cycle_timer_t	timer;
 	void * param;
+	uint8_t	perf;	// index of its owner counter, see sim_perf.h
 } avr_cycle_timer_slot_t, *avr_cycle_timer_slot_p;
 
 /*
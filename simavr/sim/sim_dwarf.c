@@ -0,0 +1,437 @@
+/*
+	sim_dwarf.c
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_dwarf.h"
+
+enum {
+	DW_LNS_copy = 1,
+	DW_LNS_advance_pc,
+	DW_LNS_advance_line,
+	DW_LNS_set_file,
+	DW_LNS_set_column,
+	DW_LNS_negate_stmt,
+	DW_LNS_set_basic_block,
+	DW_LNS_const_add_pc,
+	DW_LNS_fixed_advance_pc,
+	DW_LNE_end_sequence = 1,
+	DW_LNE_set_address,
+	DW_LNE_define_file,
+	DW_LNCT_path = 1,
+	DW_LNCT_directory_index,
+	DW_FORM_block = 0x09,
+	DW_FORM_data2 = 0x05,
+	DW_FORM_data4 = 0x06,
+	DW_FORM_data8 = 0x07,
+	DW_FORM_string = 0x08,
+	DW_FORM_data1 = 0x0b,
+	DW_FORM_strp = 0x0e,
+	DW_FORM_udata = 0x0f,
+	DW_FORM_data16 = 0x1e,
+	DW_FORM_line_strp = 0x1f,
+};
+
+// a bounded reader over a section, 'error' is set when reading past 'end'
+typedef struct dwarf_cursor_t {
+	const uint8_t *	p;
+	const uint8_t *	end;
+	int				error;
+} dwarf_cursor_t;
+
+static uint64_t
+_dwarf_u(
+		dwarf_cursor_t * c,
+		int bytes)
+{
+	if (c->end - c->p < bytes) {
+		c->error = 1;
+		c->p = c->end;
+		return 0;
+	}
+	uint64_t v = 0;
+	for (int i = 0; i < bytes; i++)
+		v |= (uint64_t)*c->p++ << (i * 8);
+	return v;
+}
+
+static uint64_t
+_dwarf_uleb(
+		dwarf_cursor_t * c)
+{
+	uint64_t v = 0;
+	int shift = 0;
+	while (c->p < c->end) {
+		uint8_t b = *c->p++;
+		if (shift < 64)
+			v |= (uint64_t)(b & 0x7f) << shift;
+		shift += 7;
+		if (!(b & 0x80))
+			return v;
+	}
+	c->error = 1;
+	return v;
+}
+
+static int64_t
+_dwarf_sleb(
+		dwarf_cursor_t * c)
+{
+	int64_t v = 0;
+	int shift = 0;
+	while (c->p < c->end) {
+		uint8_t b = *c->p++;
+		if (shift < 64)
+			v |= (int64_t)(b & 0x7f) << shift;
+		shift += 7;
+		if (!(b & 0x80)) {
+			if (shift < 64 && (b & 0x40))
+				v |= -((int64_t)1 << shift);
+			return v;
+		}
+	}
+	c->error = 1;
+	return v;
+}
+
+static const char *
+_dwarf_string(
+		dwarf_cursor_t * c)
+{
+	const char * s = (const char *)c->p;
+	const uint8_t * z = memchr(c->p, 0, c->end - c->p);
+	if (!z) {
+		c->error = 1;
+		c->p = c->end;
+		return "";
+	}
+	c->p = z + 1;
+	return s;
+}
+
+// returns the index of 'dir'/'name' in the file table, adding it if needed
+static int
+_dwarf_file(
+		avr_dwarf_lines_t * l,
+		const char * dir,
+		const char * name)
+{
+	char path[1024];
+	if (dir && dir[0] && name[0] != '/')
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+	else
+		snprintf(path, sizeof(path), "%s", name);
+	for (int i = l->file_count - 1; i >= 0; i--)
+		if (!strcmp(l->file[i], path))
+			return i;
+	if (!(l->file_count % 16))
+		l->file = realloc(l->file, (l->file_count + 16) * sizeof(l->file[0]));
+	l->file[l->file_count] = strdup(path);
+	return l->file_count++;
+}
+
+/*
+ * Read one DWARF 5 directory or file entry attribute; strings are
+ * returned in 'str', numbers in 'num'. Returns -1 for unknown forms.
+ */
+static int
+_dwarf_form(
+		dwarf_cursor_t * c,
+		int form,
+		int offset_size,
+		const uint8_t * line_str,
+		uint32_t line_str_size,
+		const char ** str,
+		uint64_t * num)
+{
+	*str = NULL;
+	*num = 0;
+	switch (form) {
+		case DW_FORM_string:
+			*str = _dwarf_string(c);
+			break;
+		case DW_FORM_line_strp: {
+			uint64_t o = _dwarf_u(c, offset_size);
+			if (o < line_str_size && memchr(line_str + o, 0, line_str_size - o))
+				*str = (const char *)line_str + o;
+			else
+				*str = "";
+		}	break;
+		case DW_FORM_strp:	// .debug_str is not loaded
+			_dwarf_u(c, offset_size);
+			*str = "";
+			break;
+		case DW_FORM_data1: *num = _dwarf_u(c, 1); break;
+		case DW_FORM_data2: *num = _dwarf_u(c, 2); break;
+		case DW_FORM_data4: *num = _dwarf_u(c, 4); break;
+		case DW_FORM_data8: *num = _dwarf_u(c, 8); break;
+		case DW_FORM_data16: _dwarf_u(c, 8); _dwarf_u(c, 8); break;
+		case DW_FORM_udata: *num = _dwarf_uleb(c); break;
+		case DW_FORM_block: {
+			uint64_t len = _dwarf_uleb(c);
+			if (len > (uint64_t)(c->end - c->p))
+				c->error = 1;
+			else
+				c->p += len;
+		}	break;
+		default:
+			return -1;
+	}
+	return 0;
+}
+
+static void
+_dwarf_add_range(
+		avr_dwarf_lines_t * l,
+		uint32_t start,
+		uint32_t end,
+		uint32_t line,
+		int file)
+{
+	if (end <= start || file < 0)
+		return;
+	if (l->range_count == l->range_size) {
+		l->range_size = l->range_size ? l->range_size * 2 : 1024;
+		l->range = realloc(l->range, l->range_size * sizeof(l->range[0]));
+	}
+	avr_dwarf_range_t * r = &l->range[l->range_count++];
+	r->start = start;
+	r->end = end;
+	r->line = line;
+	r->file = file;
+}
+
+// decode one line number program (one compilation unit)
+static int
+_dwarf_read_unit(
+		dwarf_cursor_t * c,
+		const uint8_t * line_str,
+		uint32_t line_str_size,
+		avr_dwarf_lines_t * l)
+{
+	int offset_size = 4;
+	uint64_t length = _dwarf_u(c, 4);
+	if (length == 0xffffffff) {
+		offset_size = 8;
+		length = _dwarf_u(c, 8);
+	}
+	if (c->error || length > (uint64_t)(c->end - c->p))
+		return -1;
+	dwarf_cursor_t u = { .p = c->p, .end = c->p + length };
+	c->p += length;
+
+	int version = _dwarf_u(&u, 2);
+	if (version < 2 || version > 5)
+		return 0;	// skip it
+	if (version >= 5)
+		_dwarf_u(&u, 2);	// address and segment selector sizes
+	uint64_t header_length = _dwarf_u(&u, offset_size);
+	if (header_length > (uint64_t)(u.end - u.p))
+		return -1;
+	const uint8_t * program = u.p + header_length;
+	int min_length = _dwarf_u(&u, 1);
+	if (version >= 4)
+		_dwarf_u(&u, 1);	// maximum operations per instruction, VLIW only
+	_dwarf_u(&u, 1);		// default is_stmt
+	int line_base = (int8_t)_dwarf_u(&u, 1);
+	int line_range = _dwarf_u(&u, 1);
+	int opcode_base = _dwarf_u(&u, 1);
+	if (!line_range || !opcode_base)
+		return -1;
+	const uint8_t * opcode_length = u.p;
+	u.p += opcode_base - 1;
+	if (u.p > u.end)
+		return -1;
+
+	// directories, then files; 'file' maps the unit's file numbers to ours
+	int dir_count = 0, file_count = 0;
+	const char ** dir = NULL;
+	int * file = NULL;
+	if (version < 5) {
+		dir = malloc(sizeof(dir[0]));
+		dir[dir_count++] = "";	// the compilation directory, unknown here
+		for (;;) {
+			const char * d = _dwarf_string(&u);
+			if (!d[0] || u.error)
+				break;
+			dir = realloc(dir, (dir_count + 1) * sizeof(dir[0]));
+			dir[dir_count++] = d;
+		}
+		file = malloc(sizeof(file[0]));
+		file[file_count++] = -1;	// files are numbered from 1
+		for (;;) {
+			const char * name = _dwarf_string(&u);
+			if (!name[0] || u.error)
+				break;
+			uint64_t di = _dwarf_uleb(&u);
+			_dwarf_uleb(&u);	// mtime
+			_dwarf_uleb(&u);	// size
+			file = realloc(file, (file_count + 1) * sizeof(file[0]));
+			file[file_count++] = _dwarf_file(l,
+					di < dir_count ? dir[di] : NULL, name);
+		}
+	} else {
+		for (int pass = 0; pass < 2 && !u.error; pass++) {
+			int format_count = _dwarf_u(&u, 1);
+			uint64_t format[format_count * 2 + 1];
+			for (int i = 0; i < format_count * 2; i++)
+				format[i] = _dwarf_uleb(&u);
+			uint64_t count = _dwarf_uleb(&u);
+			if (count > (uint64_t)(u.end - u.p))
+				break;
+			if (pass == 0)
+				dir = malloc((count + 1) * sizeof(dir[0]));
+			else
+				file = malloc((count + 1) * sizeof(file[0]));
+			for (uint64_t e = 0; e < count && !u.error; e++) {
+				const char * path = "";
+				uint64_t di = 0;
+				for (int i = 0; i < format_count; i++) {
+					const char * str;
+					uint64_t num;
+					if (_dwarf_form(&u, format[i * 2 + 1], offset_size,
+							line_str, line_str_size, &str, &num)) {
+						u.error = 1;
+						break;
+					}
+					if (format[i * 2] == DW_LNCT_path && str)
+						path = str;
+					else if (format[i * 2] == DW_LNCT_directory_index)
+						di = num;
+				}
+				if (pass == 0)
+					dir[dir_count++] = path;
+				else
+					file[file_count++] = _dwarf_file(l,
+							di < dir_count ? dir[di] : NULL, path);
+			}
+		}
+	}
+	if (u.error) {
+		free(dir);
+		free(file);
+		return -1;
+	}
+
+	// the line number program itself
+	u.p = program;
+	uint32_t addr = 0, line = 1, last_addr = 0, last_line = 0;
+	int fi = 1, last_file = -1, have_row = 0;
+	while (u.p < u.end && !u.error) {
+		int op = _dwarf_u(&u, 1);
+		int row = 0, end = 0;
+		if (op >= opcode_base) {
+			int adj = op - opcode_base;
+			addr += (adj / line_range) * min_length;
+			line += line_base + adj % line_range;
+			row = 1;
+		} else if (op == 0) {
+			uint64_t len = _dwarf_uleb(&u);
+			if (!len || len > (uint64_t)(u.end - u.p))
+				break;
+			const uint8_t * next = u.p + len;
+			int sub = _dwarf_u(&u, 1);
+			switch (sub) {
+				case DW_LNE_end_sequence:
+					row = end = 1;
+					break;
+				case DW_LNE_set_address:
+					addr = _dwarf_u(&u, len - 1 > 8 ? 8 : len - 1);
+					break;
+				case DW_LNE_define_file: {
+					const char * name = _dwarf_string(&u);
+					uint64_t di = _dwarf_uleb(&u);
+					file = realloc(file, (file_count + 1) * sizeof(file[0]));
+					file[file_count++] = _dwarf_file(l,
+							di < dir_count ? dir[di] : NULL, name);
+				}	break;
+			}
+			u.p = next;
+		} else switch (op) {
+			case DW_LNS_copy:
+				row = 1;
+				break;
+			case DW_LNS_advance_pc:
+				addr += _dwarf_uleb(&u) * min_length;
+				break;
+			case DW_LNS_advance_line:
+				line += _dwarf_sleb(&u);
+				break;
+			case DW_LNS_set_file:
+				fi = _dwarf_uleb(&u);
+				break;
+			case DW_LNS_const_add_pc:
+				addr += ((255 - opcode_base) / line_range) * min_length;
+				break;
+			case DW_LNS_fixed_advance_pc:
+				addr += _dwarf_u(&u, 2);
+				break;
+			default:	// skip the operands
+				for (int i = 0; i < opcode_length[op - 1]; i++)
+					_dwarf_uleb(&u);
+		}
+		if (!row)
+			continue;
+		// a row ends the range started by the previous one
+		if (have_row)
+			_dwarf_add_range(l, last_addr, addr, last_line, last_file);
+		have_row = !end;
+		last_addr = addr;
+		last_line = line;
+		last_file = fi >= 0 && fi < file_count ? file[fi] : -1;
+		if (end) {
+			addr = 0;
+			line = 1;
+			fi = 1;
+		}
+	}
+	free(dir);
+	free(file);
+	return u.error ? -1 : 0;
+}
+
+int
+avr_dwarf_read_lines(
+		const uint8_t * debug_line,
+		uint32_t size,
+		const uint8_t * line_str,
+		uint32_t line_str_size,
+		avr_dwarf_lines_t * lines)
+{
+	memset(lines, 0, sizeof(*lines));
+	dwarf_cursor_t c = { .p = debug_line, .end = debug_line + size };
+	while (c.p < c.end)
+		if (_dwarf_read_unit(&c, line_str, line_str_size, lines))
+			return -1;
+	return 0;
+}
+
+void
+avr_dwarf_free_lines(
+		avr_dwarf_lines_t * lines)
+{
+	for (int i = 0; i < lines->file_count; i++)
+		free(lines->file[i]);
+	free(lines->file);
+	free(lines->range);
+	memset(lines, 0, sizeof(*lines));
+}
@@ -0,0 +1,70 @@
+/*
+	sim_dwarf.h
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Minimal DWARF line number decoder: turns the .debug_line section of an
+ * ELF firmware (DWARF 2 to 5) into a list of flash address ranges, each
+ * with its source file and line.
+ */
+#ifndef __SIM_DWARF_H__
+#define __SIM_DWARF_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct avr_dwarf_range_t {
+	uint32_t	start;	// flash byte address
+	uint32_t	end;	// first address past the range
+	uint32_t	line;
+	uint16_t	file;	// index in avr_dwarf_lines_t.file
+} avr_dwarf_range_t;
+
+typedef struct avr_dwarf_lines_t {
+	uint32_t			file_count;
+	char **				file;	// paths, with their directory
+	uint32_t			range_count, range_size;
+	avr_dwarf_range_t *	range;	// in line program order
+} avr_dwarf_lines_t;
+
+/*
+ * Decode 'debug_line' (and 'line_str', the optional .debug_line_str section
+ * used by DWARF 5) into 'lines'. Returns -1 if the section is malformed,
+ * 'lines' then holds what was decoded before the error.
+ */
+int
+avr_dwarf_read_lines(
+		const uint8_t * debug_line,
+		uint32_t size,
+		const uint8_t * line_str,
+		uint32_t line_str_size,
+		avr_dwarf_lines_t * lines);
+void
+avr_dwarf_free_lines(
+		avr_dwarf_lines_t * lines);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_DWARF_H__ */
@@ -23,23 +23,77 @@
 	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <libelf.h>
-#include <gelf.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "sim_elf.h"
+#include "sim_utils.h"
 #include "sim_vcd_file.h"
 #include "avr_eeprom.h"
 #include "avr_ioport.h"
+#include "sim_profile.h"
+#include "sim_coverage.h"
+#include "sim_stack.h"
 
-#ifndef O_BINARY
-#define O_BINARY 0
-#endif
+/*
+ * The few 32 bits ELF types and constants used here, so no <elf.h> (macOS
+ * and MinGW have none) or libelf is needed. Same names as <elf.h>.
+ */
+typedef struct {
+	uint8_t		e_ident[16];
+	uint16_t	e_type;
+	uint16_t	e_machine;
+	uint32_t	e_version;
+	uint32_t	e_entry;
+	uint32_t	e_phoff;
+	uint32_t	e_shoff;
+	uint32_t	e_flags;
+	uint16_t	e_ehsize;
+	uint16_t	e_phentsize;
+	uint16_t	e_phnum;
+	uint16_t	e_shentsize;
+	uint16_t	e_shnum;
+	uint16_t	e_shstrndx;
+} Elf32_Ehdr;
+
+typedef struct {
+	uint32_t	sh_name;
+	uint32_t	sh_type;
+	uint32_t	sh_flags;
+	uint32_t	sh_addr;
+	uint32_t	sh_offset;
+	uint32_t	sh_size;
+	uint32_t	sh_link;
+	uint32_t	sh_info;
+	uint32_t	sh_addralign;
+	uint32_t	sh_entsize;
+} Elf32_Shdr;
+
+typedef struct {
+	uint32_t	st_name;
+	uint32_t	st_value;
+	uint32_t	st_size;
+	uint8_t		st_info;
+	uint8_t		st_other;
+	uint16_t	st_shndx;
+} Elf32_Sym;
+
+#define ELFMAG			"\177ELF"
+#define SELFMAG			4
+#define EI_CLASS		4
+#define EI_DATA			5
+#define ELFCLASS32		1
+#define ELFDATA2LSB		1
+#define SHT_SYMTAB		2
+#define SHT_NOBITS		8
+#define STB_GLOBAL		1
+#define STT_OBJECT		1
+#define STT_FUNC		2
+#define ELF32_ST_BIND(i)	((i) >> 4)
+#define ELF32_ST_TYPE(i)	((i) & 0xf)
 
 void
 avr_load_firmware(
@@ -54,27 +108,12 @@ avr_load_firmware(
 		avr->avcc = firmware->avcc;
 	if (firmware->aref)
 		avr->aref = firmware->aref;
-#if CONFIG_SIMAVR_TRACE && ELF_SYMBOLS
-	int scount = firmware->flashsize >> 1;
-	avr->trace_data->codeline = malloc(scount * sizeof(avr_symbol_t*));
-	memset(avr->trace_data->codeline, 0, scount * sizeof(avr_symbol_t*));
-
-	for (int i = 0; i < firmware->symbolcount; i++)
-		if (firmware->symbol[i]->addr < firmware->flashsize)	// code address
-			avr->trace_data->codeline[firmware->symbol[i]->addr >> 1] =
-				firmware->symbol[i];
-	// "spread" the pointers for known symbols forward
-	avr_symbol_t * last = NULL;
-	for (int i = 0; i < scount; i++) {
-		if (!avr->trace_data->codeline[i])
-			avr->trace_data->codeline[i] = last;
-		else
-			last = avr->trace_data->codeline[i];
-	}
-#endif
+	avr->firmware = firmware;
 
-	avr_loadcode(avr, firmware->flash,
-			firmware->flashsize, firmware->flashbase);
+	if (!firmware->flash_image ||
+			avr_flash_image_attach(avr, firmware->flash_image))
+		avr_loadcode(avr, firmware->flash,
+				firmware->flashsize, firmware->flashbase);
 	avr->codeend = firmware->flashsize +
 			firmware->flashbase - firmware->datasize;
 
@@ -175,8 +214,7 @@ avr_load_firmware(
 					}
 					char comp[128];
 					sprintf(comp, "%s.%d", firmware->trace[ti].name, bi);
-					avr_vcd_add_signal(avr->vcd,
-							bit, 1, firmware->trace[ti].name);
+					avr_vcd_add_signal(avr->vcd, bit, 1, comp);
 				}
 		}
 	}
@@ -186,10 +224,24 @@ avr_load_firmware(
 		avr_vcd_start(avr->vcd);
 }
 
+void
+avr_reload(
+		avr_t * avr,
+		elf_firmware_t * firmware)
+{
+	avr_reset_full(avr);
+	avr_load_firmware(avr, firmware);
+	if (firmware->entry || firmware->flashbase)
+		avr->pc = firmware->entry ? firmware->entry : firmware->flashbase;
+	avr_profile_rebind(avr, firmware);
+	avr_coverage_rebind(avr, firmware);
+	avr_stack_rebind(avr, firmware);
+}
+
 static void
 elf_parse_mmcu_section(
 		elf_firmware_t * firmware,
-		uint8_t * src,
+		const uint8_t * src,
 		uint32_t size)
 {
 //	hdump(".mmcu", src, size);
@@ -205,7 +257,7 @@ elf_parse_mmcu_section(
 					src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
 				break;
 			case AVR_MMCU_TAG_NAME:
-				strcpy(firmware->mmcu, (char*)src);
+				strcpy(firmware->mmcu, (const char*)src);
 				break;
 			case AVR_MMCU_TAG_VCC:
 				firmware->vcc =
@@ -240,22 +292,21 @@ elf_parse_mmcu_section(
 			case AVR_MMCU_TAG_VCD_TRACE: {
 				uint8_t mask = src[0];
 				uint16_t addr = src[1] | (src[2] << 8);
-				char * name = (char*)src + 3;
+				const char * name = (const char*)src + 3;
 
 #if 0
 				AVR_LOG(NULL, LOG_DEBUG,
 						"VCD_TRACE %d %04x:%02x - %s\n", tag,
 						addr, mask, name);
 #endif
-				firmware->trace[firmware->tracecount].kind = tag;
-				firmware->trace[firmware->tracecount].mask = mask;
-				firmware->trace[firmware->tracecount].addr = addr;
-				strncpy(firmware->trace[firmware->tracecount].name, name,
-					sizeof(firmware->trace[firmware->tracecount].name));
-				firmware->tracecount++;
+				elf_firmware_trace_t * t = elf_firmware_add_trace(firmware);
+				t->kind = tag;
+				t->mask = mask;
+				t->addr = addr;
+				snprintf(t->name, sizeof(t->name), "%s", name);
 			}	break;
 			case AVR_MMCU_TAG_VCD_FILENAME: {
-				strcpy(firmware->tracename, (char*)src);
+				strcpy(firmware->tracename, (const char*)src);
 			}	break;
 			case AVR_MMCU_TAG_VCD_PERIOD: {
 				firmware->traceperiod =
@@ -273,22 +324,226 @@ elf_parse_mmcu_section(
 	}
 }
 
+/*
+ * Returns the content of section 'sh' in the mapped file, or NULL if it has
+ * none, or if it does not fit in the file.
+ */
+static const uint8_t *
+elf_section_data(
+	elf_firmware_t * firmware,
+	const Elf32_Shdr * sh)
+{
+	if (!sh || sh->sh_type == SHT_NOBITS || !sh->sh_size ||
+			sh->sh_offset > firmware->mapsize ||
+			sh->sh_size > firmware->mapsize - sh->sh_offset)
+		return NULL;
+	return (const uint8_t *)firmware->map + sh->sh_offset;
+}
+
+#if ELF_SYMBOLS
+/*
+ * Returns the name of symbol 'sym' if it is one we keep (global, function or
+ * object), NULL otherwise
+ */
+static const char *
+elf_symbol_name(
+	elf_firmware_t * firmware,
+	const Elf32_Sym * sym)
+{
+	if (ELF32_ST_BIND(sym->st_info) != STB_GLOBAL &&
+			ELF32_ST_TYPE(sym->st_info) != STT_FUNC &&
+			ELF32_ST_TYPE(sym->st_info) != STT_OBJECT)
+		return NULL;
+	if (sym->st_name >= firmware->strtab_size)
+		return NULL;
+	return (const char *)firmware->map + firmware->strtab + sym->st_name;
+}
+
 static int
-elf_copy_section(
-	const char *name,
-	Elf_Data *data,
-	uint8_t **dest)
+elf_symbol_cmp(
+	const void * a,
+	const void * b)
 {
-	*dest = malloc(data->d_size);
-	if (!*dest)
-		return -1;
+	const avr_symbol_t * sa = *(const avr_symbol_t **)a;
+	const avr_symbol_t * sb = *(const avr_symbol_t **)b;
+	if (sa->addr != sb->addr)
+		return sa->addr < sb->addr ? -1 : 1;
+	// same address, the last one in the symbol table comes first
+	return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
 
-	memcpy(*dest, data->d_buf, data->d_size);
-	AVR_LOG(NULL, LOG_DEBUG, "Loaded %zu %s\n", data->d_size, name);
+/*
+ * Builds the sorted symbol array from the mapped symbol table. All the
+ * symbols are allocated in one block, 'symbol_pool'.
+ */
+static void
+elf_load_symbols(
+	elf_firmware_t * firmware)
+{
+	const Elf32_Sym * sym = (const Elf32_Sym *)
+			((const uint8_t *)firmware->map + firmware->symtab);
+	uint32_t count = firmware->symtab_size / sizeof(Elf32_Sym);
+	uint32_t total = 0;
+	size_t size = 0;
+
+	for (uint32_t i = 0; i < count; i++) {
+		const char * name = elf_symbol_name(firmware, &sym[i]);
+		if (!name)
+			continue;
+		size += (sizeof(avr_symbol_t) + strlen(name) + 4) & ~3;
+		total++;
+	}
+	if (!total)
+		return;
+	firmware->symbol = malloc(total * sizeof(firmware->symbol[0]));
+	firmware->symbol_pool = malloc(size);
+	if (!firmware->symbol || !firmware->symbol_pool) {
+		free(firmware->symbol);
+		free(firmware->symbol_pool);
+		firmware->symbol = NULL;
+		firmware->symbol_pool = NULL;
+		return;
+	}
+	uint8_t * dst = firmware->symbol_pool;
+	for (uint32_t i = 0; i < count; i++) {
+		const char * name = elf_symbol_name(firmware, &sym[i]);
+		if (!name)
+			continue;
+		avr_symbol_t * s = (avr_symbol_t *)dst;
+		size_t len = strlen(name);
+		s->addr = sym[i].st_value;
+		s->size = sym[i].st_size;
+		memcpy((char*)s->symbol, name, len + 1);
+		dst += (sizeof(avr_symbol_t) + len + 4) & ~3;
+		firmware->symbol[firmware->symbolcount++] = s;
+	}
+	qsort(firmware->symbol, firmware->symbolcount,
+			sizeof(firmware->symbol[0]), elf_symbol_cmp);
+	AVR_LOG(NULL, LOG_DEBUG, "Loaded %u symbols\n", firmware->symbolcount);
+}
 
-	return 0;
+/*
+ * Returns the index of the symbol 'addr' is in, the slow way: a sized
+ * symbol (a function) that contains 'addr' is preferred to an unsized
+ * label that is closer, and only labels are looked at past the function.
+ */
+static int
+elf_symbol_owner(
+	elf_firmware_t * firmware,
+	uint32_t addr)
+{
+	// the symbols are sorted by address, the data ones are all after the code
+	int lo = 0, hi = firmware->symbolcount;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (firmware->symbol[mid]->addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	// any number of labels can sit between 'addr' and its function
+	int label = -1;
+	for (int i = lo - 1; i >= 0; i--) {
+		avr_symbol_t * s = firmware->symbol[i];
+		if (s->size) {
+			if (addr < s->addr + s->size)
+				return i;
+			break;
+		}
+		if (label == -1)
+			label = i;
+	}
+	return label;
 }
 
+static int
+elf_edge_cmp(
+	const void * a,
+	const void * b)
+{
+	uint32_t ea = *(const uint32_t *)a, eb = *(const uint32_t *)b;
+	return ea < eb ? -1 : ea > eb;
+}
+
+/*
+ * Builds the code address ranges index from the sorted symbols. The owner
+ * of an address only changes where a symbol starts, or where a sized one
+ * ends, so it is looked up once for each of these, and consecutive ranges
+ * of the same symbol are merged.
+ */
+static void
+elf_build_ranges(
+	elf_firmware_t * firmware)
+{
+	// without any code, stop where the data space starts
+	uint32_t codeend = firmware->flashsize ?
+			firmware->flashbase + firmware->flashsize : 0x800000;
+	uint32_t * edge = malloc(2 * firmware->symbolcount * sizeof(*edge));
+	if (!edge)
+		return;
+	uint32_t count = 0;
+	for (int i = 0; i < firmware->symbolcount; i++) {
+		avr_symbol_t * s = firmware->symbol[i];
+		if (s->addr >= codeend)
+			continue;
+		edge[count++] = s->addr;
+		if (s->size && s->addr + s->size < codeend)
+			edge[count++] = s->addr + s->size;
+	}
+	qsort(edge, count, sizeof(edge[0]), elf_edge_cmp);
+	firmware->range = malloc(count * sizeof(firmware->range[0]));
+	if (!firmware->range) {
+		free(edge);
+		return;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (i && edge[i] == edge[i - 1])
+			continue;
+		uint32_t end = codeend;
+		for (uint32_t n = i + 1; n < count && end == codeend; n++)
+			if (edge[n] != edge[i])
+				end = edge[n];
+		int symbol = elf_symbol_owner(firmware, edge[i]);
+		if (symbol < 0)
+			continue;
+		elf_symbol_range_t * last = firmware->rangecount ?
+				&firmware->range[firmware->rangecount - 1] : NULL;
+		if (last && last->symbol == symbol && last->end == edge[i])
+			last->end = end;
+		else
+			firmware->range[firmware->rangecount++] = (elf_symbol_range_t) {
+				.start = edge[i], .end = end, .symbol = symbol };
+	}
+	free(edge);
+}
+
+static pthread_mutex_t elf_symbol_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+int
+elf_firmware_load_symbols(
+	elf_firmware_t * firmware)
+{
+#if ELF_SYMBOLS
+	if (!firmware)
+		return 0;
+	if (__atomic_load_n(&firmware->symbols_loaded, __ATOMIC_ACQUIRE))
+		return firmware->symbolcount;
+	// firmwares are shared between the batch runner threads
+	pthread_mutex_lock(&elf_symbol_lock);
+	if (!firmware->symbols_loaded) {
+		if (firmware->map && firmware->symtab_size)
+			elf_load_symbols(firmware);
+		if (firmware->symbolcount && !firmware->range)
+			elf_build_ranges(firmware);
+		__atomic_store_n(&firmware->symbols_loaded, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&elf_symbol_lock);
+	return firmware->symbolcount;
+#else
+	return 0;
+#endif
+}
 
 /* The structure *firmware must be pre-initialised to zero, then optionally
  * with tracing and VCD information.
@@ -299,154 +554,246 @@ elf_read_firmware(
 	const char * file,
 	elf_firmware_t * firmware)
 {
-	Elf32_Ehdr elf_header;			/* ELF header */
-	Elf *elf = NULL;                       /* Our Elf pointer for libelf */
-	int fd; // File Descriptor
+	size_t size = 0;
+	const uint8_t * base = sim_mmap_read(file, &size);
 
-	if ((fd = open(file, O_RDONLY | O_BINARY)) == -1 ||
-			(read(fd, &elf_header, sizeof(elf_header))) < sizeof(elf_header)) {
+	if (!base) {
 		AVR_LOG(NULL, LOG_ERROR, "could not read %s\n", file);
 		perror(file);
-		close(fd);
 		return -1;
 	}
-
-	Elf_Data *data_data = NULL,
-		*data_text = NULL,
-		*data_ee = NULL;                /* Data Descriptor */
-	Elf_Data *data_fuse = NULL;
-	Elf_Data *data_lockbits = NULL;
-
+	const Elf32_Ehdr * eh = (const Elf32_Ehdr *)base;
+	if (size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+			eh->e_ident[EI_CLASS] != ELFCLASS32 ||
+			eh->e_ident[EI_DATA] != ELFDATA2LSB ||
+			eh->e_shentsize != sizeof(Elf32_Shdr) ||
+			eh->e_shoff > size ||
+			eh->e_shnum > (size - eh->e_shoff) / sizeof(Elf32_Shdr) ||
+			eh->e_shstrndx >= eh->e_shnum) {
+		AVR_LOG(NULL, LOG_ERROR, "%s: not a 32 bits little endian ELF file\n",
+				file);
+		sim_munmap_read(base, size);
+		return -1;
+	}
+	// the sections we load point straight in the mapping, it stays around
+	// until elf_free_firmware()
+	firmware->map = base;
+	firmware->mapsize = size;
+
+	const Elf32_Shdr * sh = (const Elf32_Shdr *)(base + eh->e_shoff);
+	const uint8_t * names = elf_section_data(firmware, &sh[eh->e_shstrndx]);
+	uint32_t names_size = names ? sh[eh->e_shstrndx].sh_size : 0;
+	if (names_size && names[names_size - 1])
+		names_size = 0;		// not terminated, ignore it
+
+	const Elf32_Shdr *text = NULL, *data = NULL, *ee = NULL;
+	const Elf32_Shdr *fuse = NULL, *lockbits = NULL;
 #if ELF_SYMBOLS
 	firmware->symbolcount = 0;
 	firmware->symbol = NULL;
+	const Elf32_Shdr *line = NULL, *line_str = NULL;
 #endif
 
-	/* this is actually mandatory !! otherwise elf_begin() fails */
-	if (elf_version(EV_CURRENT) == EV_NONE) {
-			/* library out of date - recover from error */
-	}
-	// Iterate through section headers again this time well stop when we find symbols
-	elf = elf_begin(fd, ELF_C_READ, NULL);
-	//printf("Loading elf %s : %p\n", file, elf);
-
-	Elf_Scn *scn = NULL;                   /* Section Descriptor */
-
-	while ((scn = elf_nextscn(elf, scn)) != NULL) {
-		GElf_Shdr shdr;                 /* Section Header */
-		gelf_getshdr(scn, &shdr);
-		char * name = elf_strptr(elf, elf_header.e_shstrndx, shdr.sh_name);
+	for (int i = 0; i < eh->e_shnum; i++) {
+		const Elf32_Shdr * s = &sh[i];
+		if (s->sh_name >= names_size)
+			continue;
+		const char * name = (const char *)names + s->sh_name;
 	//	printf("Walking elf section '%s'\n", name);
 
 		if (!strcmp(name, ".text"))
-			data_text = elf_getdata(scn, NULL);
+			text = s;
 		else if (!strcmp(name, ".data"))
-			data_data = elf_getdata(scn, NULL);
+			data = s;
 		else if (!strcmp(name, ".eeprom"))
-			data_ee = elf_getdata(scn, NULL);
+			ee = s;
 		else if (!strcmp(name, ".fuse"))
-			data_fuse = elf_getdata(scn, NULL);
+			fuse = s;
 		else if (!strcmp(name, ".lock"))
-			data_lockbits = elf_getdata(scn, NULL);
-		else if (!strcmp(name, ".bss")) {
-			Elf_Data *s = elf_getdata(scn, NULL);
-			firmware->bsssize = s->d_size;
-		} else if (!strcmp(name, ".mmcu")) {
-			Elf_Data *s = elf_getdata(scn, NULL);
-			elf_parse_mmcu_section(firmware, s->d_buf, s->d_size);
-			//printf("%s: avr_mcu_t size %ld / read %ld\n", __FUNCTION__, sizeof(struct avr_mcu_t), s->d_size);
-		//	avr->frequency = f_cpu;
+			lockbits = s;
+		else if (!strcmp(name, ".bss"))
+			firmware->bsssize = s->sh_size;
+		else if (!strcmp(name, ".mmcu")) {
+			const uint8_t * mmcu = elf_section_data(firmware, s);
+			if (mmcu)
+				elf_parse_mmcu_section(firmware, mmcu, s->sh_size);
 		}
 #if ELF_SYMBOLS
-		// When we find a section header marked SHT_SYMTAB stop and get symbols
-		if (shdr.sh_type == SHT_SYMTAB) {
-			// edata points to our symbol table
-			Elf_Data *edata = elf_getdata(scn, NULL);
-
-			// how many symbols are there? this number comes from the size of
-			// the section divided by the entry size
-			int symbol_count = shdr.sh_size / shdr.sh_entsize;
-
-			// loop through to grab all symbols
-			for (int i = 0; i < symbol_count; i++) {
-				GElf_Sym sym;			/* Symbol */
-				// libelf grabs the symbol data using gelf_getsym()
-				gelf_getsym(edata, i, &sym);
-
-				// print out the value and size
-				if (ELF32_ST_BIND(sym.st_info) == STB_GLOBAL ||
-						ELF32_ST_TYPE(sym.st_info) == STT_FUNC ||
-						ELF32_ST_TYPE(sym.st_info) == STT_OBJECT) {
-					const char * name = elf_strptr(elf, shdr.sh_link, sym.st_name);
-
-					// if its a bootloader, this symbol will be the entry point we need
-					if (!strcmp(name, "__vectors"))
-						firmware->flashbase = sym.st_value;
-					avr_symbol_t * s = malloc(sizeof(avr_symbol_t) + strlen(name) + 1);
-					strcpy((char*)s->symbol, name);
-					s->addr = sym.st_value;
-					s->size = sym.st_size;
-					if (!(firmware->symbolcount % 8))
-						firmware->symbol = realloc(
-							firmware->symbol,
-							(firmware->symbolcount + 8) * sizeof(firmware->symbol[0]));
-
-					// insert new element, keep the array sorted
-					int insert = -1;
-					for (int si = 0; si < firmware->symbolcount && insert == -1; si++)
-						if (firmware->symbol[si]->addr >= s->addr)
-							insert = si;
-					if (insert == -1)
-						insert = firmware->symbolcount;
-					else
-						memmove(firmware->symbol + insert + 1,
-								firmware->symbol + insert,
-								(firmware->symbolcount - insert) * sizeof(firmware->symbol[0]));
-					firmware->symbol[insert] = s;
-					firmware->symbolcount++;
-				}
+		else if (!strcmp(name, ".debug_line"))
+			line = s;
+		else if (!strcmp(name, ".debug_line_str"))
+			line_str = s;
+		// only remember where the symbols are, they are loaded on demand
+		// by elf_firmware_load_symbols()
+		if (s->sh_type == SHT_SYMTAB && s->sh_link < eh->e_shnum &&
+				s->sh_entsize == sizeof(Elf32_Sym) &&
+				elf_section_data(firmware, s) &&
+				elf_section_data(firmware, &sh[s->sh_link])) {
+			const Elf32_Shdr * str = &sh[s->sh_link];
+			if (str->sh_size && !base[str->sh_offset + str->sh_size - 1]) {
+				firmware->symtab = s->sh_offset;
+				firmware->symtab_size = s->sh_size;
+				firmware->strtab = str->sh_offset;
+				firmware->strtab_size = str->sh_size;
 			}
 		}
 #endif
 	}
-	uint32_t offset = 0;
-	firmware->flashsize =
-			(data_text ? data_text->d_size : 0) +
-			(data_data ? data_data->d_size : 0);
-	firmware->flash = malloc(firmware->flashsize);
-
-	// using unsigned int for output, since there is no AVR with 4GB
-	if (data_text) {
-	//	hdump("code", data_text->d_buf, data_text->d_size);
-		memcpy(firmware->flash + offset, data_text->d_buf, data_text->d_size);
-		AVR_LOG(NULL, LOG_DEBUG, "Loaded %zu .text at address 0x%x\n",
-				(unsigned int)data_text->d_size, firmware->flashbase);
-		offset += data_text->d_size;
-	}
-	if (data_data) {
-	//	hdump("data", data_data->d_buf, data_data->d_size);
-		memcpy(firmware->flash + offset, data_data->d_buf, data_data->d_size);
-		AVR_LOG(NULL, LOG_DEBUG, "Loaded %zu .data\n", data_data->d_size);
-		offset += data_data->d_size;
-		firmware->datasize = data_data->d_size;
-	}
-	if (data_ee) {
-		if (elf_copy_section(".eeprom", data_ee, &firmware->eeprom))
+	/*
+	 * __vectors starts .text, so for a bootloader the entry point we need
+	 * is where .text is, no need to look at the symbols for it
+	 */
+	if (text)
+		firmware->flashbase = text->sh_addr;
+	const uint8_t * text_data = elf_section_data(firmware, text);
+	const uint8_t * data_data = elf_section_data(firmware, data);
+	uint32_t text_size = text_data ? text->sh_size : 0;
+	uint32_t data_size = data_data ? data->sh_size : 0;
+
+	firmware->flashsize = text_size + data_size;
+	firmware->datasize = data_size;
+	// .data normally follows .text in the file too, so the flash image
+	// can be used in place; otherwise assemble it
+	if (!data_size || (text_size && text_data + text_size == data_data))
+		firmware->flash = (uint8_t *)text_data;
+	else if (!text_size)
+		firmware->flash = (uint8_t *)data_data;
+	else {
+		firmware->flash = malloc(firmware->flashsize);
+		if (!firmware->flash) {
+			elf_free_firmware(firmware);
 			return -1;
-		firmware->eesize = data_ee->d_size;
+		}
+		memcpy(firmware->flash, text_data, text_size);
+		memcpy(firmware->flash + text_size, data_data, data_size);
 	}
-	if (data_fuse) {
-		if (elf_copy_section(".fuse", data_fuse, &firmware->fuse))
-			return -1;
-		firmware->fusesize = data_fuse->d_size;
+	// using unsigned int for output, since there is no AVR with 4GB
+	if (text_size)
+		AVR_LOG(NULL, LOG_DEBUG, "Loaded %u .text at address 0x%x\n",
+				text_size, firmware->flashbase);
+	if (data_size)
+		AVR_LOG(NULL, LOG_DEBUG, "Loaded %u .data\n", data_size);
+
+	firmware->eeprom = (uint8_t *)elf_section_data(firmware, ee);
+	if (firmware->eeprom)
+		firmware->eesize = ee->sh_size;
+	firmware->fuse = (uint8_t *)elf_section_data(firmware, fuse);
+	if (firmware->fuse)
+		firmware->fusesize = fuse->sh_size;
+	firmware->lockbits = (uint8_t *)elf_section_data(firmware, lockbits);
+#if ELF_SYMBOLS
+	firmware->debug_line = elf_section_data(firmware, line);
+	if (firmware->debug_line)
+		firmware->debug_line_size = line->sh_size;
+	firmware->debug_line_str = elf_section_data(firmware, line_str);
+	if (firmware->debug_line_str)
+		firmware->debug_line_str_size = line_str->sh_size;
+#endif
+	return 0;
+}
+
+elf_firmware_trace_t *
+elf_firmware_add_trace(
+	elf_firmware_t * firmware)
+{
+	if (firmware->tracecount == firmware->tracesize) {
+		firmware->tracesize = firmware->tracesize ?
+				firmware->tracesize * 2 : 16;
+		firmware->trace = realloc(firmware->trace,
+				firmware->tracesize * sizeof(firmware->trace[0]));
 	}
-	if (data_lockbits) {
-		if (elf_copy_section(".lock", data_lockbits, &firmware->lockbits))
-			return -1;
+	elf_firmware_trace_t * t = &firmware->trace[firmware->tracecount++];
+	memset(t, 0, sizeof(*t));
+	return t;
+}
+
+int
+elf_firmware_find_symbol(
+	elf_firmware_t * firmware,
+	uint32_t addr)
+{
+#if ELF_SYMBOLS
+	if (!elf_firmware_load_symbols(firmware) || !firmware->rangecount)
+		return -1;
+	int lo = 0, hi = firmware->rangecount;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (firmware->range[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-//	hdump("flash", avr->flash, offset);
-	elf_end(elf);
-	close(fd);
-	return 0;
+	if (!lo || addr >= firmware->range[lo - 1].end)
+		return -1;
+	return firmware->range[lo - 1].symbol;
+#else
+	return -1;
+#endif
 }
 
+avr_symbol_t *
+avr_symbol_at(
+	avr_t * avr,
+	avr_flashaddr_t pc)
+{
+#if ELF_SYMBOLS
+	int i = elf_firmware_find_symbol(avr->firmware, pc);
+	return i < 0 ? NULL : avr->firmware->symbol[i];
+#else
+	return NULL;
+#endif
+}
+
+/* Free 'p', unless it points in the mapped file */
+static void
+elf_free_section(
+	elf_firmware_t * firmware,
+	void * p)
+{
+	const uint8_t * map = firmware->map;
+	if (map && (uint8_t *)p >= map && (uint8_t *)p < map + firmware->mapsize)
+		return;
+	free(p);
+}
+
+void
+elf_free_firmware(
+	elf_firmware_t * firmware)
+{
+	elf_free_section(firmware, firmware->flash);
+	elf_free_section(firmware, firmware->eeprom);
+	elf_free_section(firmware, firmware->fuse);
+	elf_free_section(firmware, firmware->lockbits);
+	firmware->flash = firmware->eeprom = NULL;
+	firmware->fuse = firmware->lockbits = NULL;
+	avr_flash_image_unref(firmware->flash_image);
+	firmware->flash_image = NULL;
+	free(firmware->trace);
+	firmware->trace = NULL;
+	firmware->tracecount = firmware->tracesize = 0;
+#if ELF_SYMBOLS
+	if (firmware->symbol_pool) {
+		free(firmware->symbol);
+		free(firmware->symbol_pool);
+	} else if (firmware->symbol) {
+		// filled by the caller, one allocation per symbol
+		for (int i = 0; i < firmware->symbolcount; i++)
+			free(firmware->symbol[i]);
+		free(firmware->symbol);
+	}
+	free(firmware->range);
+	firmware->symbol = NULL;
+	firmware->symbol_pool = NULL;
+	firmware->symbolcount = 0;
+	firmware->range = NULL;
+	firmware->rangecount = 0;
+	firmware->symbols_loaded = 0;
+	firmware->symtab = firmware->symtab_size = 0;
+	firmware->strtab = firmware->strtab_size = 0;
+	firmware->debug_line = firmware->debug_line_str = NULL;
+	firmware->debug_line_size = firmware->debug_line_str_size = 0;
+#endif
+	sim_munmap_read(firmware->map, firmware->mapsize);
+	firmware->map = NULL;
+	firmware->mapsize = 0;
+}
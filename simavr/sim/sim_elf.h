@@ -22,6 +22,7 @@
 #ifndef __SIM_ELF_H__
 #define __SIM_ELF_H__
 
+#include <stddef.h>
 #include "avr/avr_mcu_section.h"
 
 #ifdef __cplusplus
@@ -37,9 +38,27 @@ extern "C" {
  */
 #define AVR_SEGMENT_OFFSET_FLASH 0
 #define AVR_SEGMENT_OFFSET_EEPROM 0x00810000
+#define AVR_SEGMENT_OFFSET_FUSE 0x00820000
+#define AVR_SEGMENT_OFFSET_LOCK 0x00830000
 
 #include "sim_avr.h"
 
+#if ELF_SYMBOLS
+// a range of code addresses, and the symbol they belong to
+typedef struct elf_symbol_range_t {
+	uint32_t	start, end;	// end is excluded
+	int32_t		symbol;		// index in elf_firmware_t.symbol
+} elf_symbol_range_t;
+#endif
+
+// a VCD trace, as found in the .mmcu section or given on the command line
+typedef struct elf_firmware_trace_t {
+	uint8_t kind;		// AVR_MMCU_TAG_VCD_*
+	uint8_t mask;
+	uint16_t addr;
+	char	name[64];
+} elf_firmware_trace_t;
+
 typedef struct elf_firmware_t {
 	char  mmcu[64];
 	uint32_t	frequency;
@@ -48,12 +67,8 @@ typedef struct elf_firmware_t {
 	char		tracename[128];	// trace filename
 	uint32_t	traceperiod;
 	int			tracecount;
-	struct {
-		uint8_t kind;
-		uint8_t mask;
-		uint16_t addr;
-		char	name[64];
-	} trace[32];
+	int			tracesize;	// allocated entries in 'trace'
+	elf_firmware_trace_t * trace;
 
 	struct {
 		char port;
@@ -65,6 +80,7 @@ typedef struct elf_firmware_t {
 	uint16_t	console_register_addr;
 
 	uint32_t	flashbase;	// base address
+	uint32_t	entry;		// start address of a .hex/.srec, 0 if none
 	uint8_t * 	flash;
 	uint32_t	flashsize;
 	uint32_t 	datasize;
@@ -75,15 +91,39 @@ typedef struct elf_firmware_t {
 	uint8_t *	fuse;
 	uint32_t	fusesize;
 	uint8_t *	lockbits;
+	// optional: if set, and of the right size, avr_load_firmware() shares
+	// this image as flash instead of copying 'flash' into each instance
+	avr_flash_image_t * flash_image;
+
+	// the file, as mapped by elf_read_firmware(); the sections above
+	// point straight in it whenever possible, and must not be modified
+	const void *	map;
+	size_t		mapsize;
 
 #if ELF_SYMBOLS
+	// sorted by address, see elf_firmware_load_symbols()
 	avr_symbol_t **  symbol;
 	uint32_t	symbolcount;
+	int			symbols_loaded;
+	void *		symbol_pool;	// storage for the symbols
+	// code address to symbol index, sorted and not overlapping
+	elf_symbol_range_t * range;
+	uint32_t	rangecount;
+	// offsets of the symbol table, and its strings, in 'map'
+	uint32_t	symtab, symtab_size;
+	uint32_t	strtab, strtab_size;
+	// raw DWARF line number sections (in 'map'), see sim_dwarf.h
+	const uint8_t *	debug_line;
+	uint32_t	debug_line_size;
+	const uint8_t *	debug_line_str;
+	uint32_t	debug_line_str_size;
 #endif
 } elf_firmware_t ;
 
 /* The structure *firmware must be pre-initialised to zero, then optionally
  * with tracing and VCD information.
+ * The file is mapped, and only the sections the simulator needs are looked
+ * at; the symbols are left alone until elf_firmware_load_symbols().
  */
 
 int
@@ -95,6 +135,55 @@ void
 avr_load_firmware(
 	avr_t * avr,
 	elf_firmware_t * firmware);
+/*
+ * Reuses 'avr' for another firmware: avr_reset_full(), then
+ * avr_load_firmware(), and the PC is set to the firmware entry point. The
+ * profile, coverage and stack analysis, if any, start over with 'firmware'.
+ * It is a lot cheaper than avr_terminate() and making a new instance.
+ */
+void
+avr_reload(
+	avr_t * avr,
+	elf_firmware_t * firmware);
+
+/* Returns a new, zeroed trace entry at the end of firmware->trace */
+elf_firmware_trace_t *
+elf_firmware_add_trace(
+	elf_firmware_t * firmware);
+
+/*
+ * Builds firmware->symbol from the symbol table, the first time it is
+ * called, and returns firmware->symbolcount. It is safe to call from
+ * several threads sharing 'firmware'. 'firmware' can be NULL.
+ */
+int
+elf_firmware_load_symbols(
+	elf_firmware_t * firmware);
+
+/*
+ * Returns the index in firmware->symbol of the code symbol 'addr' is in, or
+ * -1. A sized symbol (a function) that contains 'addr' is preferred to an
+ * unsized label that is closer. 'firmware' can be NULL.
+ * This is a binary search in firmware->range, built along the symbols.
+ */
+int
+elf_firmware_find_symbol(
+	elf_firmware_t * firmware,
+	uint32_t addr);
+
+/*
+ * Returns the symbol of the firmware loaded in 'avr' that code address
+ * 'pc' is in, or NULL
+ */
+avr_symbol_t *
+avr_symbol_at(
+	avr_t * avr,
+	avr_flashaddr_t pc);
+
+/* Release the buffers allocated by elf_read_firmware() */
+void
+elf_free_firmware(
+	elf_firmware_t * firmware);
 
 #ifdef __cplusplus
 };
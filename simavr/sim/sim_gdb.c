@@ -21,6 +21,7 @@
 
 #include "sim_network.h"
 #include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -32,34 +33,81 @@
 #include "sim_hex.h"
 #include "avr_eeprom.h"
 #include "sim_gdb.h"
+#include "sim_undo.h"
+#include "sim_perf.h"
 
 // For debug printfs: "#define DBG(w) w"
 #define DBG(w)
 
-#define WATCH_LIMIT (32)
+// latency of the network thread for new connections and pending output
+#define AVR_GDB_THREAD_POLL_MS	10
+
+typedef struct avr_gdb_buffer_t {
+	uint8_t * b;
+	uint32_t len, size;
+} avr_gdb_buffer_t;
+
+enum {
+	GDB_EVENT_CONNECT = 0,
+	GDB_EVENT_PACKET,
+	GDB_EVENT_INTERRUPT,	// ^C
+	GDB_EVENT_DISCONNECT,
+	GDB_EVENT_RESUME,		// a vCont action for this core
+	GDB_EVENT_HALT,			// all-stop, another core stopped
+	GDB_EVENT_KILL,
+	GDB_EVENT_MONITOR,		// a JSON monitor request
+};
+
+typedef struct avr_gdb_event_t {
+	struct avr_gdb_event_t * next;
+	int		kind;
+	uint32_t	client;	// monitor client the reply goes to
+	uint32_t	len;
+	char		data[];	// packet, action or request, NUL terminated
+} avr_gdb_event_t;
+
+// a non-stop stop reply, waiting for gdb to ask for it with vStopped
+typedef struct avr_gdb_stop_t {
+	struct avr_gdb_stop_t * next;
+	char		reply[];
+} avr_gdb_stop_t;
+
+typedef struct avr_gdb_monitor_t {
+	struct avr_gdb_monitor_t * next;
+	int		s;
+	uint32_t	id;
+	avr_gdb_buffer_t in, out;
+} avr_gdb_monitor_t;
 
-typedef struct {
-	uint32_t len; /**< How many points are taken (points[0] .. points[len - 1]). */
-	struct {
-		uint32_t addr; /**< Which address is watched. */
-		uint32_t size; /**< How large is the watched segment. */
-		uint32_t kind; /**< Bitmask of enum avr_gdb_watch_type values. */
-	} points[WATCH_LIMIT];
-} avr_gdb_watchpoints_t;
+/*
+ * The debug server: one gdb connection, any number of monitor clients,
+ * and the cores they can look at. 'lock' protects all of it, and the event
+ * queues of the cores; the 'in' buffers belong to the network thread.
+ */
+typedef struct avr_gdb_server_t {
+	int		listen;		// gdb listen socket
+	int		s;			// current gdb connection
+	// received bytes not yet handled (partial packets), and replies the
+	// socket didn't take yet
+	avr_gdb_buffer_t in, out;
 
-typedef struct avr_gdb_t {
-	avr_t * avr;
-	int	listen;	// listen socket
-	int	s;	// current gdb connection
+	int		monitor_listen;	// -1 if there is no monitor port
+	avr_gdb_monitor_t * monitors;
+	uint32_t	monitor_id;
 
-	avr_gdb_watchpoints_t breakpoints;
-	avr_gdb_watchpoints_t watchpoints;
+	pthread_t	thread;
+	pthread_mutex_t lock;
+	int		stop;		// tells the network thread to exit
 
-	// These are used by gdb's "info io_registers" command.
+	avr_gdb_t * cores;
+	int		core_id;	// last one given
+	int		current;	// core for the packets, "Hg"
+	int		cont;		// core for a step, "Hc", 0 for all
 
-	uint16_t ior_base;
-	uint8_t  ior_count, mad;
-} avr_gdb_t;
+	int		non_stop;	// gdb asked for non-stop mode (QNonStop:1)
+	int		stopped;	// all-stop, a stop was reported since the last resume
+	avr_gdb_stop_t * stops, ** stops_tail;
+} avr_gdb_server_t;
 
 
 /**
@@ -80,26 +128,6 @@ gdb_watch_find(
 	return -1;
 }
 
-/**
- * Contrary to gdb_watch_find, this actually checks the address against
- * a watched memory _range_.
- */
-static int
-gdb_watch_find_range(
-		const avr_gdb_watchpoints_t * w,
-		uint32_t addr )
-{
-	for (int i = 0; i < w->len; i++) {
-		if (w->points[i].addr > addr) {
-			return -1;
-		} else if (w->points[i].addr <= addr &&
-				   addr < w->points[i].addr + w->points[i].size) {
-			return i;
-		}
-	}
-	return -1;
-}
-
 /**
  * Returns -1 on error, 0 otherwise.
  */
@@ -122,8 +150,12 @@ gdb_watch_add_or_update(
 	}
 
 	/* Otherwise add it. */
-	if (w->len == WATCH_LIMIT) {
-		return -1;
+	if (w->len == w->alloc) {
+		void * p = realloc(w->points, (w->alloc + 16) * sizeof(w->points[0]));
+		if (!p)
+			return -1;
+		w->points = p;
+		w->alloc += 16;
 	}
 
 	/* Find the insertion point. */
@@ -136,7 +168,7 @@ gdb_watch_add_or_update(
 	w->len++;
 
 	/* Make space for new element, moving old ones from the end. */
-	for (int j = w->len; j > i; j--) {
+	for (int j = w->len - 1; j > i; j--) {
 		w->points[j] = w->points[j - 1];
 	}
 
@@ -183,27 +215,251 @@ gdb_watch_clear(
 	w->len = 0;
 }
 
+/*
+ * Rebuild the breakpoint bitmap from the list, called when the
+ * breakpoints change, which is rare.
+ */
+static void
+gdb_break_map_update(
+		avr_gdb_t * g )
+{
+	memset(g->break_map, 0, (g->avr->flashend >> 4) + 1);
+	for (int i = 0; i < g->breakpoints.len; i++) {
+		uint32_t addr = g->breakpoints.points[i].addr;
+		g->break_map[addr >> 4] |= 1 << ((addr >> 1) & 7);
+	}
+}
+
+/*
+ * Same for the watchpoints, each data byte gets the kinds of access
+ * that are watched on it, so the core tests them with one load.
+ */
+static void
+gdb_watch_map_update(
+		avr_gdb_t * g )
+{
+	avr_t * avr = g->avr;
+	memset(g->watch_map, 0, avr->ramend + 1);
+	for (int i = 0; i < g->watchpoints.len; i++) {
+		uint32_t addr = g->watchpoints.points[i].addr;
+		uint32_t end = addr + g->watchpoints.points[i].size;
+		for (; addr < end && addr <= avr->ramend; addr++)
+			g->watch_map[addr] |= g->watchpoints.points[i].kind;
+	}
+}
+
+static const char gdb_hexdigits[] = "0123456789abcdef";
+
+// Make room for 'len' more bytes in 'b', returns where they go
+static uint8_t *
+gdb_buffer_reserve(
+		avr_gdb_buffer_t * b,
+		uint32_t len )
+{
+	if (b->len + len > b->size) {
+		uint32_t size = b->size ? b->size : 1024;
+		while (size < b->len + len)
+			size *= 2;
+		b->b = realloc(b->b, size);
+		b->size = size;
+	}
+	return b->b + b->len;
+}
+
+/*
+ * Send what we can of 'out'. The sockets are non blocking, what one
+ * doesn't take now is sent by the network thread when select() says it
+ * can. Called with the server lock held.
+ */
+static void
+gdb_flush(
+		int s,
+		avr_gdb_buffer_t * out )
+{
+	while (out->len && s != -1) {
+		ssize_t r = send(s, out->b, out->len, MSG_NOSIGNAL);
+		if (r <= 0) {
+			if (r < 0 && network_would_block())
+				return;
+			out->len = 0;	// connection is gone, recv() will tell
+			return;
+		}
+		out->len -= r;
+		memmove(out->b, out->b + r, out->len);
+	}
+}
+
+/*
+ * Queue a packet ('$') or a notification ('%') for gdb; if 'binary' is
+ * set, the characters the protocol uses are escaped, otherwise 'data' is
+ * known to be plain text. Called with the server lock held.
+ */
+static void
+gdb_frame(
+		avr_gdb_server_t * srv,
+		char start_char,
+		const uint8_t * data,
+		uint32_t len,
+		int binary )
+{
+	uint8_t * dst = gdb_buffer_reserve(&srv->out, 2 * len + 4);
+	uint8_t * start = dst;
+	uint8_t check = 0;
+	*dst++ = start_char;
+	for (uint32_t i = 0; i < len; i++) {
+		uint8_t c = data[i];
+		if (binary && (c == '$' || c == '#' || c == '}' || c == '*')) {
+			*dst++ = '}';
+			check += '}';
+			c ^= 0x20;
+		}
+		*dst++ = c;
+		check += c;
+	}
+	*dst++ = '#';
+	*dst++ = gdb_hexdigits[check >> 4];
+	*dst++ = gdb_hexdigits[check & 0xf];
+	DBG(printf("%s '%.*s'\n", __FUNCTION__, (int)(dst - start), start);)
+	srv->out.len += dst - start;
+	gdb_flush(srv->s, &srv->out);
+}
+
+static void
+gdb_server_reply(
+		avr_gdb_server_t * srv,
+		const char * cmd )
+{
+	pthread_mutex_lock(&srv->lock);
+	gdb_frame(srv, '$', (uint8_t*)cmd, strlen(cmd), 0);
+	pthread_mutex_unlock(&srv->lock);
+}
+
+static void
+gdb_send_packet(
+		avr_gdb_t * g,
+		const uint8_t * data,
+		uint32_t len,
+		int binary )
+{
+	pthread_mutex_lock(&g->server->lock);
+	gdb_frame(g->server, '$', data, len, binary);
+	pthread_mutex_unlock(&g->server->lock);
+}
+
 static void
 gdb_send_reply(
 		avr_gdb_t * g,
 		char * cmd )
 {
-	uint8_t reply[1024];
-	uint8_t * dst = reply;
-	uint8_t check = 0;
-	*dst++ = '$';
-	while (*cmd) {
-		check += *cmd;
-		*dst++ = *cmd++;
+	gdb_send_packet(g, (uint8_t*)cmd, strlen(cmd), 0);
+}
+
+// Hex encode 'len' bytes of 'src' into 'dst', returns the end of 'dst'
+static char *
+gdb_hex(
+		char * dst,
+		const uint8_t * src,
+		uint32_t len )
+{
+	while (len--) {
+		*dst++ = gdb_hexdigits[*src >> 4];
+		*dst++ = gdb_hexdigits[*src++ & 0xf];
 	}
-	sprintf((char*)dst, "#%02x", check);
-	DBG(printf("%s '%s'\n", __FUNCTION__, reply);)
-	send(g->s, reply, dst - reply + 3, 0);
+	*dst = 0;
+	return dst;
 }
 
+/*
+ * Reply to a qXfer read of 'doc' (of 'size' bytes), 'args' is the
+ * "offset,length" part of the request.
+ */
 static void
-gdb_send_stop_status(
+gdb_send_xfer(
+		avr_gdb_t * g,
+		const char * doc,
+		uint32_t size,
+		const char * args )
+{
+	uint32_t offset, len;
+	if (sscanf(args, "%x,%x", &offset, &len) != 2) {
+		gdb_send_reply(g, "E01");
+		return;
+	}
+	if (offset > size)
+		offset = size;
+	char last = len < size - offset ? 'm' : 'l';
+	if (len > size - offset)
+		len = size - offset;
+	char * rep = malloc(len + 1);
+	rep[0] = last;
+	memcpy(rep + 1, doc + offset, len);
+	gdb_send_packet(g, (uint8_t*)rep, len + 1, 1);
+	free(rep);
+}
+
+static void message(avr_gdb_t * g, const char *m);
+
+/*
+ * Ends a "monitor cycles" run, at the next instruction boundary, the same
+ * way a single step ends.
+ */
+static avr_cycle_count_t
+gdb_cycles_timer(
+		avr_t * avr,
+		avr_cycle_count_t when,
+		void * param )
+{
+	if (avr->state == cpu_Running || avr->state == cpu_Sleeping)
+		avr->state = cpu_StepDone;
+	return 0;
+}
+
+/*
+ * Queue an event for core 'g', called with the server lock held. The
+ * core handles it in avr_gdb_processor().
+ */
+static void
+gdb_queue_locked(
+		avr_gdb_t * g,
+		int kind,
+		uint32_t client,
+		const void * data,
+		uint32_t len )
+{
+	avr_gdb_event_t * e = malloc(sizeof(*e) + len + 1);
+	e->next = NULL;
+	e->kind = kind;
+	e->client = client;
+	e->len = len;
+	if (len)
+		memcpy(e->data, data, len);
+	e->data[len] = 0;
+
+	*g->event_tail = e;
+	g->event_tail = &e->next;
+	__atomic_store_n(&g->pending, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&g->wakeup);
+}
+
+// Network thread: queue an event for all the cores
+static void
+gdb_queue_all(
+		avr_gdb_server_t * srv,
+		int kind,
+		const void * data,
+		uint32_t len )
+{
+	pthread_mutex_lock(&srv->lock);
+	for (avr_gdb_t * g = srv->cores; g; g = g->next)
+		gdb_queue_locked(g, kind, 0, data, len);
+	pthread_mutex_unlock(&srv->lock);
+}
+
+// Format a stop reply in 'cmd'
+static void
+gdb_format_stop_status(
 		avr_gdb_t  * g,
+		char       * cmd,
 		uint8_t     signal,
 		const char * reason,
 		uint32_t   * pp )
@@ -211,23 +467,72 @@ gdb_send_stop_status(
 	avr_t   * avr;
 	uint8_t   sreg;
 	int       n;
-	char      cmd[64];
 
 	avr = g->avr;
 	READ_SREG_INTO(avr, sreg);
 
-	n = sprintf(cmd, "T%02x20:%02x;21:%02x%02x;22:%02x%02x%02x00;",
+	n = sprintf(cmd, "T%02x20:%02x;21:%02x%02x;22:%02x%02x%02x00;thread:%x;",
 				signal, sreg,
 				avr->data[R_SPL], avr->data[R_SPH],
 				avr->pc & 0xff, (avr->pc >> 8) & 0xff,
-				(avr->pc >> 16) & 0xff);
+				(avr->pc >> 16) & 0xff, g->id);
 	if (reason) {
 		if (pp)
 			sprintf(cmd + n, "%s:%x;", reason, *pp);
+		else if (strchr(reason, ':'))
+			sprintf(cmd + n, "%s;", reason);
 		else
 			sprintf(cmd + n, "%s:;", reason);
 	}
-	gdb_send_reply(g, cmd);
+}
+
+/*
+ * Tell gdb the core stopped. In non-stop mode, that's a notification, and
+ * gdb asks for the stops with vStopped. In all-stop mode the first core to
+ * stop stops the others, and is the only one reported.
+ */
+static void
+gdb_send_stop_status(
+		avr_gdb_t  * g,
+		uint8_t     signal,
+		const char * reason,
+		uint32_t   * pp )
+{
+	avr_gdb_server_t * srv = g->server;
+	char cmd[128];
+
+	avr_cycle_timer_cancel(g->avr, gdb_cycles_timer, g);
+	if (g->rcmd) {
+		// all-stop "monitor cycles" run, gdb waits for the qRcmd reply
+		g->rcmd = 0;
+		snprintf(cmd, sizeof(cmd), "Stopped at pc 0x%04x, cycle %llu\n",
+				g->avr->pc, (unsigned long long)g->avr->cycle);
+		message(g, cmd);
+		gdb_send_reply(g, "OK");
+		return;
+	}
+	strcpy(cmd, "Stop:");
+	gdb_format_stop_status(g, cmd + 5, signal, reason, pp);
+
+	pthread_mutex_lock(&srv->lock);
+	if (srv->non_stop) {
+		avr_gdb_stop_t * st = malloc(sizeof(*st) + strlen(cmd + 5) + 1);
+		st->next = NULL;
+		strcpy(st->reply, cmd + 5);
+		// only the first one is notified, gdb asks for the others
+		if (!srv->stops)
+			gdb_frame(srv, '%', (uint8_t*)cmd, strlen(cmd), 0);
+		*srv->stops_tail = st;
+		srv->stops_tail = &st->next;
+	} else if (!srv->stopped) {
+		srv->stopped = 1;
+		srv->current = g->id;
+		gdb_frame(srv, '$', (uint8_t*)cmd + 5, strlen(cmd + 5), 0);
+		for (avr_gdb_t * o = srv->cores; o; o = o->next)
+			if (o != g)
+				gdb_queue_locked(o, GDB_EVENT_HALT, 0, NULL, 0);
+	}
+	pthread_mutex_unlock(&srv->lock);
 }
 
 static void
@@ -257,6 +562,45 @@ gdb_change_breakpoint(
 	return -1;
 }
 
+/*
+ * The cores are threads for gdb, so they share their break and
+ * watchpoints, and 'Z' and 'z' apply to all of them. In all-stop mode the
+ * other cores are stopped; in non-stop mode, they can only miss the point
+ * that is being changed, while it is.
+ * Returns -1 if 'g' can't have that point.
+ */
+static int
+gdb_change_points(
+		avr_gdb_t * g,
+		int set,
+		int kind,
+		uint32_t addr,
+		uint32_t size )
+{
+	avr_gdb_server_t * srv = g->server;
+	int res = -1;
+
+	pthread_mutex_lock(&srv->lock);
+	for (avr_gdb_t * c = srv->cores; c; c = c->next) {
+		int r = -1;
+		if (kind < 2) {
+			if (addr <= c->avr->flashend) {
+				r = gdb_change_breakpoint(&c->breakpoints, set, 1 << kind,
+						addr, size);
+				gdb_break_map_update(c);
+			}
+		} else if (addr <= c->avr->ramend) {
+			r = gdb_change_breakpoint(&c->watchpoints, set, 1 << kind,
+					addr, size);
+			gdb_watch_map_update(c);
+		}
+		if (c == g)
+			res = r;
+	}
+	pthread_mutex_unlock(&srv->lock);
+	return res;
+}
+
 static int
 gdb_write_register(
 		avr_gdb_t * g,
@@ -282,31 +626,35 @@ gdb_write_register(
 	return 1;
 }
 
+/*
+ * Store register 'regi' in 'dst', in target byte order, returns its size.
+ * The registers are hex encoded in one go by the caller.
+ */
 static int
 gdb_read_register(
 		avr_gdb_t * g,
 		int regi,
-		char * rep )
+		uint8_t * dst )
 {
 	switch (regi) {
 		case 0 ... 31:
-			sprintf(rep, "%02x", g->avr->data[regi]);
-			break;
-		case 32: {
-				uint8_t sreg;
-				READ_SREG_INTO(g->avr, sreg);
-				sprintf(rep, "%02x", sreg);
-			}
-			break;
+			dst[0] = g->avr->data[regi];
+			return 1;
+		case 32:
+			READ_SREG_INTO(g->avr, dst[0]);
+			return 1;
 		case 33:
-			sprintf(rep, "%02x%02x", g->avr->data[R_SPL], g->avr->data[R_SPH]);
-			break;
+			dst[0] = g->avr->data[R_SPL];
+			dst[1] = g->avr->data[R_SPH];
+			return 2;
 		case 34:
-			sprintf(rep, "%02x%02x%02x00",
-				g->avr->pc & 0xff, (g->avr->pc>>8)&0xff, (g->avr->pc>>16)&0xff);
-			break;
+			dst[0] = g->avr->pc;
+			dst[1] = g->avr->pc >> 8;
+			dst[2] = g->avr->pc >> 16;
+			dst[3] = 0;
+			return 4;
 	}
-	return strlen(rep);
+	return 0;
 }
 
 static int tohex(const char *in, char *out, unsigned int len)
@@ -363,6 +711,23 @@ handle_monitor(avr_t * avr, avr_gdb_t * g, char * cmd)
 		} else if (strncmp(ip, "halt", 4) == 0) {
 			avr->state = cpu_Stopped;
 			ip += 4;
+		} else if (strncmp(ip, "cycles", 6) == 0) {
+			unsigned long long count;
+			int n;
+
+			// Format is "cycles <count>", runs that many cycles and stops
+			ip += 6;
+			if (sscanf(ip, "%llu%n", &count, &n) != 1 || !count)
+				return 1;
+			ip += n;
+			g->range_start = g->range_end = 0;
+			avr_cycle_timer_register(avr, count, gdb_cycles_timer, g);
+			avr->state = cpu_Running;
+			if (!g->server->non_stop) {
+				// the reply is sent when the core stops
+				g->rcmd = 1;
+				return -1;
+			}
 		} else if (strncmp(ip, "ior", 3) == 0) {
 			unsigned int base;
 			int          n, m, count;
@@ -395,7 +760,7 @@ handle_monitor(avr_t * avr, avr_gdb_t * g, char * cmd)
 			ip += strlen(ip);
 		)
 		} else {
-			tohex("Monitor subcommands are: ior halt reset" DBG(" say") "\n",
+			tohex("Monitor subcommands are: cycles ior halt reset" DBG(" say") "\n",
 				  dehex, sizeof dehex);
 			gdb_send_reply(g, dehex);
 			return -1;
@@ -467,6 +832,7 @@ handle_v(avr_t * avr, avr_gdb_t * g, char * cmd, int length)
 
 		sscanf(cmd, "%*[^:]:%x,%x", &addr, &len);
 		if (addr < avr->flashend) {
+			avr_flash_unshare(avr);
 			src = avr->flash + addr;
 			if (addr + len > avr->flashend)
 				len = avr->flashend - addr;
@@ -488,6 +854,7 @@ handle_v(avr_t * avr, avr_gdb_t * g, char * cmd, int length)
 
 				end = cmd + length - 1; // Ignore final '#'.
 				cmd += len;
+				avr_flash_unshare(avr);
 				src = avr->flash + addr;
 				limit = avr->flash + avr->flashend;
 				for (escaped = 0; cmd < end && src < limit; ++cmd) {
@@ -529,6 +896,140 @@ handle_v(avr_t * avr, avr_gdb_t * g, char * cmd, int length)
 	}
 }
 
+/*
+ * Called for each data address restored by the undo log, flag
+ * the write watchpoints, as gdb expects us to stop on them
+ */
+static void
+gdb_reverse_watch(
+		avr_t * avr,
+		uint16_t addr,
+		void * param)
+{
+	avr_gdb_t * g = avr->gdb;
+	int * hit = param;
+
+	if (g->watch_map[addr] & AVR_GDB_WATCH_WRITE)
+		*hit = addr + 0x800000;
+}
+
+/*
+ * Run backward using the undo log, for one instruction, or until a
+ * breakpoint/watchpoint is hit, or until we run out of history.
+ */
+static void
+gdb_reverse(
+		avr_gdb_t * g,
+		int step )
+{
+	avr_t * avr = g->avr;
+	int hit = 0;
+
+	do {
+		if (!avr_undo_step(avr, gdb_reverse_watch, &hit)) {
+			avr->state = cpu_Stopped;
+			gdb_send_stop_status(g, 5, "replaylog:begin", NULL);
+			return;
+		}
+	} while (!step && !hit && !avr_gdb_break_at(g, avr->pc));
+
+	avr->state = cpu_Stopped;
+	if (hit) {
+		uint32_t false_addr = hit;
+		gdb_send_stop_status(g, 5, "watch", &false_addr);
+	} else if (!step)
+		gdb_send_stop_status(g, 5, "hwbreak", NULL);
+	else
+		gdb_send_quick_status(g, 5);
+}
+
+/*
+ * Find gdb address 'addr', returns NULL if it isn't in flash, SRAM or
+ * eeprom, otherwise 'size' is how many bytes there are from there.
+ */
+static uint8_t *
+gdb_memory(
+		avr_gdb_t * g,
+		uint32_t addr,
+		uint32_t * size )
+{
+	avr_t * avr = g->avr;
+
+	/* GDB seems to also use 0x1800000 for sram ?!?! */
+	addr &= 0xffffff;
+	if (addr < avr->flashend) {
+		*size = avr->flashend + 1 - addr;
+		return avr->flash + addr;
+	} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
+		*size = avr->ramend + 1 - (addr - 0x800000);
+		return avr->data + addr - 0x800000;
+	} else if (addr >= 0x810000 && (addr - 0x810000) <= avr->e2end) {
+		avr_eeprom_desc_t ee = {.offset = (addr - 0x810000)};
+		avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee);
+		if (ee.ee) {
+			*size = avr->e2end + 1 - ee.offset;
+			return ee.ee;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write 'len' bytes at gdb address 'addr', for the M and X packets.
+ * Returns -1 if the range isn't writable.
+ */
+static int
+gdb_write_memory(
+		avr_gdb_t * g,
+		uint32_t addr,
+		const uint8_t * src,
+		uint32_t len )
+{
+	avr_t * avr = g->avr;
+
+	addr &= 0xffffff;
+	if (!len)	// gdb probes for X support with an empty write
+		return 0;
+	if (addr < 0x800000) {
+		if (addr + len > avr->flashend + 1)
+			return -1;
+		avr_flash_unshare(avr);
+		memcpy(avr->flash + addr, src, len);
+	} else if (addr < 0x810000) {
+		addr -= 0x800000;
+		if (addr + len > avr->ramend + 1)
+			return -1;
+		memcpy(avr->data + addr, src, len);
+	} else {
+		avr_eeprom_desc_t ee = {
+			.offset = addr - 0x810000, .size = len, .ee = (uint8_t*)src };
+		if (avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Decode the '}' escaped binary data of an X packet, 'size' bytes from
+ * 'src' into at most 'len' bytes of 'dst'. Returns the decoded size.
+ */
+static uint32_t
+gdb_unescape(
+		const char * src,
+		uint32_t size,
+		uint8_t * dst,
+		uint32_t len )
+{
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < size && n < len; i++) {
+		if (src[i] == '}' && i + 1 < size)
+			dst[n++] = src[++i] ^ 0x20;
+		else
+			dst[n++] = src[i];
+	}
+	return n;
+}
+
 static void
 gdb_handle_command(
 		avr_gdb_t * g,
@@ -543,9 +1044,13 @@ gdb_handle_command(
 			if (strncmp(cmd, "Supported", 9) == 0) {
 				/* If GDB asked what features we support, report back
 				 * the features we support, which is just memory layout
-				 * information and stop reasons for now.
+				 * information, stop reasons and reverse execution for now.
 				 */
-				gdb_send_reply(g, "qXfer:memory-map:read+;swbreak+;hwbreak+");
+				snprintf(rep, sizeof(rep), "PacketSize=%x;"
+					"qXfer:memory-map:read+;qXfer:features:read+;"
+					"QNonStop+;swbreak+;hwbreak+%s", AVR_GDB_PACKET_SIZE, avr->undo ?
+					";ReverseStep+;ReverseContinue+" : "");
+				gdb_send_reply(g, rep);
 				break;
 			} else if (strncmp(cmd, "Attached", 8) == 0) {
 				/* Respond that we are attached to an existing process..
@@ -557,17 +1062,26 @@ gdb_handle_command(
 			// } else if (strncmp(cmd, "Offsets", 7) == 0) {
 			//	gdb_send_reply(g, "Text=0;Data=800000;Bss=800000");
 			//	break;
-			} else if (strncmp(cmd, "Xfer:memory-map:read", 20) == 0) {
-				snprintf(rep, sizeof(rep),
-						"l<memory-map>\n"
+			} else if (strncmp(cmd, "Xfer:memory-map:read::", 22) == 0) {
+				int len = snprintf(rep, sizeof(rep),
+						"<memory-map>\n"
 						" <memory type='ram' start='0x800000' length='%#x'/>\n"
 						" <memory type='flash' start='0' length='%#x'>\n"
 						"  <property name='blocksize'>0x80</property>\n"
 						" </memory>\n"
 						"</memory-map>",
 						g->avr->ramend + 1, g->avr->flashend + 1);
-
-				gdb_send_reply(g, rep);
+				gdb_send_xfer(g, rep, len, cmd + 22);
+				break;
+			} else if (strncmp(cmd, "Xfer:features:read:target.xml:", 30) == 0) {
+				/* Only the architecture, gdb knows the AVR registers */
+				static const char target[] =
+						"<?xml version=\"1.0\"?>\n"
+						"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+						"<target version=\"1.0\">\n"
+						" <architecture>avr</architecture>\n"
+						"</target>\n";
+				gdb_send_xfer(g, target, sizeof(target) - 1, cmd + 30);
 				break;
 			} else if (strncmp(cmd, "RegisterInfo", 12) == 0) {
 				// Send back the information we have on this register (if any).
@@ -614,26 +1128,40 @@ gdb_handle_command(
 			gdb_send_reply(g, "");
 			break;
 		case '?':
-			gdb_send_quick_status(g, 0);
+			// in non-stop mode, a running core has no stop to report
+			if (g->server->non_stop && avr->state != cpu_Stopped) {
+				gdb_send_reply(g, "OK");
+				break;
+			}
+			gdb_format_stop_status(g, rep, 0, NULL, NULL);
+			gdb_send_reply(g, rep);
 			break;
 		case 'G': {	// set all general purpose registers
-			// get their binary form
-			read_hex_string(cmd, (uint8_t*)rep, strlen(cmd));
-			uint8_t *src = (uint8_t*)rep;
+			// get their binary form, r0-r31, SREG, SP and PC
+			uint8_t regs[32 + 1 + 2 + 4];
+			if (strlen(cmd) != 2 * sizeof(regs) ||
+					read_hex_string(cmd, regs, sizeof(regs)) != sizeof(regs)) {
+				gdb_send_reply(g, "E01");
+				break;
+			}
+			uint8_t *src = regs;
 			for (int i = 0; i < 35; i++)
 				src += gdb_write_register(g, i, src);
 			gdb_send_reply(g, "OK");
 		}	break;
 		case 'g': {	// read all general purpose registers
-			char * dst = rep;
+			uint8_t regs[64];
+			int len = 0;
 			for (int i = 0; i < 35; i++)
-				dst += gdb_read_register(g, i, dst);
+				len += gdb_read_register(g, i, regs + len);
+			gdb_hex(rep, regs, len);
 			gdb_send_reply(g, rep);
 		}	break;
 		case 'p': {	// read register
 			unsigned int regi = 0;
+			uint8_t reg[4];
 			sscanf(cmd, "%x", &regi);
-			gdb_read_register(g, regi, rep);
+			gdb_hex(rep, reg, gdb_read_register(g, regi, reg));
 			gdb_send_reply(g, rep);
 		}	break;
 		case 'P': {	// write register
@@ -643,81 +1171,76 @@ gdb_handle_command(
 				break;
 			*val++ = 0;
 			sscanf(cmd, "%x", &regi);
-			read_hex_string(val, (uint8_t*)rep, strlen(val));
-			gdb_write_register(g, regi, (uint8_t*)rep);
+			// the widest register is the PC
+			uint8_t reg[4] = { 0 };
+			if (strlen(val) > 2 * sizeof(reg) ||
+					read_hex_string(val, reg, sizeof(reg)) <= 0) {
+				gdb_send_reply(g, "E01");
+				break;
+			}
+			gdb_write_register(g, regi, reg);
 			gdb_send_reply(g, "OK");
 		}	break;
 		case 'm': {	// read memory
 			avr_flashaddr_t addr;
-			uint32_t len;
+			uint32_t len, size = 0;
 			sscanf(cmd, "%x,%x", &addr, &len);
-			uint8_t * src = NULL;
+			uint8_t * src = gdb_memory(g, addr, &size);
 			/* GDB seems to also use 0x1800000 for sram ?!?! */
 			addr &= 0xffffff;
-			if (addr < avr->flashend) {
-				src = avr->flash + addr;
-			} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
-				src = avr->data + addr - 0x800000;
-			} else if (addr == (0x800000 + avr->ramend + 1) && len == 2) {
+			if (!src && addr == (0x800000 + avr->ramend + 1) && len == 2) {
 				// Allow GDB to read a value just after end of stack.
 				// This is necessary to make instruction stepping work when stack is empty
 				AVR_LOG(avr, LOG_TRACE,
 						"GDB: read just past end of stack %08x, %08x; returning zero\n", addr, len);
 				gdb_send_reply(g, "0000");
 				break;
-			} else if (addr >= 0x810000 && (addr - 0x810000) <= avr->e2end) {
-				avr_eeprom_desc_t ee = {.offset = (addr - 0x810000)};
-				avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee);
-				if (ee.ee)
-					src = ee.ee;
-				else {
-					gdb_send_reply(g, "E01");
-					break;
-				}
-			} else {
+			} else if (!src) {
 				AVR_LOG(avr, LOG_ERROR,
 						"GDB: read memory error %08x, %08x (ramend %04x)\n",
 						addr, len, avr->ramend+1);
 				gdb_send_reply(g, "E01");
 				break;
 			}
-			char * dst = rep;
-			while (len--) {
-				sprintf(dst, "%02x", *src++);
-				dst += 2;
-			}
-			*dst = 0;
-			gdb_send_reply(g, rep);
+			if (len > size)
+				len = size;
+			if (len > AVR_GDB_PACKET_SIZE / 2)
+				len = AVR_GDB_PACKET_SIZE / 2;
+			char * dst = len * 2 < sizeof(rep) ? rep : malloc(len * 2 + 1);
+			gdb_hex(dst, src, len);
+			gdb_send_packet(g, (uint8_t*)dst, len * 2, 0);
+			if (dst != rep)
+				free(dst);
 		}	break;
-		case 'M': {	// write memory
+		case 'M': 	// write memory, hex
+		case 'X': {	// write memory, binary
 			uint32_t addr, len;
 			sscanf(cmd, "%x,%x", &addr, &len);
-			char * start = strchr(cmd, ':');
-			if (!start) {
+			char * start = memchr(cmd, ':', length - 1);
+			if (!start || len > AVR_GDB_PACKET_SIZE) {
 				gdb_send_reply(g, "E01");
 				break;
 			}
-			if (addr < 0xffff) {
-				read_hex_string(start + 1, avr->flash + addr, strlen(start+1));
-				gdb_send_reply(g, "OK");
-			} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
-				read_hex_string(start + 1, avr->data + addr - 0x800000, strlen(start+1));
-				gdb_send_reply(g, "OK");
-			} else if (addr >= 0x810000 && (addr - 0x810000) <= avr->e2end) {
-				read_hex_string(start + 1, (uint8_t*)rep, strlen(start+1));
-				avr_eeprom_desc_t ee = {.offset = (addr - 0x810000), .size = len, .ee = (uint8_t*)rep };
-				avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
-				gdb_send_reply(g, "OK");
-			} else {
+			start++;
+			uint8_t * data = malloc(len + 1);
+			uint32_t got = command == 'M' ?
+					read_hex_string(start, data, len) :
+					gdb_unescape(start, cmd + length - 1 - start, data, len);
+			if (got != len || gdb_write_memory(g, addr, data, len)) {
 				AVR_LOG(avr, LOG_ERROR, "GDB: write memory error %08x, %08x\n", addr, len);
 				gdb_send_reply(g, "E01");
-			}
-		}	break;
-		case 'c': {	// continue
-			avr->state = cpu_Running;
+			} else
+				gdb_send_reply(g, "OK");
+			free(data);
 		}	break;
-		case 's': {	// step
-			avr->state = cpu_Step;
+		case 'b': {	// reverse step/continue
+			if (*cmd == 's' || *cmd == 'c') {
+				pthread_mutex_lock(&g->server->lock);
+				g->server->stopped = 0;
+				pthread_mutex_unlock(&g->server->lock);
+				gdb_reverse(g, *cmd == 's');
+			} else
+				gdb_send_reply(g, "");
 		}	break;
 		case 'r': {	// deprecated, suggested for AVRStudio compatibility
 			avr_reset(avr);
@@ -732,12 +1255,10 @@ gdb_handle_command(
 			switch (kind) {
 				case 0:	// software breakpoint
 				case 1:	// hardware breakpoint
-					if (addr > avr->flashend ||
-							gdb_change_breakpoint(&g->breakpoints, set, 1 << kind, addr, len) == -1) {
+					if (gdb_change_points(g, set, kind, addr, len) == -1) {
 						gdb_send_reply(g, "E01");
 						break;
 					}
-
 					gdb_send_reply(g, "OK");
 					break;
 				case 2: // write watchpoint
@@ -745,12 +1266,10 @@ gdb_handle_command(
 				case 4: // access watchpoint
 					/* Mask out the offset applied to SRAM addresses. */
 					addr &= ~0x800000;
-					if (addr > avr->ramend ||
-							gdb_change_breakpoint(&g->watchpoints, set, 1 << kind, addr, len) == -1) {
+					if (gdb_change_points(g, set, kind, addr, len) == -1) {
 						gdb_send_reply(g, "E01");
 						break;
 					}
-
 					gdb_send_reply(g, "OK");
 					break;
 				default:
@@ -763,14 +1282,12 @@ gdb_handle_command(
 			if (avr->state = cpu_Stopped)
 				avr->state = cpu_Running;
 			gdb_send_reply(g, "OK");
-			close(g->s);
-			g->s = -1;
+			pthread_mutex_lock(&g->server->lock);
+			close(g->server->s);
+			g->server->s = -1;
+			pthread_mutex_unlock(&g->server->lock);
 			break;
 #endif
-		case 'k': 	// kill
-			avr->state = cpu_Done;
-			gdb_send_reply(g, "OK");
-			break;
 		case 'v':
 			handle_v(avr, g, cmd, length);
 			break;
@@ -780,97 +1297,740 @@ gdb_handle_command(
 	}
 }
 
-static int
-gdb_network_handler(
-		avr_gdb_t * g,
-		uint32_t dosleep )
+// Called with the server lock held, returns NULL if there is no core 'id'
+static avr_gdb_t *
+gdb_server_core(
+		avr_gdb_server_t * srv,
+		int id )
 {
-	fd_set read_set;
-	int max;
-	FD_ZERO(&read_set);
-
-	if (g->s != -1) {
-		FD_SET(g->s, &read_set);
-		max = g->s + 1;
-	} else {
-		FD_SET(g->listen, &read_set);
-		max = g->listen + 1;
-	}
-	struct timeval timo = { dosleep / 1000000, dosleep % 1000000 };
-	int ret = select(max, &read_set, NULL, NULL, &timo);
+	for (avr_gdb_t * g = srv->cores; g; g = g->next)
+		if (g->id == id)
+			return g;
+	return NULL;
+}
 
-	if (ret == 0)
-		return 0;
+// The core the packets go to, called with the server lock held
+static avr_gdb_t *
+gdb_server_target(
+		avr_gdb_server_t * srv )
+{
+	avr_gdb_t * g = gdb_server_core(srv, srv->current);
+	return g ? g : srv->cores;
+}
 
-	if (FD_ISSET(g->listen, &read_set)) {
-		g->s = accept(g->listen, NULL, NULL);
+/*
+ * Network thread: each core takes the first vCont action that names it,
+ * or that names no thread, and gets it as a GDB_EVENT_RESUME.
+ */
+static void
+gdb_server_vcont(
+		avr_gdb_server_t * srv,
+		char * cmd )
+{
+	struct {
+		char * action;
+		int thread;
+	} act[16];
+	int count = 0, resume = 0;
 
-		if (g->s == -1) {
-			perror("gdb_network_handler accept");
-			sleep(5);
-			return 1;
+	if (*cmd == '?') {
+		gdb_server_reply(srv, "vCont;c;C;s;S;t;r");
+		return;
+	}
+	if (*cmd != ';') {
+		gdb_server_reply(srv, "");
+		return;
+	}
+	while (cmd && count < 16) {
+		char * a = cmd + 1;
+		cmd = strchr(a, ';');
+		if (cmd)
+			*cmd = 0;
+		char * colon = strchr(a, ':');
+		act[count].thread = -1;
+		if (colon) {
+			*colon = 0;
+			act[count].thread = strtol(colon + 1, NULL, 16);
 		}
-		int i = 1;
-		setsockopt (g->s, IPPROTO_TCP, TCP_NODELAY, &i, sizeof (i));
-		g->avr->state = cpu_Stopped;
-		DBG(printf("%s connection opened\n", __FUNCTION__);)
+		act[count++].action = a;
+		if (*a != 't')
+			resume = 1;
 	}
+	pthread_mutex_lock(&srv->lock);
+	for (avr_gdb_t * g = srv->cores; g; g = g->next)
+		for (int i = 0; i < count; i++)
+			if (act[i].thread <= 0 || act[i].thread == g->id) {
+				gdb_queue_locked(g, GDB_EVENT_RESUME, 0, act[i].action,
+						strlen(act[i].action));
+				break;
+			}
+	if (resume)
+		srv->stopped = 0;
+	if (srv->non_stop)
+		gdb_frame(srv, '$', (uint8_t*)"OK", 2, 0);
+	pthread_mutex_unlock(&srv->lock);
+}
 
-	if (g->s != -1 && FD_ISSET(g->s, &read_set)) {
-		uint8_t buffer[1024];
+static void
+gdb_server_clear_stops(
+		avr_gdb_server_t * srv )
+{
+	while (srv->stops) {
+		avr_gdb_stop_t * st = srv->stops;
+		srv->stops = st->next;
+		free(st);
+	}
+	srv->stops_tail = &srv->stops;
+}
 
-		ssize_t r = recv(g->s, buffer, sizeof(buffer)-1, 0);
+/*
+ * Network thread: handle the packets that are about the server, or all
+ * the cores. Returns zero if 'cmd' is for the current core.
+ */
+static int
+gdb_server_packet(
+		avr_gdb_server_t * srv,
+		char * cmd )
+{
+	char rep[256];
 
-		if (r == 0) {
-			DBG(printf("%s connection closed\n", __FUNCTION__);)
-			close(g->s);
-			gdb_watch_clear(&g->breakpoints);
-			gdb_watch_clear(&g->watchpoints);
-			g->avr->state = cpu_Running;	// resume
-			g->s = -1;
+	switch (*cmd) {
+		case 'c':	// continue, all the cores
+			strcpy(rep, ";c");
+			gdb_server_vcont(srv, rep);
+			return 1;
+		case 's': {	// step the "Hc" core, or the current one
+			pthread_mutex_lock(&srv->lock);
+			int id = srv->cont > 0 ? srv->cont : gdb_server_target(srv)->id;
+			pthread_mutex_unlock(&srv->lock);
+			sprintf(rep, ";s:%x", id);
+			gdb_server_vcont(srv, rep);
+			return 1;
+		}
+		case 'v':
+			if (strncmp(cmd, "vCont", 5) == 0) {
+				gdb_server_vcont(srv, cmd + 5);
+				return 1;
+			} else if (strcmp(cmd, "vStopped") == 0) {
+				// the first stop was acknowledged, send the next one
+				pthread_mutex_lock(&srv->lock);
+				avr_gdb_stop_t * st = srv->stops;
+				if (st) {
+					srv->stops = st->next;
+					if (!srv->stops)
+						srv->stops_tail = &srv->stops;
+					free(st);
+				}
+				const char * r = srv->stops ? srv->stops->reply : "OK";
+				gdb_frame(srv, '$', (uint8_t*)r, strlen(r), 0);
+				pthread_mutex_unlock(&srv->lock);
+				return 1;
+			} else if (strcmp(cmd, "vCtrlC") == 0) {
+				pthread_mutex_lock(&srv->lock);
+				gdb_frame(srv, '$', (uint8_t*)"OK", 2, 0);
+				gdb_queue_locked(gdb_server_target(srv),
+						GDB_EVENT_INTERRUPT, 0, NULL, 0);
+				pthread_mutex_unlock(&srv->lock);
+				return 1;
+			}
+			return 0;
+		case 'H': {	// select the core for the next packets (g), or steps (c)
+			int id = strtol(cmd + 2, NULL, 16);
+			pthread_mutex_lock(&srv->lock);
+			if (id > 0 && !gdb_server_core(srv, id))
+				strcpy(rep, "E01");
+			else {
+				if (cmd[1] == 'g') {
+					if (id > 0)
+						srv->current = id;
+				} else
+					srv->cont = id > 0 ? id : 0;
+				strcpy(rep, "OK");
+			}
+			gdb_frame(srv, '$', (uint8_t*)rep, strlen(rep), 0);
+			pthread_mutex_unlock(&srv->lock);
 			return 1;
 		}
-		if (r == -1) {
-			perror("gdb_network_handler recv");
-			sleep(1);
+		case 'T': {	// is that thread alive?
+			pthread_mutex_lock(&srv->lock);
+			strcpy(rep, gdb_server_core(srv, strtol(cmd + 1, NULL, 16)) ?
+					"OK" : "E01");
+			gdb_frame(srv, '$', (uint8_t*)rep, strlen(rep), 0);
+			pthread_mutex_unlock(&srv->lock);
 			return 1;
 		}
-		buffer[r] = 0;
+		case 'k': 	// kill
+			gdb_queue_all(srv, GDB_EVENT_KILL, NULL, 0);
+			gdb_server_reply(srv, "OK");
+			return 1;
+		case 'Q':
+			if (strncmp(cmd, "QNonStop:", 9) == 0) {
+				pthread_mutex_lock(&srv->lock);
+				srv->non_stop = cmd[9] == '1';
+				srv->stopped = 1;
+				gdb_server_clear_stops(srv);
+				gdb_frame(srv, '$', (uint8_t*)"OK", 2, 0);
+				pthread_mutex_unlock(&srv->lock);
+				return 1;
+			}
+			return 0;
+		case 'q':
+			pthread_mutex_lock(&srv->lock);
+			rep[0] = 0;
+			if (strcmp(cmd, "qfThreadInfo") == 0) {
+				int n = sprintf(rep, "m");
+				for (avr_gdb_t * g = srv->cores; g && n < sizeof(rep) - 10;
+						g = g->next)
+					n += sprintf(rep + n, "%s%x", n > 1 ? "," : "", g->id);
+			} else if (strcmp(cmd, "qsThreadInfo") == 0) {
+				strcpy(rep, "l");
+			} else if (strcmp(cmd, "qC") == 0) {
+				sprintf(rep, "QC%x", gdb_server_target(srv)->id);
+			} else if (strncmp(cmd, "qThreadExtraInfo,", 17) == 0) {
+				avr_gdb_t * g = gdb_server_core(srv,
+						strtol(cmd + 17, NULL, 16));
+				if (g)
+					tohex(g->avr->mmcu, rep, sizeof(rep));
+				else
+					strcpy(rep, "E01");
+			}
+			if (rep[0])
+				gdb_frame(srv, '$', (uint8_t*)rep, strlen(rep), 0);
+			pthread_mutex_unlock(&srv->lock);
+			return rep[0] != 0;
+	}
+	return 0;
+}
+
+/*
+ * Network thread: handle all the complete packets of the input buffer,
+ * keep the start of the next one for when the rest of it arrives.
+ */
+static void
+gdb_handle_input(
+		avr_gdb_server_t * srv )
+{
+	uint8_t * src = srv->in.b;
+	uint8_t * end = srv->in.b + srv->in.len;
 
-		uint8_t * src = buffer;
-		while (*src == '+' || *src == '-')
+	while (src < end) {
+		if (*src == '+' || *src == '-') {
 			src++;
-		DBG(
-			if (!strncmp("$vFlashWrite", (char *)src, 12)) {
-				printf("%s: received Flashwrite command %ld bytes\n",
-					   __FUNCTION__, r);
-			} else {
-				printf("%s: received command %ld bytes\n'%s'\n",
-					   __FUNCTION__, r, buffer);
-			})
-		// hdump("gdb", buffer, r);
-		// control C -- lets send the guy a nice status packet
-		if (*src == 3) {
+		} else if (*src == 3) {
+			// control C -- the core will send the guy a nice status packet
 			src++;
-			gdb_send_quick_status(g, 2); // SIGINT
-			g->avr->state = cpu_Stopped;
-			printf("GDB hit control-c\n");
+			pthread_mutex_lock(&srv->lock);
+			gdb_queue_locked(gdb_server_target(srv),
+					GDB_EVENT_INTERRUPT, 0, NULL, 0);
+			pthread_mutex_unlock(&srv->lock);
 		} else if (*src == '$') {
-			// strip checksum
-			uint8_t * end = buffer + r - 1;
-			while (end > src && *end != '#')
-				*end-- = 0;
-			*end = 0;
-			src++;
-			DBG(
-				if (strncmp("vFlashWrite", (char *)src, 11))
-					printf("GDB command = '%s'\n", src);)
-			send(g->s, "+", 1, 0);
-			if (end > src)
-				gdb_handle_command(g, (char*)src, end - src);
+			uint8_t * hash = memchr(src, '#', end - src);
+			if (!hash || end - hash < 3)
+				break;	// incomplete, wait for more
+			*hash = 0;
+			pthread_mutex_lock(&srv->lock);
+			*gdb_buffer_reserve(&srv->out, 1) = '+';
+			srv->out.len++;
+			gdb_flush(srv->s, &srv->out);
+			pthread_mutex_unlock(&srv->lock);
+			if (hash > src + 1 && !gdb_server_packet(srv, (char*)src + 1)) {
+				pthread_mutex_lock(&srv->lock);
+				gdb_queue_locked(gdb_server_target(srv), GDB_EVENT_PACKET, 0,
+						src + 1, hash - src - 1);
+				pthread_mutex_unlock(&srv->lock);
+			}
+			src = hash + 3;
+		} else
+			src++;	// line noise
+	}
+	srv->in.len = end - src;
+	// a runaway packet would grow the buffer forever
+	if (srv->in.len > 2 * AVR_GDB_PACKET_SIZE)
+		srv->in.len = 0;
+	memmove(srv->in.b, src, srv->in.len);
+}
+
+/*
+ * JSON monitor. Each request is a single line JSON object, and so is each
+ * reply, or {"error":"..."}:
+ *	{"cmd":"cores"}					the ids and mmcu of the cores
+ *	{"cmd":"state","core":<id>}		state, pc, sp and cycle
+ *	{"cmd":"perf","core":<id>}		the totals of the performance counters
+ *	{"cmd":"read","core":<id>,"addr":<addr>,"len":<len>}
+ *		'len' bytes (up to AVR_GDB_MONITOR_READ) at gdb address 'addr':
+ *		flash from 0, SRAM from 0x800000, eeprom from 0x810000, hex
+ *		encoded in "data". Numbers can also be "0x" strings.
+ * "core" defaults to the first core, and an "id" in the request is copied
+ * into its reply. The requests are handled by their core between two
+ * instructions, they don't stop it.
+ */
+#define AVR_GDB_MONITOR_READ	1024
+
+// Returns what follows "key": in a JSON object, or NULL
+static const char *
+gdb_json_find(
+		const char * line,
+		const char * key )
+{
+	size_t len = strlen(key);
+	for (const char * p = strchr(line, '"'); p; p = strchr(p + 1, '"')) {
+		if (strncmp(p + 1, key, len) || p[len + 1] != '"')
+			continue;
+		p += len + 2;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p != ':')
+			continue;
+		p++;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		return p;
+	}
+	return NULL;
+}
+
+static int
+gdb_json_uint(
+		const char * line,
+		const char * key,
+		uint32_t * value )
+{
+	const char * p = gdb_json_find(line, key);
+	if (!p)
+		return -1;
+	if (*p == '"')
+		p++;
+	char * end;
+	*value = strtoul(p, &end, 0);
+	return end == p ? -1 : 0;
+}
+
+static int
+gdb_json_str(
+		const char * line,
+		const char * key,
+		char * dst,
+		int size )
+{
+	const char * p = gdb_json_find(line, key);
+	if (!p || *p++ != '"')
+		return -1;
+	int n = 0;
+	while (*p && *p != '"' && n < size - 1)
+		dst[n++] = *p++;
+	dst[n] = 0;
+	return 0;
+}
+
+// Start a reply to 'line' in 'rep', with its "id"
+static int
+gdb_monitor_head(
+		const char * line,
+		char * rep )
+{
+	uint32_t id;
+	if (gdb_json_uint(line, "id", &id) == 0)
+		return sprintf(rep, "{\"id\":%u,", id);
+	return sprintf(rep, "{");
+}
+
+// Queue a reply line for monitor 'client', called with the server lock held
+static void
+gdb_monitor_reply_locked(
+		avr_gdb_server_t * srv,
+		uint32_t client,
+		const char * rep )
+{
+	for (avr_gdb_monitor_t * m = srv->monitors; m; m = m->next) {
+		if (m->id != client)
+			continue;
+		uint32_t len = strlen(rep);
+		uint8_t * dst = gdb_buffer_reserve(&m->out, len + 1);
+		memcpy(dst, rep, len);
+		dst[len] = '\n';
+		m->out.len += len + 1;
+		gdb_flush(m->s, &m->out);
+		break;
+	}
+}
+
+static void
+gdb_monitor_reply(
+		avr_gdb_server_t * srv,
+		uint32_t client,
+		const char * rep )
+{
+	pthread_mutex_lock(&srv->lock);
+	gdb_monitor_reply_locked(srv, client, rep);
+	pthread_mutex_unlock(&srv->lock);
+}
+
+static const char * gdb_cpu_state[] = {
+	[cpu_Limbo] = "limbo", [cpu_Stopped] = "stopped",
+	[cpu_Running] = "running", [cpu_Sleeping] = "sleeping",
+	[cpu_Step] = "step", [cpu_StepDone] = "stepdone",
+	[cpu_Done] = "done", [cpu_Crashed] = "crashed",
+};
+
+// Simulation thread: a monitor request for core 'g'
+static void
+gdb_monitor_request(
+		avr_gdb_t * g,
+		uint32_t client,
+		const char * line )
+{
+	avr_t * avr = g->avr;
+	char rep[64 + 2 * AVR_GDB_MONITOR_READ];
+	char cmd[16] = "";
+	int n = gdb_monitor_head(line, rep);
+
+	gdb_json_str(line, "cmd", cmd, sizeof(cmd));
+	if (!strcmp(cmd, "state")) {
+		sprintf(rep + n, "\"core\":%d,\"state\":\"%s\",\"pc\":%u,\"sp\":%u,"
+				"\"cycle\":%llu}", g->id, avr->state <= cpu_Crashed ?
+				gdb_cpu_state[avr->state] : "?", avr->pc,
+				avr->data[R_SPL] | (avr->data[R_SPH] << 8),
+				(unsigned long long)avr->cycle);
+	} else if (!strcmp(cmd, "perf")) {
+		avr_perf_t * p = malloc(sizeof(*p));
+		avr_perf_ioctl(avr, AVR_IOCTL_PERF_GET, p);
+		sprintf(rep + n, "\"core\":%d,\"instructions\":%llu,\"cycles\":%llu,"
+				"\"sleep_cycles\":%llu,\"irq_raised\":%llu}", g->id,
+				(unsigned long long)p->instructions,
+				(unsigned long long)p->cycles,
+				(unsigned long long)p->sleep_cycles,
+				(unsigned long long)p->irq_raised);
+		free(p);
+	} else if (!strcmp(cmd, "read")) {
+		uint32_t addr, len, size;
+		uint8_t * src = NULL;
+		if (gdb_json_uint(line, "addr", &addr) == 0 &&
+				gdb_json_uint(line, "len", &len) == 0)
+			src = gdb_memory(g, addr, &size);
+		if (src) {
+			if (len > size)
+				len = size;
+			if (len > AVR_GDB_MONITOR_READ)
+				len = AVR_GDB_MONITOR_READ;
+			n += sprintf(rep + n, "\"core\":%d,\"addr\":%u,\"data\":\"",
+					g->id, addr);
+			n = gdb_hex(rep + n, src, len) - rep;
+			strcpy(rep + n, "\"}");
+		} else
+			strcpy(rep + n, "\"error\":\"bad address\"}");
+	} else
+		strcpy(rep + n, "\"error\":\"unknown cmd\"}");
+	gdb_monitor_reply(g->server, client, rep);
+}
+
+/*
+ * Network thread: route the complete lines of a monitor client to their
+ * core, or answer them if they're about the server.
+ */
+static void
+gdb_monitor_input(
+		avr_gdb_server_t * srv,
+		avr_gdb_monitor_t * m )
+{
+	char * src = (char*)m->in.b;
+	char * end = src + m->in.len;
+	char rep[256];
+
+	for (char * eol; src < end && (eol = memchr(src, '\n', end - src));
+			src = eol + 1) {
+		*eol = 0;
+		if (eol == src || (eol == src + 1 && *src == '\r'))
+			continue;
+		char cmd[16] = "";
+		uint32_t id = 0;
+		int n = gdb_monitor_head(src, rep);
+		gdb_json_str(src, "cmd", cmd, sizeof(cmd));
+		gdb_json_uint(src, "core", &id);
+
+		pthread_mutex_lock(&srv->lock);
+		if (!strcmp(cmd, "cores")) {
+			n += sprintf(rep + n, "\"cores\":[");
+			for (avr_gdb_t * g = srv->cores; g && n < sizeof(rep) - 48;
+					g = g->next)
+				n += sprintf(rep + n, "%s{\"id\":%d,\"mmcu\":\"%s\"}",
+						g == srv->cores ? "" : ",", g->id, g->avr->mmcu);
+			strcpy(rep + n, "]}");
+			gdb_monitor_reply_locked(srv, m->id, rep);
+		} else {
+			avr_gdb_t * g = id ? gdb_server_core(srv, id) : srv->cores;
+			if (g)
+				gdb_queue_locked(g, GDB_EVENT_MONITOR, m->id, src, eol - src);
+			else {
+				strcpy(rep + n, "\"error\":\"no such core\"}");
+				gdb_monitor_reply_locked(srv, m->id, rep);
+			}
 		}
+		pthread_mutex_unlock(&srv->lock);
 	}
-	return 1;
+	m->in.len = end - src;
+	if (m->in.len > AVR_GDB_PACKET_SIZE)
+		m->in.len = 0;
+	memmove(m->in.b, src, m->in.len);
+}
+
+static int
+gdb_accept(
+		int listen )
+{
+	int s = accept(listen, NULL, NULL);
+	if (s == -1) {
+		perror("gdb_network_thread accept");
+		sleep(1);
+		return -1;
+	}
+	int i = 1;
+	setsockopt (s, IPPROTO_TCP, TCP_NODELAY, &i, sizeof (i));
+	network_set_nonblocking(s);
+	return s;
+}
+
+#define GDB_FD_SET(_fd, _set) { FD_SET(_fd, _set); if (_fd >= max) max = _fd + 1; }
+
+static void *
+gdb_network_thread(
+		void * param )
+{
+	avr_gdb_server_t * srv = param;
+
+	for (;;) {
+		fd_set read_set, write_set;
+		int max = 0;
+		FD_ZERO(&read_set);
+		FD_ZERO(&write_set);
+
+		pthread_mutex_lock(&srv->lock);
+		if (srv->stop) {
+			pthread_mutex_unlock(&srv->lock);
+			break;
+		}
+		int s = srv->s, ls = srv->listen;
+		if (s != -1) {
+			GDB_FD_SET(s, &read_set);
+			if (srv->out.len)
+				GDB_FD_SET(s, &write_set);
+		} else if (ls != -1)
+			GDB_FD_SET(ls, &read_set);
+		if (srv->monitor_listen != -1)
+			GDB_FD_SET(srv->monitor_listen, &read_set);
+		for (avr_gdb_monitor_t * m = srv->monitors; m; m = m->next) {
+			GDB_FD_SET(m->s, &read_set);
+			if (m->out.len)
+				GDB_FD_SET(m->s, &write_set);
+		}
+		pthread_mutex_unlock(&srv->lock);
+
+		struct timeval timo = { 0, AVR_GDB_THREAD_POLL_MS * 1000 };
+		if (select(max, &read_set, &write_set, NULL, &timo) <= 0)
+			continue;
+
+		if (s == -1 && ls != -1 && FD_ISSET(ls, &read_set)) {
+			s = gdb_accept(ls);
+			if (s != -1) {
+				srv->in.len = 0;
+				pthread_mutex_lock(&srv->lock);
+				srv->out.len = 0;
+				srv->s = s;
+				srv->non_stop = 0;
+				srv->stopped = 1;
+				srv->current = srv->cores ? srv->cores->id : 0;
+				srv->cont = 0;
+				gdb_server_clear_stops(srv);
+				pthread_mutex_unlock(&srv->lock);
+				gdb_queue_all(srv, GDB_EVENT_CONNECT, NULL, 0);
+			}
+		} else if (s != -1) {
+			if (FD_ISSET(s, &write_set)) {
+				pthread_mutex_lock(&srv->lock);
+				gdb_flush(srv->s, &srv->out);
+				pthread_mutex_unlock(&srv->lock);
+			}
+			if (FD_ISSET(s, &read_set)) {
+				uint8_t * dst = gdb_buffer_reserve(&srv->in, 4096);
+				ssize_t r = recv(s, dst, srv->in.size - srv->in.len, 0);
+
+				if (r > 0) {
+					DBG(printf("%s: received %ld bytes\n", __FUNCTION__, (long)r);)
+					srv->in.len += r;
+					gdb_handle_input(srv);
+				} else if (r == 0 || !network_would_block()) {
+					if (r == -1)
+						perror("gdb_network_thread recv");
+					pthread_mutex_lock(&srv->lock);
+					close(s);
+					srv->s = -1;
+					srv->out.len = 0;
+					pthread_mutex_unlock(&srv->lock);
+					srv->in.len = 0;
+					gdb_queue_all(srv, GDB_EVENT_DISCONNECT, NULL, 0);
+				}
+			}
+		}
+
+		if (srv->monitor_listen != -1 &&
+				FD_ISSET(srv->monitor_listen, &read_set)) {
+			int ms = gdb_accept(srv->monitor_listen);
+			if (ms != -1) {
+				avr_gdb_monitor_t * m = calloc(1, sizeof(*m));
+				m->s = ms;
+				m->id = ++srv->monitor_id;
+				pthread_mutex_lock(&srv->lock);
+				m->next = srv->monitors;
+				srv->monitors = m;
+				pthread_mutex_unlock(&srv->lock);
+			}
+		}
+		// only this thread changes the list, it can walk it unlocked
+		for (avr_gdb_monitor_t * m = srv->monitors, * next; m; m = next) {
+			next = m->next;
+			if (FD_ISSET(m->s, &write_set)) {
+				pthread_mutex_lock(&srv->lock);
+				gdb_flush(m->s, &m->out);
+				pthread_mutex_unlock(&srv->lock);
+			}
+			if (!FD_ISSET(m->s, &read_set))
+				continue;
+			uint8_t * dst = gdb_buffer_reserve(&m->in, 1024);
+			ssize_t r = recv(m->s, dst, m->in.size - m->in.len, 0);
+			if (r > 0) {
+				m->in.len += r;
+				gdb_monitor_input(srv, m);
+			} else if (r == 0 || !network_would_block()) {
+				pthread_mutex_lock(&srv->lock);
+				avr_gdb_monitor_t ** l = &srv->monitors;
+				while (*l != m)
+					l = &(*l)->next;
+				*l = m->next;
+				pthread_mutex_unlock(&srv->lock);
+				close(m->s);
+				free(m->in.b);
+				free(m->out.b);
+				free(m);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Simulation thread: handle the queued events, waiting up to 'usec' for
+ * one to arrive. Returns non zero if there was any.
+ */
+static int
+gdb_handle_events(
+		avr_gdb_t * g,
+		uint32_t usec )
+{
+	avr_t * avr = g->avr;
+	avr_gdb_server_t * srv = g->server;
+
+	if (!usec && !avr_gdb_pending(g))
+		return 0;
+	pthread_mutex_lock(&srv->lock);
+	/*
+	 * A stopped core waits for its events, unless this thread also runs
+	 * another core that is not stopped, that wait would stall it
+	 */
+	g->thread = pthread_self();
+	for (avr_gdb_t * o = srv->cores; o && usec && !g->event; o = o->next)
+		if (o != g && pthread_equal(o->thread, g->thread) &&
+				o->avr->state != cpu_Stopped)
+			usec = 0;
+	if (!g->event && usec) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += usec / 1000000;
+		ts.tv_nsec += (usec % 1000000) * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&g->wakeup, &srv->lock, &ts);
+	}
+	avr_gdb_event_t * e = g->event;
+	g->event = NULL;
+	g->event_tail = &g->event;
+	__atomic_store_n(&g->pending, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&srv->lock);
+
+	int handled = e != NULL;
+	while (e) {
+		avr_gdb_event_t * next = e->next;
+		switch (e->kind) {
+			case GDB_EVENT_CONNECT:
+				DBG(printf("%s connection opened\n", __FUNCTION__);)
+				g->rcmd = 0;
+				avr->state = cpu_Stopped;
+				break;
+			case GDB_EVENT_PACKET:
+				DBG(
+					if (strncmp("vFlashWrite", e->data, 11))
+						printf("GDB command = '%s'\n", e->data);)
+				gdb_handle_command(g, e->data, e->len);
+				break;
+			case GDB_EVENT_INTERRUPT:
+				avr->state = cpu_Stopped;
+				gdb_send_quick_status(g, 2); // SIGINT
+				printf("GDB hit control-c\n");
+				break;
+			case GDB_EVENT_DISCONNECT:
+				DBG(printf("%s connection closed\n", __FUNCTION__);)
+				gdb_watch_clear(&g->breakpoints);
+				gdb_watch_clear(&g->watchpoints);
+				gdb_break_map_update(g);
+				gdb_watch_map_update(g);
+				avr_cycle_timer_cancel(avr, gdb_cycles_timer, g);
+				g->rcmd = 0;
+				g->range_start = g->range_end = 0;
+				avr->state = cpu_Running;	// resume
+				break;
+			case GDB_EVENT_RESUME: {
+				uint32_t start, end;
+				if (avr->state == cpu_Done)
+					break;
+				g->range_start = g->range_end = 0;
+				switch (e->data[0]) {
+					case 'c':
+					case 'C':
+						avr->state = cpu_Running;
+						break;
+					case 'r':	// step while the pc is in [start, end)
+						if (sscanf(e->data + 1, "%x,%x", &start, &end) == 2) {
+							g->range_start = start;
+							g->range_end = end;
+						}
+						// fall through
+					case 's':
+					case 'S':
+						avr->state = cpu_Step;
+						break;
+					case 't':	// non-stop mode only, stop and report signal 0
+						if (avr->state == cpu_Stopped)
+							gdb_send_quick_status(g, 0);
+						else
+							avr->state = cpu_StepDone;
+						break;
+				}
+			}	break;
+			case GDB_EVENT_HALT:
+				if (avr->state != cpu_Done && avr->state != cpu_Crashed)
+					avr->state = cpu_Stopped;
+				break;
+			case GDB_EVENT_KILL:
+				avr->state = cpu_Done;
+				break;
+			case GDB_EVENT_MONITOR:
+				gdb_monitor_request(g, e->client, e->data);
+				break;
+		}
+		free(e);
+		e = next;
+	}
+	return handled;
 }
 
 /* Called on a hardware break instruction. */
@@ -896,14 +2056,8 @@ avr_gdb_handle_watchpoints(
 	avr_gdb_t *g = avr->gdb;
     uint32_t   false_addr;
 
-	int i = gdb_watch_find_range(&g->watchpoints, addr);
-	if (i == -1) {
-		return;
-	}
-
-	int kind = g->watchpoints.points[i].kind;
-	DBG(printf("Addr %04x found watchpoint %d size %d type %x wanted %x\n",
-			   addr, i, g->watchpoints.points[i].size, kind, type);)
+	int kind = g->watch_map[addr];
+	DBG(printf("Addr %04x watched %x wanted %x\n", addr, kind, type);)
 	if (kind & type) {
 		/* Send gdb reply (see GDB user manual appendix E.3). */
 
@@ -926,91 +2080,270 @@ avr_gdb_processor(
 		return 0;
 	avr_gdb_t * g = avr->gdb;
 
-	if (avr->state == cpu_Running &&
-			gdb_watch_find(&g->breakpoints, avr->pc) != -1) {
+	if (avr->state == cpu_Running && avr_gdb_break_at(g, avr->pc)) {
 		DBG(printf("avr_gdb_processor hit breakpoint at %08x\n", avr->pc);)
 		gdb_send_stop_status(g, 5, "hwbreak", NULL);
 		avr->state = cpu_Stopped;
 	} else if (avr->state == cpu_StepDone) {
-		gdb_send_quick_status(g, 0);
-		avr->state = cpu_Stopped;
+		if (avr->pc >= g->range_start && avr->pc < g->range_end &&
+				!avr_gdb_break_at(g, avr->pc)) {
+			avr->state = cpu_Step;	// range stepping, carry on
+		} else {
+			g->range_start = g->range_end = 0;
+			gdb_send_quick_status(g, 0);
+			avr->state = cpu_Stopped;
+		}
 	}
 	// this also sleeps for a bit
-	return gdb_network_handler(g, sleep);
+	return gdb_handle_events(g, sleep);
 }
 
 
-int
-avr_gdb_init(
-		avr_t * avr )
+// Returns a listening socket on 'port', or -1
+static int
+gdb_listen(
+		avr_t * avr,
+		int port,
+		int backlog )
 {
-	if (avr->gdb)
-		return 0; // GDB server already is active
-
-	avr_gdb_t * g = malloc(sizeof(avr_gdb_t));
-	memset(g, 0, sizeof(avr_gdb_t));
-
-	avr->gdb = NULL;
-
-	if ( network_init() ) {
-		AVR_LOG(avr, LOG_ERROR, "GDB: Can't initialize network");
-		goto error;
-	}
-
-	if ((g->listen = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+	int s = socket(PF_INET, SOCK_STREAM, 0);
+	if (s < 0) {
 		AVR_LOG(avr, LOG_ERROR, "GDB: Can't create socket: %s", strerror(errno));
-		goto error;
+		return -1;
 	}
 
 	int optval = 1;
-	setsockopt(g->listen, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 
 	struct sockaddr_in address = { 0 };
 	address.sin_family = AF_INET;
-	address.sin_port = htons (avr->gdb_port);
+	address.sin_port = htons (port);
 
-	if (bind(g->listen, (struct sockaddr *) &address, sizeof(address))) {
+	if (bind(s, (struct sockaddr *) &address, sizeof(address))) {
 		AVR_LOG(avr, LOG_ERROR, "GDB: Can not bind socket: %s", strerror(errno));
-		goto error;
+		close(s);
+		return -1;
 	}
-	if (listen(g->listen, 1)) {
+	if (listen(s, backlog)) {
 		perror("listen");
-		goto error;
+		close(s);
+		return -1;
 	}
-	printf("avr_gdb_init listening on port %d\n", avr->gdb_port);
+	return s;
+}
+
+// Add 'avr' to the cores of 'srv'
+static void
+gdb_add_core(
+		avr_t * avr,
+		avr_gdb_server_t * srv )
+{
+	avr_gdb_t * g = calloc(1, sizeof(avr_gdb_t));
+
 	g->avr = avr;
-	g->s = -1;
+	g->server = srv;
+	g->break_map = calloc(1, (avr->flashend >> 4) + 1);
+	g->watch_map = calloc(1, avr->ramend + 1);
+	g->event_tail = &g->event;
+	g->thread = pthread_self();
+	pthread_cond_init(&g->wakeup, NULL);
+
+	pthread_mutex_lock(&srv->lock);
+	g->id = ++srv->core_id;
+	// reverse execution is a gdb thing, the monitor doesn't need it
+	int undo = srv->listen != -1;
+	avr_gdb_t ** l = &srv->cores;
+	while (*l)
+		l = &(*l)->next;
+	*l = g;
+	// a new core stops, as the others did, when a gdb is connected
+	if (srv->s != -1)
+		gdb_queue_locked(g, GDB_EVENT_CONNECT, 0, NULL, 0);
+	pthread_mutex_unlock(&srv->lock);
+
 	avr->gdb = g;
 	// change default run behaviour to use the slightly slower versions
 	avr->run = avr_callback_run_gdb;
 	avr->sleep = avr_callback_sleep_gdb;
+	// record history, for reverse execution
+	if (undo)
+		avr_undo_init(avr, AVR_UNDO_DEFAULT_SIZE);
+}
 
+// Start listening for gdb on a server that only had the monitor port
+static int
+gdb_server_listen_gdb(
+		avr_t * avr,
+		avr_gdb_server_t * srv )
+{
+	if (srv->listen != -1)
+		return 0;
+	int s = gdb_listen(avr, avr->gdb_port, 1);
+	if (s < 0)
+		return -1;
+	printf("avr_gdb_init listening on port %d\n", avr->gdb_port);
+	pthread_mutex_lock(&srv->lock);
+	srv->listen = s;
+	pthread_mutex_unlock(&srv->lock);
+	if (!avr->undo)
+		avr_undo_init(avr, AVR_UNDO_DEFAULT_SIZE);
+	return 0;
+}
+
+static int
+gdb_server_start(
+		avr_t * avr,
+		int gdb )
+{
+	avr_gdb_server_t * srv = calloc(1, sizeof(avr_gdb_server_t));
+
+	srv->listen = srv->monitor_listen = srv->s = -1;
+	avr->gdb = NULL;
+
+	if ( network_init() ) {
+		AVR_LOG(avr, LOG_ERROR, "GDB: Can't initialize network");
+		free(srv);
+		return -1;
+	}
+	if (gdb) {
+		if ((srv->listen = gdb_listen(avr, avr->gdb_port, 1)) < 0)
+			goto error;
+		printf("avr_gdb_init listening on port %d\n", avr->gdb_port);
+	}
+	if (avr->monitor_port) {
+		if ((srv->monitor_listen = gdb_listen(avr, avr->monitor_port, 4)) < 0)
+			goto error;
+		printf("avr_gdb_init monitor listening on port %d\n",
+				avr->monitor_port);
+	}
+	srv->stops_tail = &srv->stops;
+	pthread_mutex_init(&srv->lock, NULL);
+	gdb_add_core(avr, srv);
+
+	if (pthread_create(&srv->thread, NULL, gdb_network_thread, srv)) {
+		AVR_LOG(avr, LOG_ERROR, "GDB: Can't start the network thread");
+		srv->stop = 1;
+		avr_deinit_gdb(avr);
+		return -1;
+	}
 	return 0;
 
 error:
-	if (g->listen >= 0)
-		close(g->listen);
-	free(g);
+	if (srv->listen >= 0)
+		close(srv->listen);
+	free(srv);
+	network_release();
 
 	return -1;
 }
 
+int
+avr_gdb_init(
+		avr_t * avr )
+{
+	// GDB server already is active, maybe only for the monitor
+	if (avr->gdb)
+		return gdb_server_listen_gdb(avr, avr->gdb->server);
+	return gdb_server_start(avr, 1);
+}
+
+int
+avr_gdb_init_monitor(
+		avr_t * avr )
+{
+	if (avr->gdb)
+		return 0;
+	if (!avr->monitor_port) {
+		AVR_LOG(avr, LOG_ERROR, "GDB: %s: no monitor port\n", __func__);
+		return -1;
+	}
+	return gdb_server_start(avr, 0);
+}
+
+int
+avr_gdb_init_shared(
+		avr_t * avr,
+		avr_t * first )
+{
+	if (avr->gdb)
+		return 0; // GDB server already is active
+	if (!first->gdb) {
+		AVR_LOG(avr, LOG_ERROR, "GDB: %s has no gdb server to share\n",
+				first->mmcu);
+		return -1;
+	}
+	gdb_add_core(avr, first->gdb->server);
+	return 0;
+}
+
+// The last core stopped the server
+static void
+gdb_server_free(
+		avr_gdb_server_t * srv )
+{
+	// 'stop' is already set if the thread never started
+	if (!srv->stop) {
+		pthread_mutex_lock(&srv->lock);
+		srv->stop = 1;
+		pthread_mutex_unlock(&srv->lock);
+		pthread_join(srv->thread, NULL);
+	}
+	if (srv->listen != -1)
+		close(srv->listen);
+	if (srv->s != -1)
+		close(srv->s);
+	if (srv->monitor_listen != -1)
+		close(srv->monitor_listen);
+	while (srv->monitors) {
+		avr_gdb_monitor_t * m = srv->monitors;
+		srv->monitors = m->next;
+		close(m->s);
+		free(m->in.b);
+		free(m->out.b);
+		free(m);
+	}
+	gdb_server_clear_stops(srv);
+	free(srv->in.b);
+	free(srv->out.b);
+	pthread_mutex_destroy(&srv->lock);
+	free(srv);
+
+	network_release();
+}
+
 void
 avr_deinit_gdb(
 		avr_t * avr )
 {
 	if (!avr->gdb)
 		return;
+	avr_gdb_t * g = avr->gdb;
+	avr_gdb_server_t * srv = g->server;
+
+	pthread_mutex_lock(&srv->lock);
+	avr_gdb_t ** l = &srv->cores;
+	while (*l != g)
+		l = &(*l)->next;
+	*l = g->next;
+	int last = srv->cores == NULL;
+	pthread_mutex_unlock(&srv->lock);
+	if (last)
+		gdb_server_free(srv);
+
 	avr->run = avr_callback_run_raw; // restore normal callbacks
 	avr->sleep = avr_callback_sleep_raw;
-	if (avr->gdb->listen != -1)
-		close(avr->gdb->listen);
-	avr->gdb->listen = -1;
-	if (avr->gdb->s != -1)
-		close(avr->gdb->s);
-	avr->gdb->s = -1;
-	free(avr->gdb);
+	avr_undo_deinit(avr);
+	avr_cycle_timer_cancel(avr, gdb_cycles_timer, g);
+	free(g->break_map);
+	free(g->watch_map);
+	free(g->breakpoints.points);
+	free(g->watchpoints.points);
+	while (g->event) {
+		avr_gdb_event_t * e = g->event;
+		g->event = e->next;
+		free(e);
+	}
+	pthread_cond_destroy(&g->wakeup);
+	free(g);
 	avr->gdb = NULL;
-
-	network_release();
 }
@@ -22,6 +22,9 @@
 #ifndef __SIM_GDB_H__
 #define __SIM_GDB_H__
 
+#include <pthread.h>
+#include "sim_avr.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -37,7 +40,76 @@ enum avr_gdb_watch_type {
 	AVR_GDB_WATCH_ACCESS = 1 << 4
 };
 
+// largest packet we accept, advertised to gdb with qSupported
+#define AVR_GDB_PACKET_SIZE		0x10000
+
+typedef struct {
+	uint32_t len; /**< How many points are taken (points[0] .. points[len - 1]). */
+	uint32_t alloc; /**< How many points are allocated. */
+	struct {
+		uint32_t addr; /**< Which address is watched. */
+		uint32_t size; /**< How large is the watched segment. */
+		uint32_t kind; /**< Bitmask of enum avr_gdb_watch_type values. */
+	} * points;
+} avr_gdb_watchpoints_t;
+
+struct avr_gdb_event_t;
+struct avr_gdb_server_t;
+
+/*
+ * One per debugged core. The sockets are handled by the network thread of
+ * a server, shared by all the cores it debugs, that gdb sees as threads.
+ * That thread queues the packets it receives as events for their core,
+ * and each core handles its own between two instructions, so the AVR
+ * state is only ever touched by the thread running that core, and a
+ * running core only has to look at its 'pending' flag.
+ */
+typedef struct avr_gdb_t {
+	avr_t * avr;
+	struct avr_gdb_server_t * server;
+	struct avr_gdb_t * next;	// in the server list of cores
+	int		id;			// gdb thread id, from 1
+
+	pthread_cond_t	wakeup;	// signaled when an event is queued
+	uint32_t	pending;	// events are queued
+	// protected by the server lock
+	struct avr_gdb_event_t * event, ** event_tail;
+
+	// thread that runs this core; a stopped core only waits for its
+	// events when no other core of that thread is running
+	pthread_t	thread;
+	int		rcmd;		// a "monitor cycles" waits for its reply
+	// vCont range stepping, keep stepping while the pc is in there
+	avr_flashaddr_t range_start, range_end;
+
+	avr_gdb_watchpoints_t breakpoints;
+	avr_gdb_watchpoints_t watchpoints;
+	// one bit per flash word, set for the words with a breakpoint, so the
+	// run loop doesn't have to search 'breakpoints' for each instruction
+	uint8_t * break_map;
+	// one byte per data address, with the avr_gdb_watch_type bits that
+	// are watched on it
+	uint8_t * watch_map;
+
+	// These are used by gdb's "info io_registers" command.
+
+	uint16_t ior_base;
+	uint8_t  ior_count, mad;
+} avr_gdb_t;
+
+/*
+ * Start a server on avr->gdb_port, and on avr->monitor_port for the JSON
+ * monitor clients if that is non zero, with 'avr' as its first core.
+ * If 'avr' already has a monitor only server, gdb is added to it.
+ */
 int avr_gdb_init(avr_t * avr);
+/*
+ * Start a server with only the JSON monitor, on avr->monitor_port. A later
+ * avr_gdb_init() (on a crash, say) adds the gdb port to it.
+ */
+int avr_gdb_init_monitor(avr_t * avr);
+// Debug 'avr' as another core (gdb thread) of the server 'first' runs
+int avr_gdb_init_shared(avr_t * avr, avr_t * first);
 
 void avr_deinit_gdb(avr_t * avr);
 
@@ -48,6 +120,33 @@ int avr_gdb_processor(avr_t * avr, int sleep);
 void avr_gdb_handle_watchpoints(avr_t * g, uint16_t addr, enum avr_gdb_watch_type type);
 void avr_gdb_handle_break(avr_t *);
 
+// Called from the core, is this kind of access to 'addr' watched?
+static inline int
+avr_gdb_watched(
+		avr_gdb_t * g,
+		uint16_t addr,
+		enum avr_gdb_watch_type type)
+{
+	return g->watch_map[addr] & type;
+}
+
+// Called from the run loop, is there something from gdb to handle?
+static inline int
+avr_gdb_pending(
+		avr_gdb_t * g)
+{
+	return __atomic_load_n(&g->pending, __ATOMIC_RELAXED);
+}
+
+// Called from the run loop, is there a breakpoint at 'pc'?
+static inline int
+avr_gdb_break_at(
+		avr_gdb_t * g,
+		avr_flashaddr_t pc)
+{
+	return (g->break_map[pc >> 4] >> ((pc >> 1) & 7)) & 1;
+}
+
 #ifdef __cplusplus
 };
 #endif
@@ -22,7 +22,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include "sim_hex.h"
+#include "sim_elf.h"
+#include "sim_utils.h"
 
 // friendly hex dump
 void hdump(const char *w, uint8_t *b, size_t l)
@@ -85,88 +88,449 @@ free_ihex_chunks(
 			free(chunks[i].data);
 }
 
-int
-read_ihex_chunks(
-		const char * fname,
-		ihex_chunk_p * chunks )
+/*
+ * The .hex and .srec files are mapped, and parsed twice in place: the first
+ * pass only looks at the record addresses and sizes, so the images can be
+ * allocated at their final size, the second one decodes the data straight
+ * into them.
+ */
+typedef void (*image_data_p)(
+		void * param,
+		uint32_t addr,
+		const uint8_t * data,	// NULL on the sizing pass
+		uint32_t size);
+
+typedef struct image_parse_t {
+	const char *	fname;
+	const uint8_t *	src;
+	size_t			size;
+	int				decode;	// 0 for the sizing pass
+	image_data_p	data;
+	void *			param;
+	int				has_start;
+	uint32_t		start;	// start address record, if has_start
+} image_parse_t;
+
+static inline int
+_hex_nibble(
+		uint8_t c)
 {
-	if (!fname || !chunks)
-		return -1;
-	FILE * f = fopen(fname, "r");
-	if (!f) {
-		perror(fname);
-		return -1;
+	if ((unsigned)(c - '0') < 10)
+		return c - '0';
+	c |= 0x20;
+	if ((unsigned)(c - 'a') < 6)
+		return c - 'a' + 0xa;
+	return -1;
+}
+
+/*
+ * Decode 'count' bytes of hex text at 'src' into 'dst', adding them to
+ * '*sum'. Returns -1 on a non hex digit.
+ */
+static int
+_hex_decode(
+		const uint8_t * src,
+		uint8_t * dst,
+		int count,
+		uint8_t * sum)
+{
+	for (int i = 0; i < count; i++, src += 2) {
+		int h = _hex_nibble(src[0]), l = _hex_nibble(src[1]);
+		if (h < 0 || l < 0)
+			return -1;
+		dst[i] = (h << 4) | l;
+		*sum += dst[i];
 	}
-	uint32_t segment = 0;	// segment address
-	int chunk = 0, max_chunks = 0;
-	*chunks = NULL;
+	return 0;
+}
 
-	while (!feof(f)) {
-		char line[128];
-		if (!fgets(line, sizeof(line)-1, f))
-			continue;
-		if (line[0] != ':') {
-			fprintf(stderr, "AVR: '%s' invalid ihex format (%.4s)\n", fname, line);
-			break;
-		}
-		uint8_t bline[64];
+/*
+ * Returns the first record of a text image, skipping blanks, or NULL at the
+ * end of the file. 'line' counts the lines, for the error messages.
+ */
+static const uint8_t *
+_image_next_record(
+		const uint8_t * p,
+		const uint8_t * end,
+		int * line)
+{
+	while (p < end && *p <= ' ') {
+		if (*p == '\n')
+			(*line)++;
+		p++;
+	}
+	return p < end ? p : NULL;
+}
 
-		int len = read_hex_string(line + 1, bline, sizeof(bline));
-		if (len <= 0)
-			continue;
+static int
+_ihex_parse(
+		image_parse_t * ip)
+{
+	const uint8_t * p = ip->src, * end = ip->src + ip->size;
+	uint32_t segment = 0;	// segment address
+	int line = 1;
 
-		uint8_t chk = 0;
-		{	// calculate checksum
-			uint8_t * src = bline;
-			int tlen = len-1;
-			while (tlen--)
-				chk += *src++;
-			chk = 0x100 - chk;
+	while ((p = _image_next_record(p, end, &line)) != NULL) {
+		uint8_t rec[5 + 255], sum = 0;
+		if (*p != ':' || end - p < 11 || _hex_decode(p + 1, rec, 4, &sum)) {
+			fprintf(stderr, "AVR: '%s' invalid ihex format line %d\n",
+					ip->fname, line);
+			return -1;
 		}
-		if (chk != bline[len-1]) {
-			fprintf(stderr, "%s: %s, invalid checksum %02x/%02x\n", __FUNCTION__, fname, chk, bline[len-1]);
-			break;
+		int len = rec[0], type = rec[3];
+		if (end - p < 11 + len * 2) {
+			fprintf(stderr, "AVR: '%s' truncated ihex line %d\n",
+					ip->fname, line);
+			return -1;
 		}
-		uint32_t addr = 0;
-		switch (bline[3]) {
+		// data records are only sized in the first pass
+		if (ip->decode || type != 0) {
+			if (_hex_decode(p + 9, rec + 4, len + 1, &sum)) {
+				fprintf(stderr, "AVR: '%s' invalid ihex format line %d\n",
+						ip->fname, line);
+				return -1;
+			}
+			if (sum) {
+				fprintf(stderr, "%s: %s, invalid checksum line %d\n",
+						__FUNCTION__, ip->fname, line);
+				return -1;
+			}
+		}
+		p += 11 + len * 2;
+		const uint8_t * d = rec + 4;
+		switch (type) {
 			case 0: // normal data
-				addr = segment | (bline[1] << 8) | bline[2];
+				ip->data(ip->param, segment + ((rec[1] << 8) | rec[2]),
+						ip->decode ? d : NULL, len);
 				break;
-			case 1: // end of file - reset segment
+			case 1: // end of file - reset segment, there might be another one
 				segment = 0;
-				continue;
-			case 2: // extended address 2 bytes
-				segment = ((bline[4] << 8) | bline[5]) << 4;
-				continue;
-			case 4:
-				segment = ((bline[4] << 8) | bline[5]) << 16;
-				continue;
+				break;
+			case 2: // extended segment address
+				segment = ((d[0] << 8) | d[1]) << 4;
+				break;
+			case 3: // start segment address, CS:IP
+				ip->has_start = 1;
+				ip->start = (((d[0] << 8) | d[1]) << 4) + ((d[2] << 8) | d[3]);
+				break;
+			case 4: // extended linear address
+				segment = ((d[0] << 8) | d[1]) << 16;
+				break;
+			case 5: // start linear address
+				ip->has_start = 1;
+				ip->start = (d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+				break;
 			default:
-				fprintf(stderr, "%s: %s, unsupported check type %02x\n", __FUNCTION__, fname, bline[3]);
-				continue;
+				fprintf(stderr, "%s: %s, unsupported record type %02x\n",
+						__FUNCTION__, ip->fname, type);
+				break;
+		}
+	}
+	return 0;
+}
+
+static int
+_srec_parse(
+		image_parse_t * ip)
+{
+	const uint8_t * p = ip->src, * end = ip->src + ip->size;
+	int line = 1;
+
+	while ((p = _image_next_record(p, end, &line)) != NULL) {
+		uint8_t rec[1 + 255], sum = 0;
+		if (*p != 'S' || end - p < 4 || (unsigned)(p[1] - '0') > 9 ||
+				_hex_decode(p + 2, rec, 1, &sum)) {
+			fprintf(stderr, "AVR: '%s' invalid srec format line %d\n",
+					ip->fname, line);
+			return -1;
+		}
+		int type = p[1] - '0', len = rec[0];
+		static const uint8_t alen[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+		if (len < alen[type] + 1 || end - p < 4 + len * 2) {
+			fprintf(stderr, "AVR: '%s' truncated srec line %d\n",
+					ip->fname, line);
+			return -1;
+		}
+		int decode = ip->decode || type < 1 || type > 3 ? len : alen[type];
+		if (_hex_decode(p + 4, rec + 1, decode, &sum)) {
+			fprintf(stderr, "AVR: '%s' invalid srec format line %d\n",
+					ip->fname, line);
+			return -1;
 		}
-		if (chunk < max_chunks && addr != ((*chunks)[chunk].baseaddr + (*chunks)[chunk].size)) {
-			if ((*chunks)[chunk].size)
-				chunk++;
+		if (decode == len && sum != 0xff) {
+			fprintf(stderr, "%s: %s, invalid checksum line %d\n",
+					__FUNCTION__, ip->fname, line);
+			return -1;
 		}
-		if (chunk >= max_chunks) {
-			max_chunks++;
-			/* Here we allocate and zero an extra chunk, to act as terminator */
-			*chunks = realloc(*chunks, (1 + max_chunks) * sizeof(ihex_chunk_t));
-			memset(*chunks + chunk, 0,
-					(1 + (max_chunks - chunk)) * sizeof(ihex_chunk_t));
-			(*chunks)[chunk].baseaddr = addr;
+		p += 4 + len * 2;
+		uint32_t addr = 0;
+		for (int i = 0; i < alen[type]; i++)
+			addr = (addr << 8) | rec[1 + i];
+		switch (type) {
+			case 1: case 2: case 3:	// data
+				ip->data(ip->param, addr,
+						ip->decode ? rec + 1 + alen[type] : NULL,
+						len - alen[type] - 1);
+				break;
+			case 7: case 8: case 9:	// start address
+				ip->has_start = 1;
+				ip->start = addr;
+				break;
+			default:	// header, record counts
+				break;
 		}
-		(*chunks)[chunk].data = realloc((*chunks)[chunk].data,
-									(*chunks)[chunk].size + bline[0]);
-		memcpy((*chunks)[chunk].data + (*chunks)[chunk].size,
-				bline + 4, bline[0]);
-		(*chunks)[chunk].size += bline[0];
 	}
-	fclose(f);
-	return max_chunks;
+	return 0;
 }
 
+int
+image_kind(
+		const char * fname)
+{
+	const char * suffix = fname ? strrchr(fname, '.') : NULL;
+	if (!suffix)
+		return IMAGE_ELF;
+	if (!strcasecmp(suffix, ".hex") || !strcasecmp(suffix, ".ihex") ||
+			!strcasecmp(suffix, ".ihx"))
+		return IMAGE_IHEX;
+	if (!strcasecmp(suffix, ".srec") || !strcasecmp(suffix, ".s19") ||
+			!strcasecmp(suffix, ".s28") || !strcasecmp(suffix, ".s37") ||
+			!strcasecmp(suffix, ".mot"))
+		return IMAGE_SREC;
+	if (!strcasecmp(suffix, ".bin"))
+		return IMAGE_BIN;
+	return IMAGE_ELF;
+}
+
+/*
+ * Map 'fname' and run both passes of its parser, calling 'data' with
+ * 'param'; 'done' is called in between, to allocate the images.
+ */
+static int
+_image_parse(
+		const char * fname,
+		int kind,
+		image_data_p data,
+		int (*done)(void * param),
+		void * param,
+		image_parse_t * ip)
+{
+	*ip = (image_parse_t) {
+		.fname = fname, .data = data, .param = param,
+	};
+	ip->src = sim_mmap_read(fname, &ip->size);
+	if (!ip->src) {
+		perror(fname);
+		return -1;
+	}
+	int res = 0;
+	for (ip->decode = 0; ip->decode < 2 && !res; ip->decode++) {
+		if (ip->decode)
+			res = done(param);
+		if (res)
+			break;
+		if (kind == IMAGE_BIN)
+			data(param, 0, ip->decode ? ip->src : NULL, ip->size);
+		else
+			res = kind == IMAGE_SREC ? _srec_parse(ip) : _ihex_parse(ip);
+	}
+	sim_munmap_read(ip->src, ip->size);
+	return res;
+}
+
+typedef struct ihex_chunks_t {
+	ihex_chunk_p	chunk;
+	int				count, size;
+	int				current;	// chunk being filled, on the second pass
+	uint32_t		fill;
+} ihex_chunks_t;
+
+static void
+_ihex_chunks_data(
+		void * param,
+		uint32_t addr,
+		const uint8_t * data,
+		uint32_t size)
+{
+	ihex_chunks_t * c = param;
+	if (data) {
+		// same records as the first pass, in the same order
+		ihex_chunk_p ch = &c->chunk[c->current];
+		if (addr != ch->baseaddr + c->fill) {
+			ch = &c->chunk[++c->current];
+			c->fill = 0;
+		}
+		memcpy(ch->data + c->fill, data, size);
+		c->fill += size;
+		return;
+	}
+	if (c->count && addr == c->chunk[c->count - 1].baseaddr +
+			c->chunk[c->count - 1].size) {
+		c->chunk[c->count - 1].size += size;
+		return;
+	}
+	if (c->count + 1 >= c->size) {
+		c->size = c->size ? c->size * 2 : 8;
+		c->chunk = realloc(c->chunk, c->size * sizeof(c->chunk[0]));
+	}
+	// keep a zeroed chunk at the end, as terminator
+	c->chunk[c->count] = (ihex_chunk_t) { .baseaddr = addr, .size = size };
+	c->chunk[++c->count] = (ihex_chunk_t) { 0 };
+}
+
+static int
+_ihex_chunks_alloc(
+		void * param)
+{
+	ihex_chunks_t * c = param;
+	for (int i = 0; i < c->count; i++)
+		if (c->chunk[i].size &&
+				!(c->chunk[i].data = malloc(c->chunk[i].size)))
+			return -1;
+	return 0;
+}
+
+int
+read_ihex_chunks(
+		const char * fname,
+		ihex_chunk_p * chunks )
+{
+	if (!fname || !chunks)
+		return -1;
+	ihex_chunks_t c = { 0 };
+	image_parse_t ip;
+	int res = _image_parse(fname, IMAGE_IHEX,
+			_ihex_chunks_data, _ihex_chunks_alloc, &c, &ip);
+	// zero sized records make empty chunks, that would end the array early
+	int count = 0;
+	for (int i = 0; i < c.count; i++)
+		if (c.chunk[i].size)
+			c.chunk[count++] = c.chunk[i];
+		else
+			free(c.chunk[i].data);
+	if (c.chunk)
+		c.chunk[count] = (ihex_chunk_t) { 0 };
+	if (res) {
+		free_ihex_chunks(c.chunk);
+		free(c.chunk);
+		c.chunk = NULL;
+		count = -1;
+	}
+	*chunks = c.chunk;
+	return count;
+}
+
+/*
+ * The regions of the ELF address space avr-objcopy uses in the images, in
+ * which the data is put in the firmware
+ */
+enum {
+	IMAGE_FLASH = 0, IMAGE_EEPROM, IMAGE_FUSE, IMAGE_LOCK, IMAGE_REGIONS
+};
+static const struct {
+	uint32_t	start, end;
+	int			fixed;	// 1 if the image starts at 'start', not at the data
+} image_region[IMAGE_REGIONS] = {
+	[IMAGE_FLASH] = { AVR_SEGMENT_OFFSET_FLASH, 1*1024*1024, 0 },
+	[IMAGE_EEPROM] = { AVR_SEGMENT_OFFSET_EEPROM, AVR_SEGMENT_OFFSET_FUSE, 1 },
+	[IMAGE_FUSE] = { AVR_SEGMENT_OFFSET_FUSE, AVR_SEGMENT_OFFSET_LOCK, 1 },
+	[IMAGE_LOCK] = { AVR_SEGMENT_OFFSET_LOCK, AVR_SEGMENT_OFFSET_LOCK + 0x10000, 1 },
+};
+
+typedef struct image_firmware_t {
+	struct {
+		uint32_t	lo, hi;	// extent of the data found, hi excluded
+		uint8_t *	data;
+	} region[IMAGE_REGIONS];
+	uint32_t		base;	// added to the addresses of the file
+} image_firmware_t;
+
+static void
+_image_firmware_data(
+		void * param,
+		uint32_t addr,
+		const uint8_t * data,
+		uint32_t size)
+{
+	image_firmware_t * f = param;
+	if (!size)
+		return;
+	addr += f->base;
+	for (int ri = 0; ri < IMAGE_REGIONS; ri++) {
+		if (addr < image_region[ri].start || addr >= image_region[ri].end)
+			continue;
+		if (size > image_region[ri].end - addr)
+			size = image_region[ri].end - addr;
+		if (data) {
+			memcpy(f->region[ri].data + addr - f->region[ri].lo, data, size);
+			return;
+		}
+		uint32_t lo = image_region[ri].fixed ? image_region[ri].start : addr;
+		if (f->region[ri].hi == 0 || lo < f->region[ri].lo)
+			f->region[ri].lo = lo;
+		if (addr + size > f->region[ri].hi)
+			f->region[ri].hi = addr + size;
+		return;
+	}
+	// anything else, like the data space, is ignored
+}
+
+static int
+_image_firmware_alloc(
+		void * param)
+{
+	image_firmware_t * f = param;
+	for (int ri = 0; ri < IMAGE_REGIONS; ri++) {
+		uint32_t size = f->region[ri].hi - f->region[ri].lo;
+		if (!f->region[ri].hi)
+			continue;
+		// gaps are left erased
+		f->region[ri].data = malloc(size);
+		if (!f->region[ri].data)
+			return -1;
+		memset(f->region[ri].data, 0xff, size);
+	}
+	return 0;
+}
+
+int
+read_image_firmware(
+		const char * fname,
+		struct elf_firmware_t * firmware,
+		uint32_t base)
+{
+	int kind = image_kind(fname);
+	if (kind == IMAGE_ELF)
+		return -1;
+	image_firmware_t f = { .base = base };
+	image_parse_t ip;
+	if (_image_parse(fname, kind, _image_firmware_data,
+			_image_firmware_alloc, &f, &ip)) {
+		for (int ri = 0; ri < IMAGE_REGIONS; ri++)
+			free(f.region[ri].data);
+		return -1;
+	}
+	if (f.region[IMAGE_FLASH].data) {
+		firmware->flash = f.region[IMAGE_FLASH].data;
+		firmware->flashbase = f.region[IMAGE_FLASH].lo;
+		firmware->flashsize = f.region[IMAGE_FLASH].hi - f.region[IMAGE_FLASH].lo;
+	}
+	if (f.region[IMAGE_EEPROM].data) {
+		firmware->eeprom = f.region[IMAGE_EEPROM].data;
+		firmware->eesize = f.region[IMAGE_EEPROM].hi - AVR_SEGMENT_OFFSET_EEPROM;
+	}
+	if (f.region[IMAGE_FUSE].data) {
+		firmware->fuse = f.region[IMAGE_FUSE].data;
+		firmware->fusesize = f.region[IMAGE_FUSE].hi - AVR_SEGMENT_OFFSET_FUSE;
+	}
+	if (f.region[IMAGE_LOCK].data)
+		firmware->lockbits = f.region[IMAGE_LOCK].data;
+	// objcopy relocates the start address along with the data, so it
+	// can end up pointing at the eeprom
+	if (ip.has_start && ip.start < image_region[IMAGE_FLASH].end)
+		firmware->entry = ip.start;
+	return 0;
+}
 
 uint8_t *
 read_ihex_file(
@@ -58,6 +58,34 @@ void
 free_ihex_chunks(
 		ihex_chunk_p chunks);
 
+// the kinds of firmware files, as told by their suffix
+enum {
+	IMAGE_ELF = 0,	// anything that is not one of the others
+	IMAGE_IHEX,		// .hex, .ihex, .ihx
+	IMAGE_SREC,		// .srec, .s19, .s28, .s37, .mot
+	IMAGE_BIN,		// .bin, a raw image
+};
+
+int
+image_kind(
+		const char * fname);
+
+struct elf_firmware_t;
+/*
+ * Loads the IHEX, SREC or raw binary file 'fname' into 'firmware', 'base'
+ * is added to the addresses in the file (AVR_SEGMENT_OFFSET_EEPROM loads it
+ * as eeprom). Like avr-objcopy makes them, the images can hold the flash,
+ * eeprom, fuses and lock bits; all of the chunks are loaded, and the gaps
+ * in between are left erased (0xff). The start address record, if any and
+ * if it is in the flash, goes in firmware->entry.
+ * Returns 0, or -1 if an error occurs.
+ */
+int
+read_image_firmware(
+		const char * fname,
+		struct elf_firmware_t * firmware,
+		uint32_t base);
+
 // reads IHEX file 'fname', puts it's decoded size in *'dsize' and returns
 // a newly allocated buffer with the binary data (or NULL, if error)
 uint8_t *
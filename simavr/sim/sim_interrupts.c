@@ -27,6 +27,9 @@
 #include "sim_interrupts.h"
 #include "sim_avr.h"
 #include "sim_core.h"
+#include "sim_itrace.h"
+#include "sim_callstack.h"
+#include "sim_perf.h"
 
 DEFINE_FIFO(avr_int_vector_p, avr_int_pending);
 
@@ -283,6 +286,13 @@ avr_service_interrupts(
 	} else {
 		if (vector->trace)
 			printf("IRQ%d calling\n", vector->vector);
+		avr->perf->interrupts[vector->vector < AVR_PERF_VECTORS ?
+				vector->vector : AVR_PERF_VECTORS - 1]++;
+		if (unlikely(avr->itrace))
+			avr_itrace_irq(avr, vector->vector);
+		if (unlikely(avr->callstack))
+			avr_callstack_call(avr, vector->vector * avr->vector_size,
+					_avr_sp_get(avr), avr->cycle, 1);
 		_avr_push_addr(avr, avr->pc);
 		avr_sreg_set(avr, S_I, 0);
 		avr->pc = vector->vector * avr->vector_size;
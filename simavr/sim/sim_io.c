@@ -26,6 +26,7 @@
 #include <ctype.h>
 #include <stdint.h>
 #include "sim_io.h"
+#include "sim_perf.h"
 
 int
 avr_ioctl(
@@ -34,7 +35,7 @@ avr_ioctl(
 		void * io_param)
 {
 	avr_io_t * port = avr->io_port;
-	int res = -1;
+	int res = avr_perf_ioctl(avr, ctl, io_param);
 	while (port && res == -1) {
 		if (port->ioctl)
 			res = port->ioctl(port, ctl, io_param);
@@ -35,6 +35,8 @@ extern "C" {
 #define AVR_IOCTL_DEF(_a,_b,_c,_d) \
 	(((_a) << 24)|((_b) << 16)|((_c) << 8)|((_d)))
 
+struct avr_state_io_t;
+
 /*
  * IO module base struct
  * Modules uses that as their first member in their own struct
@@ -56,6 +58,12 @@ typedef struct avr_io_t {
 
 	// optional, a function to free up allocated system resources
 	void (*dealloc)(struct avr_io_t *io);
+	/*
+	 * optional, saves or restores (see avr_state_io()) what the module
+	 * keeps besides its IO registers and IRQs. A core with a module that
+	 * has none can't be saved in a snapshot. Returns -1 on error.
+	 */
+	int (*state)(struct avr_io_t *io, struct avr_state_io_t *s);
 } avr_io_t;
 
 /*
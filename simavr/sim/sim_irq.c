@@ -28,6 +28,7 @@
 typedef struct avr_irq_hook_t {
 	struct avr_irq_hook_t * next;
 	int busy;	// prevent reentrance of callbacks
+	int sealed;	// installed before avr_irq_pool_seal(), kept by avr_irq_pool_unhook()
 
 	struct avr_irq_t * chain;	// raise the IRQ on this too - optional if "notify" is on
 	avr_irq_notify_t notify;	// called when IRQ is raised - optional if "chain" is on
@@ -39,10 +40,11 @@ _avr_irq_pool_add(
 		avr_irq_pool_t * pool,
 		avr_irq_t * irq)
 {
-	int insert = 0;
+	int insert = pool->free;
 	/* lookup a slot */
 	for (; insert < pool->count && pool->irq[insert]; insert++)
 		;
+	pool->free = insert + 1;
 	if (insert == pool->count) {
 		if ((pool->count & 0xf) == 0) {
 			pool->irq = (avr_irq_t**)realloc(pool->irq,
@@ -59,11 +61,23 @@ _avr_irq_pool_remove(
 		avr_irq_pool_t * pool,
 		avr_irq_t * irq)
 {
-	for (int i = 0; i < pool->count; i++)
-		if (pool->irq[i] == irq) {
-			pool->irq[i] = 0;
-			return;
-		}
+	/*
+	 * The irqs are mostly freed in the order they were allocated, so
+	 * start looking where the last one was, and wrap around.
+	 */
+	for (int n = 0, i = pool->last; n < pool->count; n++, i++) {
+		if (i >= pool->count)
+			i = 0;
+		if (pool->irq[i] != irq)
+			continue;
+		pool->irq[i] = 0;
+		pool->last = i;
+		if (i < pool->free)
+			pool->free = i;
+		while (pool->count && !pool->irq[pool->count - 1])
+			pool->count--;
+		return;
+	}
 }
 
 void
@@ -202,6 +216,8 @@ avr_raise_irq_float(
 			(irq->flags & IRQ_FLAG_FILTERED) && !(irq->flags & IRQ_FLAG_INIT))
 		return;
 	irq->flags &= ~(IRQ_FLAG_INIT | IRQ_FLAG_FLOATING);
+	if (irq->pool)
+		irq->pool->raised++;
 	if (floating)
 		irq->flags |= IRQ_FLAG_FLOATING;
 	avr_irq_hook_t *hook = irq->hook;
@@ -278,6 +294,50 @@ avr_unconnect_irq(
 	}
 }
 
+void
+avr_irq_pool_seal(
+		avr_irq_pool_t * pool)
+{
+	for (int i = 0; i < pool->count; i++) {
+		avr_irq_t * irq = pool->irq[i];
+		if (!irq)
+			continue;
+		for (avr_irq_hook_t * hook = irq->hook; hook; hook = hook->next)
+			hook->sealed = 1;
+	}
+}
+
+int
+avr_irq_pool_unhook(
+		avr_irq_pool_t * pool)
+{
+	int removed = 0;
+	for (int i = 0; i < pool->count; i++) {
+		avr_irq_t * irq = pool->irq[i];
+		if (!irq)
+			continue;
+		/*
+		 * New hooks are always added at the head of the list, so the
+		 * unsealed ones come first -- but the whole list is walked
+		 * anyway, it's short.
+		 */
+		avr_irq_hook_t ** prev = &irq->hook;
+		while (*prev) {
+			avr_irq_hook_t * hook = *prev;
+			if (hook->sealed || hook->busy) {
+				prev = &hook->next;
+				continue;
+			}
+			*prev = hook->next;
+			free(hook);
+			removed++;
+		}
+		// next raise notifies the remaining hooks, whatever the value
+		irq->flags |= IRQ_FLAG_INIT;
+	}
+	return removed;
+}
+
 uint8_t
 avr_irq_get_flags(
 		avr_irq_t * irq )
@@ -66,6 +66,9 @@ enum {
 typedef struct avr_irq_pool_t {
 	int count;						//!< number of irqs living in the pool
 	struct avr_irq_t ** irq;		//!< irqs belonging in this pool
+	uint64_t raised;				//!< number of avr_raise_irq() that notified
+	int free;						//!< there is no free slot before this one
+	int last;						//!< slot of the last irq removed
 } avr_irq_pool_t;
 
 /*!
@@ -100,6 +103,21 @@ avr_init_irq(
 		uint32_t base,
 		uint32_t count,
 		const char ** names /* optional */);
+/*!
+ * Marks every hook currently installed on the irqs of 'pool' as permanent,
+ * avr_irq_pool_unhook() will leave them alone.
+ */
+void
+avr_irq_pool_seal(
+		avr_irq_pool_t * pool);
+/*!
+ * Removes, in one pass, all the hooks and connections added to the irqs
+ * of 'pool' since avr_irq_pool_seal(). Hooks that are currently being
+ * called are kept. Returns the number of hooks removed.
+ */
+int
+avr_irq_pool_unhook(
+		avr_irq_pool_t * pool);
 //! Returns the current IRQ flags
 uint8_t
 avr_irq_get_flags(
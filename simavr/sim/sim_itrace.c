@@ -0,0 +1,264 @@
+/*
+	sim_itrace.c
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_utils.h"
+#include "sim_itrace.h"
+
+int
+avr_itrace_init(
+		avr_t * avr,
+		const char * path,
+		uint32_t size)
+{
+	if (avr->itrace_ring)
+		return 0;
+	if (size > AVR_ITRACE_MAX_SIZE) {
+		AVR_LOG(avr, LOG_ERROR, "ITRACE: %u records, the maximum is %u\n",
+				size, AVR_ITRACE_MAX_SIZE);
+		return -1;
+	}
+	uint32_t s = 1;
+	while (s < size)
+		s <<= 1;
+	uint64_t length = sizeof(avr_itrace_header_t) +
+			(uint64_t)s * sizeof(avr_itrace_record_t);
+	if (length > UINT32_MAX) {
+		AVR_LOG(avr, LOG_ERROR, "ITRACE: %u records don't fit in a file\n", s);
+		return -1;
+	}
+	avr_itrace_t * t = malloc(sizeof(avr_itrace_t));
+	if (!t)
+		return -1;
+	memset(t, 0, sizeof(*t));
+	if (path) {
+		t->header = sim_mmap_file(path, length, 0, 0, 1);
+		t->mapped = 1;
+	} else
+		t->header = calloc(1, length);
+	if (!t->header) {
+		AVR_LOG(avr, LOG_ERROR, "ITRACE: Can't allocate %d records in %s: %s\n",
+				s, path ? path : "memory", strerror(errno));
+		free(t);
+		return -1;
+	}
+	t->record = (avr_itrace_record_t *)(t->header + 1);
+	t->mask = s - 1;
+	t->length = length;
+	t->current = &t->dummy;
+
+	avr_itrace_header_t * h = t->header;
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, AVR_ITRACE_MAGIC, sizeof(h->magic));
+	h->version = AVR_ITRACE_VERSION;
+	h->record_size = sizeof(avr_itrace_record_t);
+	h->size = s;
+	h->frequency = avr->frequency;
+	snprintf(h->mmcu, sizeof(h->mmcu), "%s", avr->mmcu);
+
+	avr->itrace_ring = t;
+	avr->itrace = t;
+	return 0;
+}
+
+void
+avr_itrace_deinit(
+		avr_t * avr)
+{
+	avr_itrace_t * t = avr->itrace_ring;
+	if (!t)
+		return;
+	avr->itrace = avr->itrace_ring = NULL;
+	if (t->mapped)
+		sim_munmap_file(t->header, t->length, 0);
+	else
+		free(t->header);
+	free(t);
+}
+
+void
+avr_itrace_start(
+		avr_t * avr)
+{
+	avr_itrace_t * t = avr->itrace_ring;
+	if (!t || avr->itrace)
+		return;
+	// the current record is stale, don't add writes to it
+	t->current = &t->dummy;
+	avr->itrace = t;
+}
+
+void
+avr_itrace_stop(
+		avr_t * avr)
+{
+	avr->itrace = NULL;
+}
+
+int
+avr_itrace_save(
+		avr_t * avr,
+		const char * path)
+{
+	avr_itrace_t * t = avr->itrace_ring;
+	if (!t)
+		return -1;
+	FILE * o = fopen(path, "wb");
+	if (!o) {
+		AVR_LOG(avr, LOG_ERROR, "ITRACE: Can't create %s: %s\n",
+				path, strerror(errno));
+		return -1;
+	}
+	// until the ring wraps, only the start of it is valid
+	uint64_t count = t->header->count;
+	uint32_t n = count > t->mask ? t->mask + 1 : count;
+	int res = 0;
+	if (fwrite(t->header, sizeof(avr_itrace_header_t), 1, o) != 1 ||
+			(n && fwrite(t->record, sizeof(avr_itrace_record_t), n, o) != n))
+		res = -1;
+	if (fclose(o))
+		res = -1;
+	if (res)
+		AVR_LOG(avr, LOG_ERROR, "ITRACE: Error writing %s\n", path);
+	return res;
+}
+
+static inline avr_itrace_record_t *
+_avr_itrace_push(
+		avr_t * avr)
+{
+	avr_itrace_t * t = avr->itrace;
+	avr_itrace_record_t * r = &t->record[t->header->count++ & t->mask];
+	uint8_t sreg = 0;
+	for (int i = 0; i < 8; i++)
+		sreg |= (avr->sreg[i] != 0) << i;
+	r->cycle = avr->cycle;
+	r->pc = avr->pc;
+	r->sp = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+	r->sreg = sreg;
+	r->info = 0;
+	t->current = r;
+	return r;
+}
+
+void
+avr_itrace_mark(
+		avr_t * avr)
+{
+	avr_itrace_record_t * r = _avr_itrace_push(avr);
+	// the caller already checked that pc is within the flash
+	uint32_t opcode = avr->flash[avr->pc] | (avr->flash[avr->pc + 1] << 8);
+	if (avr->pc + 3 <= avr->flashend)
+		opcode |= (avr->flash[avr->pc + 2] << 16) |
+				((uint32_t)avr->flash[avr->pc + 3] << 24);
+	r->opcode = opcode;
+}
+
+void
+avr_itrace_irq(
+		avr_t * avr,
+		uint8_t vector)
+{
+	avr_itrace_record_t * r = _avr_itrace_push(avr);
+	r->opcode = vector;
+	r->info = AVR_ITRACE_IRQ;
+}
+
+int
+avr_itrace_decode(
+		const char * path,
+		elf_firmware_t * firmware,
+		FILE * out,
+		uint32_t count)
+{
+	size_t fsize;
+	const uint8_t * base = sim_mmap_read(path, &fsize);
+	if (!base) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	const avr_itrace_header_t * h = (const avr_itrace_header_t *)base;
+	if (fsize < sizeof(*h) || memcmp(h->magic, AVR_ITRACE_MAGIC, sizeof(h->magic)) ||
+			h->version != AVR_ITRACE_VERSION ||
+			h->record_size != sizeof(avr_itrace_record_t) ||
+			!h->size || (h->size & (h->size - 1))) {
+		fprintf(stderr, "%s: not a simavr instruction trace\n", path);
+		sim_munmap_read(base, fsize);
+		return -1;
+	}
+	const avr_itrace_record_t * rec = (const avr_itrace_record_t *)(h + 1);
+	// until the ring wraps, only the start of it is valid
+	uint64_t end = h->count;
+	uint64_t n = end < h->size ? end : h->size;
+	if (n > (fsize - sizeof(*h)) / sizeof(*rec)) {
+		fprintf(stderr, "%s: truncated trace file\n", path);
+		sim_munmap_read(base, fsize);
+		return -1;
+	}
+	if (count && count < n)
+		n = count;
+
+	fprintf(out, "# %s, %s at %u Hz, %llu instructions traced, last %llu:\n",
+			path, h->mmcu, h->frequency,
+			(unsigned long long)h->count, (unsigned long long)n);
+	for (uint64_t i = end - n; i < end; i++) {
+		const avr_itrace_record_t * r = &rec[i & (h->size - 1)];
+		char where[64];
+		avr_symbol_t * s = NULL;
+#if ELF_SYMBOLS
+		int si = elf_firmware_find_symbol(firmware, r->pc);
+		if (si >= 0)
+			s = firmware->symbol[si];
+#endif
+		if (!s)
+			where[0] = 0;
+		else if (r->pc == s->addr)
+			snprintf(where, sizeof(where), "%s", s->symbol);
+		else
+			snprintf(where, sizeof(where), "%s+0x%x", s->symbol, r->pc - s->addr);
+		char sreg[9];
+		for (int b = 0; b < 8; b++)
+			sreg[7 - b] = (r->sreg & (1 << b)) ? "cznvshti"[b] : '-';
+		sreg[8] = 0;
+
+		fprintf(out, "%12llu %06x %-24s ", (unsigned long long)r->cycle,
+				r->pc, where);
+		if (r->info & AVR_ITRACE_IRQ)
+			fprintf(out, "IRQ %-5d", r->opcode & 0xff);
+		else if (avr_opcode_is_32_bits(r->opcode))
+			fprintf(out, "%04x %04x", r->opcode & 0xffff, r->opcode >> 16);
+		else
+			fprintf(out, "%04x     ", r->opcode & 0xffff);
+		fprintf(out, " SP=%04x %s", r->sp, sreg);
+		for (int w = 0; w < (r->info & AVR_ITRACE_WRITE_COUNT); w++)
+			fprintf(out, " %04x=%02x", r->write[w].addr, r->write[w].value);
+		if (r->info & AVR_ITRACE_LOST)
+			fprintf(out, " ...");
+		fprintf(out, "\n");
+	}
+	sim_munmap_read(base, fsize);
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+	sim_itrace.h
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Binary instruction trace. Unlike CONFIG_SIMAVR_TRACE, this doesn't need
+ * a special build, and can be started and stopped at runtime.
+ *
+ * Before each instruction, the core appends a fixed size record with the
+ * cycle counter, PC, opcode, SP and SREG; the data space writes done by
+ * the instruction (registers, IO and SRAM) are then added to that record.
+ * Interrupts get a record of their own, flagged AVR_ITRACE_IRQ.
+ * Writes done by the IO modules between two instructions (in cycle timers)
+ * are attached to the previous instruction.
+ *
+ * The records are kept in a fixed size ring, optionally backed by a file:
+ * in that case the trace is still there if simavr crashes, or is killed.
+ * The ring is in host byte order, and is decoded offline by
+ * avr_itrace_decode(), using the ELF symbols to name the functions.
+ */
+#ifndef __SIM_ITRACE_H__
+#define __SIM_ITRACE_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// default number of records in the ring, must be a power of two
+#define AVR_ITRACE_DEFAULT_SIZE	(1024 * 1024)
+// largest ring, its file stays well under 4GB
+#define AVR_ITRACE_MAX_SIZE		(64 * 1024 * 1024)
+
+#define AVR_ITRACE_MAGIC		"simavrIT"
+#define AVR_ITRACE_VERSION		1
+// maximum number of writes kept per instruction
+#define AVR_ITRACE_WRITES		3
+
+enum {
+	AVR_ITRACE_WRITE_COUNT	= 0x03,	// mask, number of valid write[]
+	AVR_ITRACE_LOST			= 0x04,	// more writes than AVR_ITRACE_WRITES
+	AVR_ITRACE_IRQ			= 0x08,	// interrupt entry, 'opcode' is the vector
+};
+
+typedef struct avr_itrace_record_t {
+	avr_cycle_count_t	cycle;	// cycle counter before the instruction
+	uint32_t			pc;		// byte address
+	uint32_t			opcode;	// first flash word, second one in the top 16 bits
+	uint16_t			sp;		// before the instruction
+	uint8_t				sreg;	// before the instruction
+	uint8_t				info;	// AVR_ITRACE_* flags and write count
+	struct {
+		uint16_t			addr;
+		uint8_t				value;	// value written
+		uint8_t				pad;
+	} write[AVR_ITRACE_WRITES];
+} avr_itrace_record_t;
+
+// start of the ring, and of the saved trace files
+typedef struct avr_itrace_header_t {
+	char				magic[8];
+	uint16_t			version;
+	uint16_t			record_size;
+	uint32_t			size;		// number of records in the ring
+	uint32_t			frequency;
+	uint32_t			reserved;
+	uint64_t			count;		// records ever written, the next one is at count % size
+	char				mmcu[32];
+} avr_itrace_header_t;
+
+typedef struct avr_itrace_t {
+	avr_itrace_header_t *	header;
+	avr_itrace_record_t *	record;	// the ring, right after the header
+	uint32_t				mask;	// size - 1
+	uint32_t				length;	// bytes mapped
+	int						mapped;	// backed by a file
+	avr_itrace_record_t *	current;// record of the current instruction
+	avr_itrace_record_t		dummy;	// 'current' until the first instruction
+} avr_itrace_t;
+
+/*
+ * Allocate a ring of 'size' records (rounded up to a power of two), in
+ * file 'path' if not NULL, and start recording.
+ * Returns -1 on error, or if 'size' is more than AVR_ITRACE_MAX_SIZE.
+ */
+int
+avr_itrace_init(
+		avr_t * avr,
+		const char * path,
+		uint32_t size);
+// stop recording, and release the ring. A file backed ring is left in its file
+void
+avr_itrace_deinit(
+		avr_t * avr);
+// pause/resume recording, the ring is kept
+void
+avr_itrace_start(
+		avr_t * avr);
+void
+avr_itrace_stop(
+		avr_t * avr);
+// write the ring to 'path', in the same format as a file backed one
+int
+avr_itrace_save(
+		avr_t * avr,
+		const char * path);
+/*
+ * Print the last 'count' records (zero for all of them) of trace file
+ * 'path' to 'out'. If 'firmware' is not NULL, its symbols are used to name
+ * the functions. Returns -1 on error.
+ */
+int
+avr_itrace_decode(
+		const char * path,
+		elf_firmware_t * firmware,
+		FILE * out,
+		uint32_t count);
+
+// Called by the core before each instruction
+void
+avr_itrace_mark(
+		avr_t * avr);
+// Called by the interrupt code before jumping to 'vector'
+void
+avr_itrace_irq(
+		avr_t * avr,
+		uint8_t vector);
+
+// Called by the core when 'v' is written to 'addr'
+static inline void
+avr_itrace_write(
+		avr_t * avr,
+		uint16_t addr,
+		uint8_t v)
+{
+	avr_itrace_record_t * r = avr->itrace->current;
+	int n = r->info & AVR_ITRACE_WRITE_COUNT;
+	if (n == AVR_ITRACE_WRITES) {
+		r->info |= AVR_ITRACE_LOST;
+		return;
+	}
+	r->write[n].addr = addr;
+	r->write[n].value = v;
+	r->info++;
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_ITRACE_H__ */
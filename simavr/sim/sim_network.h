@@ -58,6 +58,20 @@ static inline void network_release(void)
 	WSACleanup();
 }
 
+static inline int network_set_nonblocking(int sockfd)
+{
+	u_long mode = 1;
+	return ioctlsocket(sockfd, FIONBIO, &mode) ? -1 : 0;
+}
+
+// after a failed send/recv, was it only because the socket is full/empty?
+static inline int network_would_block(void)
+{
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+#define MSG_NOSIGNAL 0
+
 #else
 
 // native Linux
@@ -68,6 +82,8 @@ static inline void network_release(void)
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
 
 static inline int network_init(void)
 {
@@ -80,6 +96,22 @@ static inline void network_release(void)
 	// nothing to do
 }
 
+static inline int network_set_nonblocking(int sockfd)
+{
+	int flags = fcntl(sockfd, F_GETFL, 0);
+	return flags < 0 ? -1 : fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// after a failed send/recv, was it only because the socket is full/empty?
+static inline int network_would_block(void)
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+#ifndef MSG_NOSIGNAL	// BSDs and OSX use SO_NOSIGPIPE instead
+#define MSG_NOSIGNAL 0
+#endif
+
 #endif
 
 #ifdef __cplusplus
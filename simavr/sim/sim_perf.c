@@ -0,0 +1,191 @@
+/*
+	sim_perf.c
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE	// for dladdr()
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+#include "sim_avr.h"
+#include "sim_perf.h"
+
+int
+avr_perf_init(
+		avr_t * avr)
+{
+	if (avr->perf)
+		return 0;
+	avr->perf = calloc(1, sizeof(avr_perf_t));
+	return avr->perf ? 0 : -1;
+}
+
+void
+avr_perf_deinit(
+		avr_t * avr)
+{
+	free(avr->perf);
+	avr->perf = NULL;
+}
+
+uint8_t
+avr_perf_timer_owner(
+		avr_t * avr,
+		avr_cycle_timer_t timer,
+		void * param)
+{
+	avr_perf_t * p = avr->perf;
+	for (int i = 0; i < p->timer_count; i++)
+		if (p->timer[i].timer == timer && p->timer[i].param == param)
+			return i;
+	if (p->timer_count == AVR_PERF_TIMERS - 1)
+		return AVR_PERF_TIMERS - 1;
+	p->timer[p->timer_count].timer = timer;
+	p->timer[p->timer_count].param = param;
+	return p->timer_count++;
+}
+
+static void
+_avr_perf_reset(
+		avr_t * avr)
+{
+	avr_perf_t * p = avr->perf;
+	p->instructions = p->sleep_cycles = 0;
+	p->cycle_base = -avr->cycle;
+	memset(p->interrupts, 0, sizeof(p->interrupts));
+	memset(p->io_read, 0, sizeof(p->io_read));
+	memset(p->io_write, 0, sizeof(p->io_write));
+	// keep the owners, the cycle timer slots refer to them
+	for (int i = 0; i < AVR_PERF_TIMERS; i++)
+		p->timer[i].calls = 0;
+	avr->irq_pool.raised = 0;
+}
+
+int
+avr_perf_ioctl(
+		avr_t * avr,
+		uint32_t ctl,
+		void * io_param)
+{
+	avr_perf_t * p = avr->perf;
+	if (!p)
+		return -1;
+	switch (ctl) {
+		case AVR_IOCTL_PERF_GET: {
+			avr_perf_t * r = io_param;
+			p->cycles = p->cycle_base + avr->cycle;
+			p->irq_raised = avr->irq_pool.raised;
+			memcpy(r, p, sizeof(*r));
+			return 0;
+		}
+		case AVR_IOCTL_PERF_RESET:
+			_avr_perf_reset(avr);
+			return 0;
+	}
+	return -1;
+}
+
+// IO modules are often the parameter of their own cycle timers
+static const char *
+_avr_perf_timer_kind(
+		avr_t * avr,
+		void * param)
+{
+	for (avr_io_t * port = avr->io_port; port; port = port->next)
+		if ((void*)port == param)
+			return port->kind;
+	return NULL;
+}
+
+/*
+ * Name a cycle timer callback after its symbol if it's exported, static
+ * ones are named "object+offset" instead, for addr2line.
+ */
+static const char *
+_avr_perf_timer_name(
+		avr_cycle_timer_t timer,
+		char * buf,
+		size_t size)
+{
+	Dl_info info;
+	void * addr = (void*)(uintptr_t)timer;
+	if (!dladdr(addr, &info))
+		return NULL;
+	if (info.dli_sname && info.dli_saddr == addr)
+		return info.dli_sname;
+	if (!info.dli_fname)
+		return NULL;
+	const char * base = strrchr(info.dli_fname, '/');
+	snprintf(buf, size, "%s+0x%lx", base ? base + 1 : info.dli_fname,
+			(unsigned long)((uintptr_t)addr - (uintptr_t)info.dli_fbase));
+	return buf;
+}
+
+void
+avr_perf_write_json(
+		avr_t * avr,
+		FILE * out)
+{
+	avr_perf_t p;
+	if (avr_perf_ioctl(avr, AVR_IOCTL_PERF_GET, &p))
+		return;
+	fprintf(out, "{\"mmcu\":\"%s\",\"host_ns\":%llu,\"cycle\":%llu,"
+			"\"cycles\":%llu,\"instructions\":%llu,\"sleep_cycles\":%llu,"
+			"\"irq_raised\":%llu",
+			avr->mmcu, (unsigned long long)avr_get_time_stamp(avr),
+			(unsigned long long)avr->cycle, (unsigned long long)p.cycles,
+			(unsigned long long)p.instructions,
+			(unsigned long long)p.sleep_cycles,
+			(unsigned long long)p.irq_raised);
+	fprintf(out, ",\"interrupts\":{");
+	for (int i = 0, n = 0; i < AVR_PERF_VECTORS; i++)
+		if (p.interrupts[i])
+			fprintf(out, "%s\"%d\":%llu", n++ ? "," : "", i,
+					(unsigned long long)p.interrupts[i]);
+	// the io[] table is larger than the IO space of most cores, the end
+	// of it is SRAM
+	fprintf(out, "},\"io\":{");
+	for (int i = 0, n = 0; i < MAX_IOs && AVR_IO_TO_DATA(i) <= avr->ioend; i++)
+		if (p.io_read[i] || p.io_write[i])
+			fprintf(out, "%s\"0x%02x\":{\"r\":%llu,\"w\":%llu}", n++ ? "," : "",
+					AVR_IO_TO_DATA(i), (unsigned long long)p.io_read[i],
+					(unsigned long long)p.io_write[i]);
+	fprintf(out, "},\"timers\":[");
+	for (int i = 0, n = 0; i < AVR_PERF_TIMERS; i++) {
+		avr_perf_timer_t * t = &p.timer[i];
+		if (!t->calls)
+			continue;
+		fprintf(out, "%s{", n++ ? "," : "");
+		if (i == AVR_PERF_TIMERS - 1)
+			fprintf(out, "\"timer\":\"other\"");
+		else {
+			const char * kind = _avr_perf_timer_kind(avr, t->param);
+			char buf[128];
+			const char * name = _avr_perf_timer_name(t->timer, buf, sizeof(buf));
+			fprintf(out, "\"timer\":\"%s\"",
+					name ? name : kind ? kind : "unknown");
+			if (kind)
+				fprintf(out, ",\"kind\":\"%s\"", kind);
+		}
+		fprintf(out, ",\"calls\":%llu}", (unsigned long long)t->calls);
+	}
+	fprintf(out, "]}\n");
+	fflush(out);
+}
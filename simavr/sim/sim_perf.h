@@ -0,0 +1,107 @@
+/*
+	sim_perf.h
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Performance counters. Unlike the profiler and the other instrumentation,
+ * these are always on: they are a handful of increments on paths that are
+ * already taken (instruction retired, IO register access, interrupt
+ * serviced, cycle timer called, IRQ raised), and tell whether the time goes
+ * into the firmware, a peripheral model, or the host.
+ *
+ * The counters are allocated by avr_init(), and count from there; they are
+ * not cleared by avr_reset(), only by AVR_IOCTL_PERF_RESET.
+ */
+#ifndef __SIM_PERF_H__
+#define __SIM_PERF_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// copy the counters into an avr_perf_t passed as parameter
+#define AVR_IOCTL_PERF_GET		AVR_IOCTL_DEF('p','r','f','g')
+// clear the counters, parameter is ignored
+#define AVR_IOCTL_PERF_RESET	AVR_IOCTL_DEF('p','r','f','r')
+
+// interrupt vectors counted, the last one also counts all the ones above
+#define AVR_PERF_VECTORS	64
+// distinct cycle timer owners, the last one counts all the others
+#define AVR_PERF_TIMERS		(MAX_CYCLE_TIMERS * 2)
+
+// a cycle timer "owner" is a callback and its parameter
+typedef struct avr_perf_timer_t {
+	avr_cycle_timer_t	timer;
+	void *				param;
+	uint64_t			calls;
+} avr_perf_timer_t;
+
+typedef struct avr_perf_t {
+	uint64_t	instructions;	// instructions retired
+	uint64_t	cycles;			// total, including sleep; survives resets
+	uint64_t	sleep_cycles;
+	uint64_t	cycle_base;		// internal, makes 'cycles' from avr->cycle
+	uint64_t	interrupts[AVR_PERF_VECTORS];	// serviced, per vector
+	uint64_t	io_read[MAX_IOs];	// per IO register, see AVR_DATA_TO_IO()
+	uint64_t	io_write[MAX_IOs];
+	uint64_t	irq_raised;		// IRQs raised in avr->irq_pool
+	uint32_t	timer_count;
+	avr_perf_timer_t	timer[AVR_PERF_TIMERS];
+} avr_perf_t;
+
+// Called by avr_init() and avr_terminate()
+int
+avr_perf_init(
+		avr_t * avr);
+void
+avr_perf_deinit(
+		avr_t * avr);
+// handles the AVR_IOCTL_PERF_* ioctls, returns -1 for any other one
+int
+avr_perf_ioctl(
+		avr_t * avr,
+		uint32_t ctl,
+		void * io_param);
+/*
+ * Write the counters to 'out' as a single line JSON object, so a file
+ * can hold a series of snapshots. Only the non zero vectors, IO registers
+ * and timers are listed; timers are named after their callback, and the
+ * kind of the IO module they belong to, if any.
+ */
+void
+avr_perf_write_json(
+		avr_t * avr,
+		FILE * out);
+
+// Returns the index of the counter for a cycle timer owner
+uint8_t
+avr_perf_timer_owner(
+		avr_t * avr,
+		avr_cycle_timer_t timer,
+		void * param);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_PERF_H__ */
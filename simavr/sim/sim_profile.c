@@ -0,0 +1,462 @@
+/*
+	sim_profile.c
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "sim_avr.h"
+#include "sim_profile.h"
+#include "sim_callstack.h"
+
+static avr_cycle_count_t
+_avr_profile_sample(
+		avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_profile_t * p = avr->profile;
+	if (!p)
+		return 0;
+	if ((avr->pc >> 1) < p->size)
+		p->cycles[avr->pc >> 1] += p->period;
+	return when + p->period;
+}
+
+int
+avr_profile_init(
+		avr_t * avr,
+		elf_firmware_t * firmware,
+		uint32_t period,
+		const char * output,
+		avr_profile_format_t format)
+{
+	if (avr->profile)
+		return 0;
+	avr_profile_t * p = malloc(sizeof(avr_profile_t));
+	if (!p)
+		return -1;
+	memset(p, 0, sizeof(*p));
+	p->period = period;
+	p->size = (avr->flashend + 1) >> 1;
+	p->cycles = calloc(p->size, sizeof(p->cycles[0]));
+	if (!period)
+		p->count = calloc(p->size, sizeof(p->count[0]));
+	if (!p->cycles || (!period && !p->count) ||
+			(!period && avr_callstack_get(avr))) {
+		AVR_LOG(avr, LOG_ERROR, "PROFILE: Can't allocate the counters\n");
+		free(p->count);
+		free(p->cycles);
+		free(p);
+		return -1;
+	}
+	p->firmware = firmware;
+	p->output = output ? strdup(output) : NULL;
+	p->format = format;
+	avr->profile = p;
+	avr_profile_reset(avr);
+	p->cycle = avr->cycle;
+	return 0;
+}
+
+void
+avr_profile_reset(
+		avr_t * avr)
+{
+	avr_profile_t * p = avr->profile;
+	if (!p)
+		return;
+	p->pc = avr->pc;
+	p->cycle = 0;
+	// the cycle timers were all cancelled by the reset
+	if (p->period)
+		avr_cycle_timer_register(avr, p->period, _avr_profile_sample, avr);
+}
+
+void
+avr_profile_rebind(
+		avr_t * avr,
+		elf_firmware_t * firmware)
+{
+	avr_profile_t * p = avr->profile;
+	if (!p)
+		return;
+	p->firmware = firmware;
+	memset(p->cycles, 0, p->size * sizeof(p->cycles[0]));
+	if (p->count)
+		memset(p->count, 0, p->size * sizeof(p->count[0]));
+	if (p->edge)
+		memset(p->edge, 0, p->edge_size * sizeof(p->edge[0]));
+	p->edge_count = 0;
+}
+
+void
+avr_profile_deinit(
+		avr_t * avr)
+{
+	avr_profile_t * p = avr->profile;
+	if (!p)
+		return;
+	if (p->output)
+		avr_profile_write(avr, p->output, p->format);
+	if (p->period)
+		avr_cycle_timer_cancel(avr, _avr_profile_sample, avr);
+	else
+		avr_callstack_put(avr);
+	avr->profile = NULL;
+	free(p->edge);
+	free(p->output);
+	free(p->count);
+	free(p->cycles);
+	free(p);
+}
+
+int
+avr_profile_parse_format(
+		const char * name)
+{
+	if (!strcmp(name, "flat"))
+		return AVR_PROFILE_FLAT;
+	if (!strcmp(name, "gmon"))
+		return AVR_PROFILE_GMON;
+	if (!strcmp(name, "folded"))
+		return AVR_PROFILE_FOLDED;
+	if (!strcmp(name, "callgrind"))
+		return AVR_PROFILE_CALLGRIND;
+	return -1;
+}
+
+static avr_profile_edge_t *
+_avr_profile_edge_find(
+		avr_profile_t * p,
+		avr_flashaddr_t site,
+		avr_flashaddr_t target)
+{
+	uint32_t mask = p->edge_size - 1;
+	uint32_t h = ((site >> 1) * 31 + (target >> 1)) & mask;
+	while (p->edge[h].count &&
+			(p->edge[h].site != site || p->edge[h].target != target))
+		h = (h + 1) & mask;
+	return &p->edge[h];
+}
+
+// return the edge for 'site' -> 'target', creating it if needed
+static avr_profile_edge_t *
+_avr_profile_edge(
+		avr_profile_t * p,
+		avr_flashaddr_t site,
+		avr_flashaddr_t target)
+{
+	if (p->edge_count >= p->edge_size / 2) {
+		avr_profile_edge_t * old = p->edge;
+		uint32_t size = p->edge_size;
+		avr_profile_edge_t * edge = calloc(size ? size * 2 : 256, sizeof(*edge));
+		if (!edge)
+			return NULL;
+		p->edge = edge;
+		p->edge_size = size ? size * 2 : 256;
+		for (uint32_t i = 0; i < size; i++)
+			if (old[i].count)
+				*_avr_profile_edge_find(p, old[i].site, old[i].target) = old[i];
+		free(old);
+	}
+	avr_profile_edge_t * e = _avr_profile_edge_find(p, site, target);
+	if (!e->count) {
+		e->site = site;
+		e->target = target;
+		p->edge_count++;
+	}
+	return e;
+}
+
+void
+avr_profile_ret(
+		avr_t * avr,
+		avr_call_frame_t * f,
+		avr_cycle_count_t end)
+{
+	avr_profile_t * p = avr->profile;
+	if (p->period)
+		return;
+	avr_profile_edge_t * e = _avr_profile_edge(p, f->site, f->target);
+	if (!e)
+		return;
+	e->count++;
+	e->cycles += end - f->start;
+}
+
+typedef struct avr_profile_func_t {
+	int			symbol;	// -1 for code outside of any symbol
+	uint64_t	cycles;
+	uint64_t	count;
+	uint64_t	calls;
+} avr_profile_func_t;
+
+static int
+_avr_profile_func_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_profile_func_t * fa = a, * fb = b;
+	if (fa->cycles != fb->cycles)
+		return fa->cycles < fb->cycles ? 1 : -1;
+	return fa->symbol - fb->symbol;
+}
+
+/*
+ * Add up the counters per function, sorted by decreasing cycles. Returns
+ * the number of functions with a non zero count, and the total in 'total'.
+ */
+static int
+_avr_profile_functions(
+		avr_profile_t * p,
+		avr_profile_func_t ** out,
+		uint64_t * total)
+{
+	int count = 1;
+#if ELF_SYMBOLS
+	count += elf_firmware_load_symbols(p->firmware);
+#endif
+	avr_profile_func_t * func = calloc(count, sizeof(*func));
+	if (!func)
+		return -1;
+	for (int i = 0; i < count; i++)
+		func[i].symbol = i - 1;
+	*total = 0;
+	for (uint32_t w = 0; w < p->size; w++) {
+		if (!p->cycles[w] && !(p->count && p->count[w]))
+			continue;
+		int s = elf_firmware_find_symbol(p->firmware, w << 1);
+		func[s + 1].cycles += p->cycles[w];
+		if (p->count)
+			func[s + 1].count += p->count[w];
+		*total += p->cycles[w];
+	}
+	for (uint32_t i = 0; i < p->edge_size; i++)
+		if (p->edge[i].count)
+			func[elf_firmware_find_symbol(p->firmware, p->edge[i].target) + 1].calls +=
+					p->edge[i].count;
+	qsort(func, count, sizeof(*func), _avr_profile_func_cmp);
+	while (count && !func[count - 1].cycles && !func[count - 1].count)
+		count--;
+	*out = func;
+	return count;
+}
+
+static const char *
+_avr_profile_name(
+		avr_profile_t * p,
+		int symbol)
+{
+#if ELF_SYMBOLS
+	if (symbol >= 0)
+		return p->firmware->symbol[symbol]->symbol;
+#endif
+	return "[unknown]";
+}
+
+static void
+_avr_profile_put(
+		FILE * o,
+		uint32_t v,
+		int bytes)
+{
+	// gmon.out uses the byte order of the target, little endian for AVR
+	for (int i = 0; i < bytes; i++)
+		fputc((v >> (i * 8)) & 0xff, o);
+}
+
+/*
+ * Write a gmon.out file with a single histogram record, one bin per flash
+ * word. Bins are only 16 bits, so they count units of 'scale' cycles, and
+ * the profiling rate is adjusted so avr-gprof still reports seconds.
+ */
+static void
+_avr_profile_write_gmon(
+		avr_t * avr,
+		avr_profile_t * p,
+		FILE * o)
+{
+	uint64_t max = 0;
+	for (uint32_t w = 0; w < p->size; w++)
+		if (p->cycles[w] > max)
+			max = p->cycles[w];
+	uint64_t scale = (max + 0xfffe) / 0xffff;
+	if (!scale)
+		scale = 1;
+	uint32_t rate = avr->frequency / scale;
+
+	fwrite("gmon", 4, 1, o);
+	_avr_profile_put(o, 1, 4);		// version
+	_avr_profile_put(o, 0, 4);		// spare
+	_avr_profile_put(o, 0, 4);
+	_avr_profile_put(o, 0, 4);
+	fputc(0, o);					// GMON_TAG_TIME_HIST
+	_avr_profile_put(o, 0, 4);		// low pc
+	_avr_profile_put(o, p->size << 1, 4);	// high pc
+	_avr_profile_put(o, p->size, 4);	// number of bins
+	_avr_profile_put(o, rate ? rate : 1, 4);
+	char dimen[15] = "seconds";
+	fwrite(dimen, sizeof(dimen), 1, o);
+	fputc('s', o);
+	for (uint32_t w = 0; w < p->size; w++)
+		_avr_profile_put(o, (p->cycles[w] + scale / 2) / scale, 2);
+}
+
+static int
+_avr_profile_edge_cmp(
+		const void * a,
+		const void * b)
+{
+	const avr_profile_edge_t * ea = *(avr_profile_edge_t **)a;
+	const avr_profile_edge_t * eb = *(avr_profile_edge_t **)b;
+	if (ea->site != eb->site)
+		return ea->site < eb->site ? -1 : 1;
+	return ea->target < eb->target ? -1 : ea->target > eb->target;
+}
+
+/*
+ * Write a callgrind file, with instruction addresses as positions: the
+ * self cost of each instruction, and the calls made from it, in address
+ * order. The Instructions event is only there in exact mode.
+ */
+static int
+_avr_profile_write_callgrind(
+		avr_t * avr,
+		avr_profile_t * p,
+		FILE * o)
+{
+	avr_profile_edge_t ** edge = malloc((p->edge_count + 1) * sizeof(*edge));
+	if (!edge)
+		return -1;
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < p->edge_size; i++)
+		if (p->edge[i].count)
+			edge[count++] = &p->edge[i];
+	qsort(edge, count, sizeof(*edge), _avr_profile_edge_cmp);
+
+	fprintf(o, "# callgrind format\nversion: 1\ncreator: simavr\n");
+	fprintf(o, "cmd: %s at %u Hz\n", avr->mmcu, avr->frequency);
+	fprintf(o, "positions: instr\nevents: Cycles%s\n\n",
+			p->period ? "" : " Instructions");
+	int current = -2;
+	uint32_t ei = 0;
+	for (uint32_t w = 0; w < p->size; w++) {
+		int calls = ei < count && (edge[ei]->site >> 1) == w;
+		if (!p->cycles[w] && !(p->count && p->count[w]) && !calls)
+			continue;
+		int s = elf_firmware_find_symbol(p->firmware, w << 1);
+		if (s != current) {
+			fprintf(o, "fn=%s\n", _avr_profile_name(p, s));
+			current = s;
+		}
+		if (p->count)
+			fprintf(o, "0x%x %llu %u\n", w << 1,
+					(unsigned long long)p->cycles[w], p->count[w]);
+		else
+			fprintf(o, "0x%x %llu\n", w << 1, (unsigned long long)p->cycles[w]);
+		for (; ei < count && (edge[ei]->site >> 1) == w; ei++) {
+			avr_profile_edge_t * e = edge[ei];
+			fprintf(o, "cfn=%s\ncalls=%llu 0x%x\n0x%x %llu\n",
+					_avr_profile_name(p, elf_firmware_find_symbol(p->firmware, e->target)),
+					(unsigned long long)e->count, e->target,
+					e->site, (unsigned long long)e->cycles);
+		}
+	}
+	free(edge);
+	return 0;
+}
+
+int
+avr_profile_write(
+		avr_t * avr,
+		const char * path,
+		avr_profile_format_t format)
+{
+	avr_profile_t * p = avr->profile;
+	if (!p)
+		return -1;
+	// charge the instruction being run
+	if (!p->period) {
+		p->cycles[p->pc >> 1] += avr->cycle - p->cycle;
+		p->cycle = avr->cycle;
+	}
+	FILE * o = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+	if (!o) {
+		AVR_LOG(avr, LOG_ERROR, "PROFILE: Can't create %s: %s\n",
+				path, strerror(errno));
+		return -1;
+	}
+	if (format == AVR_PROFILE_GMON) {
+		_avr_profile_write_gmon(avr, p, o);
+	} else if (format == AVR_PROFILE_CALLGRIND) {
+		_avr_profile_write_callgrind(avr, p, o);
+	} else {
+		avr_profile_func_t * func;
+		uint64_t total;
+		int count = _avr_profile_functions(p, &func, &total);
+		if (count < 0) {
+			if (o != stdout)
+				fclose(o);
+			return -1;
+		}
+		if (format == AVR_PROFILE_FLAT) {
+			fprintf(o, "Flat profile: %s at %u Hz, %llu cycles",
+					avr->mmcu, avr->frequency, (unsigned long long)total);
+			if (p->period)
+				fprintf(o, ", sampled every %u cycles\n", p->period);
+			else
+				fprintf(o, "\n");
+			if (p->period)
+				fprintf(o, "%7s %12s %12s  %s\n", "%", "cumulative", "self",
+						"function");
+			else
+				fprintf(o, "%7s %12s %12s %12s %10s  %s\n", "%", "cumulative",
+						"self", "instr", "calls", "function");
+		}
+		uint64_t cumulative = 0;
+		for (int i = 0; i < count; i++) {
+			const char * name = _avr_profile_name(p, func[i].symbol);
+			cumulative += func[i].cycles;
+			if (format == AVR_PROFILE_FOLDED) {
+				if (func[i].cycles)
+					fprintf(o, "%s %llu\n", name,
+							(unsigned long long)func[i].cycles);
+				continue;
+			}
+			fprintf(o, "%7.2f %12llu %12llu ",
+					total ? 100.0 * func[i].cycles / total : 0.0,
+					(unsigned long long)cumulative,
+					(unsigned long long)func[i].cycles);
+			if (p->period)
+				fprintf(o, " %s\n", name);
+			else
+				fprintf(o, "%12llu %10llu  %s\n", (unsigned long long)func[i].count,
+						(unsigned long long)func[i].calls, name);
+		}
+		free(func);
+	}
+	if (o != stdout && fclose(o)) {
+		AVR_LOG(avr, LOG_ERROR, "PROFILE: Error writing %s\n", path);
+		return -1;
+	}
+	return 0;
+}
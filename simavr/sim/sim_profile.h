@@ -0,0 +1,149 @@
+/*
+	sim_profile.h
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cycle profiler. The cycles are accumulated per flash word, then added up
+ * per function using the ELF symbols when the report is written.
+ *
+ * In "exact" mode, the core charges the cycles taken by each instruction
+ * to its PC, and counts how many times it was run. The cycles spent
+ * sleeping are charged to the SLEEP instruction, and the interrupt entry
+ * cycles to the instruction that was interrupted.
+ * In "sampling" mode, a cycle timer charges 'period' cycles to the current
+ * PC every 'period' cycles instead, which costs nothing per instruction.
+ *
+ * Exact mode also uses the shadow call stack (see sim_callstack.h) to count
+ * the calls and the inclusive cycles of each call site.
+ *
+ * The report can be a flat per-function text profile, a gmon.out file for
+ * avr-gprof, "folded" lines for flamegraph.pl, or a callgrind file for
+ * KCachegrind.
+ */
+#ifndef __SIM_PROFILE_H__
+#define __SIM_PROFILE_H__
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum avr_profile_format_t {
+	AVR_PROFILE_FLAT = 0,	// text, one line per function
+	AVR_PROFILE_GMON,		// gmon.out histogram, for avr-gprof
+	AVR_PROFILE_FOLDED,		// "function cycles" lines, for flamegraph.pl
+	AVR_PROFILE_CALLGRIND,	// callgrind.out, for KCachegrind
+} avr_profile_format_t;
+
+// a call site, and where it went to
+typedef struct avr_profile_edge_t {
+	avr_flashaddr_t		site;
+	avr_flashaddr_t		target;
+	uint64_t			count;	// zero for a free slot
+	uint64_t			cycles;	// inclusive
+} avr_profile_edge_t;
+
+typedef struct avr_profile_t {
+	uint32_t				period;	// sampling period, zero in exact mode
+	uint32_t				size;	// flash words
+	uint64_t *				cycles;	// per flash word
+	uint32_t *				count;	// per flash word, exact mode only
+	avr_flashaddr_t			pc;		// instruction being run
+	avr_cycle_count_t		cycle;	// when it started
+	elf_firmware_t *		firmware;	// for the symbols, can be NULL
+	// call graph, exact mode only
+	uint32_t				edge_count, edge_size;	// edge_size is a power of two
+	avr_profile_edge_t *	edge;	// hash table
+	char *					output;	// report written at avr_terminate() time
+	avr_profile_format_t	format;
+} avr_profile_t;
+
+/*
+ * Start profiling 'avr'; if 'period' is zero, every instruction is
+ * accounted for, otherwise the PC is sampled every 'period' cycles.
+ * 'firmware' (optional) provides the symbols, and has to stay valid until
+ * the profiler is stopped. If 'output' is not NULL, a report in 'format' is
+ * written there by avr_terminate().
+ * Returns -1 on error.
+ */
+int
+avr_profile_init(
+		avr_t * avr,
+		elf_firmware_t * firmware,
+		uint32_t period,
+		const char * output,
+		avr_profile_format_t format);
+// stop profiling, write the report if any, and free the profiler
+void
+avr_profile_deinit(
+		avr_t * avr);
+// called by avr_reset(), as the cycle counter restarts at zero
+void
+avr_profile_reset(
+		avr_t * avr);
+/*
+ * Clear the counters and take the symbols from 'firmware' (can be NULL)
+ * from now on; called by avr_reset_full() and avr_reload(), as the flash
+ * now holds some other code.
+ */
+void
+avr_profile_rebind(
+		avr_t * avr,
+		elf_firmware_t * firmware);
+// write a report in 'format' to 'path' ("-" is stdout)
+int
+avr_profile_write(
+		avr_t * avr,
+		const char * path,
+		avr_profile_format_t format);
+// parse a format name ("flat", "gmon", "folded" or "callgrind"), returns -1 if unknown
+int
+avr_profile_parse_format(
+		const char * name);
+
+// Called by the core before each instruction, in exact mode
+static inline void
+avr_profile_mark(
+		avr_t * avr)
+{
+	avr_profile_t * p = avr->profile;
+	if (p->period)
+		return;
+	p->cycles[p->pc >> 1] += avr->cycle - p->cycle;
+	p->count[avr->pc >> 1]++;
+	p->pc = avr->pc;
+	p->cycle = avr->cycle;
+}
+
+struct avr_call_frame_t;
+// Called by the shadow call stack when frame 'f' returned, 'end' is when it's done
+void
+avr_profile_ret(
+		avr_t * avr,
+		struct avr_call_frame_t * f,
+		avr_cycle_count_t end);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_PROFILE_H__ */
@@ -0,0 +1,187 @@
+/*
+	sim_stack.c
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "sim_avr.h"
+#include "sim_stack.h"
+
+int
+avr_stack_init(
+		avr_t * avr,
+		elf_firmware_t * firmware,
+		const char * output)
+{
+	if (avr->stack)
+		return 0;
+	avr_stack_t * s = malloc(sizeof(avr_stack_t));
+	if (!s)
+		return -1;
+	if (avr_callstack_get(avr)) {
+		free(s);
+		return -1;
+	}
+	s->output = output ? strdup(output) : NULL;
+	avr->stack = s;
+	avr_stack_rebind(avr, firmware);
+	return 0;
+}
+
+void
+avr_stack_rebind(
+		avr_t * avr,
+		elf_firmware_t * firmware)
+{
+	avr_stack_t * s = avr->stack;
+	if (!s)
+		return;
+	char * output = s->output;
+	memset(s, 0, sizeof(*s));
+	s->output = output;
+	s->firmware = firmware;
+	// .data then .bss are at the start of the SRAM
+	if (firmware && (firmware->datasize || firmware->bsssize))
+		s->limit = avr->ioend + 1 + firmware->datasize + firmware->bsssize;
+	s->min = 0xffff;
+	for (int i = 0; i < AVR_STACK_LEVELS; i++)
+		s->level_min[i] = 0xffff;
+}
+
+void
+avr_stack_deinit(
+		avr_t * avr)
+{
+	avr_stack_t * s = avr->stack;
+	if (!s)
+		return;
+	if (s->output) {
+		FILE * o = strcmp(s->output, "-") ? fopen(s->output, "w") : stdout;
+		if (o) {
+			avr_stack_report(avr, o);
+			if (o != stdout)
+				fclose(o);
+		} else
+			AVR_LOG(avr, LOG_ERROR, "STACK: Can't create %s: %s\n",
+					s->output, strerror(errno));
+	}
+	avr->stack = NULL;
+	avr_callstack_put(avr);
+	free(s->output);
+	free(s);
+}
+
+void
+avr_stack_low(
+		avr_t * avr,
+		uint16_t sp)
+{
+	avr_stack_t * s = avr->stack;
+	s->level_min[avr->interrupts.running_ptr] = sp;
+	if (sp < s->min) {
+		s->min = sp;
+		s->min_pc = avr->pc;
+		s->min_cycle = avr->cycle;
+		avr_callstack_t * c = avr->callstack;
+		s->min_depth = c->depth;
+		memcpy(s->min_stack, c->frame, c->depth * sizeof(c->frame[0]));
+	}
+	// SP points to the next free byte, so it can be one byte into .bss
+	if (sp + 1 < s->limit) {
+		if (!s->overflow++) {
+			s->overflow_pc = avr->pc;
+			s->overflow_cycle = avr->cycle;
+			AVR_LOG(avr, LOG_ERROR,
+					"STACK: SP=%04x is in .data/.bss (ends at %04x) at PC=%04x\n",
+					sp, s->limit, avr->pc);
+		}
+	}
+}
+
+static void
+_avr_stack_where(
+		avr_stack_t * s,
+		avr_flashaddr_t pc,
+		FILE * out)
+{
+	fprintf(out, "0x%04x", pc);
+#if ELF_SYMBOLS
+	int i = elf_firmware_find_symbol(s->firmware, pc);
+	if (i < 0)
+		return;
+	avr_symbol_t * sym = s->firmware->symbol[i];
+	if (pc == sym->addr)
+		fprintf(out, " %s", sym->symbol);
+	else
+		fprintf(out, " %s+0x%x", sym->symbol, pc - sym->addr);
+#endif
+}
+
+void
+avr_stack_report(
+		avr_t * avr,
+		FILE * out)
+{
+	avr_stack_t * s = avr->stack;
+	if (!s)
+		return;
+	fprintf(out, "Stack usage: %s, RAMEND %04x\n", avr->mmcu, avr->ramend);
+	if (s->min == 0xffff) {
+		fprintf(out, "  no instruction run\n");
+		return;
+	}
+	fprintf(out, "  worst case: SP=%04x, %d bytes used, at PC ",
+			s->min, avr->ramend - s->min);
+	_avr_stack_where(s, s->min_pc, out);
+	fprintf(out, ", cycle %llu\n", (unsigned long long)s->min_cycle);
+	if (s->limit) {
+		if (s->overflow) {
+			fprintf(out, "  OVERFLOW: SP went into .data/.bss (ends at %04x) "
+					"%u times, first at PC ", s->limit, s->overflow);
+			_avr_stack_where(s, s->overflow_pc, out);
+			fprintf(out, ", cycle %llu\n",
+					(unsigned long long)s->overflow_cycle);
+		} else
+			fprintf(out, "  .bss ends at %04x, %d bytes never used\n",
+					s->limit, s->min + 1 - s->limit);
+	}
+	for (int i = 0; i < AVR_STACK_LEVELS; i++) {
+		if (s->level_min[i] == 0xffff)
+			continue;
+		if (i)
+			fprintf(out, "  interrupt level %d: min SP=%04x\n", i, s->level_min[i]);
+		else
+			fprintf(out, "  main: min SP=%04x\n", s->level_min[i]);
+	}
+	fprintf(out, "  call chain at worst case:\n    #0 ");
+	_avr_stack_where(s, s->min_pc, out);
+	fprintf(out, "\n");
+	for (int i = s->min_depth - 1, n = 1; i >= 0; i--, n++) {
+		avr_call_frame_t * f = &s->min_stack[i];
+		fprintf(out, "    #%d ", n);
+		_avr_stack_where(s, f->site, out);
+		if (f->irq)
+			fprintf(out, " (interrupted by vector %d)",
+					f->target / avr->vector_size);
+		fprintf(out, ", SP=%04x\n", f->sp);
+	}
+}
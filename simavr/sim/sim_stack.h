@@ -0,0 +1,118 @@
+/*
+	sim_stack.h
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Stack usage analysis. This is the runtime version of AVR_STACK_WATCH, it
+ * doesn't need a special build.
+ *
+ * Before each instruction, the core compares SP with the lowest value seen
+ * so far at the current interrupt nesting level (0 is the main code). When
+ * SP reaches a new overall low, the call chain (from the shadow call stack,
+ * see sim_callstack.h) is saved, to show how the worst case was reached.
+ *
+ * If the firmware is known, SP going below the end of .bss (ie, into .data
+ * or .bss) is flagged as a stack overflow. Note that the heap, if any, is
+ * not accounted for, and that firmwares that keep stacks in .bss (task or
+ * coroutine stacks) will be flagged too.
+ */
+#ifndef __SIM_STACK_H__
+#define __SIM_STACK_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_callstack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// interrupt nesting levels tracked, 0 is the main code
+#define AVR_STACK_LEVELS		65
+
+typedef struct avr_stack_t {
+	uint16_t			limit;	// end of .bss, zero if unknown
+	uint16_t			min;	// lowest SP seen
+	avr_flashaddr_t		min_pc;	// where it was seen
+	avr_cycle_count_t	min_cycle;
+	uint16_t			level_min[AVR_STACK_LEVELS];
+	// first overflow
+	uint32_t			overflow;	// number of new lows below 'limit'
+	avr_flashaddr_t		overflow_pc;
+	avr_cycle_count_t	overflow_cycle;
+	// copy of the shadow call stack when 'min' was reached
+	uint32_t			min_depth;
+	avr_call_frame_t	min_stack[AVR_CALLSTACK_MAX_DEPTH];
+	elf_firmware_t *	firmware;	// for the symbols, can be NULL
+	char *				output;	// report written at avr_terminate() time
+} avr_stack_t;
+
+/*
+ * Start tracking the stack usage of 'avr'. 'firmware' (optional) provides
+ * the end of .bss and the symbols, and has to stay valid until the analysis
+ * is stopped. If 'output' is not NULL, a report is written there by
+ * avr_terminate() ("-" is stdout).
+ * Returns -1 on error.
+ */
+int
+avr_stack_init(
+		avr_t * avr,
+		elf_firmware_t * firmware,
+		const char * output);
+// stop the analysis, write the report if any, and free it
+void
+avr_stack_deinit(
+		avr_t * avr);
+/*
+ * Start over with 'firmware' (can be NULL) for the end of .bss and the
+ * symbols; called by avr_reset_full() and avr_reload()
+ */
+void
+avr_stack_rebind(
+		avr_t * avr,
+		elf_firmware_t * firmware);
+// print the worst case stack usage, and how it was reached
+void
+avr_stack_report(
+		avr_t * avr,
+		FILE * out);
+
+// called when SP goes below the lowest value seen at the current level
+void
+avr_stack_low(
+		avr_t * avr,
+		uint16_t sp);
+
+// Called by the core before each instruction
+static inline void
+avr_stack_mark(
+		avr_t * avr)
+{
+	uint16_t sp = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+	if (sp < avr->stack->level_min[avr->interrupts.running_ptr])
+		avr_stack_low(avr, sp);
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_STACK_H__ */
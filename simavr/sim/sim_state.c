@@ -0,0 +1,637 @@
+/*
+	sim_state.c
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE	// for dladdr()
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifndef __MINGW32__
+#include <dlfcn.h>
+#endif
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_io.h"
+#include "sim_undo.h"
+#include "sim_state.h"
+#include "avr_eeprom.h"
+
+DEFINE_FIFO(avr_int_vector_p, avr_int_pending);
+
+#define AVR_STATE_MAGIC		"simavrST"
+#define AVR_STATE_VERSION	3
+
+// cycle timer functions are saved relative to this one
+#define AVR_STATE_CODE_BASE	((intptr_t)avr_cycle_timer_register)
+
+typedef struct avr_state_header_t {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	core_size;
+	uint64_t	build;		// see _avr_state_build()
+	char		mmcu[32];
+	uint32_t	frequency;
+	uint32_t	flashend;
+	uint32_t	e2end;
+	uint32_t	ramend;
+} avr_state_header_t;
+
+typedef struct avr_state_core_t {
+	avr_cycle_count_t	cycle;
+	avr_cycle_count_t	run_cycle_limit;
+	uint32_t	pc, reset_pc, codeend;
+	int32_t		state;
+	uint32_t	vcc, avcc, aref;
+	int8_t		interrupt_state;
+	uint8_t		sreg[8];
+} avr_state_core_t;
+
+// what an IO module 'state' callback saved, followed by 'size' bytes
+typedef struct avr_state_module_t {
+	uint32_t	kind;	// hash of avr_io_t.kind, to check it's the same module
+	uint32_t	size;
+} avr_state_module_t;
+
+typedef struct avr_state_irq_t {
+	uint32_t	irq;
+	uint32_t	name;	// hash of the name, to check it's the same IRQ
+	uint32_t	value;
+	uint32_t	flags;
+} avr_state_irq_t;
+
+typedef struct avr_state_timer_t {
+	avr_cycle_count_t	when;
+	int64_t		timer;	// relative to AVR_STATE_CODE_BASE
+	int64_t		param;	// offset in the core, or -1 for NULL
+} avr_state_timer_t;
+
+uint64_t
+avr_state_hash(
+		uint64_t hash,
+		const void * data,
+		size_t size)
+{
+	const uint8_t * d = data;
+	if (!hash)
+		hash = 0xcbf29ce484222325ull;
+	while (size--) {
+		hash ^= *d++;
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+uint64_t
+avr_state_hash_file(
+		uint64_t hash,
+		const char * path)
+{
+	FILE * f = fopen(path, "rb");
+	if (!f)
+		return avr_state_hash(hash, path, strlen(path));
+	uint8_t buf[4096];
+	size_t r;
+	while ((r = fread(buf, 1, sizeof(buf), f)) > 0)
+		hash = avr_state_hash(hash, buf, r);
+	fclose(f);
+	return hash;
+}
+
+/*
+ * Anything that changes the layout of the core structure, or moves the
+ * code around invalidates the snapshots
+ */
+static uint64_t
+_avr_state_build(
+		avr_t * avr)
+{
+	intptr_t b[] = {
+		AVR_STATE_VERSION, sizeof(avr_t), avr->core_size,
+		(intptr_t)avr_run_one - AVR_STATE_CODE_BASE,
+		(intptr_t)avr_state_save - AVR_STATE_CODE_BASE,
+	};
+	return avr_state_hash(0, b, sizeof(b));
+}
+
+static uint8_t *
+_avr_state_eeprom(
+		avr_t * avr,
+		uint32_t * size)
+{
+	avr_eeprom_desc_t d = { .size = avr->e2end + 1 };
+	*size = 0;
+	if (!avr->e2end)
+		return NULL;
+	avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &d);
+	if (d.ee)
+		*size = d.size;
+	return d.ee;
+}
+
+uint64_t
+avr_state_key(
+		avr_t * avr,
+		const void * extra,
+		size_t size)
+{
+	uint64_t build = _avr_state_build(avr);
+	uint64_t h = avr_state_hash(0, &build, sizeof(build));
+	h = avr_state_hash(h, avr->mmcu, strlen(avr->mmcu));
+	h = avr_state_hash(h, &avr->frequency, sizeof(avr->frequency));
+	h = avr_state_hash(h, avr->flash, avr->flashend + 1);
+	uint32_t ee_size;
+	uint8_t * ee = _avr_state_eeprom(avr, &ee_size);
+	if (ee)
+		h = avr_state_hash(h, ee, ee_size);
+	if (extra && size)
+		h = avr_state_hash(h, extra, size);
+	return h;
+}
+
+static int
+_avr_state_vector_index(
+		avr_t * avr,
+		avr_int_vector_t * vector)
+{
+	for (int i = 0; i < avr->interrupts.vector_count; i++)
+		if (avr->interrupts.vector[i] == vector)
+			return i;
+	return -1;
+}
+
+static int
+_avr_state_in_core(
+		avr_t * avr,
+		const void * p)
+{
+	return (const uint8_t*)p >= (uint8_t*)avr &&
+			(const uint8_t*)p < (uint8_t*)avr + avr->core_size;
+}
+
+/*
+ * Returns the base address of the executable or library that contains
+ * 'p', or NULL if it isn't in one. Code offsets saved in a snapshot are
+ * only valid in that same object.
+ */
+static const void *
+_avr_state_object(
+		const void * p)
+{
+#ifdef __MINGW32__
+	return NULL;
+#else
+	Dl_info info;
+	if (!p || !dladdr(p, &info))
+		return NULL;
+	return info.dli_fbase;
+#endif
+}
+
+static int
+_avr_state_write(
+		FILE * f,
+		const void * data,
+		size_t size)
+{
+	return size && fwrite(data, size, 1, f) != 1 ? -1 : 0;
+}
+
+int
+avr_state_io(
+		avr_state_io_t * s,
+		void * data,
+		size_t size)
+{
+	if (s->load) {
+		if (size > s->size - s->pos)
+			return -1;
+		memcpy(data, s->b + s->pos, size);
+	} else {
+		if (size > s->size - s->pos) {
+			size_t n = (s->pos + size) * 2;
+			uint8_t * b = realloc(s->b, n);
+			if (!b)
+				return -1;
+			s->b = b;
+			s->size = n;
+		}
+		memcpy(s->b + s->pos, data, size);
+	}
+	s->pos += size;
+	return 0;
+}
+
+static uint32_t
+_avr_state_kind(
+		avr_io_t * io)
+{
+	return io->kind ? avr_state_hash(0, io->kind, strlen(io->kind)) : 0;
+}
+
+// the modules are saved in the order they are registered in
+static int
+_avr_state_save_modules(
+		avr_t * avr,
+		FILE * f)
+{
+	uint32_t count = 0;
+	for (avr_io_t * io = avr->io_port; io; io = io->next)
+		count++;
+	int res = _avr_state_write(f, &count, sizeof(count));
+	avr_state_io_t s = { .load = 0 };
+	for (avr_io_t * io = avr->io_port; io && !res; io = io->next) {
+		s.pos = 0;
+		if (io->state(io, &s)) {
+			AVR_LOG(avr, LOG_ERROR, "STATE: %s: can't save the %s module\n",
+					__func__, io->kind);
+			res = -1;
+			break;
+		}
+		avr_state_module_t m = {
+			.kind = _avr_state_kind(io),
+			.size = s.pos,
+		};
+		res = _avr_state_write(f, &m, sizeof(m)) ||
+				_avr_state_write(f, s.b, s.pos);
+	}
+	free(s.b);
+	return res;
+}
+
+int
+avr_state_save(
+		avr_t * avr,
+		const char * path)
+{
+	if (!avr->core_size) {
+		AVR_LOG(avr, LOG_ERROR, "STATE: %s: unknown core size\n", __func__);
+		return -1;
+	}
+	/*
+	 * check the cycle timers can be saved before doing anything: the
+	 * callback is saved as an offset in this library, so it can't be in
+	 * the application, and the parameter must be in the core
+	 */
+	const void * lib = _avr_state_object((void*)AVR_STATE_CODE_BASE);
+	if (!lib) {
+		AVR_LOG(avr, LOG_ERROR, "STATE: %s: can't locate the code on this "
+				"platform\n", __func__);
+		return -1;
+	}
+	uint32_t timer_count = 0;
+	for (avr_cycle_timer_slot_p t = avr->cycle_timers.timer; t; t = t->next) {
+		if (_avr_state_object((void*)t->timer) != lib) {
+			AVR_LOG(avr, LOG_ERROR, "STATE: %s: cycle timer %p is not in "
+					"simavr, can't be saved\n", __func__, t->timer);
+			return -1;
+		}
+		if (t->param && !_avr_state_in_core(avr, t->param)) {
+			AVR_LOG(avr, LOG_ERROR, "STATE: %s: cycle timer %p has an external "
+					"parameter, can't be saved\n", __func__, t->timer);
+			return -1;
+		}
+		timer_count++;
+	}
+	// and so must be the private state of the IO modules
+	for (avr_io_t * io = avr->io_port; io; io = io->next)
+		if (!io->state) {
+			AVR_LOG(avr, LOG_ERROR, "STATE: %s: the %s module has no state "
+					"callback, can't be saved\n", __func__, io->kind);
+			return -1;
+		}
+	FILE * f = fopen(path, "wb");
+	if (!f) {
+		AVR_LOG(avr, LOG_ERROR, "STATE: %s: %s: %s\n", __func__,
+				path, strerror(errno));
+		return -1;
+	}
+	avr_state_header_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, AVR_STATE_MAGIC, sizeof(h.magic));
+	h.version = AVR_STATE_VERSION;
+	h.core_size = avr->core_size;
+	h.build = _avr_state_build(avr);
+	strncpy(h.mmcu, avr->mmcu, sizeof(h.mmcu) - 1);
+	h.frequency = avr->frequency;
+	h.flashend = avr->flashend;
+	h.e2end = avr->e2end;
+	h.ramend = avr->ramend;
+
+	avr_state_core_t c;
+	memset(&c, 0, sizeof(c));
+	c.cycle = avr->cycle;
+	c.run_cycle_limit = avr->run_cycle_limit;
+	c.pc = avr->pc;
+	c.reset_pc = avr->reset_pc;
+	c.codeend = avr->codeend;
+	c.state = avr->state;
+	c.vcc = avr->vcc;
+	c.avcc = avr->avcc;
+	c.aref = avr->aref;
+	c.interrupt_state = avr->interrupt_state;
+	memcpy(c.sreg, avr->sreg, sizeof(c.sreg));
+
+	int res = _avr_state_write(f, &h, sizeof(h)) ||
+			_avr_state_write(f, &c, sizeof(c)) ||
+			_avr_state_write(f, avr->data, avr->ramend + 1) ||
+			_avr_state_write(f, avr->flash, avr->flashend + 1);
+	uint32_t ee_size;
+	uint8_t * ee = _avr_state_eeprom(avr, &ee_size);
+	res = res || _avr_state_write(f, &ee_size, sizeof(ee_size)) ||
+			_avr_state_write(f, ee, ee_size);
+	res = res || _avr_state_save_modules(avr, f);
+
+	// IRQ values, in the order they were allocated
+	uint32_t irq_count = avr->irq_pool.count;
+	res = res || _avr_state_write(f, &irq_count, sizeof(irq_count));
+	for (int i = 0; i < irq_count && !res; i++) {
+		avr_irq_t * irq = avr->irq_pool.irq[i];
+		avr_state_irq_t s = {
+			.irq = irq->irq,
+			.name = irq->name ? avr_state_hash(0, irq->name, strlen(irq->name)) : 0,
+			.value = irq->value,
+			.flags = irq->flags,
+		};
+		res = _avr_state_write(f, &s, sizeof(s));
+	}
+	// pending and running interrupts, as indexes in the vector table
+	avr_int_table_p table = &avr->interrupts;
+	uint8_t vec[130];
+	int vc = 0;
+	vec[vc++] = avr_int_pending_get_read_size(&table->pending);
+	for (int i = 0; i < vec[0]; i++)
+		vec[vc++] = _avr_state_vector_index(avr,
+				avr_int_pending_read_at(&table->pending, i));
+	vec[vc++] = table->running_ptr;
+	for (int i = 0; i < table->running_ptr; i++)
+		vec[vc++] = _avr_state_vector_index(avr, table->running[i]);
+	res = res || _avr_state_write(f, vec, vc);
+
+	res = res || _avr_state_write(f, &timer_count, sizeof(timer_count));
+	for (avr_cycle_timer_slot_p t = avr->cycle_timers.timer; t && !res; t = t->next) {
+		avr_state_timer_t s = {
+			.when = t->when,
+			.timer = (intptr_t)t->timer - AVR_STATE_CODE_BASE,
+			.param = t->param ? (uint8_t*)t->param - (uint8_t*)avr : -1,
+		};
+		res = _avr_state_write(f, &s, sizeof(s));
+	}
+	if (fclose(f))
+		res = -1;
+	if (res) {
+		AVR_LOG(avr, LOG_ERROR, "STATE: %s: error writing %s\n", __func__, path);
+		unlink(path);
+		return -1;
+	}
+	return 0;
+}
+
+// cursor in a loaded snapshot
+typedef struct avr_state_cursor_t {
+	uint8_t *	b;
+	size_t		size, pos;
+} avr_state_cursor_t;
+
+static void *
+_avr_state_read(
+		avr_state_cursor_t * c,
+		size_t size)
+{
+	if (c->pos + size > c->size)
+		return NULL;
+	void * res = c->b + c->pos;
+	c->pos += size;
+	return res;
+}
+
+#define _avr_state_read_u32(_c, _v) ({ \
+		uint32_t * _p = _avr_state_read(_c, sizeof(uint32_t)); \
+		if (_p) memcpy(&(_v), _p, sizeof(uint32_t)); \
+		_p != NULL; \
+	})
+
+int
+avr_state_load(
+		avr_t * avr,
+		const char * path)
+{
+	FILE * f = fopen(path, "rb");
+	if (!f)
+		return -1;
+	avr_state_cursor_t c = { 0 };
+	fseek(f, 0, SEEK_END);
+	c.size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	c.b = malloc(c.size ? c.size : 1);
+	int ok = fread(c.b, 1, c.size, f) == c.size;
+	fclose(f);
+
+	avr_state_header_t h;
+	avr_state_header_t * hp = ok ? _avr_state_read(&c, sizeof(h)) : NULL;
+	if (hp)
+		memcpy(&h, hp, sizeof(h));
+	if (!hp || memcmp(h.magic, AVR_STATE_MAGIC, sizeof(h.magic)) ||
+			h.version != AVR_STATE_VERSION ||
+			h.core_size != avr->core_size ||
+			h.build != _avr_state_build(avr) ||
+			strncmp(h.mmcu, avr->mmcu, sizeof(h.mmcu)) ||
+			h.flashend != avr->flashend ||
+			h.ramend != avr->ramend || h.e2end != avr->e2end) {
+		AVR_LOG(avr, LOG_WARNING, "STATE: %s: %s is not a snapshot of this core\n",
+				__func__, path);
+		free(c.b);
+		return -1;
+	}
+	/*
+	 * Parse all the sections before changing anything, so a truncated file
+	 * leaves the core alone
+	 */
+	avr_state_core_t core;
+	avr_state_core_t * cp = _avr_state_read(&c, sizeof(core));
+	uint8_t * data = _avr_state_read(&c, avr->ramend + 1);
+	uint8_t * flash = _avr_state_read(&c, avr->flashend + 1);
+	uint32_t ee_size = 0, module_count = 0, irq_count = 0;
+	uint8_t * ee = NULL, * modules = NULL;
+	avr_state_irq_t * irqs = NULL;
+	uint8_t * pending = NULL, * running = NULL;
+	uint32_t timer_count = 0;
+	avr_state_timer_t * timers = NULL;
+
+	ok = cp && data && flash && _avr_state_read_u32(&c, ee_size) &&
+			(ee = _avr_state_read(&c, ee_size)) != NULL &&
+			_avr_state_read_u32(&c, module_count);
+	// same modules, in the same order
+	if (ok) {
+		modules = c.b + c.pos;
+		avr_io_t * io = avr->io_port;
+		for (int i = 0; i < module_count && ok; i++, io = io->next) {
+			avr_state_module_t m;
+			avr_state_module_t * mp = _avr_state_read(&c, sizeof(m));
+			if (mp)
+				memcpy(&m, mp, sizeof(m));
+			ok = mp && io && io->state && m.kind == _avr_state_kind(io) &&
+					_avr_state_read(&c, m.size);
+		}
+		ok = ok && !io;
+	}
+	ok = ok && _avr_state_read_u32(&c, irq_count) &&
+			(irqs = _avr_state_read(&c, irq_count * sizeof(*irqs))) &&
+			(pending = _avr_state_read(&c, 1)) &&
+			_avr_state_read(&c, pending[0]) &&
+			(running = _avr_state_read(&c, 1)) &&
+			_avr_state_read(&c, running[0]) &&
+			_avr_state_read_u32(&c, timer_count) &&
+			(timers = _avr_state_read(&c, timer_count * sizeof(*timers)));
+	for (int i = 0; ok && i < pending[0] + running[0]; i++) {
+		uint8_t v = i < pending[0] ? pending[1 + i] : running[1 + i - pending[0]];
+		ok = v < avr->interrupts.vector_count;
+	}
+	const void * lib = _avr_state_object((void*)AVR_STATE_CODE_BASE);
+	for (int i = 0; ok && i < timer_count; i++) {
+		avr_state_timer_t t;
+		memcpy(&t, &timers[i], sizeof(t));
+		ok = lib && _avr_state_object(
+				(void*)(AVR_STATE_CODE_BASE + (intptr_t)t.timer)) == lib &&
+				(t.param == -1 ||
+					(t.param >= 0 && t.param < avr->core_size));
+	}
+	if (!ok || (ee_size && ee_size != avr->e2end + 1)) {
+		AVR_LOG(avr, LOG_WARNING, "STATE: %s: %s is truncated or corrupted\n",
+				__func__, path);
+		free(c.b);
+		return -1;
+	}
+	memcpy(&core, cp, sizeof(core));
+
+	// core
+	avr->cycle = core.cycle;
+	avr->run_cycle_limit = core.run_cycle_limit;
+	avr->pc = core.pc;
+	avr->reset_pc = core.reset_pc;
+	avr->codeend = core.codeend;
+	avr->state = core.state;
+	avr->vcc = core.vcc;
+	avr->avcc = core.avcc;
+	avr->aref = core.aref;
+	avr->interrupt_state = core.interrupt_state;
+	memcpy(avr->sreg, core.sreg, sizeof(avr->sreg));
+	memcpy(avr->data, data, avr->ramend + 1);
+	// keep a shared flash image if the code is the same
+	if (memcmp(avr->flash, flash, avr->flashend + 1))
+		avr_loadcode(avr, flash, avr->flashend + 1, 0);
+	if (ee_size) {
+		uint32_t size;
+		uint8_t * dst = _avr_state_eeprom(avr, &size);
+		if (dst && size == ee_size)
+			memcpy(dst, ee, ee_size);
+	}
+	// IO modules, their kinds were checked but not their state sizes
+	uint8_t * p = modules;
+	for (avr_io_t * io = avr->io_port; io; io = io->next) {
+		avr_state_module_t m;
+		memcpy(&m, p, sizeof(m));
+		avr_state_io_t s = {
+			.load = 1, .b = p + sizeof(m), .size = m.size,
+		};
+		if (io->state(io, &s) || s.pos != s.size)
+			AVR_LOG(avr, LOG_WARNING, "STATE: %s: the %s module state "
+					"doesn't match, not fully restored\n", __func__, io->kind);
+		p += sizeof(m) + m.size;
+	}
+	// IRQs, stops at the first one that doesn't match
+	for (int i = 0; i < irq_count && i < avr->irq_pool.count; i++) {
+		avr_state_irq_t s;
+		memcpy(&s, &irqs[i], sizeof(s));
+		avr_irq_t * irq = avr->irq_pool.irq[i];
+		uint32_t name = irq->name ?
+				avr_state_hash(0, irq->name, strlen(irq->name)) : 0;
+		if (s.irq != irq->irq || s.name != name) {
+			AVR_LOG(avr, LOG_WARNING, "STATE: %s: IRQ %d differs, "
+					"IRQs not restored past it\n", __func__, i);
+			break;
+		}
+		const uint8_t state_flags = IRQ_FLAG_INIT | IRQ_FLAG_FLOATING;
+		irq->value = s.value;
+		irq->flags = (irq->flags & ~state_flags) | (s.flags & state_flags);
+	}
+	// interrupts
+	avr_int_table_p table = &avr->interrupts;
+	avr_int_pending_reset(&table->pending);
+	for (int i = 0; i < pending[0]; i++)
+		avr_int_pending_write(&table->pending, table->vector[pending[1 + i]]);
+	table->running_ptr = running[0];
+	for (int i = 0; i < running[0]; i++)
+		table->running[i] = table->vector[running[1 + i]];
+	// cycle timers, in the order they were queued
+	avr_cycle_timer_reset(avr);
+	avr->run_cycle_limit = core.run_cycle_limit;
+	for (int i = 0; i < timer_count; i++) {
+		avr_state_timer_t s;
+		memcpy(&s, &timers[i], sizeof(s));
+		avr_cycle_timer_register(avr,
+				s.when > avr->cycle ? s.when - avr->cycle : 0,
+				(avr_cycle_timer_t)(AVR_STATE_CODE_BASE + (intptr_t)s.timer),
+				s.param < 0 ? NULL : (uint8_t*)avr + s.param);
+	}
+	// there is no going back past a restore
+	avr_undo_clear(avr);
+	free(c.b);
+	return 0;
+}
+
+int
+avr_state_warm_start(
+		avr_t * avr,
+		const char * dir,
+		uint64_t key,
+		avr_cycle_count_t cycle,
+		avr_flashaddr_t pc)
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%s-%016llx.state", dir, avr->mmcu,
+			(unsigned long long)key);
+	if (!access(path, R_OK) && avr_state_load(avr, path) == 0) {
+		AVR_LOG(avr, LOG_TRACE, "STATE: %s: restored %s at cycle %llu\n",
+				__func__, path, (unsigned long long)avr->cycle);
+		return 1;
+	}
+	if (!cycle && pc == AVR_STATE_ANY_PC)
+		return 0;
+	while ((!cycle || avr->cycle < cycle) && avr->pc != pc) {
+		int state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed) {
+			AVR_LOG(avr, LOG_WARNING, "STATE: %s: firmware stopped at cycle %llu, "
+					"before the warm start point\n", __func__,
+					(unsigned long long)avr->cycle);
+			return -1;
+		}
+	}
+	// write a temporary file first, in case another instance is reading it
+	char tmp[1100];
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	if (avr_state_save(avr, tmp) == 0 && rename(tmp, path) != 0) {
+		AVR_LOG(avr, LOG_WARNING, "STATE: %s: can't create %s: %s\n",
+				__func__, path, strerror(errno));
+		unlink(tmp);
+	}
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+	sim_state.h
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Machine state snapshots, and a "warm start" cache built on top of them.
+ *
+ * A snapshot contains the core (PC, SREG, cycle counter, interrupts), the
+ * data space, flash and eeprom, the pending cycle timers and the values of
+ * the IRQs. The private state of the IO modules is saved and restored by
+ * their 'state' callback (see avr_io_t), a core with a module that has no
+ * such callback can't be saved.
+ *
+ * Cycle timer parameters are saved relative to the core structure, and
+ * their functions relative to the simavr code, so a snapshot can only be
+ * restored by the same simavr build. It can't be saved if a cycle timer
+ * uses a parameter that lives outside of the core (a VCD file for example).
+ *
+ * The snapshot is in host byte order, it is meant as a cache, not as an
+ * interchange format.
+ */
+#ifndef __SIM_STATE_H__
+#define __SIM_STATE_H__
+
+#include <stddef.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// pass as 'pc' to avr_state_warm_start() to only stop at a cycle
+#define AVR_STATE_ANY_PC	0xffffffff
+
+// passed to the 'state' callback of the IO modules
+typedef struct avr_state_io_t {
+	int			load;	// restoring the module, otherwise saving it
+	uint8_t *	b;
+	size_t		size, pos;
+} avr_state_io_t;
+
+/*
+ * Called by the 'state' callback of an IO module for each of its fields:
+ * when saving, the 'size' bytes at 'data' are added to the snapshot, when
+ * loading, they are read back from it, in the same order. Returns -1 if
+ * the snapshot has no more data for the module.
+ */
+int
+avr_state_io(
+		avr_state_io_t * s,
+		void * data,
+		size_t size);
+#define AVR_STATE_IO(_s, _field) avr_state_io(_s, &(_field), sizeof(_field))
+
+// save the state of 'avr' in file 'path', returns -1 on error
+int
+avr_state_save(
+		avr_t * avr,
+		const char * path);
+/*
+ * Restore the state of 'avr' from 'path'. 'avr' must be the same core,
+ * initialized the same way as the one that was saved; the cycle timers
+ * registered before the restore are lost. Returns -1 on error.
+ */
+int
+avr_state_load(
+		avr_t * avr,
+		const char * path);
+
+// FNV-1a hash of a buffer, pass zero as 'hash' to start a new one
+uint64_t
+avr_state_hash(
+		uint64_t hash,
+		const void * data,
+		size_t size);
+// add the content of file 'path' to 'hash'
+uint64_t
+avr_state_hash_file(
+		uint64_t hash,
+		const char * path);
+/*
+ * Returns a cache key for the current 'avr': core, frequency, flash and
+ * eeprom content (ie, the firmware), plus 'size' bytes of 'extra' data that
+ * the caller can use for the initial inputs.
+ */
+uint64_t
+avr_state_key(
+		avr_t * avr,
+		const void * extra,
+		size_t size);
+/*
+ * Warm start: if 'dir' contains a snapshot for 'key', restore it. Otherwise
+ * run 'avr' until it reaches 'cycle' (if non zero) or 'pc' (a byte address,
+ * or AVR_STATE_ANY_PC), and save a snapshot there for the next time.
+ * Returns 1 if the state was restored, zero if it was run (and saved, if
+ * possible) or -1 if the firmware stopped before the point was reached.
+ */
+int
+avr_state_warm_start(
+		avr_t * avr,
+		const char * dir,
+		uint64_t key,
+		avr_cycle_count_t cycle,
+		avr_flashaddr_t pc);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_STATE_H__ */
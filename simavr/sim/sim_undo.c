@@ -0,0 +1,129 @@
+/*
+	sim_undo.c
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim_avr.h"
+#include "sim_core.h"
+#include "sim_undo.h"
+
+int
+avr_undo_init(
+		avr_t * avr,
+		uint32_t size)
+{
+	if (avr->undo)
+		return 0;
+	uint32_t s = 1;
+	while (s < size)
+		s <<= 1;
+	avr_undo_t * u = malloc(sizeof(avr_undo_t));
+	if (!u)
+		return -1;
+	memset(u, 0, sizeof(*u));
+	u->size = s;
+	u->log = malloc(s * sizeof(avr_undo_entry_t));
+	if (!u->log) {
+		AVR_LOG(avr, LOG_ERROR, "UNDO: Can't allocate %d entries\n", s);
+		free(u);
+		return -1;
+	}
+	avr->undo = u;
+	return 0;
+}
+
+void
+avr_undo_deinit(
+		avr_t * avr)
+{
+	if (!avr->undo)
+		return;
+	free(avr->undo->log);
+	free(avr->undo);
+	avr->undo = NULL;
+}
+
+void
+avr_undo_clear(
+		avr_t * avr)
+{
+	if (!avr->undo)
+		return;
+	avr->undo->head = avr->undo->count = 0;
+}
+
+void
+avr_undo_mark(
+		avr_t * avr)
+{
+	avr_undo_entry_t * e = _avr_undo_push(avr->undo);
+	uint8_t sreg;
+	READ_SREG_INTO(avr, sreg);
+	e->cycle = avr->cycle;
+	e->pc = avr->pc;
+	e->addr = (uint8_t)avr->interrupt_state;
+	e->value = sreg;
+	e->running = avr->interrupts.running_ptr;
+}
+
+int
+avr_undo_step(
+		avr_t * avr,
+		avr_undo_notify_t notify,
+		void * param)
+{
+	avr_undo_t * u = avr->undo;
+	if (!u)
+		return 0;
+	const uint32_t mask = u->size - 1;
+
+	/*
+	 * Locate the mark of the last instruction first; if the ring wrapped
+	 * over it, the writes that follow can't be undone consistently.
+	 */
+	uint32_t n = 0;
+	while (n < u->count && u->log[(u->head - 1 - n) & mask].pc == AVR_UNDO_WRITE)
+		n++;
+	if (n == u->count) {
+		u->count = 0;
+		return 0;
+	}
+	// restore the writes, most recent first
+	for (uint32_t i = 0; i < n; i++) {
+		avr_undo_entry_t * e = &u->log[(u->head - 1 - i) & mask];
+		avr->data[e->addr] = e->value;
+		if (notify)
+			notify(avr, e->addr, param);
+	}
+	avr_undo_entry_t * m = &u->log[(u->head - 1 - n) & mask];
+	u->head = (u->head - 1 - n) & mask;
+	u->count -= n + 1;
+
+	avr->pc = m->pc;
+	avr->cycle = m->cycle;
+	avr->data[R_SREG] = m->value;
+	for (int i = 0; i < 8; i++)
+		avr->sreg[i] = (m->value >> i) & 1;
+	avr->interrupt_state = (int8_t)m->addr;
+	avr->interrupts.running_ptr = m->running;
+	return 1;
+}
@@ -0,0 +1,129 @@
+/*
+	sim_undo.h
+
+	Copyright 2008, 2009 Michel Pollet <buserror@gmail.com>
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The undo log records enough of the core state to run the firmware
+ * "backward", this is what allows gdb "reverse-step" and "reverse-continue".
+ *
+ * Before each instruction, the core pushes a "mark" with the PC, SREG and
+ * cycle counter; every write to the data space (registers, IO and SRAM)
+ * then pushes the address and the value it is about to overwrite. Undoing
+ * an instruction is just popping the writes back in reverse order until
+ * the mark is reached.
+ *
+ * The log is a fixed size ring, once full, the oldest instructions are
+ * forgotten, so it can stay enabled for long runs.
+ * Note that only the core state is rewound; the internal state of the IO
+ * modules (and their pending cycle timers) is not.
+ */
+#ifndef __SIM_UNDO_H__
+#define __SIM_UNDO_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// default number of entries in the log, must be a power of two
+#define AVR_UNDO_DEFAULT_SIZE	(256 * 1024)
+
+// 'pc' value of entries that are data writes, not instruction marks
+#define AVR_UNDO_WRITE			0xffffffff
+
+typedef struct avr_undo_entry_t {
+	avr_cycle_count_t	cycle;	// mark: cycle counter before the instruction
+	uint32_t			pc;		// mark: PC of the instruction, or AVR_UNDO_WRITE
+	uint16_t			addr;	// write: data address. mark: interrupt state
+	uint8_t				value;	// write: previous value. mark: SREG
+	uint8_t				running;// mark: interrupt nesting depth
+} avr_undo_entry_t;
+
+typedef struct avr_undo_t {
+	uint32_t			size;	// power of two
+	uint32_t			head;	// next entry to write
+	uint32_t			count;	// valid entries before head
+	avr_undo_entry_t *	log;
+} avr_undo_t;
+
+// called by an undone write, allows gdb to detect watchpoints
+typedef void (*avr_undo_notify_t)(
+		avr_t * avr,
+		uint16_t addr,
+		void * param);
+
+// allocate the undo log (size is rounded up to a power of two) and start recording
+int
+avr_undo_init(
+		avr_t * avr,
+		uint32_t size);
+// stop recording, and free the log
+void
+avr_undo_deinit(
+		avr_t * avr);
+// forget all the recorded history (after a reset for example)
+void
+avr_undo_clear(
+		avr_t * avr);
+/*
+ * Undo the last instruction executed, restoring the data space, PC, SREG and
+ * cycle counter. 'notify' (optional) is called for each address restored.
+ * Returns zero if there is no more history to undo.
+ */
+int
+avr_undo_step(
+		avr_t * avr,
+		avr_undo_notify_t notify,
+		void * param);
+
+static inline avr_undo_entry_t *
+_avr_undo_push(
+		avr_undo_t * u)
+{
+	avr_undo_entry_t * e = &u->log[u->head];
+	u->head = (u->head + 1) & (u->size - 1);
+	if (u->count < u->size)
+		u->count++;
+	return e;
+}
+
+// Called by the core before each instruction
+void
+avr_undo_mark(
+		avr_t * avr);
+
+// Called by the core before 'addr' is overwritten
+static inline void
+avr_undo_write(
+		avr_t * avr,
+		uint16_t addr)
+{
+	avr_undo_entry_t * e = _avr_undo_push(avr->undo);
+	e->pc = AVR_UNDO_WRITE;
+	e->addr = addr;
+	e->value = avr->data[addr];
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_UNDO_H__ */
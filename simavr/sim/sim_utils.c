@@ -24,6 +24,16 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
 #include "sim_utils.h"
 
@@ -66,3 +76,138 @@ argv_parse(
 	argv->argv[argv->argc] = NULL;
 	return argv;
 }
+
+#ifndef __MINGW32__
+static size_t
+sim_mmap_length(
+	uint32_t size,
+	uint32_t extra )
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return ((size_t)size + extra + page - 1) & ~(page - 1);
+}
+#endif
+
+void *
+sim_mmap_file(
+	const char * path,
+	uint32_t size,
+	uint32_t extra,
+	uint8_t fill,
+	int shared )
+{
+#ifdef __MINGW32__
+	errno = ENOSYS;
+	return NULL;
+#else
+	int fd = open(path, shared ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (fd < 0 && (shared || errno != ENOENT))
+		return NULL;
+	struct stat st = { .st_size = 0 };
+	if (fd >= 0 && fstat(fd, &st) < 0)
+		goto error;
+	uint32_t fsize = st.st_size < size ? st.st_size : size;
+	if (shared && st.st_size < size && ftruncate(fd, size) < 0)
+		goto error;
+	/*
+	 * Reserve the whole area with anonymous memory first, then map the
+	 * file over it; this way 'extra' is never past the end of the file,
+	 * and a private mapping of a short file is still fully accessible.
+	 */
+	size_t length = sim_mmap_length(size, extra);
+	uint8_t * base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		goto error;
+	uint32_t flen = shared ? size : fsize;
+	if (flen && mmap(base, flen, PROT_READ | PROT_WRITE,
+			(shared ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED,
+			fd, 0) == MAP_FAILED) {
+		int e = errno;
+		munmap(base, length);
+		errno = e;
+		goto error;
+	}
+	if (fd >= 0)
+		close(fd);
+	if (fsize < size)
+		memset(base + fsize, fill, size - fsize);
+	return base;
+error:
+	if (fd >= 0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+	}
+	return NULL;
+#endif
+}
+
+void
+sim_munmap_file(
+	void * base,
+	uint32_t size,
+	uint32_t extra )
+{
+#ifndef __MINGW32__
+	if (base)
+		munmap(base, sim_mmap_length(size, extra));
+#endif
+}
+
+const void *
+sim_mmap_read(
+	const char * path,
+	size_t * size )
+{
+	int fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	void * base = NULL;
+	if (fstat(fd, &st) < 0)
+		goto done;
+	*size = st.st_size;
+#ifndef __MINGW32__
+	if (*size) {
+		base = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (base == MAP_FAILED)
+			base = NULL;
+		else
+			madvise(base, *size, MADV_SEQUENTIAL);
+		goto done;
+	}
+#endif
+	base = malloc(*size + 1);
+	for (size_t got = 0; got < *size; ) {
+		ssize_t r = read(fd, (uint8_t*)base + got, *size - got);
+		if (r <= 0) {
+			free(base);
+			base = NULL;
+			break;
+		}
+		got += r;
+	}
+done: {
+		int e = errno;
+		close(fd);
+		errno = e;
+	}
+	return base;
+}
+
+void
+sim_munmap_read(
+	const void * base,
+	size_t size )
+{
+	if (!base)
+		return;
+#ifndef __MINGW32__
+	if (size) {
+		munmap((void *)base, size);
+		return;
+	}
+#endif
+	free((void *)base);
+}
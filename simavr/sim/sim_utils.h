@@ -26,6 +26,7 @@
 #define __SIM_UTILS_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef struct argv_t {
 	uint32_t size, argc;
@@ -48,4 +49,43 @@ argv_parse(
 	argv_p	argv,
 	char * line );
 
+/*
+ * Map 'size' bytes of file 'path' in memory, to use as a backing store
+ * for flash or eeprom.
+ * If 'shared' is set, the file is created or grown as needed, and the
+ * changes are written back to it. Otherwise the file (if it exists) is only
+ * the initial content, and changes are private to this mapping.
+ * Bytes past the end of the original file are set to 'fill', and 'extra'
+ * bytes of scratch memory are available right after 'size'.
+ * Returns NULL on error, with errno set.
+ */
+void *
+sim_mmap_file(
+	const char * path,
+	uint32_t size,
+	uint32_t extra,
+	uint8_t fill,
+	int shared );
+// unmap a file mapped with sim_mmap_file(), with the same size and extra
+void
+sim_munmap_file(
+	void * base,
+	uint32_t size,
+	uint32_t extra );
+
+/*
+ * Map file 'path' read only, and return its size in 'size'. Where mmap()
+ * is not available the file is read in memory instead.
+ * Returns NULL on error, with errno set.
+ */
+const void *
+sim_mmap_read(
+	const char * path,
+	size_t * size );
+// release a file mapped with sim_mmap_read()
+void
+sim_munmap_read(
+	const void * base,
+	size_t size );
+
 #endif /* __SIM_UTILS_H__ */
@@ -28,13 +28,17 @@
 #include <inttypes.h>
 #include <ctype.h>
 #include <time.h>
+#include <stdarg.h>
+#include <pthread.h>
+#if CONFIG_SIMAVR_ZLIB
+#include <zlib.h>
+#endif
 #include "sim_vcd_file.h"
 #include "sim_avr.h"
 #include "sim_time.h"
 #include "sim_utils.h"
 #include "sim_core_config.h"
 
-DEFINE_FIFO(avr_vcd_log_t, avr_vcd_fifo);
 
 #define strdupa(__s) strcpy(alloca(strlen(__s)+1), __s)
 
@@ -43,6 +47,31 @@ _avr_vcd_notify(
 		struct avr_irq_t * irq,
 		uint32_t value,
 		void * param);
+static void
+_avr_vcd_set_backend(
+		avr_vcd_t * vcd);
+static void
+_avr_vcd_writer_value(
+		avr_vcd_t * vcd,
+		avr_vcd_signal_t * s,
+		const uint32_t ** value,
+		const uint32_t ** floating);
+
+// returns a new, zeroed signal at the end of the signal table
+static avr_vcd_signal_t *
+_avr_vcd_signal_new(
+		avr_vcd_t * vcd)
+{
+	if (vcd->signal_count == vcd->signal_size) {
+		vcd->signal_size = vcd->signal_size ? vcd->signal_size * 2 : 16;
+		vcd->signal = realloc(vcd->signal,
+				vcd->signal_size * sizeof(vcd->signal[0]));
+	}
+	avr_vcd_signal_t * s = calloc(1, sizeof(*s));
+	s->scope = vcd->scope_current;
+	vcd->signal[vcd->signal_count++] = s;
+	return s;
+}
 
 int
 avr_vcd_init(
@@ -54,141 +83,237 @@ avr_vcd_init(
 	memset(vcd, 0, sizeof(avr_vcd_t));
 	vcd->avr = avr;
 	vcd->filename = strdup(filename);
-	vcd->period = avr_usec_to_cycles(vcd->avr, period);
+	_avr_vcd_set_backend(vcd);
+	avr_vcd_set_scope(vcd, NULL);
 	return 0;
 }
 
 /*
- * Parse a VCD 'timing' line. The lines are assumed to be:
- * #<absolute timestamp>[\n][<value x/z/0/1><signal alias character>|
- * 		b[x/z/0/1]?<space><signal alias character|
- *		r<real value><space><signal alias character]+
+ * VCD input. The file is mapped in memory, and indexed once when opened:
+ * the index has an entry every AVR_VCD_INDEX_STEP bytes of file, with the
+ * value of all the signals at that point, so seeking only has to replay
+ * a small part of the file. The replay uses a single cycle timer, that
+ * raises all the changes of a timestamp in one go, and returns the cycle
+ * of the next timestamp.
+ */
+#define AVR_VCD_INDEX_STEP		(64 * 1024)
+
+enum {
+	AVR_VCD_INPUT_END = 0,
+	AVR_VCD_INPUT_TIME,
+	AVR_VCD_INPUT_CHANGE,
+};
+
+typedef struct avr_vcd_index_t {
+	uint64_t		when;		// file time of that timestamp
+	size_t			pos;		// offset of its '#'
+} avr_vcd_index_t;
+
+typedef struct avr_vcd_input_t {
+	const char *	base;		// mapped file
+	size_t			size;
+	size_t			body;		// offset of the value changes
+	size_t			pos;		// offset of the next token to replay
+	uint64_t		first, last;	// first and last timestamp of the file
+	double			unit;		// seconds per file time unit
+	double			scale;		// replay time scale
+	int				loop;
+	uint64_t		loops;		// number of times the file was replayed
+	uint64_t		origin;		// file time replayed at cycle 'start'
+	avr_cycle_count_t start;
+
+	int				index_count;
+	avr_vcd_index_t * index;
+	uint32_t *		snap_value;		// signal values for each index entry
+	uint8_t *		snap_floating;	// ... with 2 for "not set yet"
+
+	uint32_t		hash_mask;	// identifier -> signal index hash table
+	int *			hash;
+} avr_vcd_input_t;
+
+// returns the length of the token at '*pos', and skips it; zero at the end
+static size_t
+_avr_vcd_input_token(
+		avr_vcd_input_t * in,
+		size_t * pos,
+		const char ** tok)
+{
+	size_t p = *pos;
+	while (p < in->size && (uint8_t)in->base[p] <= ' ')
+		p++;
+	*tok = in->base + p;
+	size_t s = p;
+	while (p < in->size && (uint8_t)in->base[p] > ' ')
+		p++;
+	*pos = p;
+	return p - s;
+}
+
+static int
+_avr_vcd_input_is(
+		const char * tok,
+		size_t len,
+		const char * keyword)
+{
+	return len == strlen(keyword) && !memcmp(tok, keyword, len);
+}
+
+// skip tokens up to, and including "$end"
+static void
+_avr_vcd_input_skip(
+		avr_vcd_input_t * in,
+		size_t * pos)
+{
+	const char * tok;
+	size_t len;
+	while ((len = _avr_vcd_input_token(in, pos, &tok)) != 0)
+		if (_avr_vcd_input_is(tok, len, "$end"))
+			break;
+}
+
+static uint32_t
+_avr_vcd_input_hash(
+		const char * id,
+		size_t len)
+{
+	uint32_t h = 2166136261u;
+	while (len--)
+		h = (h ^ (uint8_t)*id++) * 16777619u;
+	return h;
+}
+
+static int
+_avr_vcd_input_lookup(
+		avr_vcd_t * vcd,
+		avr_vcd_input_t * in,
+		const char * id,
+		size_t len)
+{
+	if (!len || len >= sizeof(vcd->signal[0]->alias))
+		return -1;
+	for (uint32_t h = _avr_vcd_input_hash(id, len); ; h++) {
+		int si = in->hash[h & in->hash_mask];
+		if (si < 0)
+			return -1;
+		if (!strncmp(vcd->signal[si]->alias, id, len) &&
+				!vcd->signal[si]->alias[len])
+			return si;
+	}
+}
+
+/*
+ * Returns the next event of the file from '*pos': either a timestamp in
+ * 'when', or a change for signal 'sig'. The lines are assumed to be:
+ * #<absolute timestamp>[\n][<value x/z/0/1><signal alias>|
+ * 		b[x/z/0/1]?<space><signal alias>|
+ *		r<real value><space><signal alias>]+
  * For example:
  * #1234 1' 0$
  * Or:
  * #1234
  * b1101x1 '
  * 0$
- *
- * This function tries to handle this transparently, and pushes the
- * signal/values into the FIFO for processing by the timer when
- * convenient.
- * NOTE: Add 'floating' support here. Also, FIX THE TIMING.
+ * The $dumpvars (etc) sections are replayed as normal changes, unknown
+ * signals and other sections are skipped.
  */
-static avr_cycle_count_t
-avr_vcd_input_parse_line(
+static int
+_avr_vcd_input_next(
 		avr_vcd_t * vcd,
-		argv_p v )
+		avr_vcd_input_t * in,
+		size_t * pos,
+		uint64_t * when,
+		int * sig,
+		uint32_t * value,
+		int * floating)
 {
-	uint64_t res = 0;
-	int vi = 0;
+	const char * tok;
+	size_t len;
 
-	if (v->argc == 0)
-		return res;
-
-	if (v->argv[0][0] == '#') {
-		res = atoll(v->argv[0] + 1) * vcd->vcd_to_ns;
-		vcd->start = vcd->period;
-		vcd->period = res;
-		vi++;
-	}
-	for (int i = vi; i < v->argc; i++) {
-		char * a = v->argv[i];
+	while ((len = _avr_vcd_input_token(in, pos, &tok)) != 0) {
+		const char * id = NULL;
+		size_t idlen = 0;
 		uint32_t val = 0;
-		int floating = 0;
-		char name = 0;
-		int sigindex;
-
-		if (*a == 'b' || *a == 'B') {	// Binary string
-			a++;
-			while (*a) {
-				if (*a == 'x' || *a == 'z') {
+		int fl = 0;
+
+		switch (tok[0]) {
+			case '#': {
+				uint64_t t = 0;
+				for (size_t i = 1; i < len && isdigit(tok[i]); i++)
+					t = (t * 10) + (tok[i] - '0');
+				*when = t;
+				return AVR_VCD_INPUT_TIME;
+			}
+			case '$':
+				// value changes in those are used as-is
+				if (!_avr_vcd_input_is(tok, len, "$dumpvars") &&
+						!_avr_vcd_input_is(tok, len, "$dumpall") &&
+						!_avr_vcd_input_is(tok, len, "$dumpon") &&
+						!_avr_vcd_input_is(tok, len, "$dumpoff") &&
+						!_avr_vcd_input_is(tok, len, "$end"))
+					_avr_vcd_input_skip(in, pos);
+				continue;
+			case 'b': case 'B':	// Binary string
+				for (size_t i = 1; i < len; i++) {
 					val <<= 1;
-					floating |= (floating << 1) | 1;
-				} else if (*a == '0' || *a == '1') {
-					val = (val << 1) | (*a - '0');
-					floating <<= 1;
-				} else {
-					name = *a;
-					break;
+					if (tok[i] == '1')
+						val |= 1;
+					else if (tok[i] != '0')
+						fl = 1;
 				}
-				a++;
-			}
-		} else if (*a == '0' || *a == '1' || *a == 'x' || *a == 'z') {
-			if (*a == 'x' || *a == 'z')
-				floating = 1;
-			else
-				val = *a++ - '0';
-			if (*a && *a > ' ')
-				name = *a;
-		} else if (*a == 'r' || *a == 'R') {
-			val = (uint32_t)strtod(++a, NULL);
-		}
-
-		if (!name && (i < v->argc - 1)) {
-			const char *n = v->argv[i+1];
-			if (strlen(n) == 1) {
-				// we've got a name, it was not attached
-				name = *n;
-				i++;	// skip that one
-			}
-		}
-		sigindex = -1;
-		if (name) {
-			for (int si = 0;
-						si < vcd->signal_count &&
-						sigindex == -1; si++) {
-				if (vcd->signal[si].alias == name)
-					sigindex = si;
-			}
+				idlen = _avr_vcd_input_token(in, pos, &id);
+				break;
+			case 'r': case 'R': {
+				char real[32];
+				snprintf(real, sizeof(real), "%.*s", (int)len - 1, tok + 1);
+				val = (uint32_t)strtod(real, NULL);
+				idlen = _avr_vcd_input_token(in, pos, &id);
+			}	break;
+			case '0': case '1':
+				val = tok[0] - '0';
+				// fall through
+			case 'x': case 'X': case 'z': case 'Z':
+				fl = tok[0] > '1';
+				id = tok + 1;
+				idlen = len - 1;
+				if (!idlen)	// we've got a name, it was not attached
+					idlen = _avr_vcd_input_token(in, pos, &id);
+				break;
+			default:
+				continue;
 		}
-		if (sigindex == -1) {
-			printf("Signal name '%c' value %x not found\n",
-					name? name : '?', val);
+		int si = _avr_vcd_input_lookup(vcd, in, id, idlen);
+		if (si < 0) {
+			AVR_LOG(vcd->avr, LOG_TRACE, "VCD: %s: signal '%.*s' not found\n",
+					vcd->filename, (int)idlen, id);
 			continue;
 		}
-		avr_vcd_log_t e = {
-				.when = vcd->period,
-				.sigindex = sigindex,
-				.floating = !!floating,
-				.value = val,
-		};
-	//	printf("%10u %d\n", e.when, e.value);
-		avr_vcd_fifo_write(&vcd->log, e);
+		*sig = si;
+		*value = val;
+		*floating = fl;
+		return AVR_VCD_INPUT_CHANGE;
 	}
-	return res;
+	return AVR_VCD_INPUT_END;
 }
 
-/*
- * Read some signals from the file and fill the FIFO with it, we read
- * a completely arbitrary amount of stuff to fill the FIFO reasonably well
- */
-static int
-avr_vcd_input_read(
-		avr_vcd_t * vcd )
+// cycle at which file time 'when' of the current loop is replayed
+static avr_cycle_count_t
+_avr_vcd_input_cycle(
+		avr_vcd_t * vcd,
+		avr_vcd_input_t * in,
+		uint64_t when)
 {
-	char line[1024];
-
-	while (fgets(line, sizeof(line), vcd->input)) {
-	//	printf("%s", line);
-		if (!line[0])	// technically can't happen, but make sure next line works
-			continue;
-		vcd->input_line = argv_parse(vcd->input_line, line);
-		avr_vcd_input_parse_line(vcd, vcd->input_line);
-		/* stop once the fifo is full enough */
-		if (avr_vcd_fifo_get_read_size(&vcd->log) >= 128)
-			break;
-	}
-	return avr_vcd_fifo_isempty(&vcd->log);
+	// 'when' is before 'origin' once a seek'ed replay has looped
+	double t = (double)when - (double)in->origin +
+			(double)in->loops * (in->last - in->first);
+	return in->start + (avr_cycle_count_t)
+			(t * in->unit * in->scale * vcd->avr->frequency + 0.5);
 }
 
 /*
- * This is called when we need to change the state of one or more IRQ,
- * so look in the FIFO to know 'our' stamp time, read as much as we can
- * that is still on that same timestamp.
- * When when the FIFO content has too far in the future, re-schedule the
- * timer for that time and shoot off.
- * Also try to top up the FIFO with new read stuff when it's drained
+ * This is called when we need to change the state of one or more IRQ:
+ * raise all the changes up to the next timestamp that is still in the
+ * future, and return the cycle of that one.
+ * When the file is done, either rewind it (when looping) or stop simavr.
  */
 static avr_cycle_count_t
 _avr_vcd_input_timer(
@@ -196,44 +321,194 @@ _avr_vcd_input_timer(
 		avr_cycle_count_t when,
 		void * param)
 {
-	avr_cycle_count_t next;
 	avr_vcd_t * vcd = param;
+	avr_vcd_input_t * in = vcd->input;
+	uint64_t stamp;
+	uint32_t value;
+	int sig, floating;
+
+	for (;;) {
+		size_t pos = in->pos;
+		switch (_avr_vcd_input_next(vcd, in, &in->pos,
+					&stamp, &sig, &value, &floating)) {
+			case AVR_VCD_INPUT_CHANGE:
+				avr_raise_irq_float(&vcd->signal[sig]->irq, value, floating);
+				break;
+			case AVR_VCD_INPUT_TIME: {
+				avr_cycle_count_t next = _avr_vcd_input_cycle(vcd, in, stamp);
+				if (next > when) {
+					in->pos = pos;	// replay that timestamp next time
+					return next;
+				}
+			}	break;
+			case AVR_VCD_INPUT_END:
+				if (in->loop && in->last > in->first) {
+					in->loops++;
+					in->pos = in->body;
+					break;
+				}
+				AVR_LOG(vcd->avr, LOG_TRACE,
+						"%s Finished reading, ending simavr\n",
+						vcd->filename);
+				avr->state = cpu_Done;
+				return 0;
+		}
+	}
+}
 
-again:
-	// get some more if needed
-	if (avr_vcd_fifo_get_read_size(&vcd->log) < (vcd->signal_count * 16))
-		avr_vcd_input_read(vcd);
+static void
+_avr_vcd_input_free(
+		avr_vcd_t * vcd)
+{
+	avr_vcd_input_t * in = vcd->input;
+	if (!in)
+		return;
+	sim_munmap_read(in->base, in->size);
+	free(in->index);
+	free(in->snap_value);
+	free(in->snap_floating);
+	free(in->hash);
+	free(in);
+	vcd->input = NULL;
+}
 
-	if (avr_vcd_fifo_isempty(&vcd->log)) {
-		printf("%s DONE but why are we here?\n", __func__);
-		return 0;
+/*
+ * Walk the whole file once, to find the first and last timestamps, and
+ * fill the index
+ */
+static void
+_avr_vcd_input_index(
+		avr_vcd_t * vcd,
+		avr_vcd_input_t * in)
+{
+	int count = vcd->signal_count;
+	uint32_t value[count + 1];
+	uint8_t floating[count + 1];
+	memset(value, 0, sizeof(value));
+	memset(floating, 2, sizeof(floating));
+
+	size_t pos = in->body, last = 0;
+	uint64_t stamp;
+	uint32_t val;
+	int sig, fl, timed = 0;
+	for (;;) {
+		size_t start = pos;
+		int type = _avr_vcd_input_next(vcd, in, &pos, &stamp, &sig, &val, &fl);
+		if (type == AVR_VCD_INPUT_END)
+			break;
+		if (type == AVR_VCD_INPUT_CHANGE) {
+			value[sig] = val;
+			floating[sig] = fl;
+			continue;
+		}
+		if (!timed)
+			in->first = stamp;
+		in->last = stamp;
+		if (timed++ && start - last < AVR_VCD_INDEX_STEP)
+			continue;
+		last = start;
+		if ((in->index_count & 0xff) == 0) {
+			int size = in->index_count + 256;
+			in->index = realloc(in->index, size * sizeof(in->index[0]));
+			in->snap_value = realloc(in->snap_value,
+					size * (count + 1) * sizeof(value[0]));
+			in->snap_floating = realloc(in->snap_floating,
+					size * (count + 1));
+		}
+		in->index[in->index_count] = (avr_vcd_index_t) {
+			.when = stamp, .pos = start };
+		memcpy(in->snap_value + in->index_count * (count + 1),
+				value, sizeof(value));
+		memcpy(in->snap_floating + in->index_count * (count + 1),
+				floating, sizeof(floating));
+		in->index_count++;
 	}
+}
 
-	avr_vcd_log_t log = avr_vcd_fifo_read_at(&vcd->log, 0);
-	uint64_t stamp = log.when;
-	while (!avr_vcd_fifo_isempty(&vcd->log)) {
-		log = avr_vcd_fifo_read_at(&vcd->log, 0);
-		if (log.when != stamp)	// leave those in the FIFO
+int
+avr_vcd_input_seek(
+		avr_vcd_t * vcd,
+		uint64_t nsec)
+{
+	avr_vcd_input_t * in = vcd->input;
+	if (!in)
+		return -1;
+	uint64_t target = in->unit > 0 ? (uint64_t)(nsec * 1e-9 / in->unit) : 0;
+	int count = vcd->signal_count;
+	uint32_t value[count + 1];
+	uint8_t floating[count + 1];
+	memset(value, 0, sizeof(value));
+	memset(floating, 2, sizeof(floating));
+
+	// last index entry at or before 'target'
+	size_t pos = in->body;
+	int lo = 0, hi = in->index_count - 1, found = -1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (in->index[mid].when <= target) {
+			found = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	if (found >= 0) {
+		pos = in->index[found].pos;
+		memcpy(value, in->snap_value + found * (count + 1), sizeof(value));
+		memcpy(floating, in->snap_floating + found * (count + 1),
+				sizeof(floating));
+	}
+	// from there, play the changes silently up to the target
+	uint64_t stamp;
+	uint32_t val;
+	int sig, fl;
+	for (;;) {
+		size_t start = pos;
+		int type = _avr_vcd_input_next(vcd, in, &pos, &stamp, &sig, &val, &fl);
+		if (type == AVR_VCD_INPUT_END)
+			break;
+		if (type == AVR_VCD_INPUT_TIME && stamp > target) {
+			pos = start;
 			break;
-		// we already have it
-		avr_vcd_fifo_read_offset(&vcd->log, 1);
-		avr_vcd_signal_p signal = &vcd->signal[log.sigindex];
-		avr_raise_irq_float(&signal->irq, log.value, log.floating);
+		}
+		if (type == AVR_VCD_INPUT_CHANGE) {
+			value[sig] = val;
+			floating[sig] = fl;
+		}
 	}
+	for (int i = 0; i < count; i++)
+		if (floating[i] != 2)
+			avr_raise_irq_float(&vcd->signal[i]->irq, value[i], floating[i]);
+	in->pos = pos;
+	in->origin = target;
+	in->loops = 0;
+	in->start = vcd->avr->cycle;
+	avr_cycle_timer_register(vcd->avr, 0, _avr_vcd_input_timer, vcd);
+	return 0;
+}
 
-	if (avr_vcd_fifo_isempty(&vcd->log)) {
-		AVR_LOG(vcd->avr, LOG_TRACE,
-				"%s Finished reading, ending simavr\n",
-				vcd->filename);
-		avr->state = cpu_Done;
-		return 0;
-	}
-	log = avr_vcd_fifo_read_at(&vcd->log, 0);
+void
+avr_vcd_input_loop(
+		avr_vcd_t * vcd,
+		int loop)
+{
+	if (vcd->input)
+		vcd->input->loop = loop;
+}
 
-	next = (log.when * avr->frequency) / (1000*1000*1000);
-	if (next <= when)
-		goto again;
-	return next;
+void
+avr_vcd_input_scale(
+		avr_vcd_t * vcd,
+		double scale)
+{
+	avr_vcd_input_t * in = vcd->input;
+	if (!in || scale <= 0)
+		return;
+	in->scale = scale;
+	// not started yet, the first timestamp moved
+	if (in->pos == in->body && !in->loops && in->index_count)
+		avr_cycle_timer_register(vcd->avr,
+				_avr_vcd_input_cycle(vcd, in, in->first) - vcd->avr->cycle,
+				_avr_vcd_input_timer, vcd);
 }
 
 int
@@ -245,93 +520,85 @@ avr_vcd_init_input(
 	memset(vcd, 0, sizeof(avr_vcd_t));
 	vcd->avr = avr;
 	vcd->filename = strdup(filename);
+	avr_vcd_set_scope(vcd, NULL);
 
-	vcd->input = fopen(vcd->filename, "r");
-	if (!vcd->input) {
+	avr_vcd_input_t * in = calloc(1, sizeof(*in));
+	in->base = sim_mmap_read(filename, &in->size);
+	if (!in->base) {
 		perror(filename);
+		free(in);
 		return -1;
 	}
-	char line[1024];
-	argv_p v = NULL;
-
-	while (fgets(line, sizeof(line), vcd->input)) {
-		if (!line[0])	// technically can't happen, but make sure next line works
-			continue;
-		v = argv_parse(v, line);
-
-		// we are done reading headers, got our first timestamp
-		if (v->line[0] == '#') {
-			uint64_t when;
-
-			vcd->start = 0;
-			avr_vcd_input_parse_line(vcd, v);
-			when = (vcd->period * vcd->avr->frequency) /
-				(1000*1000*1000);
-			avr_cycle_timer_register(vcd->avr, when,
-						 _avr_vcd_input_timer, vcd);
+	vcd->input = in;
+	in->unit = 1e-9;
+	in->scale = 1;
+
+	const char * tok;
+	size_t len, pos = 0;
+	while ((len = _avr_vcd_input_token(in, &pos, &tok)) != 0) {
+		if (_avr_vcd_input_is(tok, len, "$enddefinitions")) {
+			_avr_vcd_input_skip(in, &pos);
 			break;
-		}
-		// ignore multiline stuff
-		if (v->line[0] != '$')
-			continue;
-
-		const char * end = !strcmp(v->argv[v->argc - 1], "$end") ?
-								v->argv[v->argc - 1] : NULL;
-		const char *keyword = v->argv[0];
-
-		if (keyword == end)
-			keyword = NULL;
-		if (!keyword)
-			continue;
-
-		if (!strcmp(keyword, "$timescale")) {
-			// sim_vcd header allows only integer factors of ns: 1ns, 2us, 3ms, 10s, ...
-			uint64_t cnt = 0;
-			char *si = v->argv[1];
-
-			vcd->vcd_to_ns = 1;
-			while (si && *si && isdigit(*si))
-				cnt = (cnt * 10) + (*si++ - '0');
-			while (si && *si == ' ')
-				si++;
-			if (si && !*si)
-				si = v->argv[2];
-			if (!strcmp(si, "ns")) {
-				// no calculation here
-				vcd->vcd_to_ns = cnt;
-			} else if (!strcmp(si, "us")) {
-				cnt*=1000;
-				vcd->vcd_to_ns = cnt;
-			} else if (!strcmp(si, "ms")) {
-				cnt*=1000*1000;
-				vcd->vcd_to_ns = cnt;
-			} else if (!strcmp(si, "s")) {
-				cnt*=1000*1000*1000;
-				vcd->vcd_to_ns = cnt;
-			}
-			// printf("cnt %dus; unit %s\n", (int)cnt, si);
-		} else if (!strcmp(keyword, "$var")) {
-			const char *name = v->argv[4];
-
-			vcd->signal[vcd->signal_count].alias = v->argv[3][0];
-			vcd->signal[vcd->signal_count].size = atoi(v->argv[2]);
-			strncpy(vcd->signal[vcd->signal_count].name, name,
-						sizeof(vcd->signal[0].name));
-
-			vcd->signal_count++;
-		}
+		} else if (_avr_vcd_input_is(tok, len, "$timescale")) {
+			// <number>[ ]<unit>, with unit one of s, ms, us, ns, ps, fs
+			char ts[32] = "";
+			while ((len = _avr_vcd_input_token(in, &pos, &tok)) != 0 &&
+					!_avr_vcd_input_is(tok, len, "$end"))
+				snprintf(ts + strlen(ts), sizeof(ts) - strlen(ts),
+						"%.*s", (int)len, tok);
+			char * u;
+			double cnt = strtod(ts, &u);
+			static const struct { const char * n; double s; } units[] = {
+				{ "s", 1 }, { "ms", 1e-3 }, { "us", 1e-6 },
+				{ "ns", 1e-9 }, { "ps", 1e-12 }, { "fs", 1e-15 },
+			};
+			for (int i = 0; i < sizeof(units) / sizeof(units[0]); i++)
+				if (!strcmp(u, units[i].n))
+					in->unit = (cnt > 0 ? cnt : 1) * units[i].s;
+		} else if (_avr_vcd_input_is(tok, len, "$var")) {
+			// $var <type> <size> <identifier> <name> [<range>] $end
+			const char * v[4];
+			size_t vl[4];
+			int n = 0;
+			while ((len = _avr_vcd_input_token(in, &pos, &tok)) != 0 &&
+					!_avr_vcd_input_is(tok, len, "$end"))
+				if (n < 4) {
+					v[n] = tok;
+					vl[n++] = len;
+				}
+			if (n < 4)
+				continue;
+			avr_vcd_signal_t * s = _avr_vcd_signal_new(vcd);
+			snprintf(s->alias, sizeof(s->alias), "%.*s", (int)vl[2], v[2]);
+			s->size = atoi(v[1]);
+			snprintf(s->name, sizeof(s->name), "%.*s", (int)vl[3], v[3]);
+		} else if (tok[0] == '$')
+			_avr_vcd_input_skip(in, &pos);
 	}
-	// reuse this one
-	vcd->input_line = v;
+	in->body = in->pos = pos;
+
+	// hash table for the identifiers, at most half full
+	in->hash_mask = 15;
+	while (in->hash_mask < vcd->signal_count * 2)
+		in->hash_mask = (in->hash_mask << 1) | 1;
+	in->hash = malloc((in->hash_mask + 1) * sizeof(in->hash[0]));
+	memset(in->hash, 0xff, (in->hash_mask + 1) * sizeof(in->hash[0]));
+	for (int i = 0; i < vcd->signal_count; i++) {
+		const char * a = vcd->signal[i]->alias;
+		uint32_t h = _avr_vcd_input_hash(a, strlen(a));
+		while (in->hash[h & in->hash_mask] >= 0)
+			h++;
+		in->hash[h & in->hash_mask] = i;
+	}
+	_avr_vcd_input_index(vcd, in);
 
 	for (int i = 0; i < vcd->signal_count; i++) {
-		AVR_LOG(vcd->avr, LOG_TRACE, "%s %2d '%c' %s : size %d\n",
-				__func__, i,
-				vcd->signal[i].alias, vcd->signal[i].name,
-				vcd->signal[i].size);
+		avr_vcd_signal_t * s = vcd->signal[i];
+		AVR_LOG(vcd->avr, LOG_TRACE, "%s %2d '%s' %s : size %d\n",
+				__func__, i, s->alias, s->name, s->size);
 		/* format is <four-character ioctl>[_<IRQ index>] */
-		if (strlen(vcd->signal[i].name) >= 4) {
-			char *dup = strdupa(vcd->signal[i].name);
+		if (strlen(s->name) >= 4) {
+			char *dup = strdupa(s->name);
 			char *ioctl = strsep(&dup, "_");
 			int index = 0;
 			if (dup)
@@ -341,20 +608,26 @@ avr_vcd_init_input(
 						ioctl[0], ioctl[1], ioctl[2], ioctl[3]);
 				avr_irq_t * irq = avr_io_getirq(vcd->avr, ioc, index);
 				if (irq) {
-					vcd->signal[i].irq.flags = IRQ_FLAG_INIT;
-					avr_connect_irq(&vcd->signal[i].irq, irq);
+					s->irq.flags = IRQ_FLAG_INIT;
+					avr_connect_irq(&s->irq, irq);
 				} else {
 					AVR_LOG(vcd->avr, LOG_WARNING,
 							"%s IRQ was not found\n",
-							vcd->signal[i].name);
-                                }
+							s->name);
+				}
 				continue;
 			}
 			AVR_LOG(vcd->avr, LOG_WARNING,
 					"%s is an invalid IRQ format\n",
-					vcd->signal[i].name);
+					s->name);
 		}
 	}
+	in->start = vcd->avr->cycle;
+	in->origin = 0;
+	if (in->index_count)
+		avr_cycle_timer_register(vcd->avr,
+				_avr_vcd_input_cycle(vcd, in, in->first) - in->start,
+				_avr_vcd_input_timer, vcd);
 	return 0;
 }
 
@@ -366,10 +639,26 @@ avr_vcd_close(
 
 	/* dispose of any link and hooks */
 	for (int i = 0; i < vcd->signal_count; i++) {
-		avr_vcd_signal_t * s = &vcd->signal[i];
+		avr_vcd_signal_t * s = vcd->signal[i];
 
 		avr_free_irq(&s->irq, 1);
+		if (s->part) {
+			avr_free_irq(s->part, s->part_count);
+			free(s->part);
+		}
+		free(s);
 	}
+	free(vcd->signal);
+	vcd->signal = NULL;
+	vcd->signal_count = vcd->signal_size = 0;
+	free(vcd->source);
+	vcd->source = NULL;
+	vcd->source_count = vcd->source_size = 0;
+	for (int i = 0; i < vcd->scope_count; i++)
+		free(vcd->scope[i]);
+	free(vcd->scope);
+	vcd->scope = NULL;
+	vcd->scope_count = vcd->scope_current = 0;
 
 	if (vcd->filename) {
 		free(vcd->filename);
@@ -377,108 +666,751 @@ avr_vcd_close(
 	}
 }
 
+/*
+ * Format the value of 's', one character per bit; bits with their
+ * 'floating' bit set (or all of them if 'value' is NULL) are 'x'
+ */
 static char *
-_avr_vcd_get_float_signal_text(
+_avr_vcd_get_signal_text(
 		avr_vcd_signal_t * s,
-		char * out)
+		char * out,
+		const uint32_t * value,
+		const uint32_t * floating)
 {
 	char * dst = out;
 
 	if (s->size > 1)
 		*dst++ = 'b';
 
-	for (int i = s->size; i > 0; i--)
-		*dst++ = 'x';
+	for (int i = s->size - 1; i >= 0; i--) {
+		uint32_t bit = 1u << (i & 31);
+		if (!value || (floating[i >> 5] & bit))
+			*dst++ = 'x';
+		else
+			*dst++ = value[i >> 5] & bit ? '1' : '0';
+	}
 	if (s->size > 1)
 		*dst++ = ' ';
-	*dst++ = s->alias;
-	*dst = 0;
+	strcpy(dst, s->alias);
 	return out;
 }
 
-static char *
-_avr_vcd_get_signal_text(
+/*
+ * VCD text output. The text is formatted in a buffer that is handed to a
+ * 'sink' when full; the plain VCD backend writes it to the file, the
+ * compressed one deflates it first.
+ */
+#define AVR_VCD_TEXT_SIZE		(64 * 1024)
+
+typedef struct avr_vcd_text_t {
+	uint64_t	last;		// last timestamp written
+	int			timed;		// set once a timestamp was written
+	void		(*sink)(avr_vcd_t * vcd, const char * b, size_t len);
+	uint32_t	len;
+	char		buf[AVR_VCD_TEXT_SIZE];
+} avr_vcd_text_t;
+
+static void
+_avr_vcd_text_flush(
+		avr_vcd_t * vcd)
+{
+	avr_vcd_text_t * t = vcd->backend_data;
+	if (t->len)
+		t->sink(vcd, t->buf, t->len);
+	t->len = 0;
+}
+
+static void __attribute__ ((format (printf, 2, 3)))
+_avr_vcd_text_printf(
+		avr_vcd_t * vcd,
+		const char * format,
+		... )
+{
+	avr_vcd_text_t * t = vcd->backend_data;
+	va_list ap;
+	va_start(ap, format);
+	int l = vsnprintf(t->buf + t->len, sizeof(t->buf) - t->len, format, ap);
+	va_end(ap);
+	if (t->len + l >= sizeof(t->buf)) {	// didn't fit, flush and retry
+		_avr_vcd_text_flush(vcd);
+		va_start(ap, format);
+		l = vsnprintf(t->buf, sizeof(t->buf), format, ap);
+		va_end(ap);
+		if (l >= sizeof(t->buf))
+			l = sizeof(t->buf) - 1;
+	}
+	t->len += l;
+}
+
+static void
+_avr_vcd_text_value(
+		avr_vcd_t * vcd,
 		avr_vcd_signal_t * s,
-		char * out,
-		uint32_t value)
+		const uint32_t * value,
+		const uint32_t * floating)
 {
-	char * dst = out;
+	avr_vcd_text_t * t = vcd->backend_data;
+	// room for the signal text, its alias and the newline
+	if (t->len + s->size + sizeof(s->alias) + 4 > sizeof(t->buf))
+		_avr_vcd_text_flush(vcd);
+	char * out = t->buf + t->len;
+	_avr_vcd_get_signal_text(s, out, value, floating);
+	t->len += strlen(out);
+	t->buf[t->len++] = '\n';
+}
 
-	if (s->size > 1)
-		*dst++ = 'b';
+/*
+ * Compare scope paths component by component, so that "a" < "a.b" < "ab"
+ * and the signals keep their order within a scope. The header is only
+ * written from the simulation thread, hence the static.
+ */
+static avr_vcd_t * _avr_vcd_sort_vcd;
 
-	for (int i = s->size; i > 0; i--)
-		*dst++ = value & (1 << (i-1)) ? '1' : '0';
-	if (s->size > 1)
-		*dst++ = ' ';
-	*dst++ = s->alias;
-	*dst = 0;
-	return out;
+static int
+_avr_vcd_scope_cmp(
+		const void * a,
+		const void * b)
+{
+	int ia = *(int *)a, ib = *(int *)b;
+	const char * pa = _avr_vcd_sort_vcd->scope[
+			_avr_vcd_sort_vcd->signal[ia]->scope];
+	const char * pb = _avr_vcd_sort_vcd->scope[
+			_avr_vcd_sort_vcd->signal[ib]->scope];
+	for (; *pa && *pa == *pb; pa++, pb++)
+		;
+	int ca = *pa == '.' ? 1 : *pa, cb = *pb == '.' ? 1 : *pb;
+	if (ca != cb)
+		return ca - cb;
+	return ia - ib;
+}
+
+// close the scopes of path 'from' that are not in 'to', and open the new ones
+static void
+_avr_vcd_text_scope(
+		avr_vcd_t * vcd,
+		const char * from,
+		const char * to)
+{
+	int common = 0;		// length of the common components
+	for (int i = 0; ; i++) {
+		if ((!from[i] || from[i] == '.') && (!to[i] || to[i] == '.'))
+			common = i;
+		if (!from[i] || from[i] != to[i])
+			break;
+	}
+	for (const char * p = from + common; *p; p++)
+		if (*p == '.' || p == from + common)
+			_avr_vcd_text_printf(vcd, "$upscope $end\n");
+	const char * p = to + common;
+	while (*p) {
+		if (*p == '.')
+			p++;
+		int l = strcspn(p, ".");
+		_avr_vcd_text_printf(vcd, "$scope module %.*s $end\n", l, p);
+		p += l;
+	}
+}
+
+static void
+_avr_vcd_text_header(
+		avr_vcd_t * vcd)
+{
+	time_t now;
+
+	time(&now);
+	_avr_vcd_text_printf(vcd, "$date %s$end\n", ctime(&now));
+	_avr_vcd_text_printf(vcd,
+		"$version Simavr " CONFIG_SIMAVR_VERSION " $end\n");
+	_avr_vcd_text_printf(vcd, "$timescale 10ns $end\n");	// 10ns base, aka 100MHz
+	_avr_vcd_text_printf(vcd, "$scope module logic $end\n");
+
+	/*
+	 * Sorting the signals by scope groups each scope, and its children,
+	 * so they are opened once; from there it's a matter of closing and
+	 * opening the path components that differ from the previous signal.
+	 */
+	int * order = malloc((vcd->signal_count + 1) * sizeof(order[0]));
+	for (int i = 0; i < vcd->signal_count; i++)
+		order[i] = i;
+	_avr_vcd_sort_vcd = vcd;
+	qsort(order, vcd->signal_count, sizeof(order[0]), _avr_vcd_scope_cmp);
+	const char * prev = "";
+	for (int i = 0; i < vcd->signal_count; i++) {
+		avr_vcd_signal_t * s = vcd->signal[order[i]];
+		const char * cur = vcd->scope[s->scope];
+		_avr_vcd_text_scope(vcd, prev, cur);
+		prev = cur;
+		_avr_vcd_text_printf(vcd, "$var wire %d %s %s $end\n",
+			s->size, s->alias, s->name);
+	}
+	_avr_vcd_text_scope(vcd, prev, "");
+	free(order);
+
+	_avr_vcd_text_printf(vcd, "$upscope $end\n");
+	_avr_vcd_text_printf(vcd, "$enddefinitions $end\n");
+
+	_avr_vcd_text_printf(vcd, "$dumpvars\n");
+	for (int i = 0; i < vcd->signal_count; i++)
+		_avr_vcd_text_value(vcd, vcd->signal[i], NULL, NULL);
+	_avr_vcd_text_printf(vcd, "$end\n");
+}
+
+static void
+_avr_vcd_text_change(
+		avr_vcd_t * vcd,
+		uint64_t when,
+		avr_vcd_signal_t * s,
+		const uint32_t * value,
+		const uint32_t * floating)
+{
+	avr_vcd_text_t * t = vcd->backend_data;
+	if (!t->timed || when != t->last) {
+		_avr_vcd_text_printf(vcd, "#%" PRIu64  "\n", when);
+		t->last = when;
+		t->timed = 1;
+	}
+	_avr_vcd_text_value(vcd, s, value, floating);
+}
+
+static void
+_avr_vcd_file_sink(
+		avr_vcd_t * vcd,
+		const char * b,
+		size_t len)
+{
+	if (fwrite(b, len, 1, vcd->output) != 1)
+		AVR_LOG(vcd->avr, LOG_ERROR, "VCD: %s: write error\n", __func__);
+}
+
+static int
+_avr_vcd_file_open(
+		avr_vcd_t * vcd)
+{
+	vcd->output = fopen(vcd->filename, "w");
+	if (vcd->output == NULL) {
+		perror(vcd->filename);
+		return -1;
+	}
+	avr_vcd_text_t * t = calloc(1, sizeof(*t));
+	t->sink = _avr_vcd_file_sink;
+	vcd->backend_data = t;
+	_avr_vcd_text_header(vcd);
+	return 0;
+}
+
+static void
+_avr_vcd_file_close(
+		avr_vcd_t * vcd)
+{
+	_avr_vcd_text_flush(vcd);
+	fclose(vcd->output);
+	vcd->output = NULL;
+	free(vcd->backend_data);
+	vcd->backend_data = NULL;
 }
 
-/* Write queued output to the VCD file. */
+static avr_vcd_backend_t _avr_vcd_backend_file = {
+	.suffix = ".vcd",
+	.open = _avr_vcd_file_open,
+	.change = _avr_vcd_text_change,
+	.flush = _avr_vcd_text_flush,
+	.close = _avr_vcd_file_close,
+};
+
+#if CONFIG_SIMAVR_ZLIB
+/*
+ * Compressed VCD: the text is compressed in independent gzip members of
+ * about AVR_VCD_GZ_BLOCK bytes, that 'gzip -d' (and thus gtkwave) see as one
+ * plain VCD file. Each member starts with a timestamp and a $dumpall of all
+ * the signals, and "<file>.idx" lists the time and file offset of each of
+ * them, so a reader can start decompressing at any of them.
+ */
+#define AVR_VCD_GZ_BLOCK		(4 * 1024 * 1024)
+
+typedef struct avr_vcd_gz_t {
+	avr_vcd_text_t	text;		// must be first
+	z_stream		z;
+	FILE *			index;
+	uint64_t		block;		// uncompressed size of the current member
+	uint8_t			out[AVR_VCD_TEXT_SIZE];
+} avr_vcd_gz_t;
+
+static void
+_avr_vcd_gz_deflate(
+		avr_vcd_t * vcd,
+		int flush)
+{
+	avr_vcd_gz_t * g = vcd->backend_data;
+	int res;
+	do {
+		g->z.next_out = g->out;
+		g->z.avail_out = sizeof(g->out);
+		res = deflate(&g->z, flush);
+		size_t len = sizeof(g->out) - g->z.avail_out;
+		if (len && fwrite(g->out, len, 1, vcd->output) != 1)
+			AVR_LOG(vcd->avr, LOG_ERROR, "VCD: %s: write error\n", __func__);
+	} while (g->z.avail_out == 0 || (flush == Z_FINISH && res == Z_OK));
+}
+
+static void
+_avr_vcd_gz_sink(
+		avr_vcd_t * vcd,
+		const char * b,
+		size_t len)
+{
+	avr_vcd_gz_t * g = vcd->backend_data;
+	g->z.next_in = (Bytef *)b;
+	g->z.avail_in = len;
+	_avr_vcd_gz_deflate(vcd, Z_NO_FLUSH);
+	g->block += len;
+}
+
+static int
+_avr_vcd_gz_open(
+		avr_vcd_t * vcd)
+{
+	vcd->output = fopen(vcd->filename, "wb");
+	if (vcd->output == NULL) {
+		perror(vcd->filename);
+		return -1;
+	}
+	char iname[strlen(vcd->filename) + 8];
+	sprintf(iname, "%s.idx", vcd->filename);
+	avr_vcd_gz_t * g = calloc(1, sizeof(*g));
+	g->index = fopen(iname, "w");
+	// windowBits 16+15 makes deflate write gzip headers and trailers
+	if (!g->index || deflateInit2(&g->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		AVR_LOG(vcd->avr, LOG_ERROR, "VCD: %s: can't create %s\n",
+				__func__, g->index ? vcd->filename : iname);
+		if (g->index)
+			fclose(g->index);
+		free(g);
+		fclose(vcd->output);
+		vcd->output = NULL;
+		return -1;
+	}
+	g->text.sink = _avr_vcd_gz_sink;
+	vcd->backend_data = g;
+	fprintf(g->index, "# time (10ns) / gzip member offset\n0 0\n");
+	_avr_vcd_text_header(vcd);
+	return 0;
+}
+
+static void
+_avr_vcd_gz_finish_block(
+		avr_vcd_t * vcd)
+{
+	avr_vcd_gz_t * g = vcd->backend_data;
+	_avr_vcd_text_flush(vcd);
+	g->z.avail_in = 0;
+	_avr_vcd_gz_deflate(vcd, Z_FINISH);
+	deflateReset(&g->z);
+	g->block = 0;
+}
+
+static void
+_avr_vcd_gz_change(
+		avr_vcd_t * vcd,
+		uint64_t when,
+		avr_vcd_signal_t * s,
+		const uint32_t * value,
+		const uint32_t * floating)
+{
+	avr_vcd_gz_t * g = vcd->backend_data;
+	avr_vcd_text_t * t = &g->text;
+
+	if (t->timed && when != t->last &&
+			g->block + t->len >= AVR_VCD_GZ_BLOCK) {
+		_avr_vcd_gz_finish_block(vcd);
+		fprintf(g->index, "%" PRIu64 " %ld\n", when, ftell(vcd->output));
+		_avr_vcd_text_printf(vcd, "#%" PRIu64  "\n$dumpall\n", when);
+		for (int i = 0; i < vcd->signal_count; i++) {
+			const uint32_t * v, * f;
+			_avr_vcd_writer_value(vcd, vcd->signal[i], &v, &f);
+			_avr_vcd_text_value(vcd, vcd->signal[i], v, f);
+		}
+		_avr_vcd_text_printf(vcd, "$end\n");
+		t->last = when;
+	}
+	_avr_vcd_text_change(vcd, when, s, value, floating);
+}
 
 static void
-avr_vcd_flush_log(
+_avr_vcd_gz_close(
 		avr_vcd_t * vcd)
 {
-#if AVR_VCD_MAX_SIGNALS > 32
-	uint64_t seen = 0;
+	avr_vcd_gz_t * g = vcd->backend_data;
+	_avr_vcd_gz_finish_block(vcd);
+	deflateEnd(&g->z);
+	fclose(g->index);
+	fclose(vcd->output);
+	vcd->output = NULL;
+	free(g);
+	vcd->backend_data = NULL;
+}
+
+static avr_vcd_backend_t _avr_vcd_backend_gz = {
+	.next = &_avr_vcd_backend_file,
+	.suffix = ".vcd.gz",
+	.open = _avr_vcd_gz_open,
+	.change = _avr_vcd_gz_change,
+	.close = _avr_vcd_gz_close,
+};
+static avr_vcd_backend_t * _avr_vcd_backends = &_avr_vcd_backend_gz;
 #else
-	uint32_t seen = 0;
+static avr_vcd_backend_t * _avr_vcd_backends = &_avr_vcd_backend_file;
 #endif
-	uint64_t oldbase = 0;	// make sure it's different
-	char out[48];
 
-	if (avr_vcd_fifo_isempty(&vcd->log) || !vcd->output)
+void
+avr_vcd_register_backend(
+		avr_vcd_backend_t * backend)
+{
+	backend->next = _avr_vcd_backends;
+	_avr_vcd_backends = backend;
+}
+
+/*
+ * returns the backend with the longest matching suffix, plain VCD if
+ * there is no suffix at all, or NULL for a suffix nobody knows about
+ */
+static const avr_vcd_backend_t *
+_avr_vcd_find_backend(
+		const char * filename)
+{
+	const avr_vcd_backend_t * res = NULL;
+	size_t fl = strlen(filename), best = 0;
+	for (avr_vcd_backend_t * b = _avr_vcd_backends; b; b = b->next) {
+		size_t sl = strlen(b->suffix);
+		if (sl <= fl && sl > best &&
+				!strcasecmp(filename + fl - sl, b->suffix)) {
+			res = b;
+			best = sl;
+		}
+	}
+	if (!res) {
+		const char * ext = strrchr(filename, '.');
+		if (!ext || strchr(ext, '/'))
+			res = &_avr_vcd_backend_file;
+	}
+	return res;
+}
+
+static void
+_avr_vcd_set_backend(
+		avr_vcd_t * vcd)
+{
+	const char * filename = vcd->filename;
+	vcd->backend = _avr_vcd_find_backend(filename);
+	if (vcd->backend)
 		return;
+	/*
+	 * Don't write VCD text in a file that claims to be something else
+	 * (.fst...), the viewers would reject it
+	 */
+	const char * ext = strrchr(filename, '.');
+	int l = ext - filename;
+	char * vcdname = malloc(l + 5);
+	sprintf(vcdname, "%.*s.vcd", l, filename);
+	AVR_LOG(NULL, LOG_WARNING, "VCD: %s: unsupported format '%s', "
+			"writing plain VCD to %s\n", filename, ext, vcdname);
+	free(vcd->filename);
+	vcd->filename = vcdname;
+	vcd->backend = &_avr_vcd_backend_file;
+}
 
-	while (!avr_vcd_fifo_isempty(&vcd->log)) {
-		avr_vcd_log_t l = avr_vcd_fifo_read(&vcd->log);
-		// 10ns base -- 100MHz should be enough
-		uint64_t base = avr_cycles_to_nsec(vcd->avr, l.when - vcd->start) / 10;
+/*
+ * VCD output is written by a background thread, so the simulation never
+ * waits for the formatting and the file IO.
+ *
+ * The value changes are appended to a list of fixed size 'chunks' by the
+ * simulation thread (the only producer), and read back by the writer thread
+ * (the only consumer). Each chunk 'count' is published with a release
+ * store, so the producer never takes a lock, except to get a new chunk when
+ * the current one is full. The list grows as needed, so no value change is
+ * ever dropped, and the simulation never waits for the writer.
+ */
+#define AVR_VCD_CHUNK_SIZE		4096	// log entries per chunk
+#define AVR_VCD_CHUNK_SPARE		16		// chunks kept for reuse
+#define AVR_VCD_WRITER_POLL_MS	10		// latency for a partial chunk
+
+typedef struct avr_vcd_chunk_t {
+	struct avr_vcd_chunk_t * next;
+	uint32_t		count;		// published entries
+	avr_vcd_log_t	log[AVR_VCD_CHUNK_SIZE];
+} avr_vcd_chunk_t;
+
+typedef struct avr_vcd_writer_t {
+	struct avr_vcd_writer_t * next;	// in the list of running writers
+	avr_vcd_t *			vcd;
+	pthread_t			thread;
+	pthread_mutex_t		lock;		// protects 'spare', and the wakeups
+	pthread_cond_t		wakeup;
+	int					stop;
+	avr_vcd_chunk_t *	head;		// consumer side
+	uint32_t			pos;		// next entry to read in 'head'
+	avr_vcd_chunk_t *	tail;		// producer side
+	avr_vcd_chunk_t *	spare;		// recycled chunks
+	int					spare_count;
+
+	// timestamp and value state, for the writer thread only
+	uint64_t			oldbase;
+	uint32_t			stamp;		// incremented for each new timestamp
+	uint32_t *			seen;		// per signal, 'stamp' it was last seen
+	uint32_t *			value;		// signal values, see signal 'word'
+	uint32_t *			floating;
+} avr_vcd_writer_t;
+
+static void
+_avr_vcd_writer_value(
+		avr_vcd_t * vcd,
+		avr_vcd_signal_t * s,
+		const uint32_t ** value,
+		const uint32_t ** floating)
+{
+	*value = vcd->writer->value + s->word;
+	*floating = vcd->writer->floating + s->word;
+}
+
+/*
+ * Update 'size' bits (up to 32) of a bit array at 'shift',
+ * returns non zero if they changed
+ */
+static int
+_avr_vcd_set_bits(
+		uint32_t * words,
+		int shift,
+		int size,
+		uint32_t bits)
+{
+	uint32_t * w = words + (shift >> 5);
+	int two = (shift & 31) + size > 32;
+	uint64_t mask = ((size == 32 ? 0xffffffffull : (1ull << size) - 1))
+						<< (shift & 31);
+	uint64_t old = w[0] | (two ? (uint64_t)w[1] << 32 : 0);
+	uint64_t new = (old & ~mask) | (((uint64_t)bits << (shift & 31)) & mask);
+	w[0] = new;
+	if (two)
+		w[1] = new >> 32;
+	return new != old;
+}
+
+static void
+_avr_vcd_writer_format(
+		avr_vcd_writer_t * w,
+		avr_vcd_log_t * l)
+{
+	avr_vcd_t * vcd = w->vcd;
+	avr_vcd_source_t * src = &vcd->source[l->sigindex];
+	avr_vcd_signal_t * s = vcd->signal[src->signal];
+	uint32_t * value = w->value + s->word;
+	uint32_t * floating = w->floating + s->word;
+
+	// only the signals that actually changed are written
+	int changed = _avr_vcd_set_bits(value, src->shift, src->size, l->value);
+	changed |= _avr_vcd_set_bits(floating, src->shift, src->size,
+						l->floating ? ~0 : 0);
+	if (!changed)
+		return;
+	// 10ns base -- 100MHz should be enough
+	uint64_t base = avr_cycles_to_nsec(vcd->avr, l->when - vcd->start) / 10;
+	/*
+	 * if that trace was seen in this nsec already, we fudge the
+	 * base time to make sure the new value is offset by one nsec,
+	 * to make sure we get at least a small pulse on the waveform.
+	 *
+	 * This is a bit of a fudge, but it is the only way to represent
+	 * very short "pulses" that are still visible on the waveform.
+	 */
+	if (base == w->oldbase && w->seen[src->signal] == w->stamp)
+		base++;	// this forces a new timestamp
+
+	if (base > w->oldbase || !w->stamp) {
+		w->stamp++;
+		w->oldbase = base;
+	}
+	// mark this trace as seen for this timestamp
+	w->seen[src->signal] = w->stamp;
+	vcd->backend->change(vcd, base, s, value, floating);
+}
 
+static void *
+_avr_vcd_writer_thread(
+		void * param)
+{
+	avr_vcd_writer_t * w = param;
+
+	for (;;) {
+		avr_vcd_chunk_t * c = w->head;
+		uint32_t count = __atomic_load_n(&c->count, __ATOMIC_ACQUIRE);
+		if (w->pos < count) {
+			while (w->pos < count)
+				_avr_vcd_writer_format(w, &c->log[w->pos++]);
+			continue;
+		}
+		avr_vcd_chunk_t * next = __atomic_load_n(&c->next, __ATOMIC_ACQUIRE);
+		if (count == AVR_VCD_CHUNK_SIZE && next) {
+			w->head = next;
+			w->pos = 0;
+			pthread_mutex_lock(&w->lock);
+			if (w->spare_count < AVR_VCD_CHUNK_SPARE) {
+				c->next = w->spare;
+				w->spare = c;
+				w->spare_count++;
+				c = NULL;
+			}
+			pthread_mutex_unlock(&w->lock);
+			free(c);
+			continue;
+		}
+		if (w->vcd->backend->flush)
+			w->vcd->backend->flush(w->vcd);
 		/*
-		 * if that trace was seen in this nsec already, we fudge the
-		 * base time to make sure the new value is offset by one nsec,
-		 * to make sure we get at least a small pulse on the waveform.
-		 *
-		 * This is a bit of a fudge, but it is the only way to represent
-		 * very short "pulses" that are still visible on the waveform.
+		 * The producer sets 'stop' after its last entry, so if it's set,
+		 * one more pass is enough to get everything.
 		 */
-		if (base == oldbase &&
-				(seen & (1 << l.sigindex)))
-			base++;	// this forces a new timestamp
-
-		if (base > oldbase || !seen) {
-			seen = 0;
-			fprintf(vcd->output, "#%" PRIu64  "\n", base);
-			oldbase = base;
+		pthread_mutex_lock(&w->lock);
+		if (w->stop) {
+			pthread_mutex_unlock(&w->lock);
+			if (__atomic_load_n(&c->count, __ATOMIC_ACQUIRE) == w->pos &&
+					!__atomic_load_n(&c->next, __ATOMIC_ACQUIRE))
+				break;
+			continue;
 		}
-		// mark this trace as seen for this timestamp
-		seen |= (1 << l.sigindex);
-		fprintf(vcd->output, "%s\n",
-				l.floating ?
-					_avr_vcd_get_float_signal_text(
-							&vcd->signal[l.sigindex],
-							out) :
-					_avr_vcd_get_signal_text(
-							&vcd->signal[l.sigindex],
-							out, l.value));
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += AVR_VCD_WRITER_POLL_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&w->wakeup, &w->lock, &ts);
+		pthread_mutex_unlock(&w->lock);
 	}
+	return NULL;
 }
 
-/* Cycle timer for writing queued output. */
+/*
+ * The running writers are stopped at exit() time, so the files are complete
+ * even if the program never calls avr_vcd_stop()
+ */
+static pthread_mutex_t _avr_vcd_writers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _avr_vcd_writers_once = PTHREAD_ONCE_INIT;
+static avr_vcd_writer_t * _avr_vcd_writers = NULL;
 
-static avr_cycle_count_t
-_avr_vcd_timer(
-		struct avr_t * avr,
-		avr_cycle_count_t when,
-		void * param)
+static void
+_avr_vcd_writer_stop(
+		avr_vcd_t * vcd);
+
+static void
+_avr_vcd_writers_atexit(void)
 {
-	avr_vcd_t * vcd = param;
-	avr_vcd_flush_log(vcd);
-	return when + vcd->period;
+	for (;;) {
+		pthread_mutex_lock(&_avr_vcd_writers_lock);
+		avr_vcd_writer_t * w = _avr_vcd_writers;
+		pthread_mutex_unlock(&_avr_vcd_writers_lock);
+		if (!w)
+			break;
+		_avr_vcd_writer_stop(w->vcd);
+	}
+}
+
+static void
+_avr_vcd_writers_init(void)
+{
+	atexit(_avr_vcd_writers_atexit);
+}
+
+static avr_vcd_chunk_t *
+_avr_vcd_chunk_get(
+		avr_vcd_writer_t * w)
+{
+	pthread_mutex_lock(&w->lock);
+	avr_vcd_chunk_t * c = w->spare;
+	if (c) {
+		w->spare = c->next;
+		w->spare_count--;
+	}
+	pthread_mutex_unlock(&w->lock);
+	if (!c)
+		c = malloc(sizeof(*c));
+	c->next = NULL;
+	c->count = 0;
+	return c;
+}
+
+static int
+_avr_vcd_writer_start(
+		avr_vcd_t * vcd)
+{
+	avr_vcd_writer_t * w = calloc(1, sizeof(*w));
+	w->vcd = vcd;
+	uint32_t words = 0;
+	for (int i = 0; i < vcd->signal_count; i++) {
+		vcd->signal[i]->word = words;
+		words += (vcd->signal[i]->size + 31) / 32;
+	}
+	w->seen = calloc(vcd->signal_count + 1, sizeof(w->seen[0]));
+	w->value = calloc(words + 1, sizeof(w->value[0]));
+	w->floating = malloc((words + 1) * sizeof(w->floating[0]));
+	memset(w->floating, 0xff, (words + 1) * sizeof(w->floating[0]));
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->wakeup, NULL);
+	w->head = w->tail = _avr_vcd_chunk_get(w);
+	if (pthread_create(&w->thread, NULL, _avr_vcd_writer_thread, w)) {
+		AVR_LOG(vcd->avr, LOG_ERROR, "VCD: %s: can't start the writer thread\n",
+				__func__);
+		free(w->head);
+		free(w->seen);
+		free(w->value);
+		free(w->floating);
+		free(w);
+		return -1;
+	}
+	vcd->writer = w;
+	pthread_once(&_avr_vcd_writers_once, _avr_vcd_writers_init);
+	pthread_mutex_lock(&_avr_vcd_writers_lock);
+	w->next = _avr_vcd_writers;
+	_avr_vcd_writers = w;
+	pthread_mutex_unlock(&_avr_vcd_writers_lock);
+	return 0;
+}
+
+// write everything that was queued, and stop the writer thread
+static void
+_avr_vcd_writer_stop(
+		avr_vcd_t * vcd)
+{
+	avr_vcd_writer_t * w = vcd->writer;
+	if (!w)
+		return;
+	pthread_mutex_lock(&_avr_vcd_writers_lock);
+	for (avr_vcd_writer_t ** l = &_avr_vcd_writers; *l; l = &(*l)->next)
+		if (*l == w) {
+			*l = w->next;
+			break;
+		}
+	pthread_mutex_unlock(&_avr_vcd_writers_lock);
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_signal(&w->wakeup);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	vcd->backend->close(vcd);
+
+	while (w->spare) {
+		avr_vcd_chunk_t * c = w->spare;
+		w->spare = c->next;
+		free(c);
+	}
+	free(w->head);
+	free(w->seen);
+	free(w->value);
+	free(w->floating);
+	pthread_cond_destroy(&w->wakeup);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+	vcd->writer = NULL;
 }
 
 /* Called for an IRQ that is being recorded. */
@@ -490,30 +1422,63 @@ _avr_vcd_notify(
 		void * param)
 {
 	avr_vcd_t * vcd = (avr_vcd_t *)param;
+	avr_vcd_writer_t * w = vcd->writer;
 
-	if (!vcd->output) {
+	if (!w) {
 		AVR_LOG(vcd->avr, LOG_WARNING,
 				"%s: no output\n",
 				__FUNCTION__);
 		return;
 	}
 
-	avr_vcd_signal_t * s = (avr_vcd_signal_t*)irq;
-	avr_vcd_log_t l = {
-		.sigindex = s->irq.irq,
-		.when = vcd->avr->cycle,
-		.value = value,
-		.floating = !!(avr_irq_get_flags(irq) & IRQ_FLAG_FLOATING),
-	};
-	if (avr_vcd_fifo_isfull(&vcd->log)) {
-		AVR_LOG(vcd->avr, LOG_WARNING,
-				"%s FIFO Overload, flushing!\n",
-				__func__);
-		/* Decrease period by a quarter, for next time */
-		vcd->period -= vcd->period >> 2;
-		avr_vcd_flush_log(vcd);
+	avr_vcd_chunk_t * c = w->tail;
+	uint32_t count = c->count;	// only ever written by this thread
+	if (count == AVR_VCD_CHUNK_SIZE) {
+		c = _avr_vcd_chunk_get(w);
+		count = 0;
+		__atomic_store_n(&w->tail->next, c, __ATOMIC_RELEASE);
+		w->tail = c;
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->wakeup);
+		pthread_mutex_unlock(&w->lock);
+	}
+	avr_vcd_log_t * l = &c->log[count];
+	l->sigindex = irq->irq;
+	l->when = vcd->avr->cycle;
+	l->value = value;
+	l->floating = !!(avr_irq_get_flags(irq) & IRQ_FLAG_FLOATING);
+	__atomic_store_n(&c->count, count + 1, __ATOMIC_RELEASE);
+}
+
+// add a source to 'signal', its IRQ number is the index in the source table
+static void
+_avr_vcd_source_add(
+		avr_vcd_t * vcd,
+		avr_irq_t * irq,
+		const char * name,
+		int signal,
+		int shift,
+		int size)
+{
+	if (vcd->source_count == vcd->source_size) {
+		vcd->source_size = vcd->source_size ? vcd->source_size * 2 : 16;
+		vcd->source = realloc(vcd->source,
+				vcd->source_size * sizeof(vcd->source[0]));
 	}
-	avr_vcd_fifo_write(&vcd->log, l);
+	int index = vcd->source_count++;
+	vcd->source[index] = (avr_vcd_source_t) {
+		.signal = signal, .shift = shift, .size = size };
+
+	/* manufacture a nice IRQ name */
+	char iname[10 + strlen(name) + 1];
+	if (size > 1)
+		sprintf(iname, "%d>vcd.%s", size, name);
+	else
+		sprintf(iname, ">vcd.%s", name);
+
+	const char * names[1] = { iname };
+	avr_init_irq(&vcd->avr->irq_pool, irq, index, 1, names);
+	avr_irq_register_notify(irq, _avr_vcd_notify, vcd);
 }
 
 /* Register an IRQ whose value is to be logged. */
@@ -525,44 +1490,80 @@ avr_vcd_add_signal(
 		int signal_bit_size,
 		const char * name )
 {
-	if (vcd->signal_count == AVR_VCD_MAX_SIGNALS) {
+	avr_irq_t * irq = signal_irq;
+	return avr_vcd_add_bus(vcd, &irq, 1, signal_bit_size, name);
+}
+
+int
+avr_vcd_add_bus(
+		avr_vcd_t * vcd,
+		avr_irq_t ** irqs,
+		int count,
+		int bits,
+		const char * name )
+{
+	if (count < 1 || bits < 1 || bits > 32 ||
+			count * bits > AVR_VCD_MAX_SIGNAL_SIZE) {
 		AVR_LOG(vcd->avr, LOG_ERROR,
 			" %s: unable add signal '%s'\n",
 			__FUNCTION__, name);
 		return -1;
 	}
-	int index = vcd->signal_count++;
-	avr_vcd_signal_t * s = &vcd->signal[index];
-	strncpy(s->name, name, sizeof(s->name));
-	s->size = signal_bit_size;
-	s->alias = ' ' + vcd->signal_count ;
-
-	/* manufacture a nice IRQ name */
-	int l = strlen(name);
-	char iname[10 + l + 1];
-	if (signal_bit_size > 1)
-		sprintf(iname, "%d>vcd.%s", signal_bit_size, name);
-	else
-		sprintf(iname, ">vcd.%s", name);
-
-	const char * names[1] = { iname };
-	avr_init_irq(&vcd->avr->irq_pool, &s->irq, index, 1, names);
-	avr_irq_register_notify(&s->irq, _avr_vcd_notify, vcd);
+	int index = vcd->signal_count;
+	avr_vcd_signal_t * s = _avr_vcd_signal_new(vcd);
+	snprintf(s->name, sizeof(s->name), "%s", name);
+	s->size = count * bits;
+	// identifiers use the printable characters, '!' to '~'
+	char * a = s->alias;
+	for (int i = index; i >= 0; i = (i / 94) - 1)
+		*a++ = '!' + (i % 94);
+	*a = 0;
+
+	_avr_vcd_source_add(vcd, &s->irq, name, index, 0, bits);
+	if (count > 1) {
+		s->part = calloc(count - 1, sizeof(avr_irq_t));
+		s->part_count = count - 1;
+		for (int i = 1; i < count; i++)
+			_avr_vcd_source_add(vcd, &s->part[i - 1], name,
+					index, i * bits, bits);
+	}
+	for (int i = 0; i < count; i++)
+		avr_connect_irq(irqs[i], i ? &s->part[i - 1] : &s->irq);
+	return 0;
+}
 
-	avr_connect_irq(signal_irq, &s->irq);
+int
+avr_vcd_set_scope(
+		avr_vcd_t * vcd,
+		const char * scope )
+{
+	if (!vcd->scope) {
+		vcd->scope = malloc(sizeof(vcd->scope[0]));
+		vcd->scope[vcd->scope_count++] = strdup("");
+	}
+	while (scope && *scope == '.')
+		scope++;
+	if (!scope)
+		scope = "";
+	for (int i = 0; i < vcd->scope_count; i++)
+		if (!strcmp(vcd->scope[i], scope)) {
+			vcd->scope_current = i;
+			return 0;
+		}
+	vcd->scope = realloc(vcd->scope,
+			(vcd->scope_count + 1) * sizeof(vcd->scope[0]));
+	vcd->scope_current = vcd->scope_count;
+	vcd->scope[vcd->scope_count++] = strdup(scope);
 	return 0;
 }
 
-/* Open the VCD output file and write header.  Does nothing for input. */
+/* Open the output file and write header.  Does nothing for input. */
 
 int
 avr_vcd_start(
 		avr_vcd_t * vcd)
 {
-	time_t now;
-
 	vcd->start = vcd->avr->cycle;
-	avr_vcd_fifo_reset(&vcd->log);
 
 	if (vcd->input) {
 		/*
@@ -571,38 +1572,14 @@ avr_vcd_start(
 		 */
 		return 0;
 	}
-	if (vcd->output)
+	if (vcd->writer)
 		avr_vcd_stop(vcd);
-	vcd->output = fopen(vcd->filename, "w");
-	if (vcd->output == NULL) {
-		perror(vcd->filename);
+	if (vcd->backend->open(vcd))
+		return -1;
+	if (_avr_vcd_writer_start(vcd)) {
+		vcd->backend->close(vcd);
 		return -1;
 	}
-
-	time(&now);
-	fprintf(vcd->output, "$date %s$end\n", ctime(&now));
-	fprintf(vcd->output,
-		"$version Simavr " CONFIG_SIMAVR_VERSION " $end\n");
-	fprintf(vcd->output, "$timescale 10ns $end\n");	// 10ns base, aka 100MHz
-	fprintf(vcd->output, "$scope module logic $end\n");
-
-	for (int i = 0; i < vcd->signal_count; i++) {
-		fprintf(vcd->output, "$var wire %d %c %s $end\n",
-			vcd->signal[i].size, vcd->signal[i].alias, vcd->signal[i].name);
-	}
-
-	fprintf(vcd->output, "$upscope $end\n");
-	fprintf(vcd->output, "$enddefinitions $end\n");
-
-	fprintf(vcd->output, "$dumpvars\n");
-	for (int i = 0; i < vcd->signal_count; i++) {
-		avr_vcd_signal_t * s = &vcd->signal[i];
-		char out[48];
-		fprintf(vcd->output, "%s\n",
-				_avr_vcd_get_float_signal_text(s, out));
-	}
-	fprintf(vcd->output, "$end\n");
-	avr_cycle_timer_register(vcd->avr, vcd->period, _avr_vcd_timer, vcd);
 	return 0;
 }
 
@@ -610,17 +1587,11 @@ int
 avr_vcd_stop(
 		avr_vcd_t * vcd)
 {
-	avr_cycle_timer_cancel(vcd->avr, _avr_vcd_timer, vcd);
 	avr_cycle_timer_cancel(vcd->avr, _avr_vcd_input_timer, vcd);
 
-	avr_vcd_flush_log(vcd);
+	_avr_vcd_writer_stop(vcd);
 
-	if (vcd->input_line)
-		free(vcd->input_line);
-	vcd->input_line = NULL;
-	if (vcd->input)
-		fclose(vcd->input);
-	vcd->input = NULL;
+	_avr_vcd_input_free(vcd);
 	if (vcd->output)
 		fclose(vcd->output);
 	vcd->output = NULL;
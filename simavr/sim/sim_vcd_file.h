@@ -27,7 +27,6 @@
 
 #include <stdio.h>
 #include "sim_irq.h"
-#include "fifo_declare.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,35 +41,68 @@ extern "C" {
  *
  * It can also do the reverse, load a VCD file generated by for example
  * sigrock signal analyzer, and 'replay' digital input with the proper
- * timing.
- *
- * TODO: Add support for 'looping' a VCD input.
+ * timing, optionally looping, seeking in it, or scaling its time.
  */
 
-#define AVR_VCD_MAX_SIGNALS 64
+// largest signal, in bits
+#define AVR_VCD_MAX_SIGNAL_SIZE		1024
 
 typedef struct avr_vcd_signal_t {
 	/*
-	 * For VCD output this is the IRQ we receive new values from.
+	 * For VCD output this is the IRQ we receive new values from (the
+	 * least significant part of a bus).
 	 * For VCD input, this is the IRQ we broadcast the values to
 	 */
 	avr_irq_t 		irq;
-	char 			alias;			// vcd one character alias
-	uint8_t			size;			// in bits
-	char 			name[32];		// full human name
+	avr_irq_t *		part;			// other IRQs of a bus, if any
+	uint16_t		part_count;
+	char 			alias[8];		// vcd identifier
+	uint16_t		size;			// in bits
+	uint16_t		scope;			// index in the scope table
+	uint32_t		word;			// offset of its value in the writer
+	char 			name[64];		// full human name
 } avr_vcd_signal_t, *avr_vcd_signal_p;
 
+/*
+ * Output: each IRQ feeding a signal is a 'source', that updates 'size' bits
+ * of the signal value, starting at bit 'shift'.
+ */
+typedef struct avr_vcd_source_t {
+	uint32_t		signal;			// index in signal table
+	uint16_t		shift;
+	uint8_t			size;
+} avr_vcd_source_t;
+
+// a value change queued for the output writer
 typedef struct avr_vcd_log_t {
-	uint64_t 		when;			// Cycles for output,
-							//     nS for input.
-	uint64_t			sigindex : 8,	// index in signal table
-					floating : 1,
-					value : 32;
+	uint64_t 		when;			// Cycles
+	uint32_t		value;
+	uint32_t		sigindex : 31,	// index in source table
+					floating : 1;
 } avr_vcd_log_t, *avr_vcd_log_p;
 
-DECLARE_FIFO(avr_vcd_log_t, avr_vcd_fifo, 256);
+struct avr_vcd_writer_t;
+struct avr_vcd_input_t;
+struct avr_vcd_t;
 
-struct argv_t;
+/*
+ * Output formats. avr_vcd_init() picks the backend from the file name
+ * suffix, with plain VCD as the default. open() is called by
+ * avr_vcd_start(), the others from the writer thread, with the value
+ * changes in time order; 'when' is in 10ns units, and the value of the
+ * signal (with one bit per value bit in 'floating') is given as 32 bits
+ * words. flush() is optional, and called when the writer is idle.
+ */
+typedef struct avr_vcd_backend_t {
+	struct avr_vcd_backend_t * next;
+	const char *	suffix;		// ".vcd", ".vcd.gz"...
+	int		(*open)(struct avr_vcd_t * vcd);
+	void	(*change)(struct avr_vcd_t * vcd, uint64_t when,
+				avr_vcd_signal_t * s,
+				const uint32_t * value, const uint32_t * floating);
+	void	(*flush)(struct avr_vcd_t * vcd);
+	void	(*close)(struct avr_vcd_t * vcd);
+} avr_vcd_backend_t;
 
 typedef struct avr_vcd_t {
 	struct avr_t *	avr;	// AVR we are attaching timers to..
@@ -78,17 +110,31 @@ typedef struct avr_vcd_t {
 	char *			filename;		// .vcd filename
 	/* can be input OR output, not both */
 	FILE * 			output;
-	FILE * 			input;
-	struct argv_t	* input_line;
+	struct avr_vcd_input_t * input;	// mapped input file, see sim_vcd_file.c
 
 	int 				signal_count;
-	avr_vcd_signal_t	signal[AVR_VCD_MAX_SIGNALS];
+	int					signal_size;	// allocated entries in 'signal'
+	avr_vcd_signal_t **	signal;
+	int					source_count;
+	int					source_size;
+	avr_vcd_source_t *	source;
+	/*
+	 * Scopes are "."-separated paths, the signals added after
+	 * avr_vcd_set_scope() are placed in the current one. Scope zero is the
+	 * top level.
+	 */
+	int					scope_count;
+	int					scope_current;
+	char **				scope;
 
 	uint64_t 		start;
-	uint64_t 		period;		// for output cycles
-	uint64_t 		vcd_to_ns;	// for input unit mapping
-
-	avr_vcd_fifo_t	log;
+	/*
+	 * Output: the value changes are queued by the simulation thread, and
+	 * formatted and written by a background thread, see sim_vcd_file.c
+	 */
+	struct avr_vcd_writer_t * writer;
+	const avr_vcd_backend_t * backend;
+	void *			backend_data;
 } avr_vcd_t;
 
 // initializes a new VCD trace file, and returns zero if all is well
@@ -97,7 +143,7 @@ avr_vcd_init(
 		struct avr_t * avr,
 		const char * filename, 	// filename to write
 		avr_vcd_t * vcd,		// vcd struct to initialize
-		uint32_t	period );	// file flushing period is in usec
+		uint32_t	period );	// unused, the file is written in the background
 int
 avr_vcd_init_input(
 		struct avr_t * avr,
@@ -107,6 +153,31 @@ void
 avr_vcd_close(
 		avr_vcd_t * vcd );
 
+// replay the input file forever
+void
+avr_vcd_input_loop(
+		avr_vcd_t * vcd,
+		int loop );
+// multiply the input file time by 'scale', 2.0 replays it twice slower
+void
+avr_vcd_input_scale(
+		avr_vcd_t * vcd,
+		double scale );
+/*
+ * Restart the input replay from 'nsec' in the file (in file time), after
+ * setting the signals to their values at that point. Returns -1 if 'vcd'
+ * is not an input.
+ */
+int
+avr_vcd_input_seek(
+		avr_vcd_t * vcd,
+		uint64_t nsec );
+
+// add an output format, selected by its file name suffix
+void
+avr_vcd_register_backend(
+		avr_vcd_backend_t * backend );
+
 // Add a trace signal to the vcd file. Must be called before avr_vcd_start()
 int
 avr_vcd_add_signal(
@@ -115,6 +186,26 @@ avr_vcd_add_signal(
 		int signal_bit_size,
 		const char * name );
 
+/*
+ * Add a bus signal made of 'count' IRQs of 'bits' bits each, the first one
+ * being the least significant. Must be called before avr_vcd_start()
+ */
+int
+avr_vcd_add_bus(
+		avr_vcd_t * vcd,
+		avr_irq_t ** irqs,
+		int count,
+		int bits,
+		const char * name );
+/*
+ * Set the scope of the signals added next, as a "."-separated path, for
+ * example "board.uart0". NULL or "" is the top level.
+ */
+int
+avr_vcd_set_scope(
+		avr_vcd_t * vcd,
+		const char * scope );
+
 // Starts recording the signal value into the file
 int
 avr_vcd_start(
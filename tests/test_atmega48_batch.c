@@ -0,0 +1,131 @@
+#include "tests.h"
+#include "sim_batch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// writes "AB" to GPIOR0, then sleeps with the interrupts off
+static const uint16_t code[] = {
+	0xe401,		// ldi r16, 'A'
+	0xbb0e,		// out GPIOR0, r16
+	0xe402,		// ldi r16, 'B'
+	0xbb0e,		// out GPIOR0, r16
+	0x94f8,		// cli
+	0x9588,		// sleep
+};
+
+static void
+write_file(
+		const char * path,
+		const void * data,
+		size_t size)
+{
+	FILE * f = fopen(path, "w");
+	if (!f || fwrite(data, 1, size, f) != size)
+		fail("Can't write %s", path);
+	fclose(f);
+}
+
+static char *
+read_file(
+		const char * path)
+{
+	static char buffer[4096];
+	FILE * f = fopen(path, "r");
+	size_t len = f ? fread(buffer, 1, sizeof(buffer) - 1, f) : 0;
+	buffer[len] = 0;
+	if (f)
+		fclose(f);
+	unlink(path);
+	return buffer;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	char dir[] = "/tmp/simavr_batch_XXXXXX";
+	if (!mkdtemp(dir))
+		fail("Can't create the batch directory");
+	char fw[64], manifest[64], junit[64], json[64];
+	snprintf(fw, sizeof(fw), "%s/fw.bin", dir);
+	snprintf(manifest, sizeof(manifest), "%s/manifest", dir);
+	snprintf(junit, sizeof(junit), "%s/junit.xml", dir);
+	snprintf(json, sizeof(json), "%s/results.json", dir);
+
+	uint8_t image[sizeof(code)];
+	for (int i = 0; i < sizeof(code) / 2; i++) {
+		image[i * 2] = code[i];
+		image[i * 2 + 1] = code[i] >> 8;
+	}
+	write_file(fw, image, sizeof(image));
+	const char * entries =
+		"# both entries share the firmware, only the second one fails\n"
+		"name=\"writes <AB>\" firmware=fw.bin mmcu=atmega48 freq=8000000"
+			" reg=3e finish=1 expect=\"AB\"\n"
+		"\n"
+		"name=wrong firmware=fw.bin mmcu=atmega48 freq=8000000"
+			" reg=3e expect=\"AC\"\n";
+	write_file(manifest, entries, strlen(entries));
+
+	avr_batch_t * batch = avr_batch_load(manifest);
+	if (!batch || batch->count != 2)
+		fail("Can't load the manifest");
+	batch->log = LOG_NONE;
+	if (avr_batch_run(batch, 2) != 1)
+		fail("Not exactly one entry failed");
+	unlink(fw);
+	unlink(manifest);
+
+	avr_batch_entry_t * pass = &batch->entry[0], * wrong = &batch->entry[1];
+	if (pass->status != AVR_BATCH_PASS || pass->state != cpu_Done)
+		fail("The first entry didn't pass: %s", pass->message);
+	if (wrong->status != AVR_BATCH_FAIL || !strstr(wrong->message, "Outputs differ"))
+		fail("The second entry didn't fail on its output: %s", wrong->message);
+	if (pass->output_len != 2 || memcmp(pass->output, "AB", 2) ||
+			wrong->output_len != 2 || memcmp(wrong->output, "AB", 2))
+		fail("Wrong output captured");
+	// same code, same core, same number of cycles, and not many of them
+	if (!pass->run_cycles || pass->run_cycles > 100 ||
+			wrong->run_cycles != pass->run_cycles)
+		fail("Wrong cycle counts %llu and %llu",
+				(unsigned long long)pass->run_cycles,
+				(unsigned long long)wrong->run_cycles);
+
+	char cycles[64];
+	if (avr_batch_write_junit(batch, junit))
+		fail("Can't write the JUnit report");
+	char * report = read_file(junit);
+	snprintf(cycles, sizeof(cycles),
+			"<property name=\"cycles\" value=\"%llu\"/>",
+			(unsigned long long)pass->run_cycles);
+	if (!strstr(report, "tests=\"2\" failures=\"1\" errors=\"0\"") ||
+			!strstr(report, "classname=\"simavr.atmega48\" name=\"writes &lt;AB&gt;\"") ||
+			!strstr(report, "<failure message=\"Outputs differ") ||
+			!strstr(report, cycles))
+		fail("Wrong JUnit report:\n%s", report);
+	if (strstr(report, "<failure") < strstr(report, "name=\"wrong\""))
+		fail("The passing entry has a failure:\n%s", report);
+
+	if (avr_batch_write_json(batch, json))
+		fail("Can't write the JSON report");
+	report = read_file(json);
+	char line[256];
+	snprintf(line, sizeof(line),
+			"{ \"name\": \"writes <AB>\", \"firmware\": \"%s\", "
+			"\"status\": \"pass\", \"cycles\": %llu,",
+			fw, (unsigned long long)pass->run_cycles);
+	if (!strstr(report, line))
+		fail("Wrong JSON report, no '%s':\n%s", line, report);
+	snprintf(line, sizeof(line),
+			"{ \"name\": \"wrong\", \"firmware\": \"%s\", "
+			"\"status\": \"fail\", \"cycles\": %llu,",
+			fw, (unsigned long long)wrong->run_cycles);
+	if (!strstr(report, line) || !strstr(report, "\"output\": \"AB\""))
+		fail("Wrong JSON report, no '%s':\n%s", line, report);
+	rmdir(dir);
+
+	avr_batch_free(batch);
+	tests_success();
+	return 0;
+}
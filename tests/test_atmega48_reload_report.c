@@ -0,0 +1,124 @@
+#include "tests.h"
+#include "sim_elf.h"
+#include "sim_profile.h"
+#include "sim_coverage.h"
+#include "sim_stack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// loops 10 times in func_a, then sleeps with the interrupts off
+static const uint16_t code_a[] = {
+	0xe00a,		// ldi r16, 10
+	0x950a,		// dec r16
+	0xf7f1,		// brne .-4
+	0x94f8,		// cli
+	0x9588,		// sleep
+};
+// jumps to func_b at word 32, that sleeps right away
+static const uint16_t code_b[] = {
+	0xc01f,		// rjmp .+62
+	[32] = 0x94f8,	// cli
+	0x9588,		// sleep
+};
+
+static void
+make_firmware(
+		elf_firmware_t * f,
+		const uint16_t * code,
+		int words,
+		const char * func,
+		uint32_t addr,
+		uint32_t size,
+		uint32_t bsssize)
+{
+	memset(f, 0, sizeof(*f));
+	strcpy(f->mmcu, "atmega48");
+	f->flash = malloc(words * 2);
+	for (int i = 0; i < words; i++) {
+		f->flash[i * 2] = code[i];
+		f->flash[i * 2 + 1] = code[i] >> 8;
+	}
+	f->flashsize = words * 2;
+	f->bsssize = bsssize;
+	f->symbol = malloc(sizeof(f->symbol[0]));
+	f->symbol[0] = calloc(1, sizeof(avr_symbol_t) + strlen(func) + 1);
+	f->symbol[0]->addr = addr;
+	f->symbol[0]->size = size;
+	strcpy((char *)f->symbol[0]->symbol, func);
+	f->symbolcount = 1;
+}
+
+static avr_cycle_count_t
+run(
+		avr_t * avr)
+{
+	int state;
+	do {
+		state = avr_run(avr);
+	} while (state != cpu_Done && state != cpu_Crashed);
+	if (state == cpu_Crashed)
+		fail("The firmware crashed");
+	return avr->cycle;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	elf_firmware_t a, b;
+	make_firmware(&a, code_a, sizeof(code_a) / 2, "func_a", 0, 10, 16);
+	make_firmware(&b, code_b, sizeof(code_b) / 2, "func_b", 64, 4, 32);
+
+	avr_t * avr = avr_make_mcu_by_name("atmega48");
+	if (!avr)
+		fail("Can't make the core");
+	avr_init(avr);
+	avr->log = LOG_NONE;
+	avr_load_firmware(avr, &a);
+	if (avr_profile_init(avr, &a, 0, NULL, AVR_PROFILE_FLAT) ||
+			avr_coverage_init(avr, &a, NULL, NULL) ||
+			avr_stack_init(avr, &a, NULL))
+		fail("Can't start the instrumentation");
+	run(avr);
+	if (!(avr->coverage->executed[0] & 0x02))
+		fail("The loop of func_a wasn't covered");
+
+	// func_a is gone, nothing can point at it any more
+	avr_reload(avr, &b);
+	elf_free_firmware(&a);
+	avr_cycle_count_t cycles = run(avr);
+
+	if (avr->coverage->executed[0] != 0x01)
+		fail("The coverage of func_a was kept: %02x",
+				avr->coverage->executed[0]);
+	if (avr->stack->firmware != &b || avr->stack->limit != avr->ioend + 1 + 32)
+		fail("The stack analysis isn't using the new firmware");
+
+	char path[] = "/tmp/simavr_profile_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		fail("Can't create the report file");
+	close(fd);
+	if (avr_profile_write(avr, path, AVR_PROFILE_FLAT))
+		fail("Can't write the profile");
+	FILE * f = fopen(path, "r");
+	char report[4096] = "";
+	size_t len = f ? fread(report, 1, sizeof(report) - 1, f) : 0;
+	report[len] = 0;
+	if (f)
+		fclose(f);
+	unlink(path);
+	char expected[64];
+	snprintf(expected, sizeof(expected), "%llu cycles",
+			(unsigned long long)cycles);
+	if (!strstr(report, "func_b") || strstr(report, "func_a"))
+		fail("The profile isn't for the new firmware:\n%s", report);
+	if (!strstr(report, expected))
+		fail("The profile doesn't count %s only:\n%s", expected, report);
+
+	avr_terminate(avr);
+	elf_free_firmware(&b);
+	tests_success();
+	return 0;
+}
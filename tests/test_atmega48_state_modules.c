@@ -0,0 +1,125 @@
+#include "tests.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "sim_state.h"
+#include "avr_timer.h"
+#include "avr_uart.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// starts timer0 at clk/8, enables the UART, then loops
+static const uint16_t code[] = {
+	0xe002,			// ldi r16, 0x02
+	0xbd05,			// out TCCR0B, r16
+	0xe108,			// ldi r16, (1 << RXEN0) | (1 << TXEN0)
+	0x9300, 0x00c1,	// sts UCSR0B, r16
+	0xcfff,			// rjmp .-2
+};
+
+static avr_t *
+make_core(
+		elf_firmware_t * f)
+{
+	avr_t * avr = avr_make_mcu_by_name("atmega48");
+	if (!avr)
+		fail("Can't make the core");
+	avr_init(avr);
+	avr->frequency = 8000000;
+	avr->log = LOG_NONE;
+	avr_load_firmware(avr, f);
+	return avr;
+}
+
+static avr_timer_t *
+find_timer(
+		avr_t * avr,
+		char name)
+{
+	for (avr_io_t * io = avr->io_port; io; io = io->next)
+		if (!strcmp(io->kind, "timer") && ((avr_timer_t *)io)->name == name)
+			return (avr_timer_t *)io;
+	fail("No timer%c", name);
+	return NULL;
+}
+
+static avr_uart_t *
+find_uart(
+		avr_t * avr)
+{
+	for (avr_io_t * io = avr->io_port; io; io = io->next)
+		if (!strcmp(io->kind, "uart"))
+			return (avr_uart_t *)io;
+	fail("No uart");
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	elf_firmware_t f = { 0 };
+	strcpy(f.mmcu, "atmega48");
+	f.flash = malloc(sizeof(code));
+	for (int i = 0; i < sizeof(code) / 2; i++) {
+		f.flash[i * 2] = code[i];
+		f.flash[i * 2 + 1] = code[i] >> 8;
+	}
+	f.flashsize = sizeof(code);
+
+	avr_t * avr = make_core(&f);
+	while (avr->cycle < 1000)
+		avr_run(avr);
+	avr_irq_t * rx = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	avr_raise_irq(rx, 'x');
+	avr_raise_irq(rx, 'y');
+
+	char path[] = "/tmp/simavr_state_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		fail("Can't create the snapshot file");
+	close(fd);
+	if (avr_state_save(avr, path))
+		fail("Can't save the state");
+
+	avr_t * copy = make_core(&f);
+	if (avr_state_load(copy, path))
+		fail("Can't load the state");
+	unlink(path);
+
+	// the module state that isn't in the IO registers came back
+	avr_timer_t * t = find_timer(avr, '0');
+	avr_timer_t * tc = find_timer(copy, '0');
+	if (!t->tov_cycles || tc->tov_cycles != t->tov_cycles ||
+			tc->tov_base != t->tov_base || tc->cs_div_value != t->cs_div_value)
+		fail("Timer0 not restored");
+	avr_uart_t * u = find_uart(avr);
+	avr_uart_t * uc = find_uart(copy);
+	if ((uint8_t)(u->input.write - u->input.read) != 2 ||
+			memcmp(&uc->input, &u->input, sizeof(u->input)))
+		fail("The UART input not restored");
+
+	// and both run the same from there
+	while (avr->cycle < 3000)
+		avr_run(avr);
+	while (copy->cycle < 3000)
+		avr_run(copy);
+	if (copy->pc != avr->pc || copy->cycle != avr->cycle ||
+			memcmp(copy->data, avr->data, avr->ramend + 1))
+		fail("The restored core doesn't run the same");
+
+	// a module that can't save its state stops the snapshot
+	static avr_io_t board = { .kind = "board" };
+	avr_register_io(avr, &board);
+	if (avr_state_save(avr, path) == 0) {
+		unlink(path);
+		fail("Saved a module without a state callback");
+	}
+	if (!access(path, F_OK))
+		fail("A refused snapshot left a file");
+
+	avr_terminate(avr);
+	avr_terminate(copy);
+	tests_success();
+	return 0;
+}
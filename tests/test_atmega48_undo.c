@@ -0,0 +1,101 @@
+#include "tests.h"
+#include "sim_elf.h"
+#include "sim_undo.h"
+#include "sim_core.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// writes to a register, SRAM, SREG and the stack, then loops
+static const uint16_t code[] = {
+	0xe505,			// ldi r16, 0x55
+	0x9300, 0x0100,	// sts 0x0100, r16
+	0x9408,			// sec
+	0x930f,			// push r16
+	0xcfff,			// rjmp .-2
+};
+
+#define STEPS 5
+
+typedef struct state_t {
+	uint32_t			pc;
+	avr_cycle_count_t	cycle;
+	uint8_t				sreg;
+	uint8_t *			data;
+} state_t;
+
+static void
+save(
+		avr_t * avr,
+		state_t * s)
+{
+	s->pc = avr->pc;
+	s->cycle = avr->cycle;
+	READ_SREG_INTO(avr, s->sreg);
+	s->data = malloc(avr->ramend + 1);
+	memcpy(s->data, avr->data, avr->ramend + 1);
+}
+
+static void
+check(
+		avr_t * avr,
+		state_t * s,
+		int step)
+{
+	uint8_t sreg;
+	READ_SREG_INTO(avr, sreg);
+	if (avr->pc != s->pc || avr->cycle != s->cycle || sreg != s->sreg)
+		fail("Step %d: PC %04x cycle %llu SREG %02x instead of %04x %llu %02x",
+				step, avr->pc, (unsigned long long)avr->cycle, sreg,
+				s->pc, (unsigned long long)s->cycle, s->sreg);
+	// SREG lives in avr->sreg, its IO register copy is only updated on reads
+	for (int i = 0; i <= avr->ramend; i++)
+		if (i != R_SREG && avr->data[i] != s->data[i])
+			fail("Step %d: data %04x is %02x instead of %02x",
+					step, i, avr->data[i], s->data[i]);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	elf_firmware_t f = { 0 };
+	strcpy(f.mmcu, "atmega48");
+	f.flash = malloc(sizeof(code));
+	for (int i = 0; i < sizeof(code) / 2; i++) {
+		f.flash[i * 2] = code[i];
+		f.flash[i * 2 + 1] = code[i] >> 8;
+	}
+	f.flashsize = sizeof(code);
+
+	avr_t * avr = avr_make_mcu_by_name("atmega48");
+	if (!avr)
+		fail("Can't make the core");
+	avr_init(avr);
+	avr->log = LOG_NONE;
+	avr_load_firmware(avr, &f);
+	if (avr_undo_init(avr, 64))
+		fail("Can't start the undo log");
+
+	state_t before[STEPS];
+	for (int i = 0; i < STEPS; i++) {
+		save(avr, &before[i]);
+		avr_run(avr);
+	}
+	if (avr->data[0x100] != 0x55 || avr->data[avr->ramend] != 0x55 ||
+			!avr->sreg[S_C] || avr->pc != 10)
+		fail("The firmware didn't run");
+
+	for (int i = STEPS - 1; i >= 0; i--) {
+		if (!avr_undo_step(avr, NULL, NULL))
+			fail("Step %d: no history left", i);
+		check(avr, &before[i], i);
+	}
+	if (avr_undo_step(avr, NULL, NULL))
+		fail("Undid more instructions than were run");
+
+	for (int i = 0; i < STEPS; i++)
+		free(before[i].data);
+	avr_terminate(avr);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,70 @@
+#include "tests.h"
+#include "sim_vcd_file.h"
+#include "sim_cycle_timers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static avr_t *avr;
+static int changes;
+static avr_cycle_count_t change_cycle[32];
+
+static void signal_changed(struct avr_irq_t *irq, uint32_t value, void *param) {
+	if (changes < 32)
+		change_cycle[changes] = avr->cycle;
+	changes++;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	// a square wave, 10us per level, the file lasts 40us
+	char path[] = "/tmp/simavr_vcd_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		fail("Can't create the VCD file");
+	FILE *f = fdopen(fd, "w");
+	fprintf(f, "$timescale 1us $end\n"
+			"$scope module top $end\n"
+			"$var wire 1 ! sig $end\n"
+			"$upscope $end\n"
+			"$enddefinitions $end\n"
+			"#0\n0!\n#10\n1!\n#20\n0!\n#30\n1!\n#40\n");
+	fclose(f);
+
+	avr = avr_make_mcu_by_name("atmega48");
+	if (!avr)
+		fail("Can't make the core");
+	avr_init(avr);
+	avr->frequency = 1000000;	// one cycle per microsecond
+
+	avr_vcd_t input;
+	if (avr_vcd_init_input(avr, path, &input))
+		fail("Can't read %s", path);
+	unlink(path);
+	if (input.signal_count != 1)
+		fail("Expected one signal, got %d", input.signal_count);
+	avr_vcd_input_loop(&input, 1);
+	// past the middle of the file, so the replay has to loop back to #0
+	avr_vcd_input_seek(&input, 25000);
+	avr_irq_register_notify(&input.signal[0]->irq, signal_changed, NULL);
+
+	for (avr->cycle = 0; avr->cycle < 200; avr->cycle++)
+		avr_cycle_timer_process(avr);
+	/*
+	 * #30 at cycle 5, then the file restarts at cycle 15, and changes
+	 * every 10 cycles from there
+	 */
+	if (changes < 18)
+		fail("The input stopped after looping, %d changes", changes);
+	for (int i = 0; i < 18; i++)
+		if (change_cycle[i] != 5 + i * 10)
+			fail("Change %d at cycle %lu instead of %d", i,
+					(unsigned long)change_cycle[i], 5 + i * 10);
+	if (avr->state == cpu_Done)
+		fail("The looping input ended the simulation");
+
+	avr_vcd_close(&input);
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,75 @@
+#include "tests.h"
+#include "sim_state.h"
+#include "sim_cycle_timers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+
+static avr_cycle_count_t run(void) {
+	switch(tests_init_and_run_test("atmega48_enabled_timer.axf", 100000000)) {
+	case LJR_CYCLE_TIMER:
+		fail("AVR did not wake up to the enabled timer.");
+	case LJR_SPECIAL_DEINIT:
+		break;
+	default:
+		fail("Error in test case: Should never reach this.");
+	}
+	return tests_cycle_count;
+}
+
+// a cycle timer of the application, its address means nothing in another process
+static avr_cycle_count_t app_timer(avr_t *avr, avr_cycle_count_t when, void *param) {
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+	// tests_init_avr() is called more than once
+	tests_disable_stdout = 0;
+
+	char dir[] = "/tmp/simavr_warm_XXXXXX";
+	if (!mkdtemp(dir))
+		fail("Can't create a cache directory");
+	// stop with timer0 running, halfway to the first compare match
+	tests_set_warm_start(dir, "5000");
+
+	avr_cycle_count_t cold = run();	// creates the cache
+	avr_cycle_count_t warm = run();	// starts from it
+	if (warm != cold)
+		fail("Warm start finished at cycle %lu instead of %lu",
+				(unsigned long)warm, (unsigned long)cold);
+
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	int files = 0;
+	while (d && (e = readdir(d))) {
+		char path[512];
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		unlink(path);
+		files++;
+	}
+	if (d)
+		closedir(d);
+	rmdir(dir);
+	if (files != 1)
+		fail("Expected one cached state, found %d", files);
+
+	avr_t *avr = tests_init_avr("atmega48_enabled_timer.axf");
+	char path[] = "/tmp/simavr_state_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		fail("Can't create a state file");
+	close(fd);
+	if (avr_state_save(avr, path))
+		fail("Could not save the state of a fresh core");
+	avr_cycle_timer_register(avr, 100, app_timer, NULL);
+	if (avr_state_save(avr, path) == 0)
+		fail("Saved a state with a cycle timer outside simavr");
+	unlink(path);
+
+	tests_success();
+	return 0;
+}
@@ -0,0 +1,89 @@
+#include "tests.h"
+#include "sim_elf.h"
+#include "sim_hex.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The image_gap.* files all hold 16 bytes at 0x0000 and 8 bytes at 0x0020,
+ * the .hex and .srec ones also have 4 bytes of eeprom
+ */
+static const uint8_t eeprom[] = { 0xde, 0xad, 0xbe, 0xef };
+
+static void
+check_flash(
+		const char * fname,
+		elf_firmware_t * f)
+{
+	if (f->flashbase != 0 || f->flashsize != 0x28)
+		fail("%s: flash at 0x%x, %d bytes instead of 0x0, 40", fname,
+				f->flashbase, f->flashsize);
+	for (int i = 0; i < 0x28; i++) {
+		int expected = i < 0x10 ? i : i < 0x20 ? 0xff : i;
+		if (f->flash[i] != expected)
+			fail("%s: flash 0x%02x is 0x%02x instead of 0x%02x", fname,
+					i, f->flash[i], expected);
+	}
+}
+
+static void
+check_image(
+		const char * fname)
+{
+	elf_firmware_t f = { 0 };
+	if (read_image_firmware(fname, &f, 0))
+		fail("Can't read %s", fname);
+	check_flash(fname, &f);
+	if (f.eesize != sizeof(eeprom) || memcmp(f.eeprom, eeprom, sizeof(eeprom)))
+		fail("%s: wrong eeprom, %d bytes", fname, f.eesize);
+	elf_free_firmware(&f);
+}
+
+int main(int argc, char **argv) {
+	tests_init(argc, argv);
+
+	check_image("image_gap.hex");
+	check_image("image_gap.srec");
+
+	// a raw image has no gap, it's where it is loaded that matters
+	elf_firmware_t f = { 0 };
+	if (read_image_firmware("image_gap.bin", &f, 0))
+		fail("Can't read image_gap.bin");
+	check_flash("image_gap.bin", &f);
+	if (f.eeprom)
+		fail("image_gap.bin: loaded some eeprom");
+	elf_free_firmware(&f);
+	f = (elf_firmware_t) { 0 };
+	if (read_image_firmware("image_gap.bin", &f, AVR_SEGMENT_OFFSET_EEPROM))
+		fail("Can't read image_gap.bin as eeprom");
+	if (f.flash || f.eesize != 0x28 || f.eeprom[0x10] != 0xff)
+		fail("image_gap.bin: not loaded as eeprom");
+	elf_free_firmware(&f);
+
+	// the gap splits the flash in two chunks, the eeprom is the third
+	ihex_chunk_p chunks = NULL;
+	int count = read_ihex_chunks("image_gap.hex", &chunks);
+	if (count != 3)
+		fail("image_gap.hex: %d chunks instead of 3", count);
+	if (chunks[0].baseaddr != 0 || chunks[0].size != 0x10 ||
+			chunks[1].baseaddr != 0x20 || chunks[1].size != 8 ||
+			chunks[2].baseaddr != 0x810000 || chunks[2].size != 4)
+		fail("image_gap.hex: wrong chunks");
+	if (chunks[1].data[7] != 0x27 || memcmp(chunks[2].data, eeprom, 4))
+		fail("image_gap.hex: wrong chunk data");
+	if (chunks[3].size)
+		fail("image_gap.hex: the chunks aren't terminated");
+	free_ihex_chunks(chunks);
+	free(chunks);
+
+	// only the checksum of the second line is wrong
+	chunks = NULL;
+	if (read_ihex_chunks("image_badsum.hex", &chunks) != -1 || chunks)
+		fail("image_badsum.hex: the bad checksum wasn't noticed");
+	f = (elf_firmware_t) { 0 };
+	if (read_image_firmware("image_badsum.hex", &f, 0) != -1 || f.flash)
+		fail("image_badsum.hex: loaded with a bad checksum");
+
+	tests_success();
+	return 0;
+}
@@ -2,6 +2,8 @@
 #include "sim_avr.h"
 #include "sim_elf.h"
 #include "sim_core.h"
+#include "sim_state.h"
+#include "sim_itrace.h"
 #include "avr_uart.h"
 #include <stdio.h>
 #include <setjmp.h>
@@ -15,6 +17,11 @@ int tests_disable_stdout = 1;
 
 static char *test_name = "(uninitialized test)";
 static int finished = 0;
+static const char *warm_dir = NULL;
+static const char *warm_until = NULL;
+// instruction trace, saved only if the test fails
+static const char *itrace_path = NULL;
+static avr_t *itrace_avr = NULL;
 
 #if defined(__GLIBC__) && !defined(__MINGW32__)
 static FILE *orig_stderr = NULL;
@@ -43,6 +50,35 @@ void tests_success(void) {
 void tests_init(int argc, char **argv) {
 	test_name = strdup(argv[0]);
 	atexit(atexit_handler);
+	tests_set_warm_start(getenv("SIMAVR_WARM_START"),
+			getenv("SIMAVR_WARM_UNTIL"));
+	itrace_path = getenv("SIMAVR_ITRACE");
+}
+
+void tests_set_warm_start(const char *dir, const char *until) {
+	warm_dir = dir && until ? dir : NULL;
+	warm_until = until;
+}
+
+/* Run to the warm start point, or restore it from the cache. */
+static void tests_warm_start(avr_t *avr, elf_firmware_t *fw) {
+	avr_cycle_count_t cycle = 0;
+	avr_flashaddr_t pc = AVR_STATE_ANY_PC;
+	char *end;
+
+	cycle = strtoull(warm_until, &end, 0);
+	if (*end) {
+		cycle = 0;
+		int count = elf_firmware_load_symbols(fw);
+		for (int i = 0; i < count && pc == AVR_STATE_ANY_PC; i++)
+			if (!strcmp(fw->symbol[i]->symbol, warm_until))
+				pc = fw->symbol[i]->addr;
+		if (pc == AVR_STATE_ANY_PC)
+			fail("Warm start symbol \"%s\" not found", warm_until);
+	}
+	uint64_t key = avr_state_key(avr, warm_until, strlen(warm_until));
+	if (avr_state_warm_start(avr, warm_dir, key, cycle, pc) < 0)
+		fail("Firmware stopped before the warm start point \"%s\"", warm_until);
 }
 
 static avr_cycle_count_t
@@ -111,6 +147,10 @@ avr_t *tests_init_avr(const char *elfname) {
 		fail("Creating AVR failed.");
 	avr_init(avr);
 	avr_load_firmware(avr, &fw);
+	if (warm_dir)
+		tests_warm_start(avr, &fw);
+	if (itrace_path && !avr_itrace_init(avr, NULL, AVR_ITRACE_DEFAULT_SIZE))
+		itrace_avr = avr;
 	return avr;
 }
 
@@ -291,6 +331,9 @@ void _fail(const char *filename, int linenum, const char *fmt, ...) {
 	vfprintf(stderr, fmt, va);
 	putc('\n', stderr);
 
+	if (itrace_avr && !avr_itrace_save(itrace_avr, itrace_path))
+		fprintf(stderr, "Instruction trace saved in %s\n", itrace_path);
+
 	finished = 1;
 	_exit(1);
 }
@@ -18,8 +18,15 @@ enum tests_finish_reason {
 void __attribute__ ((noreturn,format (printf, 3, 4)))
 _fail(const char *filename, int linenum, const char *fmt, ...);
 
+/* If the SIMAVR_ITRACE environment variable is set, the instructions run
+ * are recorded (see sim_itrace.h), and saved in that file if the test fails. */
 avr_t *tests_init_avr(const char *elfname);
 void tests_init(int argc, char **argv);
+/* Make tests_init_avr() start from a cached state, taken when the firmware
+ * reaches 'until' (a cycle number or a code symbol). The cache lives in 'dir'.
+ * Also set with the SIMAVR_WARM_START and SIMAVR_WARM_UNTIL environment
+ * variables. */
+void tests_set_warm_start(const char *dir, const char *until);
 void tests_success(void);
 
 int tests_run_test(avr_t *avr, unsigned long usec);